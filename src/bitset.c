@@ -0,0 +1,99 @@
+#include "bitset.h"
+#include <stdlib.h>
+#include <string.h>
+
+void bitset_init(Bitset *set, size_t num_bits)
+{
+    bitset_init_in(set, num_bits, calloc(BITSET_WORDS(num_bits) + 1, sizeof(uint64_t)));
+}
+
+void bitset_init_in(Bitset *set, size_t num_bits, uint64_t *words)
+{
+    set->words = words;
+    set->num_words = BITSET_WORDS(num_bits);
+    set->num_bits = num_bits;
+}
+
+void bitset_free(Bitset *set)
+{
+    free(set->words);
+    set->words = NULL;
+}
+
+void bitset_clear(Bitset *set)
+{
+    memset(set->words, 0, set->num_words * sizeof(uint64_t));
+}
+
+void bitset_fill(Bitset *set)
+{
+    memset(set->words, 0xff, set->num_words * sizeof(uint64_t));
+    if (set->num_bits % 64)
+        set->words[set->num_words - 1] = ((uint64_t)1 << (set->num_bits % 64)) - 1;
+}
+
+void bitset_copy(Bitset *dst, const Bitset *src)
+{
+    memcpy(dst->words, src->words, src->num_words * sizeof(uint64_t));
+}
+
+bool bitset_equal(const Bitset *a, const Bitset *b)
+{
+    return memcmp(a->words, b->words, a->num_words * sizeof(uint64_t)) == 0;
+}
+
+size_t bitset_count(const Bitset *set)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < set->num_words; i++)
+        count += __builtin_popcountll(set->words[i]);
+    return count;
+}
+
+bool bitset_union(Bitset *dst, const Bitset *src)
+{
+    uint64_t changed = 0;
+    for (size_t i = 0; i < dst->num_words; i++) {
+        uint64_t word = dst->words[i] | src->words[i];
+        changed |= word ^ dst->words[i];
+        dst->words[i] = word;
+    }
+    return changed != 0;
+}
+
+bool bitset_intersect(Bitset *dst, const Bitset *src)
+{
+    uint64_t changed = 0;
+    for (size_t i = 0; i < dst->num_words; i++) {
+        uint64_t word = dst->words[i] & src->words[i];
+        changed |= word ^ dst->words[i];
+        dst->words[i] = word;
+    }
+    return changed != 0;
+}
+
+// dst = gen | (src & ~kill), the transfer function of gen/kill problems
+bool bitset_transfer(Bitset *dst, const Bitset *gen, const Bitset *src, const Bitset *kill)
+{
+    uint64_t changed = 0;
+    for (size_t i = 0; i < dst->num_words; i++) {
+        uint64_t word = gen->words[i] | (src->words[i] & ~kill->words[i]);
+        changed |= word ^ dst->words[i];
+        dst->words[i] = word;
+    }
+    return changed != 0;
+}
+
+size_t bitset_next(const Bitset *set, size_t bit)
+{
+    if (bit >= set->num_bits)
+        return set->num_bits;
+    size_t i = bit / 64;
+    uint64_t word = set->words[i] & (~(uint64_t)0 << (bit % 64));
+    while (!word) {
+        if (++i == set->num_words)
+            return set->num_bits;
+        word = set->words[i];
+    }
+    return i * 64 + __builtin_ctzll(word);
+}
@@ -0,0 +1,55 @@
+#ifndef MINI_BITSET_H
+#define MINI_BITSET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Bitset Bitset;
+
+// A fixed number of bits stored densely in 64-bit words. Bits past
+// `num_bits` in the last word are always zero. Operations on two sets
+// require them to be the same size.
+struct Bitset
+{
+    uint64_t *words;
+    size_t num_words;
+    size_t num_bits;
+};
+
+#define BITSET_WORDS(bits) (((bits) + 63) / 64)
+
+void bitset_init(Bitset *set, size_t num_bits);
+void bitset_init_in(Bitset *set, size_t num_bits, uint64_t *words);   // Uses `words`
+void bitset_free(Bitset *set);
+
+static inline bool bitset_test(const Bitset *set, size_t bit)
+{
+    return (set->words[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void bitset_set(Bitset *set, size_t bit)
+{
+    set->words[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+static inline void bitset_reset(Bitset *set, size_t bit)
+{
+    set->words[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+}
+
+void bitset_clear(Bitset *set);
+void bitset_fill(Bitset *set);
+void bitset_copy(Bitset *dst, const Bitset *src);
+bool bitset_equal(const Bitset *a, const Bitset *b);
+size_t bitset_count(const Bitset *set);
+
+// These return whether `dst` changed
+bool bitset_union(Bitset *dst, const Bitset *src);
+bool bitset_intersect(Bitset *dst, const Bitset *src);
+bool bitset_transfer(Bitset *dst, const Bitset *gen, const Bitset *src, const Bitset *kill);
+
+// Returns the first set bit at or after `bit`, or `num_bits` if there is none
+size_t bitset_next(const Bitset *set, size_t bit);
+
+#endif
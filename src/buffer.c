@@ -0,0 +1,78 @@
+#include "buffer.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_DEFAULT_CAPACITY    256
+#define BUFFER_DEFAULT_GROWTH_RATE 2
+
+void buffer_init(Buffer *b)
+{
+    b->data = NULL;
+    b->size = 0;
+    b->capacity = 0;
+}
+
+void buffer_reserve(Buffer *b, size_t capacity)
+{
+    if (capacity <= b->capacity)
+        return;
+
+    size_t new_capacity = b->capacity ? b->capacity : BUFFER_DEFAULT_CAPACITY;
+    while (new_capacity < capacity)
+        new_capacity *= BUFFER_DEFAULT_GROWTH_RATE;
+
+    uint8_t *tmp = realloc(b->data, new_capacity);
+    if (!tmp)
+        fatal("couldn't grow buffer to %zu bytes", new_capacity);
+    b->data = tmp;
+    b->capacity = new_capacity;
+}
+
+void buffer_append(Buffer *b, const void *data, size_t size)
+{
+    // An empty buffer may have no storage to copy from
+    if (size == 0)
+        return;
+    buffer_reserve(b, b->size + size);
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+void buffer_append_u8(Buffer *b, uint8_t value)
+{
+    buffer_append(b, &value, sizeof(value));
+}
+
+void buffer_append_u32(Buffer *b, uint32_t value)
+{
+    buffer_append(b, &value, sizeof(value));
+}
+
+void buffer_append_u64(Buffer *b, uint64_t value)
+{
+    buffer_append(b, &value, sizeof(value));
+}
+
+void buffer_append_str(Buffer *b, const char *s)
+{
+    buffer_append(b, s, strlen(s));
+}
+
+void buffer_align(Buffer *b, size_t alignment)
+{
+    static const uint8_t zeros[16] = { 0 };
+    while (b->size % alignment)
+        buffer_append(b, zeros, MIN(alignment - b->size % alignment, sizeof(zeros)));
+}
+
+void buffer_clear(Buffer *b)
+{
+    b->size = 0;
+}
+
+void buffer_free(Buffer *b)
+{
+    free(b->data);
+    buffer_init(b);
+}
@@ -0,0 +1,26 @@
+#ifndef MINI_BUFFER_H
+#define MINI_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Buffer Buffer;
+struct Buffer
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+};
+
+void buffer_init(Buffer *b);
+void buffer_reserve(Buffer *b, size_t capacity);
+void buffer_append(Buffer *b, const void *data, size_t size);
+void buffer_append_u8(Buffer *b, uint8_t value);
+void buffer_append_u32(Buffer *b, uint32_t value);
+void buffer_append_u64(Buffer *b, uint64_t value);
+void buffer_append_str(Buffer *b, const char *s);
+void buffer_align(Buffer *b, size_t alignment);
+void buffer_clear(Buffer *b);
+void buffer_free(Buffer *b);
+
+#endif
@@ -0,0 +1,324 @@
+#define _DEFAULT_SOURCE
+#include "cache.h"
+#include "buffer.h"
+#include "compile.h"
+#include "serialize.h"
+#include "symbols.h"
+#include "table.h"
+#include "vector.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define CACHE_LOCK_FILE "lock"
+
+typedef struct
+{
+  uint8_t *data;
+  size_t size;
+} MemoryEntry;
+
+static char *cache_dir = NULL;
+static size_t cache_max_size = CACHE_DEFAULT_MAX_SIZE;
+static CacheStats stats = { 0 };
+
+// Optional in-process layer in front of the directory, used by long-running
+// processes. Entries are immutable for a given key, so they never go stale.
+static Table *memory = NULL;            // path -> MemoryEntry *
+static size_t memory_size = 0;
+static size_t memory_limit = 0;
+
+void cache_enable_memory(size_t limit)
+{
+  if (!memory)
+    memory = table_new();
+  memory_limit = limit;
+}
+
+static void remember(char *path, const uint8_t *data, size_t size)
+{
+  if (!memory || memory_size + size > memory_limit || table_lookup(memory, path))
+    return;
+
+  MemoryEntry *entry = malloc(sizeof(MemoryEntry));
+  entry->data = malloc(size ? size : 1);
+  memcpy(entry->data, data, size);
+  entry->size = size;
+  table_insert(memory, path, entry);
+  memory_size += size;
+}
+
+void cache_open(const char *dir, size_t max_size)
+{
+  cache_close();
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    fatal("couldn't create cache directory `%s`: %s", dir, strerror(errno));
+
+  cache_dir = aprintf("%s", dir);
+  cache_max_size = max_size;
+  memset(&stats, 0, sizeof(CacheStats));
+}
+
+bool cache_is_open()
+{
+  return cache_dir != NULL;
+}
+
+static char *entry_path(Hash128 key, const char *kind)
+{
+  return aprintf("%s/%016lx%016lx.%s", cache_dir, key.hi, key.lo, kind);
+}
+
+/* Key Derivation */
+
+static void hash_signature(Buffer *material, Symbol *symbol)
+{
+  buffer_append_u8(material, symbol->kind);
+  buffer_append_u8(material, symbol->type.id);
+  buffer_append_u8(material, symbol->is_constant);
+
+  Node *node = symbol->node;
+  if (!node) return;
+
+  switch (node->kind) {
+    case NODE_FUNC_DECL:
+      buffer_append_u8(material, node->func_decl.return_type.id);
+      for (Node *param = node->func_decl.params; param; param = param->next)
+        buffer_append_u8(material, param->var_decl.type.id);
+      break;
+    case NODE_VAR_DECL:
+      // Constant initializers may be propagated into the function
+      if (node->var_decl.init && node->var_decl.init->kind == NODE_LITERAL_EXPR) {
+        Value *value = &node->var_decl.init->literal;
+        buffer_append_u8(material, value->kind);
+        buffer_append_u64(material, value->u_val);
+      }
+      break;
+    default: break;
+  }
+}
+
+Hash128 cache_key(Token **tokens, size_t num_tokens, uint64_t pipeline, uint64_t flags)
+{
+  Buffer material;
+  buffer_init(&material);
+  buffer_append_u32(&material, CACHE_FORMAT_VERSION);
+  buffer_append_u32(&material, IR_VERSION);
+  buffer_append_u64(&material, pipeline);
+  buffer_append_u64(&material, flags);
+
+  // Source positions are deliberately left out so that moving a function
+  // around in its file doesn't invalidate its entry.
+  for (size_t i = 0; i < num_tokens; i++) {
+    Token *token = tokens[i];
+    buffer_append_u8(&material, token->kind);
+    switch (token->kind) {
+      case TOKEN_IDENTIFIER:
+        buffer_append_u32(&material, token->str.length);
+        buffer_append(&material, token->str.data, token->str.length);
+
+        Symbol *symbol = symbol_table_lookup(ctx->global_scope, token->str.data);
+        if (symbol) hash_signature(&material, symbol);
+        break;
+      case TOKEN_NUMBER:
+        buffer_append_u64(&material, token->u_val);
+        break;
+      default: break;
+    }
+  }
+
+  Hash128 key = hash_128(material.data, material.size, CACHE_FORMAT_VERSION);
+  buffer_free(&material);
+  return key;
+}
+
+/* Storage */
+
+uint8_t *cache_load(Hash128 key, const char *kind, size_t *size)
+{
+  char *path = entry_path(key, kind);
+  uint8_t *data = NULL;
+
+  MemoryEntry *resident = memory ? table_lookup(memory, path) : NULL;
+  if (resident) {
+    data = malloc(resident->size ? resident->size : 1);
+    memcpy(data, resident->data, resident->size);
+    *size = resident->size;
+    stats.hits++;
+    free(path);
+    return data;
+  }
+
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0) {
+    data = malloc(st.st_size ? st.st_size : 1);
+    size_t total = 0;
+    while (total < (size_t)st.st_size) {
+      ssize_t n = read(fd, data + total, st.st_size - total);
+      if (n <= 0) break;
+      total += n;
+    }
+
+    if (total == (size_t)st.st_size) {
+      *size = total;
+      // Refresh the modification time so eviction is least-recently-used
+      utimes(path, NULL);
+      remember(path, data, total);
+    } else {
+      free(data);
+      data = NULL;
+    }
+  }
+  if (fd >= 0) close(fd);
+
+  if (data) stats.hits++;
+  else stats.misses++;
+
+  free(path);
+  return data;
+}
+
+void cache_store(Hash128 key, const char *kind, const uint8_t *data, size_t size)
+{
+  char *path = entry_path(key, kind);
+  char *tmp_path = aprintf("%s.tmp.%d", path, (int)getpid());
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd >= 0;
+  size_t total = 0;
+  while (ok && total < size) {
+    ssize_t n = write(fd, data + total, size - total);
+    if (n <= 0) ok = false;
+    else total += n;
+  }
+  if (fd >= 0 && close(fd) != 0) ok = false;
+
+  // Publish the entry atomically; a concurrent writer of the same key
+  // produces identical contents, so whichever rename wins is fine.
+  if (ok && rename(tmp_path, path) == 0) {
+    stats.stores++;
+    remember(path, data, size);
+  } else {
+    LOG_WARN("couldn't write cache entry `%s`", path);
+    unlink(tmp_path);
+  }
+
+  free(tmp_path);
+  free(path);
+}
+
+/* Eviction */
+
+typedef struct
+{
+  char *path;
+  off_t size;
+  time_t mtime;
+} CacheEntry;
+
+static int compare_entries(const void *a, const void *b)
+{
+  const CacheEntry *lhs = *(CacheEntry **)a;
+  const CacheEntry *rhs = *(CacheEntry **)b;
+  return (lhs->mtime > rhs->mtime) - (lhs->mtime < rhs->mtime);
+}
+
+static void evict()
+{
+  // Only one process evicts at a time; the others skip instead of waiting
+  char *lock_path = aprintf("%s/%s", cache_dir, CACHE_LOCK_FILE);
+  int lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+  free(lock_path);
+  if (lock_fd < 0) return;
+  if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    close(lock_fd);
+    return;
+  }
+
+  DIR *dir = opendir(cache_dir);
+  if (!dir) {
+    close(lock_fd);
+    return;
+  }
+
+  Vector entries;
+  vector_init(&entries, sizeof(CacheEntry *));
+  size_t total_size = 0;
+
+  struct dirent *dirent;
+  while ((dirent = readdir(dir))) {
+    if (dirent->d_name[0] == '.' || strcmp(dirent->d_name, CACHE_LOCK_FILE) == 0)
+      continue;
+
+    char *path = aprintf("%s/%s", cache_dir, dirent->d_name);
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+      free(path);
+      continue;
+    }
+
+    // Temporary files of in-flight writers count towards the size, but are
+    // never evicted from under them.
+    total_size += st.st_size;
+    if (strstr(dirent->d_name, ".tmp.")) {
+      free(path);
+      continue;
+    }
+
+    CacheEntry *entry = malloc(sizeof(CacheEntry));
+    entry->path = path;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtime;
+    vector_push_back(&entries, entry);
+  }
+  closedir(dir);
+
+  if (total_size > cache_max_size) {
+    qsort(entries.data, entries.size, sizeof(CacheEntry *), compare_entries);
+
+    // Evict down to 90% of the limit so that every build doesn't evict again
+    size_t target = cache_max_size / 10 * 9;
+    for (size_t i = 0; i < entries.size && total_size > target; i++) {
+      CacheEntry *entry = vector_get(&entries, i);
+      if (unlink(entry->path) == 0) {
+        total_size -= entry->size;
+        stats.evictions++;
+        stats.evicted_bytes += entry->size;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < entries.size; i++) {
+    CacheEntry *entry = vector_get(&entries, i);
+    free(entry->path);
+    free(entry);
+  }
+  vector_free(&entries);
+
+  flock(lock_fd, LOCK_UN);
+  close(lock_fd);
+}
+
+void cache_close()
+{
+  if (!cache_dir) return;
+
+  evict();
+  free(cache_dir);
+  cache_dir = NULL;
+}
+
+CacheStats cache_stats()
+{
+  return stats;
+}
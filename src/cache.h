@@ -0,0 +1,46 @@
+#ifndef MINI_CACHE_H
+#define MINI_CACHE_H
+
+#include "lex.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Content-Addressed Function Cache
+ *
+ * Entries live in a flat directory as `<key>.<kind>` files, where the key is
+ * a 128-bit hash of a function's tokens, the signatures it references and the
+ * compiler flags. Entries are published with an atomic rename so concurrent
+ * builds sharing a directory never observe partially written files. A function
+ * is stored as its optimized IR, `ir`, and as its machine code, `code`, whose
+ * key also takes the options of the backend.
+ */
+
+#define CACHE_FORMAT_VERSION    1
+#define CACHE_DEFAULT_MAX_SIZE  (256UL * 1024 * 1024)
+
+typedef struct
+{
+  size_t hits;
+  size_t misses;
+  size_t stores;
+  size_t evictions;
+  size_t evicted_bytes;
+} CacheStats;
+
+void cache_open(const char *dir, size_t max_size);
+void cache_enable_memory(size_t limit);
+bool cache_is_open();
+void cache_close();
+
+// `pipeline` identifies the passes that run and `flags` the optimizations
+// that are enabled, and both are hashed as they are
+Hash128 cache_key(Token **tokens, size_t num_tokens, uint64_t pipeline, uint64_t flags);
+uint8_t *cache_load(Hash128 key, const char *kind, size_t *size);
+void cache_store(Hash128 key, const char *kind, const uint8_t *data, size_t size);
+
+CacheStats cache_stats();
+
+#endif
@@ -0,0 +1,282 @@
+#include "callgraph.h"
+#include "intern.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int call_graph_callee(CallGraph *calls, Instruction *call)
+{
+  return var_map_lookup(&calls->ids, intern(call->operands[0].label));
+}
+
+uint32_t callee_attributes(CallGraph *calls, Instruction *call)
+{
+  int f = call_graph_callee(calls, call);
+  return f >= 0 ? calls->nodes[f].attributes : 0;
+}
+
+/* Components */
+
+typedef struct
+{
+  CallGraph *calls;
+  int *index;               // Per function, in the order visited, or -1
+  int *lowlink;
+  bool *on_stack;
+  int *stack;
+  int stack_size;
+  int next_index;
+  int num_ordered;
+} Tarjan;
+
+// A component is complete once the walk returns to the first of its
+// functions that it visited, and everything it calls was completed before
+static void strong_connect(Tarjan *t, int v)
+{
+  CallGraph *calls = t->calls;
+  t->index[v] = t->lowlink[v] = t->next_index++;
+  t->stack[t->stack_size++] = v;
+  t->on_stack[v] = true;
+
+  CallGraphNode *node = &calls->nodes[v];
+  for (int e = node->first_callee; e < node->first_callee + node->num_callees; e++) {
+    int w = calls->callees[e];
+    if (w < 0)
+      continue;
+    if (t->index[w] < 0) {
+      strong_connect(t, w);
+      if (t->lowlink[w] < t->lowlink[v])
+        t->lowlink[v] = t->lowlink[w];
+    } else if (t->on_stack[w] && t->index[w] < t->lowlink[v]) {
+      t->lowlink[v] = t->index[w];
+    }
+  }
+
+  if (t->lowlink[v] != t->index[v])
+    return;
+  int scc = calls->num_sccs++;
+  int w;
+  do {
+    w = t->stack[--t->stack_size];
+    t->on_stack[w] = false;
+    calls->nodes[w].scc = scc;
+    calls->order[t->num_ordered++] = w;
+  } while (w != v);
+}
+
+static void find_components(CallGraph *calls)
+{
+  int n = calls->num_nodes;
+  Tarjan t = { .calls = calls };
+  t.index = malloc((n + 1) * sizeof(int));
+  t.lowlink = malloc((n + 1) * sizeof(int));
+  t.on_stack = calloc(n + 1, sizeof(bool));
+  t.stack = malloc((n + 1) * sizeof(int));
+  for (int v = 0; v < n; v++)
+    t.index[v] = -1;
+  for (int v = 0; v < n; v++) {
+    if (t.index[v] < 0)
+      strong_connect(&t, v);
+  }
+  free(t.stack);
+  free(t.on_stack);
+  free(t.lowlink);
+  free(t.index);
+}
+
+/* Attributes */
+
+// Follows the blocks of a function from its entry, stopping at calls that
+// don't return, until it finds a return
+static bool can_return(CallGraph *calls, CallGraphNode *node)
+{
+  uint32_t mark = new_visit_mark();
+  Vector stack;
+  vector_init(&stack, sizeof(BasicBlock *));
+  node->entry->mark = mark;
+  vector_push_back(&stack, node->entry);
+  bool returns = false;
+  while (stack.size && !returns) {
+    BasicBlock *block = stack.data[--stack.size];
+    bool stops = false;
+    for (size_t i = 0; i < block->instructions.size && !stops; i++) {
+      Instruction *inst = block->instructions.data[i];
+      if (inst->opcode == OP_CALL)
+        stops = callee_attributes(calls, inst) & FN_NORETURN;
+      returns = returns || (!stops && inst->opcode == OP_RET);
+    }
+    for (size_t s = 0; s < block->successors.size && !stops; s++) {
+      BasicBlock *succ = block->successors.data[s];
+      if (succ->mark != mark) {
+        succ->mark = mark;
+        vector_push_back(&stack, succ);
+      }
+    }
+  }
+  vector_free(&stack);
+  return returns;
+}
+
+static uint32_t local_attributes(CallGraph *calls, CallGraphNode *node, uint64_t *depth)
+{
+  uint32_t attributes = FN_READNONE | FN_READONLY | FN_LEAF | FN_NORECURSE;
+  BasicBlock *end = function_end(node->entry);
+  for (BasicBlock *block = node->entry; block != end; block = block->next) {
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      if (inst->opcode == OP_STORE)
+        attributes &= ~(FN_READNONE | FN_READONLY);
+      if (inst->opcode == OP_DEREF || inst->opcode == OP_ADDR)
+        attributes &= ~FN_READNONE;
+      for (uint32_t o = 0; o < inst->num_operands; o++) {
+        if (inst->operands[o].kind == OPERAND_GLOBAL)
+          attributes &= ~FN_READNONE;
+      }
+    }
+  }
+
+  // Calls within the component neither add nor remove effects
+  for (int e = node->first_callee; e < node->first_callee + node->num_callees; e++) {
+    int g = calls->callees[e];
+    attributes &= ~FN_LEAF;
+    if (g >= 0 && calls->nodes[g].scc == node->scc) {
+      attributes &= ~FN_NORECURSE;
+      continue;
+    }
+    uint32_t callee = g >= 0 ? calls->nodes[g].attributes : 0;
+    attributes &= callee | ~(FN_READNONE | FN_READONLY);
+    uint64_t callee_depth = g >= 0 ? calls->nodes[g].call_depth : CALL_DEPTH_UNBOUNDED;
+    if (callee_depth + 1 > *depth)
+      *depth = callee_depth + 1;
+  }
+  return attributes;
+}
+
+// Attributes of memory hold for a component as a whole, since its functions
+// all reach each other
+static void infer_component(CallGraph *calls, int *members, int num_members)
+{
+  uint32_t shared = FN_READNONE | FN_READONLY;
+  for (int m = 0; m < num_members; m++) {
+    CallGraphNode *node = &calls->nodes[members[m]];
+    uint64_t depth = 1;
+    node->attributes = local_attributes(calls, node, &depth);
+    if (num_members > 1)
+      node->attributes &= ~FN_NORECURSE;
+    bool is_bounded = (node->attributes & FN_NORECURSE) && depth < CALL_DEPTH_UNBOUNDED;
+    node->call_depth = is_bounded ? depth : CALL_DEPTH_UNBOUNDED;
+    shared &= node->attributes;
+  }
+
+  for (int m = 0; m < num_members; m++) {
+    CallGraphNode *node = &calls->nodes[members[m]];
+    node->attributes = (node->attributes & ~(FN_READNONE | FN_READONLY)) | shared;
+    node->attributes |= FN_NORETURN;
+  }
+
+  // No function of the component returns until one of them is seen to
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int m = 0; m < num_members; m++) {
+      CallGraphNode *node = &calls->nodes[members[m]];
+      if ((node->attributes & FN_NORETURN) && can_return(calls, node)) {
+        node->attributes &= ~FN_NORETURN;
+        changed = true;
+      }
+    }
+  }
+}
+
+/* Construction */
+
+void build_call_graph(ControlFlowGraph *graph, CallGraph *calls)
+{
+  *calls = (CallGraph){ 0 };
+  var_map_init(&calls->ids);
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    if (is_function_entry(block))
+      calls->num_nodes++;
+  }
+
+  calls->nodes = calloc(calls->num_nodes + 1, sizeof(CallGraphNode));
+  int n = 0;
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    if (!is_function_entry(block))
+      continue;
+    CallGraphNode *node = &calls->nodes[n++];
+    node->name = intern(block->tag);
+    node->entry = block;
+    var_map_insert(&calls->ids, node->name);
+  }
+
+  // Functions are numbered before any call is resolved, since a call may
+  // name a function further down
+  for (int pass = 0; pass < 2; pass++) {
+    calls->num_callees = 0;
+    for (int f = 0; f < calls->num_nodes; f++) {
+      CallGraphNode *node = &calls->nodes[f];
+      node->first_callee = calls->num_callees;
+      BasicBlock *end = function_end(node->entry);
+      for (BasicBlock *block = node->entry; block != end; block = block->next) {
+        for (size_t i = 0; i < block->instructions.size; i++) {
+          Instruction *inst = block->instructions.data[i];
+          if (inst->opcode != OP_CALL)
+            continue;
+          if (pass)
+            calls->callees[calls->num_callees] = call_graph_callee(calls, inst);
+          calls->num_callees++;
+        }
+      }
+      node->num_callees = calls->num_callees - node->first_callee;
+    }
+    if (!pass)
+      calls->callees = malloc((calls->num_callees + 1) * sizeof(int));
+  }
+
+  calls->order = malloc((calls->num_nodes + 1) * sizeof(int));
+  find_components(calls);
+
+  for (int start = 0, end = 0; start < calls->num_nodes; start = end) {
+    int scc = calls->nodes[calls->order[start]].scc;
+    while (end < calls->num_nodes && calls->nodes[calls->order[end]].scc == scc)
+      end++;
+    infer_component(calls, &calls->order[start], end - start);
+  }
+}
+
+void free_call_graph(CallGraph *calls)
+{
+  free(calls->order);
+  free(calls->callees);
+  free(calls->nodes);
+  var_map_free(&calls->ids);
+  *calls = (CallGraph){ 0 };
+}
+
+/* Dumping */
+
+void dump_call_graph(CallGraph *calls)
+{
+  static const char *attribute_names[] = { "readnone", "readonly", "noreturn", "leaf", "norecurse" };
+  printf("[CallGraph] (%d functions, %d components, bottom-up)\n", calls->num_nodes,
+      calls->num_sccs);
+  for (int i = 0; i < calls->num_nodes; i++) {
+    CallGraphNode *node = &calls->nodes[calls->order[i]];
+    printf("  %s [scc %d]", node->name, node->scc);
+    for (int a = 0; a < 5; a++) {
+      if (node->attributes & (1u << a))
+        printf(" %s", attribute_names[a]);
+    }
+    if (node->call_depth == CALL_DEPTH_UNBOUNDED)
+      printf(", call depth unbounded\n");
+    else
+      printf(", call depth %u\n", node->call_depth);
+
+    for (int e = node->first_callee; e < node->first_callee + node->num_callees; e++) {
+      int g = calls->callees[e];
+      printf("    -> %s\n", g >= 0 ? calls->nodes[g].name : "(outside the program)");
+    }
+  }
+}
@@ -0,0 +1,70 @@
+#ifndef MINI_CALLGRAPH_H
+#define MINI_CALLGRAPH_H
+
+#include "cfa.h"
+#include "varmap.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Call Graph
+ *
+ * `build_call_graph()` links every function in the graph to the functions
+ * its calls name, and finds the strongly connected components of those
+ * edges with Tarjan's algorithm. The components come out bottom-up, callees
+ * before their callers, which is the order in which interprocedural passes
+ * visit functions and in which attributes are inferred: what a function may
+ * do follows from its own instructions and from the attributes of what it
+ * calls. Functions of one component are assumed to have an attribute until
+ * one of them shows otherwise. Calls to functions outside the graph may do
+ * anything.
+ */
+
+typedef enum
+{
+  FN_READNONE = 1 << 0,     // Neither reads nor writes memory, nor takes addresses
+  FN_READONLY = 1 << 1,     // Doesn't write memory
+  FN_NORETURN = 1 << 2,     // Never returns to its caller
+  FN_LEAF = 1 << 3,         // Makes no calls
+  FN_NORECURSE = 1 << 4,    // Never calls itself, directly or through others
+} FunctionAttribute;
+
+// The call depth of a function counts frames rather than bytes of stack, as
+// the size of a frame is only known once the backend has allocated its
+// registers. It is unbounded for functions that may recurse or call out of
+// the graph.
+#define CALL_DEPTH_UNBOUNDED UINT32_MAX
+
+typedef struct
+{
+  char *name;               // Interned
+  BasicBlock *entry;
+  int first_callee;         // In `CallGraph.callees`, one per call
+  int num_callees;
+  int scc;
+  uint32_t attributes;      // FunctionAttribute
+  uint32_t call_depth;      // Most frames on the stack while it runs, its own included
+} CallGraphNode;
+
+typedef struct
+{
+  CallGraphNode *nodes;
+  int num_nodes;
+  VarMap ids;
+  int *callees;             // Functions, or -1 outside the graph
+  int num_callees;
+  int *order;               // Bottom-up, with each component contiguous
+  int num_sccs;
+} CallGraph;
+
+void build_call_graph(ControlFlowGraph *graph, CallGraph *calls);
+void free_call_graph(CallGraph *calls);
+
+// Returns the function a call calls, or -1 if it's outside the graph
+int call_graph_callee(CallGraph *calls, Instruction *call);
+// Outside the graph a function has no attributes
+uint32_t callee_attributes(CallGraph *calls, Instruction *call);
+
+void dump_call_graph(CallGraph *calls);
+
+#endif
@@ -1,4 +1,5 @@
 #include "cfa.h"
+#include "intern.h"
 #include "util.h"
 
 #include <assert.h>
@@ -7,16 +8,20 @@
 #include <string.h>
 
 static Table *var_names = NULL;
-static Table *expressions = NULL;
 static BasicBlock *blocks = NULL;
 static BasicBlock *current_block = NULL;
+static BasicBlock *entry_block = NULL;
 static int block_count = 0;
 static int num_temporaries = 0;
+static bool in_function = false;
 
-static Node *emit(Node *);
+static void emit(Node *);
+static void emit_node(Node *);
 static void add_operand(Instruction *, void *, OperandKind);
+static void add_operands_from_node(Instruction *, Node *);
+char *create_temporary();
 
-static BasicBlock *make_basic_block(char *tag, int id)
+BasicBlock *make_basic_block(char *tag, int id)
 {
   BasicBlock *block = calloc(1, sizeof(BasicBlock));
   block->id = id;
@@ -24,60 +29,269 @@ static BasicBlock *make_basic_block(char *tag, int id)
   vector_init(&block->predecessors, sizeof(BasicBlock *));
   vector_init(&block->successors, sizeof(BasicBlock *));
   vector_init(&block->instructions, sizeof(Instruction *));
-  block->variables = table_new();
   return block;
 }
 
-static Instruction *make_instruction(OpCode opcode)
+void add_edge(BasicBlock *from, BasicBlock *to)
+{
+  vector_push_back(&from->successors, to);
+  vector_push_back(&to->predecessors, from);
+}
+
+static void remove_at(Vector *v, size_t index)
+{
+  memmove(&v->data[index], &v->data[index + 1], (v->size - index - 1) * sizeof(void *));
+  v->size--;
+}
+
+// Also drops the operands that the phis of `to` take from `from`
+void remove_edge(BasicBlock *from, BasicBlock *to)
+{
+  for (size_t s = 0; s < from->successors.size; s++) {
+    if (from->successors.data[s] == to) {
+      remove_at(&from->successors, s);
+      break;
+    }
+  }
+
+  for (size_t p = 0; p < to->predecessors.size; p++) {
+    if (to->predecessors.data[p] != from)
+      continue;
+    remove_at(&to->predecessors, p);
+    for (size_t i = 0; i < to->instructions.size; i++) {
+      Instruction *phi = to->instructions.data[i];
+      if (phi->opcode == OP_DEF) continue;
+      if (phi->opcode != OP_PHI) break;
+      memmove(&phi->operands[p], &phi->operands[p + 1],
+          (phi->num_operands - p - 1) * sizeof(Operand));
+      phi->num_operands--;
+    }
+    break;
+  }
+}
+
+// The jump from `from` to `to`, whose edge is added right away
+Instruction *make_jump(BasicBlock *from, BasicBlock *to)
+{
+  Instruction *jmp = make_instruction(OP_JMP);
+  *push_operand(jmp) = (Operand){ .kind = OPERAND_LABEL, .label = to->tag };
+  add_edge(from, to);
+  return jmp;
+}
+
+Instruction *make_instruction(OpCode opcode)
 {
   Instruction *instruction = calloc(1, sizeof(Instruction));
   instruction->opcode = opcode;
+  instruction->operands = instruction->inline_operands;
+  instruction->capacity = MAX_INLINE_OPERANDS;
   return instruction;
 }
 
-static BasicBlock *add_block(char *tag)
+Operand *push_operand(Instruction *inst)
 {
-  BasicBlock *block = make_basic_block(tag, block_count++);
+  if (inst->num_operands == inst->capacity) {
+    uint32_t capacity = inst->capacity * 2;
+    Operand *operands = malloc(capacity * sizeof(Operand));
+    memcpy(operands, inst->operands, inst->num_operands * sizeof(Operand));
+    if (inst->operands != inst->inline_operands)
+      free(inst->operands);
+    inst->operands = operands;
+    inst->capacity = capacity;
+  }
+
+  Operand *operand = &inst->operands[inst->num_operands++];
+  memset(operand, 0, sizeof(Operand));
+  return operand;
+}
+
+void free_instruction(Instruction *inst)
+{
+  if (inst->operands != inst->inline_operands)
+    free(inst->operands);
+  free(inst);
+}
+
+// Returns a mark that no block carries yet, so that walks over the graph
+// don't need to reset any state before they start
+uint32_t new_visit_mark()
+{
+  static uint32_t mark = 0;
+  return ++mark;
+}
+
+bool is_function_entry(BasicBlock *block)
+{
+  Instruction *first = vector_get(&block->instructions, 0);
+  return first && first->opcode == OP_DEF;
+}
+
+// Returns the first block after the blocks of the function starting at `entry`
+BasicBlock *function_end(BasicBlock *entry)
+{
+  BasicBlock *block = entry->next;
+  while (block && !is_function_entry(block))
+    block = block->next;
+  return block;
+}
+
+// The number of instructions of the function starting at `entry`, not
+// counting its `def`
+int function_size(BasicBlock *entry)
+{
+  int size = 0;
+  BasicBlock *end = function_end(entry);
+  for (BasicBlock *block = entry; block != end; block = block->next)
+    size += block->instructions.size;
+  return size - 1;
+}
 
-  // First block
-  if (!current_block) {
-    current_block = block;
-    blocks = current_block;
+Instruction *copy_instruction(Instruction *inst)
+{
+  Instruction *copy = make_instruction(inst->opcode);
+  copy->assignee = inst->assignee;
+  for (uint32_t o = 0; o < inst->num_operands; o++)
+    *push_operand(copy) = inst->operands[o];
+  return copy;
+}
+
+// Every copy is numbered and tagged as a new block of the graph. Blocks of
+// the function are numbered through `BasicBlock.index` while they're copied.
+BasicBlock **copy_function_blocks(ControlFlowGraph *graph, BasicBlock *entry, BasicBlock *after,
+    int *num_blocks)
+{
+  BasicBlock *end = function_end(entry);
+  int count = 0;
+  for (BasicBlock *block = entry; block != end; block = block->next)
+    block->index = count++;
+
+  // The copies may go right after the originals, so these are counted
+  // rather than walked up to `end`
+  BasicBlock **copies = malloc((count + 1) * sizeof(BasicBlock *));
+  BasicBlock *block = entry;
+  for (int b = 0; b < count; b++, block = block->next) {
+    char *tag = aprintf("%s.%d", block->tag, graph->num_blocks);
+    BasicBlock *copy = make_basic_block(intern(tag), graph->num_blocks++);
+    free(tag);
+    copy->next = after->next;
+    after = after->next = copy;
+    copies[b] = copy;
   }
-  else {
-    // Add BasicBlocks to respective ancestor lists
-    vector_push_back(&block->predecessors, current_block);
-    vector_push_back(&current_block->successors, block);
 
-    current_block->next = block;
-    current_block = current_block->next;
+  block = entry;
+  for (int b = 0; b < count; b++, block = block->next) {
+    BasicBlock *copy = copies[b];
+    for (size_t p = 0; p < block->predecessors.size; p++) {
+      BasicBlock *pred = block->predecessors.data[p];
+      vector_push_back(&copy->predecessors, copies[pred->index]);
+    }
+    for (size_t s = 0; s < block->successors.size; s++) {
+      BasicBlock *succ = block->successors.data[s];
+      vector_push_back(&copy->successors, copies[succ->index]);
+    }
+
+    // Successors are in the order of the labels of the terminator
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = copy_instruction(block->instructions.data[i]);
+      uint32_t first_label = inst->opcode == OP_BR ? 1 : 0;
+      for (size_t s = 0; is_terminator(inst) && s < copy->successors.size; s++)
+        inst->operands[first_label + s].label = ((BasicBlock *)copy->successors.data[s])->tag;
+      vector_push_back(&copy->instructions, inst);
+    }
   }
-  return current_block;
+
+  *num_blocks = count;
+  return copies;
 }
 
-static char *encode_instruction(Instruction *inst)
+// Returns the blocks reachable from `entry` in reverse postorder, storing
+// each one's position in `BasicBlock.index`. The walk keeps its own stack so
+// that deep graphs don't exhaust the native one.
+BasicBlock **reverse_postorder(BasicBlock *entry, int *num_blocks)
 {
-  size_t size = 1 + (sizeof(Operand) * inst->num_operands);
-  uint8_t *buf = calloc(size, sizeof(uint8_t));
-  memcpy(buf, &inst->opcode, 1);
+  Vector postorder;
+  vector_init(&postorder, sizeof(BasicBlock *));
+
+  size_t capacity = 64, depth = 0;
+  BasicBlock **blocks = malloc(capacity * sizeof(BasicBlock *));
+  size_t *cursors = malloc(capacity * sizeof(size_t));
+
+  uint32_t mark = new_visit_mark();
+  entry->mark = mark;
+  blocks[depth] = entry;
+  cursors[depth++] = 0;
+
+  while (depth) {
+    BasicBlock *block = blocks[depth - 1];
+    size_t *cursor = &cursors[depth - 1];
+    if (*cursor == block->successors.size) {
+      vector_push_back(&postorder, block);
+      depth--;
+      continue;
+    }
 
-  for (uint8_t i = 0; i < inst->num_operands; i++)
-    memcpy(buf, &inst->operands[i], sizeof(Operand));
+    BasicBlock *succ = vector_get(&block->successors, (*cursor)++);
+    if (succ->mark == mark)
+      continue;
+    succ->mark = mark;
 
-  uint64_t inst_hash = hash_n(buf, size);
-  char *encoded = aprintf("%zu", inst_hash);
+    if (depth == capacity) {
+      capacity *= 2;
+      blocks = realloc(blocks, capacity * sizeof(BasicBlock *));
+      cursors = realloc(cursors, capacity * sizeof(size_t));
+    }
+    blocks[depth] = succ;
+    cursors[depth++] = 0;
+  }
 
-  /*
-#ifdef DEBUG
-  printf("encoded %s = ", inst->assignee);
-  for (size_t i = 0; i < strlen(encoded); i++) {
-    printf("%X ", encoded[i]);
+  *num_blocks = postorder.size;
+  BasicBlock **order = malloc((postorder.size + 1) * sizeof(BasicBlock *));
+  for (size_t i = 0; i < postorder.size; i++) {
+    BasicBlock *block = postorder.data[postorder.size - 1 - i];
+    block->index = i;
+    order[i] = block;
   }
-  printf("\n");
-#endif
-  */
 
-  return encoded;
+  free(cursors);
+  free(blocks);
+  vector_free(&postorder);
+  return order;
+}
+
+bool is_terminator(Instruction *inst)
+{
+  return inst->opcode == OP_JMP || inst->opcode == OP_BR || inst->opcode == OP_RET;
+}
+
+// Creates a block that isn't placed in the graph yet
+static BasicBlock *new_block(const char *kind)
+{
+  int id = block_count++;
+  char *tag = aprintf("%s.%d", kind, id);
+  BasicBlock *block = make_basic_block(intern(tag), id);
+  free(tag);
+  return block;
+}
+
+// Places a block after the current one and continues lowering into it
+static void switch_to_block(BasicBlock *block)
+{
+  if (current_block)
+    current_block->next = block;
+  else
+    blocks = block;
+  current_block = block;
+}
+
+static Instruction *last_instruction(BasicBlock *block)
+{
+  return vector_get(&block->instructions, block->instructions.size - 1);
+}
+
+static bool block_returns(BasicBlock *block)
+{
+  Instruction *last = last_instruction(block);
+  return last && last->opcode == OP_RET;
 }
 
 static void add_instruction(Instruction *inst)
@@ -85,23 +299,18 @@ static void add_instruction(Instruction *inst)
   if (!current_block)
     fatal("no block to add instruction to");
 
-  if (inst->assignee) {
-    char *encoded = encode_instruction(inst);
-    char *exists = (char *)table_lookup(expressions, encoded);
-    if (exists) {
-      LOG_INFO("eliminating redundant calculation for variable `%s`", inst->assignee);
-      inst->opcode = OP_ASSIGN;
-      memset(inst->operands, 0, sizeof(Operand) * MAX_OPERANDS);
-      inst->num_operands = 0;
-      add_operand(inst, exists, OPERAND_VARIABLE);
-    } else {
-      table_insert(expressions, encoded, inst->assignee);
-    }
-  }
-
   vector_push_back(&current_block->instructions, inst);
 }
 
+// Ends the current block with a jump, unless it already returned
+static void jump_to(BasicBlock *target)
+{
+  if (block_returns(current_block))
+    return;
+
+  add_instruction(make_jump(current_block, target));
+}
+
 static Instruction *previous_instruction()
 {
   if (!current_block)
@@ -116,15 +325,13 @@ static Instruction *previous_instruction()
 
 static void add_operand(Instruction *inst, void *value, OperandKind kind)
 {
-  if (inst->num_operands == MAX_OPERANDS)
-    fatal("too many operands for instruction %d", inst->opcode);
-
   Operand operand = { .kind = kind };
   switch (operand.kind) {
     case OPERAND_LITERAL:
       operand.literal = *((Value *)value);
       break;
     case OPERAND_VARIABLE:
+    case OPERAND_GLOBAL:
       operand.var = (char *)value;
       break;
     case OPERAND_LABEL:
@@ -133,7 +340,27 @@ static void add_operand(Instruction *inst, void *value, OperandKind kind)
     default: fatal("invalid OperandKind: %d", kind);
   }
 
-  inst->operands[inst->num_operands++] = operand;
+  *push_operand(inst) = operand;
+}
+
+// Names declared outside of the function being lowered live in memory
+static OperandKind variable_kind(char *name)
+{
+  return in_function && table_lookup(var_names, name) ? OPERAND_VARIABLE : OPERAND_GLOBAL;
+}
+
+// Lowers a call, returning the temporary that holds its value if it's used
+static char *emit_call(Node *node, bool has_result)
+{
+  node->visited = true;
+  Instruction *inst = make_instruction(OP_CALL);
+  add_operand(inst, node->call.name, OPERAND_LABEL);
+  for (Node *arg = node->call.args; arg; arg = arg->next)
+    add_operands_from_node(inst, arg);
+  if (has_result)
+    inst->assignee = create_temporary();
+  add_instruction(inst);
+  return inst->assignee;
 }
 
 static void add_operands_from_node(Instruction *inst, Node *node)
@@ -143,10 +370,13 @@ static void add_operands_from_node(Instruction *inst, Node *node)
       add_operand(inst, &node->literal, OPERAND_LITERAL);
       break;
     case NODE_REF_EXPR:
-      add_operand(inst, node->ref, OPERAND_VARIABLE);
+      add_operand(inst, node->ref, variable_kind(node->ref));
+      break;
+    case NODE_FUNC_CALL_EXPR:
+      add_operand(inst, emit_call(node, true), OPERAND_VARIABLE);
       break;
     default:
-      emit(node);
+      emit_node(node);
       Instruction *temporary = previous_instruction();
       add_operand(inst, temporary->assignee, OPERAND_VARIABLE);
   }
@@ -155,48 +385,117 @@ static void add_operands_from_node(Instruction *inst, Node *node)
 char *create_temporary()
 {
   int temporary_id = num_temporaries++;
-  char *temporary_name = aprintf("$t%d", temporary_id);
+  char *name = aprintf("$t%d", temporary_id);
+  char *temporary_name = intern(name);
+  free(name);
   return temporary_name;
 }
 
-static Node *emit(Node *node)
+static void emit_assignment(char *name, Node *value)
+{
+  Instruction *inst = NULL;
+  if (variable_kind(name) == OPERAND_VARIABLE) {
+    inst = make_instruction(OP_ASSIGN);
+    add_operands_from_node(inst, value);
+    inst->assignee = name;
+  } else {
+    inst = make_instruction(OP_STORE);
+    add_operand(inst, name, OPERAND_GLOBAL);
+    add_operands_from_node(inst, value);
+  }
+  add_instruction(inst);
+}
+
+// Lowers an `if` with its `elif` and `else` branches. Each condition ends its
+// block with a `br` to the branch body or the next condition, and every body
+// jumps to a common join block.
+static void emit_conditional(Node *node)
+{
+  BasicBlock *join = new_block("endif");
+
+  for (Node *cond = node; cond; cond = cond->cond_stmt.orelse) {
+    cond->visited = true;
+    if (!cond->cond_stmt.expr) {
+      emit(cond->cond_stmt.body);
+      jump_to(join);
+      break;
+    }
+
+    BasicBlock *then = new_block("then");
+    BasicBlock *otherwise = cond->cond_stmt.orelse ? new_block("else") : join;
+
+    Instruction *inst = make_instruction(OP_BR);
+    add_operands_from_node(inst, cond->cond_stmt.expr);
+    add_operand(inst, then->tag, OPERAND_LABEL);
+    add_operand(inst, otherwise->tag, OPERAND_LABEL);
+    add_instruction(inst);
+    add_edge(current_block, then);
+    add_edge(current_block, otherwise);
+
+    switch_to_block(then);
+    emit(cond->cond_stmt.body);
+    jump_to(join);
+
+    if (otherwise == join)
+      break;
+    switch_to_block(otherwise);
+  }
+
+  switch_to_block(join);
+}
+
+static void emit_node(Node *node)
 {
-  if (!node) return NULL;
   node->visited = true;
-  Node *next = node->next;
   Instruction *inst = NULL;
 
   switch (node->kind) {
     case NODE_NOOP:
-      free(node);
       break;
     case NODE_FUNC_DECL:
-      add_block(node->func_decl.name);
+      // Functions don't fall through into each other
+      switch_to_block(make_basic_block(node->func_decl.name, block_count++));
+      table_clear(var_names);
+      in_function = true;
+
       inst = make_instruction(OP_DEF);
       add_operand(inst, node->func_decl.name, OPERAND_LABEL);
+      for (Node *param = node->func_decl.params; param; param = param->next) {
+        param->visited = true;
+        table_insert(var_names, param->var_decl.name, param->var_decl.name);
+        add_operand(inst, param->var_decl.name, OPERAND_VARIABLE);
+      }
       add_instruction(inst);
-      emit(node->func_decl.params);
       emit(node->func_decl.body);
+
+      in_function = false;
       break;
     case NODE_VAR_DECL:
-      inst = make_instruction(OP_ASSIGN);
-      add_operands_from_node(inst, node->var_decl.init);
-      inst->assignee = node->var_decl.name;
-      table_insert(var_names, inst->assignee, inst->assignee);
-      add_instruction(inst);
+      if (in_function)
+        table_insert(var_names, node->var_decl.name, node->var_decl.name);
+      // Uninitialized variables have nothing to lower
+      if (!node->var_decl.init)
+        break;
+      // Globals are initialized in `$entry`, wherever they are declared
+      BasicBlock *block = current_block;
+      if (!in_function)
+        current_block = entry_block;
+      emit_assignment(node->var_decl.name, node->var_decl.init);
+      current_block = block;
       break;
     case NODE_ASSIGN_STMT:
-      inst = make_instruction(OP_ASSIGN);
-      add_operands_from_node(inst, node->assign.value);
-      inst->assignee = node->assign.name;
-      add_instruction(inst);
+      emit_assignment(node->assign.name, node->assign.value);
       break;
     case NODE_COND_STMT:
-      fatal("conditional translation to IR is not implemented yet");
+      emit_conditional(node);
+      break;
+    case NODE_FUNC_CALL_EXPR:
+      emit_call(node, false);
       break;
     case NODE_RET_STMT:
       inst = make_instruction(OP_RET);
-      add_operands_from_node(inst, node->ret_stmt.value);
+      if (node->ret_stmt.value)
+        add_operands_from_node(inst, node->ret_stmt.value);
       add_instruction(inst);
       break;
     case NODE_UNARY_EXPR:
@@ -217,37 +516,92 @@ static Node *emit(Node *node)
       break;
     case NODE_LITERAL_EXPR: // Leaf node
     case NODE_REF_EXPR:
-      return node;
+      break;
     default: fatal("cannot emit IR from node: %d", node->kind);
   }
+}
 
-  emit(next);
-  return NULL;
+// Lowers a list of statements or declarations. Statements that follow a
+// `return` can't execute and aren't lowered.
+static void emit(Node *node)
+{
+  while (node) {
+    Node *next = node->next;
+    if (in_function && block_returns(current_block)) {
+      LOG_WARN("unreachable code on line %d, col %d", node->line, node->col);
+      break;
+    }
+    emit_node(node);
+    node = next;
+  }
 }
 
+// Lowers `root` and the declarations that follow it. Global initializers are
+// lowered into the `$entry` block and each function gets its own region of
+// blocks, starting with the block that holds its `def`.
 ControlFlowGraph construct_cfg(Node *root)
 {
   var_names = table_new();
-  expressions = table_new();
   blocks = current_block = NULL;
   block_count = 0;
   num_temporaries = 0;
+  in_function = false;
 
   ControlFlowGraph graph = { 0 };
-  graph.entry = add_block("$entry");
+  graph.entry = entry_block = make_basic_block("$entry", block_count++);
+  switch_to_block(graph.entry);
 
   emit(root);
 
-  graph.exit = add_block("$exit");
+  graph.exit = NULL;
   graph.blocks = blocks;
   graph.num_blocks = block_count;
 
   table_free(var_names);
-  table_free(expressions);
 
   return graph;
 }
 
+void free_basic_block(BasicBlock *block)
+{
+  for (size_t i = 0; i < block->instructions.size; i++)
+    free_instruction(vector_get(&block->instructions, i));
+  vector_free(&block->instructions);
+  vector_free(&block->predecessors);
+  vector_free(&block->successors);
+  free(block);
+}
+
+void free_cfg(ControlFlowGraph *graph)
+{
+  BasicBlock *block = graph->blocks;
+  while (block) {
+    BasicBlock *next = block->next;
+    free_basic_block(block);
+    block = next;
+  }
+  memset(graph, 0, sizeof(ControlFlowGraph));
+}
+
+void dump_cfg(ControlFlowGraph *graph)
+{
+  BasicBlock *block = graph->blocks;
+  while (block) {
+    printf("[BasicBlock %s#%d] (%ld predecessors, %ld successors, %ld instructions)\n",
+        block->tag, block->id,
+        block->predecessors.size,
+        block->successors.size,
+        block->instructions.size);
+
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = (Instruction *)vector_get(&block->instructions, i);
+      dump_instruction(inst);
+    }
+
+    block = block->next;
+  }
+}
+
 void dump_operand(Operand operand)
 {
   switch (operand.kind) {
@@ -260,6 +614,9 @@ void dump_operand(Operand operand)
     case OPERAND_LABEL:
       printf("%s", operand.label);
       break;
+    case OPERAND_GLOBAL:
+      printf("@%s", operand.var);
+      break;
     default: fatal("invalid OperandKind: %d", operand.kind);
   }
 }
@@ -289,9 +646,17 @@ void dump_instruction(Instruction *inst)
 {
   switch (inst->opcode) {
     case OP_DEF:
-      assert(inst->num_operands == 1);
+      assert(inst->num_operands >= 1);
       printf("def ");
       dump_operand(inst->operands[0]);
+      if (inst->num_operands > 1) {
+        printf("(");
+        for (uint32_t i = 1; i < inst->num_operands; i++) {
+          printf("%s", i > 1 ? ", " : "");
+          dump_operand(inst->operands[i]);
+        }
+        printf(")");
+      }
       break;
     case OP_ASSIGN:
       assert(inst->num_operands == 1);
@@ -321,10 +686,56 @@ void dump_instruction(Instruction *inst)
       printf(opcode_as_str(inst->opcode));
       dump_operand(inst->operands[1]);
       break;
-    case OP_RET:
+    case OP_PHI:
+      printf("  %s := phi(", inst->assignee);
+      for (uint32_t i = 0; i < inst->num_operands; i++) {
+        printf("%s", i ? ", " : "");
+        dump_operand(inst->operands[i]);
+      }
+      printf(")");
+      break;
+    case OP_STORE:
+      assert(inst->num_operands == 2);
+      printf("  ");
+      dump_operand(inst->operands[0]);
+      printf(" := ");
+      dump_operand(inst->operands[1]);
+      break;
+    case OP_CALL:
+      assert(inst->num_operands >= 1);
+      printf("  ");
+      if (inst->assignee)
+        printf("%s := ", inst->assignee);
+      printf("call ");
+      dump_operand(inst->operands[0]);
+      printf("(");
+      for (uint32_t i = 1; i < inst->num_operands; i++) {
+        printf("%s", i > 1 ? ", " : "");
+        dump_operand(inst->operands[i]);
+      }
+      printf(")");
+      break;
+    case OP_JMP:
       assert(inst->num_operands == 1);
-      printf("  ret ");
+      printf("  jmp ");
+      dump_operand(inst->operands[0]);
+      break;
+    case OP_BR:
+      assert(inst->num_operands == 3);
+      printf("  br ");
       dump_operand(inst->operands[0]);
+      printf(", ");
+      dump_operand(inst->operands[1]);
+      printf(", ");
+      dump_operand(inst->operands[2]);
+      break;
+    case OP_RET:
+      assert(inst->num_operands <= 1);
+      printf("  ret");
+      if (inst->num_operands) {
+        printf(" ");
+        dump_operand(inst->operands[0]);
+      }
       break;
     default: fatal("invalid Instruction: %d", inst->opcode);
   }
@@ -42,6 +42,9 @@ enum OpCode
   OP_JMP,
   OP_BR,
   OP_RET,
+  OP_PHI,
+  OP_STORE,
+  OP_CALL,
 };
 
 enum OperandKind
@@ -50,6 +53,7 @@ enum OperandKind
   OPERAND_LITERAL,
   OPERAND_VARIABLE,
   OPERAND_LABEL,
+  OPERAND_GLOBAL,
 };
 
 struct Operand
@@ -59,19 +63,29 @@ struct Operand
   union
   {
     Value literal;
-    char *var;
+    char *var;      // Local variables and globals
     char *label;
   };
 };
 
-#define MAX_OPERANDS 2
+// Operands are stored inline unless an instruction needs more, which only
+// happens for phis at joins of many branches, for function parameters and
+// for the arguments of calls.
+#define MAX_INLINE_OPERANDS 3
 
+// `br cond, then, else` and `jmp target` end a block, naming the tags of its
+// successors. A phi has one operand per predecessor of its block, in the order
+// of `BasicBlock.predecessors`. Globals are only written by `store`. A call
+// names the function it calls in its first operand, followed by the
+// arguments, and has no assignee when its result isn't used.
 struct Instruction
 {
   OpCode opcode;
   char *assignee;
-  Operand operands[MAX_OPERANDS];
-  uint8_t num_operands;
+  Operand *operands;
+  uint32_t num_operands;
+  uint32_t capacity;
+  Operand inline_operands[MAX_INLINE_OPERANDS];
 };
 
 struct BasicBlock
@@ -81,7 +95,8 @@ struct BasicBlock
   Vector predecessors;    // BasicBlock *
   Vector successors;      // BasicBlock *
   Vector instructions;    // Instruction *
-  Table  *variables;      // char *
+  int index;              // Scratch numbering owned by the running analysis
+  uint32_t mark;          // Visited by the walk that owns this mark
   BasicBlock *next;
 };
 
@@ -93,7 +108,30 @@ struct ControlFlowGraph
   int num_blocks;
 };
 
+BasicBlock *make_basic_block(char *tag, int id);
+void free_basic_block(BasicBlock *block);
+void add_edge(BasicBlock *from, BasicBlock *to);
+void remove_edge(BasicBlock *from, BasicBlock *to);
+Instruction *make_jump(BasicBlock *from, BasicBlock *to);
+Instruction *make_instruction(OpCode opcode);
+Operand *push_operand(Instruction *inst);
+void free_instruction(Instruction *inst);
+Instruction *copy_instruction(Instruction *inst);
+bool is_terminator(Instruction *inst);
+bool is_function_entry(BasicBlock *block);
+BasicBlock *function_end(BasicBlock *entry);
+int function_size(BasicBlock *entry);
+BasicBlock **reverse_postorder(BasicBlock *entry, int *num_blocks);
+// Copies the blocks of the function starting at `entry`, with their edges
+// and instructions, and places them after `after`. Jumps and branches of the
+// copies lead to the copies. Returns them in the order of the originals.
+BasicBlock **copy_function_blocks(ControlFlowGraph *graph, BasicBlock *entry, BasicBlock *after,
+    int *num_blocks);
+uint32_t new_visit_mark();
+
 ControlFlowGraph construct_cfg(Node *root);
+void free_cfg(ControlFlowGraph *graph);
+void dump_cfg(ControlFlowGraph *graph);
 void dump_instruction(Instruction *inst);
 
 #endif
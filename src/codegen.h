@@ -2,8 +2,49 @@
 #define MINI_CODEGEN_H
 
 #include "cfa.h"
+#include "util.h"
+
+typedef enum
+{
+  REGALLOC_LINEAR_SCAN,       // Fast, the default below -O3
+  REGALLOC_GRAPH_COLORING,    // Iterated register coalescing
+} RegisterAllocator;
+
+typedef enum
+{
+  EMIT_ASSEMBLY,              // NASM source
+  EMIT_OBJECT,                // A relocatable ELF64 object
+  EMIT_EXECUTABLE,            // A static ELF64 executable, without a linker
+  EMIT_RUN,                   // Nothing, the program runs in-process instead
+} OutputKind;
+
+typedef struct
+{
+  const char *output_filename;
+  RegisterAllocator allocator;
+  OutputKind emit;
+  bool perf_symbols;          // Of code that runs in-process, for `perf`
+  bool run_in_child;          // Of the compiler, which must outlive the program
+  bool tail_calls;            // Jump to functions called in tail position
+  bool require_tail_calls;    // And fail where that isn't possible
+} CodegenOptions;
 
 /* Available Backends */
-int nasm_x86_64_generate(ControlFlowGraph *graph);
+// Returns what `main` returned when running the program, and 0 otherwise
+int nasm_x86_64_generate(ControlFlowGraph *graph, CodegenOptions *options);
+
+// Generates the program one declaration at a time, where each graph holds
+// the functions of a declaration or the initializer of a global. Programs
+// compiled this way can't run in-process. With a `key`, the cache entry of
+// the IR of a declaration, its machine code is cached too, under a key that
+// also takes the options of the backend.
+void nasm_x86_64_begin_stream(CodegenOptions *options);
+void nasm_x86_64_stream(ControlFlowGraph *graph, Hash128 *key);
+int nasm_x86_64_end_stream();
+// Releases what generating code left behind when compilation failed
+void nasm_x86_64_abort();
+
+void reset_codegen_stats();
+void dump_codegen_stats();
 
 #endif
@@ -1,5 +1,6 @@
 #include "compile.h"
 #include "lex.h"
+#include "module.h"
 #include "cfa.h"
 #include "parse.h"
 #include "types.h"
@@ -32,6 +33,8 @@ void compiler_context_init()
 
 void compiler_context_free()
 {
-  // TODO: add function to free symbol table
+  module_release_imports();
+  symbol_table_free(ctx->global_scope);
   free(ctx);
+  ctx = NULL;
 }
@@ -9,20 +9,33 @@ enum
   DUMP_AST = 1 << 2,
   DUMP_SYMBOLS = 1 << 3,
   DUMP_IR = 1 << 4,
+  DUMP_SSA = 1 << 5,
+  DUMP_LIVENESS = 1 << 6,
+  DUMP_BYTECODE = 1 << 7,
+  DUMP_CALL_GRAPH = 1 << 8,
 };
 
 enum
 {
   O_FOLD_CONSTANTS = 1 << 1,
+  O_VALUE_NUMBERING = 1 << 2,
+  O_PROPAGATE_CONSTANTS = 1 << 3,
+  O_DEAD_CODE = 1 << 4,
+  O_PROPAGATE_COPIES = 1 << 5,
+  O_COALESCE_COPIES = 1 << 6,
+  O_EVALUATE_CALLS = 1 << 7,
+  O_INLINE_FUNCTIONS = 1 << 8,
+  O_SPECIALIZE_FUNCTIONS = 1 << 9,
+  O_TAIL_CALLS = 1 << 10,
 };
 
-#define DEFAULT_OPTIMIZATIONS \
-  O_FOLD_CONSTANTS
+#define DEFAULT_OPTIMIZATION_LEVEL 2
 
 typedef struct
 {
   SymbolTable *global_scope;
   TypeID registered_types;
+  bool is_module;     // Modules don't need a `main` function
 } CompilerContext;
 
 void compiler_context_init();
@@ -0,0 +1,583 @@
+#include "copies.h"
+#include "passes.h"
+#include "util.h"
+#include "varmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Operand `o` of `inst` is read, rather than defined or used as a label
+static bool reads_variable(Instruction *inst, uint32_t o)
+{
+  return inst->opcode != OP_DEF && inst->operands[o].kind == OPERAND_VARIABLE;
+}
+
+// Copies from globals are loads and are never forwarded or coalesced
+static bool is_copy(Instruction *inst)
+{
+  return inst->opcode == OP_ASSIGN
+    && (inst->operands[0].kind == OPERAND_VARIABLE || inst->operands[0].kind == OPERAND_LITERAL);
+}
+
+static void remove_self_copies(BasicBlock *entry, BasicBlock *end)
+{
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    size_t kept = 0;
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      if (inst->opcode != OP_ASSIGN || inst->operands[0].kind != OPERAND_VARIABLE
+          || inst->operands[0].var != inst->assignee) {
+        block->instructions.data[kept++] = inst;
+        continue;
+      }
+      LOG_INFO("removing copy to variable `%s`", inst->assignee);
+      pass_counters.values_forwarded++;
+      free_instruction(inst);
+    }
+    block->instructions.size = kept;
+  }
+}
+
+/* Propagation */
+
+enum
+{
+  COPY_PENDING,
+  COPY_RESOLVING,
+  COPY_RESOLVED,
+};
+
+typedef struct
+{
+  VarMap vars;
+  Instruction **copy;     // Per variable, the copy defining it
+  Operand *source;        // Per variable, the value its uses are replaced by
+  int *state;
+} Propagation;
+
+// Follows chains of copies to the first value that isn't itself a copy. A
+// cycle of copies can only read undefined values and is left as it is.
+static void resolve_copy(Propagation *prop, int v, IntList *chain)
+{
+  chain->size = 0;
+  while (v >= 0 && prop->state[v] == COPY_PENDING) {
+    prop->state[v] = COPY_RESOLVING;
+    int_list_push(chain, v);
+    Operand *src = &prop->copy[v]->operands[0];
+    v = src->kind == OPERAND_VARIABLE ? var_map_lookup(&prop->vars, src->var) : -1;
+  }
+
+  Operand root = prop->copy[chain->data[chain->size - 1]]->operands[0];
+  if (v >= 0 && prop->state[v] == COPY_RESOLVED)
+    root = prop->source[v];
+  else if (v >= 0 && prop->state[v] == COPY_RESOLVING)
+    root = (Operand){ .kind = OPERAND_VARIABLE, .type = root.type, .var = prop->copy[v]->assignee };
+
+  for (size_t i = 0; i < chain->size; i++) {
+    prop->source[chain->data[i]] = root;
+    prop->state[chain->data[i]] = COPY_RESOLVED;
+  }
+}
+
+static void propagate_function_copies(BasicBlock *entry)
+{
+  BasicBlock *end = function_end(entry);
+  Propagation prop = { 0 };
+  var_map_init(&prop.vars);
+  Vector copies;
+  vector_init(&copies, sizeof(Instruction *));
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      if (is_copy(inst)) {
+        var_map_insert(&prop.vars, inst->assignee);
+        vector_push_back(&copies, inst);
+      }
+    }
+  }
+  if (!copies.size) {
+    vector_free(&copies);
+    var_map_free(&prop.vars);
+    return;
+  }
+
+  int n = prop.vars.count;
+  prop.copy = malloc(n * sizeof(Instruction *));
+  prop.source = malloc(n * sizeof(Operand));
+  prop.state = malloc(n * sizeof(int));
+  for (size_t c = 0; c < copies.size; c++) {
+    Instruction *inst = copies.data[c];
+    int v = var_map_lookup(&prop.vars, inst->assignee);
+    prop.copy[v] = inst;
+    prop.state[v] = COPY_PENDING;
+  }
+
+  IntList chain = { 0 };
+  for (int v = 0; v < n; v++) {
+    if (prop.state[v] == COPY_PENDING)
+      resolve_copy(&prop, v, &chain);
+  }
+
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    size_t kept = 0;
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      for (uint32_t o = 0; o < inst->num_operands; o++) {
+        if (!reads_variable(inst, o))
+          continue;
+        int v = var_map_lookup(&prop.vars, inst->operands[o].var);
+        if (v >= 0)
+          inst->operands[o] = prop.source[v];
+      }
+
+      // Copies left in a cycle now copy a variable to itself
+      if (is_copy(inst) && !(inst->operands[0].kind == OPERAND_VARIABLE
+            && inst->operands[0].var == inst->assignee)) {
+        LOG_INFO("propagating copy to variable `%s`", inst->assignee);
+        pass_counters.values_forwarded++;
+        free_instruction(inst);
+        continue;
+      }
+      block->instructions.data[kept++] = inst;
+    }
+    block->instructions.size = kept;
+  }
+
+  free(chain.data);
+  vector_free(&copies);
+  free(prop.copy);
+  free(prop.source);
+  free(prop.state);
+  var_map_free(&prop.vars);
+}
+
+void propagate_copies(ControlFlowGraph *graph)
+{
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    if (is_function_entry(block))
+      propagate_function_copies(block);
+  }
+}
+
+/* Liveness */
+
+typedef struct
+{
+  VarMap vars;
+  int num_vars;
+  char **names;
+  bool *is_param;
+  BasicBlock **blocks;
+  int num_blocks;
+
+  IntList def_blocks;     // Pairs of variable and block, in block order
+  IntList use_blocks;     // Upward exposed uses, likewise
+  int *live_out_start;    // Live out variables of block `b` are
+  int *live_out;          // live_out[live_out_start[b]..live_out_start[b + 1])
+
+  IntList edges;          // Pairs of interfering variables
+  int *adjacent_start;
+  int *adjacent;
+
+  int *parent;            // Union-find over copy related variables
+  int *size;
+  int *next_member;       // Members of each class, linked from the root
+  int *last_member;
+} Coalescer;
+
+static void collect_variables(Coalescer *co, BasicBlock *entry, BasicBlock *end)
+{
+  var_map_init(&co->vars);
+  Vector blocks;
+  vector_init(&blocks, sizeof(BasicBlock *));
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    block->index = blocks.size;
+    vector_push_back(&blocks, block);
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      if (inst->assignee)
+        var_map_insert(&co->vars, inst->assignee);
+      for (uint32_t o = 0; o < inst->num_operands; o++) {
+        if (inst->operands[o].kind == OPERAND_VARIABLE)
+          var_map_insert(&co->vars, inst->operands[o].var);
+      }
+    }
+  }
+  co->blocks = (BasicBlock **)blocks.data;
+  co->num_blocks = blocks.size;
+
+  int n = co->num_vars = co->vars.count;
+  co->names = malloc((n ? n : 1) * sizeof(char *));
+  co->is_param = calloc(n ? n : 1, sizeof(bool));
+  for (size_t i = 0; i < co->vars.capacity; i++) {
+    if (co->vars.keys[i])
+      co->names[co->vars.ids[i]] = co->vars.keys[i];
+  }
+
+  Instruction *def = vector_get(&entry->instructions, 0);
+  for (uint32_t o = 1; o < def->num_operands; o++)
+    co->is_param[var_map_lookup(&co->vars, def->operands[o].var)] = true;
+}
+
+static void collect_def_use(Coalescer *co)
+{
+  int n = co->num_vars;
+  int *defined_in = malloc((n ? n : 1) * sizeof(int));
+  int *used_in = malloc((n ? n : 1) * sizeof(int));
+  for (int v = 0; v < n; v++)
+    defined_in[v] = used_in[v] = -1;
+
+  for (int b = 0; b < co->num_blocks; b++) {
+    Vector *instructions = &co->blocks[b]->instructions;
+    for (size_t i = 0; i < instructions->size; i++) {
+      Instruction *inst = instructions->data[i];
+      for (uint32_t o = 0; o < inst->num_operands; o++) {
+        if (inst->operands[o].kind != OPERAND_VARIABLE)
+          continue;
+        int v = var_map_lookup(&co->vars, inst->operands[o].var);
+        if (inst->opcode == OP_DEF) {
+          defined_in[v] = b;
+          int_list_push(&co->def_blocks, v);
+          int_list_push(&co->def_blocks, b);
+        } else if (defined_in[v] != b && used_in[v] != b) {
+          used_in[v] = b;
+          int_list_push(&co->use_blocks, v);
+          int_list_push(&co->use_blocks, b);
+        }
+      }
+
+      if (inst->assignee) {
+        int v = var_map_lookup(&co->vars, inst->assignee);
+        if (defined_in[v] != b) {
+          defined_in[v] = b;
+          int_list_push(&co->def_blocks, v);
+          int_list_push(&co->def_blocks, b);
+        }
+      }
+    }
+  }
+
+  free(used_in);
+  free(defined_in);
+}
+
+// Sorts pairs of `(first, second)` by `first` into `start`/`values`, keeping
+// the relative order of pairs with the same `first`
+static void group_pairs(IntList *pairs, int num_keys, int **start, int **values)
+{
+  int *count = calloc(num_keys + 1, sizeof(int));
+  for (size_t i = 0; i < pairs->size; i += 2)
+    count[pairs->data[i] + 1]++;
+  for (int k = 0; k < num_keys; k++)
+    count[k + 1] += count[k];
+
+  *values = malloc((pairs->size / 2 + 1) * sizeof(int));
+  for (size_t i = 0; i < pairs->size; i += 2)
+    (*values)[count[pairs->data[i]]++] = pairs->data[i + 1];
+  memmove(count + 1, count, num_keys * sizeof(int));
+  count[0] = 0;
+  *start = count;
+}
+
+// Finds the blocks each variable is live out of by walking backwards from its
+// upward exposed uses until a definition, one variable at a time
+static void compute_liveness(Coalescer *co)
+{
+  int n = co->num_vars;
+  int num_blocks = co->num_blocks;
+  int *def_start, *defs, *use_start, *uses;
+  group_pairs(&co->def_blocks, n, &def_start, &defs);
+  group_pairs(&co->use_blocks, n, &use_start, &uses);
+
+  int *live_in = malloc(num_blocks * sizeof(int));
+  int *live_out = malloc(num_blocks * sizeof(int));
+  int *defines = malloc(num_blocks * sizeof(int));
+  for (int b = 0; b < num_blocks; b++)
+    live_in[b] = live_out[b] = defines[b] = -1;
+
+  IntList pairs = { 0 };
+  IntList worklist = { 0 };
+  for (int v = 0; v < n; v++) {
+    for (int d = def_start[v]; d < def_start[v + 1]; d++)
+      defines[defs[d]] = v;
+
+    worklist.size = 0;
+    for (int u = use_start[v]; u < use_start[v + 1]; u++) {
+      live_in[uses[u]] = v;
+      int_list_push(&worklist, uses[u]);
+    }
+    while (worklist.size) {
+      BasicBlock *block = co->blocks[worklist.data[--worklist.size]];
+      for (size_t p = 0; p < block->predecessors.size; p++) {
+        int pred = ((BasicBlock *)block->predecessors.data[p])->index;
+        if (live_out[pred] != v) {
+          live_out[pred] = v;
+          int_list_push(&pairs, pred);
+          int_list_push(&pairs, v);
+        }
+        if (live_in[pred] == v || defines[pred] == v)
+          continue;
+        live_in[pred] = v;
+        int_list_push(&worklist, pred);
+      }
+    }
+  }
+  group_pairs(&pairs, num_blocks, &co->live_out_start, &co->live_out);
+
+  free(worklist.data);
+  free(pairs.data);
+  free(defines);
+  free(live_out);
+  free(live_in);
+  free(def_start);
+  free(defs);
+  free(use_start);
+  free(uses);
+}
+
+/* Interference */
+
+typedef struct
+{
+  int *members;
+  int *position;          // Index in `members`, or -1
+  int size;
+} LiveSet;
+
+static void live_add(LiveSet *live, int v)
+{
+  if (live->position[v] >= 0) return;
+  live->position[v] = live->size;
+  live->members[live->size++] = v;
+}
+
+static void live_remove(LiveSet *live, int v)
+{
+  int at = live->position[v];
+  if (at < 0) return;
+  int last = live->members[--live->size];
+  live->members[at] = last;
+  live->position[last] = at;
+  live->position[v] = -1;
+}
+
+static void add_interference(Coalescer *co, int a, int b)
+{
+  int_list_push(&co->edges, a);
+  int_list_push(&co->edges, b);
+  int_list_push(&co->edges, b);
+  int_list_push(&co->edges, a);
+}
+
+// A definition interferes with everything live after it, except that the
+// destination of a copy may share a name with its source
+static void build_interference(Coalescer *co)
+{
+  int n = co->num_vars;
+  LiveSet live = { 0 };
+  live.members = malloc((n ? n : 1) * sizeof(int));
+  live.position = malloc((n ? n : 1) * sizeof(int));
+  for (int v = 0; v < n; v++)
+    live.position[v] = -1;
+
+  for (int b = 0; b < co->num_blocks; b++) {
+    for (int l = co->live_out_start[b]; l < co->live_out_start[b + 1]; l++)
+      live_add(&live, co->live_out[l]);
+
+    Vector *instructions = &co->blocks[b]->instructions;
+    for (size_t i = instructions->size; i-- > 0;) {
+      Instruction *inst = instructions->data[i];
+
+      if (inst->opcode == OP_DEF) {
+        // Parameters arrive together and must all keep their own names
+        for (uint32_t o = 1; o < inst->num_operands; o++) {
+          int p = var_map_lookup(&co->vars, inst->operands[o].var);
+          for (int l = 0; l < live.size; l++) {
+            if (live.members[l] != p)
+              add_interference(co, p, live.members[l]);
+          }
+          for (uint32_t q = 1; q < o; q++)
+            add_interference(co, p, var_map_lookup(&co->vars, inst->operands[q].var));
+        }
+        for (uint32_t o = 1; o < inst->num_operands; o++)
+          live_remove(&live, var_map_lookup(&co->vars, inst->operands[o].var));
+        continue;
+      }
+
+      if (inst->assignee) {
+        int d = var_map_lookup(&co->vars, inst->assignee);
+        int source = -1;
+        if (inst->opcode == OP_ASSIGN && inst->operands[0].kind == OPERAND_VARIABLE)
+          source = var_map_lookup(&co->vars, inst->operands[0].var);
+        for (int l = 0; l < live.size; l++) {
+          int v = live.members[l];
+          if (v != d && v != source)
+            add_interference(co, d, v);
+        }
+        live_remove(&live, d);
+      }
+
+      for (uint32_t o = 0; o < inst->num_operands; o++) {
+        if (inst->operands[o].kind == OPERAND_VARIABLE)
+          live_add(&live, var_map_lookup(&co->vars, inst->operands[o].var));
+      }
+    }
+
+    while (live.size)
+      live_remove(&live, live.members[live.size - 1]);
+  }
+
+  group_pairs(&co->edges, n, &co->adjacent_start, &co->adjacent);
+  free(live.members);
+  free(live.position);
+}
+
+/* Coalescing */
+
+static int find_class(Coalescer *co, int v)
+{
+  int root = v;
+  while (co->parent[root] != root)
+    root = co->parent[root];
+  while (co->parent[v] != root) {
+    int next = co->parent[v];
+    co->parent[v] = root;
+    v = next;
+  }
+  return root;
+}
+
+// Checks the neighbours of the smaller class for members of the other one
+static bool classes_interfere(Coalescer *co, int a, int b)
+{
+  if (co->size[a] > co->size[b]) {
+    int t = a; a = b; b = t;
+  }
+  for (int m = a; m >= 0; m = co->next_member[m]) {
+    for (int e = co->adjacent_start[m]; e < co->adjacent_start[m + 1]; e++) {
+      if (find_class(co, co->adjacent[e]) == b)
+        return true;
+    }
+  }
+  return false;
+}
+
+static void merge_classes(Coalescer *co, int a, int b)
+{
+  if (co->size[a] < co->size[b]) {
+    int t = a; a = b; b = t;
+  }
+  co->parent[b] = a;
+  co->size[a] += co->size[b];
+  co->next_member[co->last_member[a]] = b;
+  co->last_member[a] = co->last_member[b];
+}
+
+// Parameters keep their names, and names from the source are preferred over
+// temporaries
+static bool better_name(Coalescer *co, int a, int b)
+{
+  if (co->is_param[a] != co->is_param[b])
+    return co->is_param[a];
+  bool a_temporary = co->names[a][0] == '$';
+  bool b_temporary = co->names[b][0] == '$';
+  if (a_temporary != b_temporary)
+    return b_temporary;
+  return a < b;
+}
+
+static void coalesce_classes(Coalescer *co)
+{
+  int n = co->num_vars;
+  co->parent = malloc((n ? n : 1) * sizeof(int));
+  co->size = malloc((n ? n : 1) * sizeof(int));
+  co->next_member = malloc((n ? n : 1) * sizeof(int));
+  co->last_member = malloc((n ? n : 1) * sizeof(int));
+  for (int v = 0; v < n; v++) {
+    co->parent[v] = co->last_member[v] = v;
+    co->size[v] = 1;
+    co->next_member[v] = -1;
+  }
+
+  for (int b = 0; b < co->num_blocks; b++) {
+    Vector *instructions = &co->blocks[b]->instructions;
+    for (size_t i = 0; i < instructions->size; i++) {
+      Instruction *inst = instructions->data[i];
+      if (inst->opcode != OP_ASSIGN || inst->operands[0].kind != OPERAND_VARIABLE)
+        continue;
+      int a = find_class(co, var_map_lookup(&co->vars, inst->assignee));
+      int c = find_class(co, var_map_lookup(&co->vars, inst->operands[0].var));
+      if (a != c && !classes_interfere(co, a, c))
+        merge_classes(co, a, c);
+    }
+  }
+
+  char **rename = malloc((n ? n : 1) * sizeof(char *));
+  int *best = malloc((n ? n : 1) * sizeof(int));
+  for (int v = 0; v < n; v++)
+    best[v] = -1;
+  for (int v = 0; v < n; v++) {
+    int root = find_class(co, v);
+    if (best[root] < 0 || better_name(co, v, best[root]))
+      best[root] = v;
+  }
+  for (int v = 0; v < n; v++)
+    rename[v] = co->names[best[find_class(co, v)]];
+
+  for (int b = 0; b < co->num_blocks; b++) {
+    Vector *instructions = &co->blocks[b]->instructions;
+    for (size_t i = 0; i < instructions->size; i++) {
+      Instruction *inst = instructions->data[i];
+      if (inst->assignee)
+        inst->assignee = rename[var_map_lookup(&co->vars, inst->assignee)];
+      for (uint32_t o = 0; o < inst->num_operands; o++) {
+        Operand *operand = &inst->operands[o];
+        if (operand->kind == OPERAND_VARIABLE)
+          operand->var = rename[var_map_lookup(&co->vars, operand->var)];
+      }
+    }
+  }
+
+  free(best);
+  free(rename);
+}
+
+static void free_coalescer(Coalescer *co)
+{
+  var_map_free(&co->vars);
+  free(co->names);
+  free(co->is_param);
+  free(co->blocks);
+  free(co->def_blocks.data);
+  free(co->use_blocks.data);
+  free(co->live_out_start);
+  free(co->live_out);
+  free(co->edges.data);
+  free(co->adjacent_start);
+  free(co->adjacent);
+  free(co->parent);
+  free(co->size);
+  free(co->next_member);
+  free(co->last_member);
+}
+
+static void coalesce_function_copies(BasicBlock *entry)
+{
+  BasicBlock *end = function_end(entry);
+  Coalescer co = { 0 };
+  collect_variables(&co, entry, end);
+  collect_def_use(&co);
+  compute_liveness(&co);
+  build_interference(&co);
+  coalesce_classes(&co);
+  free_coalescer(&co);
+  remove_self_copies(entry, end);
+}
+
+void coalesce_copies(ControlFlowGraph *graph)
+{
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    if (is_function_entry(block))
+      coalesce_function_copies(block);
+  }
+}
@@ -0,0 +1,21 @@
+#ifndef MINI_COPIES_H
+#define MINI_COPIES_H
+
+#include "cfa.h"
+
+/* Copies
+ *
+ * `propagate_copies()` works on functions in SSA form: every use of the
+ * destination of a copy `x := y` is replaced by its source, after which the
+ * copy is deleted. Copies from globals are kept, since the global may be
+ * stored to before the use.
+ *
+ * `coalesce_copies()` runs after SSA destruction. Variables that are related
+ * by a copy and whose live ranges don't interfere are given the same name,
+ * and the copies between them are deleted.
+ */
+
+void propagate_copies(ControlFlowGraph *graph);
+void coalesce_copies(ControlFlowGraph *graph);
+
+#endif
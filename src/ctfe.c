@@ -0,0 +1,389 @@
+#include "ctfe.h"
+#include "callgraph.h"
+#include "compile.h"
+#include "interp.h"
+#include "passes.h"
+#include "util.h"
+#include "varmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+  ControlFlowGraph *graph;
+  CallGraph calls;
+  BytecodeProgram program;
+  bool is_compiled;
+} Evaluator;
+
+static const InterpLimits limits = { .max_steps = CTFE_MAX_STEPS, .max_depth = CTFE_MAX_DEPTH };
+
+/* Literals */
+
+static bool literal_integer(Value *literal, int64_t *value)
+{
+  switch (literal->kind) {
+    case VAL_INT: *value = literal->i_val; return true;
+    case VAL_UINT: *value = (int64_t)literal->u_val; return true;
+    case VAL_CHAR: *value = literal->c_val; return true;
+    case VAL_BOOL: *value = literal->b_val; return true;
+    default: return false;
+  }
+}
+
+// Results take the type of the function or global they come from
+static Value make_literal(char *name, int64_t value)
+{
+  Symbol *symbol = ctx ? symbol_table_lookup(ctx->global_scope, name) : NULL;
+  if (symbol && symbol->type.id == primitive_types[TYPE_BOOL].id)
+    return (Value){ .kind = VAL_BOOL, .b_val = value != 0 };
+  return (Value){ .kind = VAL_INT, .i_val = value };
+}
+
+/* Purity */
+
+// Calls to functions that touch no memory, and so only depend on their
+// arguments, can be evaluated. Those that never return aren't worth trying.
+static bool is_evaluable(Evaluator *ev, Instruction *inst)
+{
+  uint32_t attributes = callee_attributes(&ev->calls, inst);
+  return (attributes & FN_READNONE) && !(attributes & FN_NORETURN);
+}
+
+static bool calls_pure_function(Evaluator *ev)
+{
+  for (BasicBlock *block = ev->graph->blocks; block; block = block->next) {
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      if (inst->opcode == OP_CALL && is_evaluable(ev, inst))
+        return true;
+    }
+  }
+  return false;
+}
+
+// The bytecode is a snapshot of the program, whose meaning evaluating calls
+// doesn't change
+static void compile_program(Evaluator *ev)
+{
+  if (ev->is_compiled)
+    return;
+  compile_bytecode(ev->graph, &ev->program);
+  ev->is_compiled = true;
+}
+
+static void discard_program(Evaluator *ev)
+{
+  if (ev->is_compiled)
+    free_bytecode(&ev->program);
+  ev->is_compiled = false;
+}
+
+/* Calls */
+
+// Variables with a single definition that assigns them a literal. In SSA
+// form that is every variable assigned a literal, and the temporaries of
+// `$entry` only have one definition either way.
+typedef struct
+{
+  VarMap vars;
+  int *num_defs;
+  Value *values;
+  bool *is_known;
+} Constants;
+
+static void init_constants(Constants *constants, BasicBlock *entry)
+{
+  var_map_init(&constants->vars);
+  Vector defs;
+  vector_init(&defs, sizeof(char *));
+  BasicBlock *end = function_end(entry);
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      if (inst->assignee)
+        vector_push_back(&defs, inst->assignee);
+      for (uint32_t o = 1; inst->opcode == OP_DEF && o < inst->num_operands; o++)
+        vector_push_back(&defs, inst->operands[o].var);
+    }
+  }
+
+  constants->num_defs = calloc(defs.size + 1, sizeof(int));
+  constants->values = malloc((defs.size + 1) * sizeof(Value));
+  constants->is_known = calloc(defs.size + 1, sizeof(bool));
+  for (size_t d = 0; d < defs.size; d++)
+    constants->num_defs[var_map_insert(&constants->vars, defs.data[d])]++;
+  vector_free(&defs);
+}
+
+static void free_constants(Constants *constants)
+{
+  var_map_free(&constants->vars);
+  free(constants->num_defs);
+  free(constants->values);
+  free(constants->is_known);
+}
+
+static void record_constant(Constants *constants, Instruction *inst)
+{
+  if (inst->opcode != OP_ASSIGN || inst->operands[0].kind != OPERAND_LITERAL)
+    return;
+  int v = var_map_lookup(&constants->vars, inst->assignee);
+  if (constants->num_defs[v] != 1)
+    return;
+  constants->values[v] = inst->operands[0].literal;
+  constants->is_known[v] = true;
+}
+
+// Arguments and stored values that are known constants become literals
+static void substitute_constants(Constants *constants, Instruction *inst)
+{
+  uint32_t first = inst->opcode == OP_CALL || inst->opcode == OP_STORE ? 1 : inst->num_operands;
+  for (uint32_t o = first; o < inst->num_operands; o++) {
+    Operand *operand = &inst->operands[o];
+    if (operand->kind != OPERAND_VARIABLE)
+      continue;
+    int v = var_map_lookup(&constants->vars, operand->var);
+    if (v >= 0 && constants->is_known[v])
+      *operand = (Operand){ .kind = OPERAND_LITERAL, .literal = constants->values[v] };
+  }
+}
+
+// Replaces a call to a pure function whose arguments are all constants with
+// its result, unless evaluating it traps or runs into a limit
+static bool evaluate_call(Evaluator *ev, Instruction *inst)
+{
+  if (!is_evaluable(ev, inst))
+    return false;
+
+  uint32_t num_args = inst->num_operands - 1;
+  int64_t *args = malloc((num_args + 1) * sizeof(int64_t));
+  bool is_constant = true;
+  for (uint32_t a = 0; a < num_args && is_constant; a++) {
+    Operand *operand = &inst->operands[a + 1];
+    is_constant = operand->kind == OPERAND_LITERAL && literal_integer(&operand->literal, &args[a]);
+  }
+
+  char *name = inst->operands[0].label;
+  InterpResult result = { .status = INTERP_OK };
+  if (is_constant)
+    result = interp_call(&ev->program, name, args, num_args, limits);
+  free(args);
+  if (!is_constant)
+    return false;
+  if (result.status != INTERP_OK) {
+    LOG_INFO("leaving the call to `%s` for run time, as evaluating it %s", name,
+        interp_status_message(result.status));
+    return false;
+  }
+
+  LOG_INFO("evaluated the call to `%s` at compile time", name);
+  pass_counters.values_folded++;
+  inst->opcode = OP_ASSIGN;
+  inst->num_operands = 1;
+  inst->operands[0] = (Operand){ .kind = OPERAND_LITERAL, .literal = make_literal(name, result.value) };
+  return true;
+}
+
+// Walks the blocks in reverse postorder, so that definitions are seen before
+// the uses they dominate. Calls whose result isn't used go away entirely.
+static void fold_calls(Evaluator *ev, BasicBlock *entry)
+{
+  Constants constants;
+  init_constants(&constants, entry);
+  int num_blocks;
+  BasicBlock **order = reverse_postorder(entry, &num_blocks);
+  for (int b = 0; b < num_blocks; b++) {
+    Vector *instructions = &order[b]->instructions;
+    size_t kept = 0;
+    for (size_t i = 0; i < instructions->size; i++) {
+      Instruction *inst = instructions->data[i];
+      substitute_constants(&constants, inst);
+      if (inst->opcode == OP_CALL && evaluate_call(ev, inst) && !inst->assignee) {
+        free_instruction(inst);
+        continue;
+      }
+      record_constant(&constants, inst);
+      instructions->data[kept++] = inst;
+    }
+    instructions->size = kept;
+  }
+  free(order);
+  free_constants(&constants);
+}
+
+/* Globals */
+
+// Runs `$entry` when it only reads globals it stored to before and doesn't
+// call out of the program, and replaces it with a store of the final value
+// of each global, in the order they were first stored to
+static void evaluate_initializers(Evaluator *ev)
+{
+  BasicBlock *entry = ev->graph->entry;
+  if (!entry || entry->successors.size)
+    return;
+
+  VarMap stored;
+  var_map_init(&stored);
+  Vector globals;
+  vector_init(&globals, sizeof(char *));
+  bool is_closed = true, is_data = true;
+  for (size_t i = 0; i < entry->instructions.size && is_closed; i++) {
+    Instruction *inst = entry->instructions.data[i];
+    if (inst->opcode == OP_CALL || inst->opcode == OP_DEREF || inst->opcode == OP_ADDR)
+      is_closed = false;
+    for (uint32_t o = 0; o < inst->num_operands; o++) {
+      Operand *operand = &inst->operands[o];
+      bool is_read = operand->kind == OPERAND_GLOBAL && !(inst->opcode == OP_STORE && o == 0);
+      if (is_read && var_map_lookup(&stored, operand->var) < 0)
+        is_closed = false;
+    }
+
+    is_data = is_data && inst->opcode == OP_STORE && inst->operands[1].kind == OPERAND_LITERAL;
+    if (inst->opcode == OP_STORE) {
+      size_t count = stored.count;
+      var_map_insert(&stored, inst->operands[0].var);
+      if (stored.count != count)
+        vector_push_back(&globals, inst->operands[0].var);
+    }
+  }
+
+  if (is_closed && !is_data) {
+    compile_program(ev);
+    InterpResult result = interp_call(&ev->program, "$entry", NULL, 0, limits);
+    if (result.status == INTERP_OK) {
+      LOG_INFO("evaluated the initializers of %zu globals at compile time", globals.size);
+      for (size_t i = 0; i < entry->instructions.size; i++)
+        free_instruction(entry->instructions.data[i]);
+      entry->instructions.size = 0;
+
+      for (size_t g = 0; g < globals.size; g++) {
+        char *name = globals.data[g];
+        int64_t value = 0;
+        interp_global(&ev->program, name, &value);
+        Instruction *store = make_instruction(OP_STORE);
+        *push_operand(store) = (Operand){ .kind = OPERAND_GLOBAL, .var = name };
+        *push_operand(store) = (Operand){ .kind = OPERAND_LITERAL, .literal = make_literal(name, value) };
+        vector_push_back(&entry->instructions, store);
+      }
+    } else {
+      LOG_INFO("leaving the initializers of globals for run time, as evaluating them %s",
+          interp_status_message(result.status));
+    }
+  }
+
+  vector_free(&globals);
+  var_map_free(&stored);
+}
+
+static bool reads_value(Instruction *inst, uint32_t operand)
+{
+  if (inst->opcode == OP_STORE)
+    return operand == 1;
+  return inst->opcode != OP_ADDR && inst->opcode != OP_DEREF;
+}
+
+// Constants that `$entry` stores a literal to, and that nothing else stores
+// to, hold that literal wherever functions read them. Returns the number of
+// reads replaced.
+static size_t propagate_constant_globals(Evaluator *ev)
+{
+  BasicBlock *entry = ev->graph->entry;
+  if (!ctx)
+    return 0;
+
+  VarMap globals;
+  var_map_init(&globals);
+  Vector stores;
+  vector_init(&stores, sizeof(Instruction *));
+  for (BasicBlock *block = ev->graph->blocks; block; block = block->next) {
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      if (inst->opcode == OP_STORE) {
+        var_map_insert(&globals, inst->operands[0].var);
+        vector_push_back(&stores, inst);
+      }
+    }
+  }
+
+  int *num_stores = calloc(globals.count + 1, sizeof(int));
+  for (size_t s = 0; s < stores.size; s++) {
+    Instruction *store = stores.data[s];
+    num_stores[var_map_lookup(&globals, store->operands[0].var)]++;
+  }
+
+  Value *values = malloc((globals.count + 1) * sizeof(Value));
+  bool *is_constant = calloc(globals.count + 1, sizeof(bool));
+  size_t num_constants = 0, num_replaced = 0;
+  for (size_t i = 0; i < entry->instructions.size; i++) {
+    Instruction *inst = entry->instructions.data[i];
+    if (inst->opcode != OP_STORE || inst->operands[1].kind != OPERAND_LITERAL)
+      continue;
+    int g = var_map_lookup(&globals, inst->operands[0].var);
+    Symbol *symbol = symbol_table_lookup(ctx->global_scope, inst->operands[0].var);
+    if (num_stores[g] == 1 && symbol && symbol->is_constant) {
+      values[g] = inst->operands[1].literal;
+      is_constant[g] = true;
+      num_constants++;
+    }
+  }
+
+  for (BasicBlock *block = ev->graph->blocks; block && num_constants; block = block->next) {
+    if (block == entry)
+      continue;
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      for (uint32_t o = 0; o < inst->num_operands; o++) {
+        Operand *operand = &inst->operands[o];
+        if (operand->kind != OPERAND_GLOBAL || !reads_value(inst, o))
+          continue;
+        int g = var_map_lookup(&globals, operand->var);
+        if (g < 0 || !is_constant[g])
+          continue;
+        LOG_INFO("propagating constant `%s` into block `%s`", operand->var, block->tag);
+        pass_counters.values_forwarded++;
+        num_replaced++;
+        *operand = (Operand){ .kind = OPERAND_LITERAL, .literal = values[g] };
+      }
+    }
+  }
+
+  free(is_constant);
+  free(values);
+  free(num_stores);
+  vector_free(&stores);
+  var_map_free(&globals);
+  return num_replaced;
+}
+
+/* Pass */
+
+void evaluate_constant_calls(ControlFlowGraph *graph)
+{
+  Evaluator ev = { .graph = graph };
+  build_call_graph(graph, &ev.calls);
+
+  // Bytecode is compiled before any block is rewritten, and again once
+  // functions that only read constants no longer read globals at all
+  if (graph->entry) {
+    if (calls_pure_function(&ev))
+      compile_program(&ev);
+    fold_calls(&ev, graph->entry);
+    evaluate_initializers(&ev);
+    if (propagate_constant_globals(&ev)) {
+      discard_program(&ev);
+      free_call_graph(&ev.calls);
+      build_call_graph(graph, &ev.calls);
+    }
+  }
+
+  if (calls_pure_function(&ev)) {
+    compile_program(&ev);
+    for (int i = 0; i < ev.calls.num_nodes; i++)
+      fold_calls(&ev, ev.calls.nodes[ev.calls.order[i]].entry);
+  }
+
+  discard_program(&ev);
+  free_call_graph(&ev.calls);
+}
@@ -0,0 +1,28 @@
+#ifndef MINI_CTFE_H
+#define MINI_CTFE_H
+
+#include "cfa.h"
+
+/* Compile-Time Function Evaluation
+ *
+ * `evaluate_constant_calls()` runs calls to pure functions whose arguments
+ * are all constants on the IR interpreter, and replaces each call with its
+ * result. A function is pure when it neither reads nor writes globals,
+ * doesn't dereference pointers and only calls pure functions, so that its
+ * result depends on its arguments alone. Evaluation is limited in the
+ * instructions it executes and in how deeply calls nest; a call that runs
+ * into a limit or traps is left for run time.
+ *
+ * The initializers of globals in `$entry` are evaluated as a whole when
+ * they don't call out of the program, leaving a store of a literal per
+ * global, which the backend places in memory without running any code.
+ * Constants are then replaced by their value wherever functions read them.
+ */
+
+// Each call evaluated may execute this many instructions
+#define CTFE_MAX_STEPS (1 << 20)
+#define CTFE_MAX_DEPTH 1000
+
+void evaluate_constant_calls(ControlFlowGraph *graph);
+
+#endif
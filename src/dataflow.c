@@ -0,0 +1,496 @@
+#include "dataflow.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Solver */
+
+int dataflow_index(Dataflow *flow, BasicBlock *block)
+{
+  int index = block->index;
+  if (index >= 0 && index < flow->num_blocks && flow->order[index] == block)
+    return index;
+  return -1;
+}
+
+void dataflow_init(Dataflow *flow, BasicBlock *entry, DataflowDirection direction,
+    DataflowMeet meet)
+{
+  memset(flow, 0, sizeof(Dataflow));
+  flow->direction = direction;
+  flow->meet = meet;
+  flow->order = reverse_postorder(entry, &flow->num_blocks);
+}
+
+void dataflow_allocate(Dataflow *flow, size_t num_bits)
+{
+  flow->num_bits = num_bits;
+
+  // All sets live in one allocation, four per block
+  int n = flow->num_blocks;
+  size_t words = BITSET_WORDS(num_bits);
+  flow->storage = calloc(4 * n * words + 1, sizeof(uint64_t));
+  flow->in = malloc(4 * n * sizeof(Bitset));
+  flow->out = flow->in + n;
+  flow->gen = flow->out + n;
+  flow->kill = flow->gen + n;
+  for (int i = 0; i < 4 * n; i++)
+    bitset_init_in(&flow->in[i], num_bits, flow->storage + i * words);
+}
+
+void free_dataflow(Dataflow *flow)
+{
+  free(flow->order);
+  free(flow->in);
+  free(flow->storage);
+  memset(flow, 0, sizeof(Dataflow));
+}
+
+// Combines the facts flowing into block `b` from its neighbours
+static void meet_block(Dataflow *flow, int b, Bitset *facts)
+{
+  BasicBlock *block = flow->order[b];
+  bool forward = flow->direction == DATAFLOW_FORWARD;
+  Vector *neighbours = forward ? &block->predecessors : &block->successors;
+  bool boundary = forward ? b == 0 : neighbours->size == 0;
+
+  if (flow->meet == DATAFLOW_UNION || boundary)
+    bitset_clear(facts);
+  else
+    bitset_fill(facts);
+
+  for (size_t i = 0; i < neighbours->size; i++) {
+    int n = dataflow_index(flow, neighbours->data[i]);
+    if (n < 0)
+      continue;
+    Bitset *from = forward ? &flow->out[n] : &flow->in[n];
+    if (flow->meet == DATAFLOW_UNION)
+      bitset_union(facts, from);
+    else
+      bitset_intersect(facts, from);
+  }
+}
+
+void dataflow_solve(Dataflow *flow)
+{
+  int n = flow->num_blocks;
+  bool forward = flow->direction == DATAFLOW_FORWARD;
+
+  // Until the first visit, intersections start from every fact so that
+  // blocks on back edges don't remove facts they haven't computed yet
+  for (int b = 0; b < n && flow->meet == DATAFLOW_INTERSECTION; b++)
+    bitset_fill(forward ? &flow->out[b] : &flow->in[b]);
+
+  // Pending blocks by position in the order of visits. Each sweep goes
+  // through them in order, and blocks that change again behind the sweep
+  // wait for the next one.
+  Bitset pending;
+  bitset_init(&pending, n);
+  bitset_fill(&pending);
+
+  size_t position = 0;
+  for (;;) {
+    position = bitset_next(&pending, position);
+    if (position == (size_t)n) {
+      position = bitset_next(&pending, 0);
+      if (position == (size_t)n)
+        break;
+    }
+    bitset_reset(&pending, position);
+
+    int b = forward ? (int)position : n - 1 - (int)position;
+    BasicBlock *block = flow->order[b];
+    flow->visits++;
+
+    bool changed;
+    if (forward) {
+      meet_block(flow, b, &flow->in[b]);
+      changed = bitset_transfer(&flow->out[b], &flow->gen[b], &flow->in[b], &flow->kill[b]);
+    } else {
+      meet_block(flow, b, &flow->out[b]);
+      changed = bitset_transfer(&flow->in[b], &flow->gen[b], &flow->out[b], &flow->kill[b]);
+    }
+    if (!changed)
+      continue;
+
+    Vector *dependents = forward ? &block->successors : &block->predecessors;
+    for (size_t i = 0; i < dependents->size; i++) {
+      int d = dataflow_index(flow, dependents->data[i]);
+      if (d >= 0)
+        bitset_set(&pending, forward ? d : n - 1 - d);
+    }
+  }
+
+  bitset_free(&pending);
+}
+
+/* Variables */
+
+static bool is_param(Instruction *inst, uint32_t o)
+{
+  return inst->opcode == OP_DEF && o > 0;
+}
+
+// Gives every local in the reachable blocks an id
+static char **collect_variables(Dataflow *flow, VarMap *vars)
+{
+  var_map_init(vars);
+  for (int b = 0; b < flow->num_blocks; b++) {
+    Vector *instructions = &flow->order[b]->instructions;
+    for (size_t i = 0; i < instructions->size; i++) {
+      Instruction *inst = instructions->data[i];
+      if (inst->assignee)
+        var_map_insert(vars, inst->assignee);
+      for (uint32_t o = 0; o < inst->num_operands; o++) {
+        if (inst->operands[o].kind == OPERAND_VARIABLE)
+          var_map_insert(vars, inst->operands[o].var);
+      }
+    }
+  }
+
+  char **names = malloc((vars->count + 1) * sizeof(char *));
+  for (size_t i = 0; i < vars->capacity; i++) {
+    if (vars->keys[i])
+      names[vars->ids[i]] = vars->keys[i];
+  }
+  return names;
+}
+
+/* Live Variables */
+
+void compute_live_variables(BasicBlock *entry, LiveVariables *live)
+{
+  Dataflow *flow = &live->flow;
+  dataflow_init(flow, entry, DATAFLOW_BACKWARD, DATAFLOW_UNION);
+  live->names = collect_variables(flow, &live->vars);
+  dataflow_allocate(flow, live->vars.count);
+
+  for (int b = 0; b < flow->num_blocks; b++) {
+    Vector *instructions = &flow->order[b]->instructions;
+    Bitset *gen = &flow->gen[b], *kill = &flow->kill[b];
+    for (size_t i = 0; i < instructions->size; i++) {
+      Instruction *inst = instructions->data[i];
+      for (uint32_t o = 0; o < inst->num_operands && inst->opcode != OP_PHI; o++) {
+        if (inst->operands[o].kind != OPERAND_VARIABLE)
+          continue;
+        int v = var_map_lookup(&live->vars, inst->operands[o].var);
+        if (is_param(inst, o))
+          bitset_set(kill, v);
+        else if (!bitset_test(kill, v))
+          bitset_set(gen, v);
+      }
+      if (inst->assignee)
+        bitset_set(kill, var_map_lookup(&live->vars, inst->assignee));
+    }
+  }
+
+  // Phi operands are read on the way out of each predecessor, after all of
+  // its own definitions
+  for (int b = 0; b < flow->num_blocks; b++) {
+    BasicBlock *block = flow->order[b];
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *phi = block->instructions.data[i];
+      if (phi->opcode == OP_DEF) continue;
+      if (phi->opcode != OP_PHI) break;
+      for (uint32_t p = 0; p < phi->num_operands; p++) {
+        int pred = dataflow_index(flow, block->predecessors.data[p]);
+        if (pred < 0 || phi->operands[p].kind != OPERAND_VARIABLE)
+          continue;
+        int v = var_map_lookup(&live->vars, phi->operands[p].var);
+        if (!bitset_test(&flow->kill[pred], v))
+          bitset_set(&flow->gen[pred], v);
+      }
+    }
+  }
+
+  dataflow_solve(flow);
+}
+
+void free_live_variables(LiveVariables *live)
+{
+  free_dataflow(&live->flow);
+  var_map_free(&live->vars);
+  free(live->names);
+}
+
+bool is_live_out(LiveVariables *live, BasicBlock *block, char *name)
+{
+  int b = dataflow_index(&live->flow, block);
+  int v = var_map_lookup(&live->vars, name);
+  return b >= 0 && v >= 0 && bitset_test(&live->flow.out[b], v);
+}
+
+/* Reaching Definitions */
+
+void compute_reaching_definitions(BasicBlock *entry, ReachingDefinitions *reach)
+{
+  Dataflow *flow = &reach->flow;
+  dataflow_init(flow, entry, DATAFLOW_FORWARD, DATAFLOW_UNION);
+  free(collect_variables(flow, &reach->vars));
+
+  int n = reach->vars.count;
+  int *count = calloc(n + 1, sizeof(int));
+  reach->num_defs = 0;
+  for (int b = 0; b < flow->num_blocks; b++) {
+    Vector *instructions = &flow->order[b]->instructions;
+    for (size_t i = 0; i < instructions->size; i++) {
+      Instruction *inst = instructions->data[i];
+      reach->num_defs += inst->assignee != NULL;
+      for (uint32_t o = 1; inst->opcode == OP_DEF && o < inst->num_operands; o++)
+        reach->num_defs++;
+    }
+  }
+  reach->def_inst = malloc((reach->num_defs + 1) * sizeof(Instruction *));
+  reach->def_var = malloc((reach->num_defs + 1) * sizeof(char *));
+  int *def_block = malloc((reach->num_defs + 1) * sizeof(int));
+
+  int d = 0;
+  for (int b = 0; b < flow->num_blocks; b++) {
+    Vector *instructions = &flow->order[b]->instructions;
+    for (size_t i = 0; i < instructions->size; i++) {
+      Instruction *inst = instructions->data[i];
+      for (uint32_t o = 1; inst->opcode == OP_DEF && o < inst->num_operands; o++) {
+        reach->def_inst[d] = inst;
+        def_block[d] = b;
+        reach->def_var[d++] = inst->operands[o].var;
+      }
+      if (inst->assignee) {
+        reach->def_inst[d] = inst;
+        def_block[d] = b;
+        reach->def_var[d++] = inst->assignee;
+      }
+    }
+  }
+
+  for (d = 0; d < reach->num_defs; d++)
+    count[var_map_lookup(&reach->vars, reach->def_var[d]) + 1]++;
+  for (int v = 0; v < n; v++)
+    count[v + 1] += count[v];
+  reach->var_defs = malloc((reach->num_defs + 1) * sizeof(int));
+  for (d = 0; d < reach->num_defs; d++)
+    reach->var_defs[count[var_map_lookup(&reach->vars, reach->def_var[d])]++] = d;
+  memmove(count + 1, count, n * sizeof(int));
+  count[0] = 0;
+  reach->var_def_start = count;
+
+  // Each block kills every definition of the variables it assigns and
+  // generates the last one it makes of each
+  dataflow_allocate(flow, reach->num_defs);
+  int *previous = malloc((n + 1) * sizeof(int));
+  for (int v = 0; v < n; v++)
+    previous[v] = -1;
+  for (d = 0; d < reach->num_defs; d++) {
+    int v = var_map_lookup(&reach->vars, reach->def_var[d]);
+    Bitset *gen = &flow->gen[def_block[d]], *kill = &flow->kill[def_block[d]];
+    if (previous[v] >= 0 && def_block[previous[v]] == def_block[d]) {
+      bitset_reset(gen, previous[v]);
+    } else {
+      for (int k = reach->var_def_start[v]; k < reach->var_def_start[v + 1]; k++)
+        bitset_set(kill, reach->var_defs[k]);
+    }
+    bitset_set(gen, d);
+    previous[v] = d;
+  }
+  free(previous);
+  free(def_block);
+
+  dataflow_solve(flow);
+}
+
+void free_reaching_definitions(ReachingDefinitions *reach)
+{
+  free_dataflow(&reach->flow);
+  var_map_free(&reach->vars);
+  free(reach->def_inst);
+  free(reach->def_var);
+  free(reach->var_def_start);
+  free(reach->var_defs);
+}
+
+/* Available Expressions */
+
+static bool is_expression(Instruction *inst)
+{
+  if (!inst->assignee)
+    return false;
+  bool pure = inst->opcode == OP_NEG || inst->opcode == OP_NOT
+    || (inst->opcode >= OP_ADD && inst->opcode <= OP_CMP_GT_EQ);
+  for (uint32_t o = 0; pure && o < inst->num_operands; o++)
+    pure = inst->operands[o].kind == OPERAND_VARIABLE || inst->operands[o].kind == OPERAND_LITERAL;
+  return pure;
+}
+
+static bool same_operand(Operand *a, Operand *b)
+{
+  if (a->kind != b->kind)
+    return false;
+  if (a->kind == OPERAND_VARIABLE)
+    return a->var == b->var;
+  return a->literal.kind == b->literal.kind && a->literal.kind != VAL_STRING
+    && a->literal.u_val == b->literal.u_val;
+}
+
+static bool same_expression(Instruction *a, Instruction *b)
+{
+  if (a->opcode != b->opcode || a->num_operands != b->num_operands)
+    return false;
+  for (uint32_t o = 0; o < a->num_operands; o++) {
+    if (!same_operand(&a->operands[o], &b->operands[o]))
+      return false;
+  }
+  return true;
+}
+
+static uint64_t hash_expression(Instruction *inst)
+{
+  uint64_t h = inst->opcode * 0x9E3779B97F4A7C15ull;
+  for (uint32_t o = 0; o < inst->num_operands; o++) {
+    Operand *operand = &inst->operands[o];
+    uint64_t value = operand->kind == OPERAND_VARIABLE
+      ? (uint64_t)(uintptr_t)operand->var : (uint64_t)operand->literal.u_val;
+    h = (h ^ value) * 0x100000001B3ull;
+  }
+  return h ^ (h >> 29);
+}
+
+// Numbers expressions with an open addressing table of expression ids
+static int *number_expressions(Dataflow *flow, AvailableExpressions *avail)
+{
+  int count = 0;
+  for (int b = 0; b < flow->num_blocks; b++) {
+    Vector *instructions = &flow->order[b]->instructions;
+    for (size_t i = 0; i < instructions->size; i++)
+      count += is_expression(instructions->data[i]);
+  }
+
+  size_t capacity = 64;
+  while (capacity < 2 * (size_t)count)
+    capacity *= 2;
+  int *slots = malloc(capacity * sizeof(int));
+  for (size_t i = 0; i < capacity; i++)
+    slots[i] = -1;
+  avail->exprs = malloc((count + 1) * sizeof(Instruction *));
+  avail->num_exprs = 0;
+  int *ids = malloc((count + 1) * sizeof(int));
+
+  int k = 0;
+  for (int b = 0; b < flow->num_blocks; b++) {
+    Vector *instructions = &flow->order[b]->instructions;
+    for (size_t i = 0; i < instructions->size; i++) {
+      Instruction *inst = instructions->data[i];
+      if (!is_expression(inst))
+        continue;
+      size_t slot = hash_expression(inst) & (capacity - 1);
+      while (slots[slot] >= 0 && !same_expression(avail->exprs[slots[slot]], inst))
+        slot = (slot + 1) & (capacity - 1);
+      if (slots[slot] < 0) {
+        slots[slot] = avail->num_exprs;
+        avail->exprs[avail->num_exprs++] = inst;
+      }
+      ids[k++] = slots[slot];
+    }
+  }
+
+  free(slots);
+  return ids;
+}
+
+void compute_available_expressions(BasicBlock *entry, AvailableExpressions *avail)
+{
+  Dataflow *flow = &avail->flow;
+  dataflow_init(flow, entry, DATAFLOW_FORWARD, DATAFLOW_INTERSECTION);
+  VarMap vars;
+  free(collect_variables(flow, &vars));
+  int *ids = number_expressions(flow, avail);
+
+  // The expressions that read each variable, which an assignment to it kills
+  int n = vars.count;
+  int *start = calloc(n + 2, sizeof(int));
+  for (int e = 0; e < avail->num_exprs; e++) {
+    Instruction *expr = avail->exprs[e];
+    for (uint32_t o = 0; o < expr->num_operands; o++) {
+      if (expr->operands[o].kind == OPERAND_VARIABLE)
+        start[var_map_lookup(&vars, expr->operands[o].var) + 2]++;
+    }
+  }
+  for (int v = 0; v < n; v++)
+    start[v + 2] += start[v + 1];
+  int *readers = malloc((start[n + 1] + 1) * sizeof(int));
+  for (int e = 0; e < avail->num_exprs; e++) {
+    Instruction *expr = avail->exprs[e];
+    for (uint32_t o = 0; o < expr->num_operands; o++) {
+      if (expr->operands[o].kind == OPERAND_VARIABLE)
+        readers[start[var_map_lookup(&vars, expr->operands[o].var) + 1]++] = e;
+    }
+  }
+
+  dataflow_allocate(flow, avail->num_exprs);
+
+  int k = 0;
+  for (int b = 0; b < flow->num_blocks; b++) {
+    Vector *instructions = &flow->order[b]->instructions;
+    Bitset *gen = &flow->gen[b], *kill = &flow->kill[b];
+    for (size_t i = 0; i < instructions->size; i++) {
+      Instruction *inst = instructions->data[i];
+      if (is_expression(inst)) {
+        bitset_set(gen, ids[k]);
+        bitset_reset(kill, ids[k++]);
+      }
+
+      for (uint32_t o = 0; o <= inst->num_operands; o++) {
+        char *name = o == inst->num_operands ? inst->assignee
+          : is_param(inst, o) ? inst->operands[o].var : NULL;
+        int v = name ? var_map_lookup(&vars, name) : -1;
+        for (int r = v >= 0 ? start[v] : 0; v >= 0 && r < start[v + 1]; r++) {
+          bitset_reset(gen, readers[r]);
+          bitset_set(kill, readers[r]);
+        }
+      }
+    }
+  }
+
+  dataflow_solve(flow);
+
+  free(readers);
+  free(start);
+  free(ids);
+  var_map_free(&vars);
+}
+
+void free_available_expressions(AvailableExpressions *avail)
+{
+  free_dataflow(&avail->flow);
+  free(avail->exprs);
+}
+
+/* Dumping */
+
+static void dump_variables(LiveVariables *live, Bitset *set)
+{
+  const char *separator = "";
+  for (size_t v = bitset_next(set, 0); v < set->num_bits; v = bitset_next(set, v + 1)) {
+    printf("%s%s", separator, live->names[v]);
+    separator = ", ";
+  }
+}
+
+void dump_live_variables(ControlFlowGraph *graph)
+{
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    if (!is_function_entry(block))
+      continue;
+
+    LiveVariables live;
+    compute_live_variables(block, &live);
+    for (int b = 0; b < live.flow.num_blocks; b++) {
+      printf("[BasicBlock %s#%d] live in: ", live.flow.order[b]->tag, live.flow.order[b]->id);
+      dump_variables(&live, &live.flow.in[b]);
+      printf("; live out: ");
+      dump_variables(&live, &live.flow.out[b]);
+      printf("\n");
+    }
+    free_live_variables(&live);
+  }
+}
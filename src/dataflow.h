@@ -0,0 +1,122 @@
+#ifndef MINI_DATAFLOW_H
+#define MINI_DATAFLOW_H
+
+#include "bitset.h"
+#include "cfa.h"
+#include "varmap.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Dataflow Analysis
+ *
+ * Solves gen/kill problems over the blocks reachable from one entry block (a
+ * function), where the facts leaving a block are `gen ∪ (facts entering it −
+ * kill)`. `dataflow_init()` numbers the blocks in reverse postorder, which is
+ * also stored in `BasicBlock.index`, and `dataflow_allocate()` gives every
+ * block empty sets once the client knows how many facts there are. The
+ * client fills in `gen` and `kill` and calls `dataflow_solve()`, which visits
+ * blocks from a worklist in reverse postorder (postorder for backward
+ * problems) until nothing changes.
+ *
+ * `in` and `out` are always the facts at the start and at the end of a
+ * block, whichever way the problem flows. The entry has no facts coming in
+ * for forward problems, and neither do blocks without successors for
+ * backward ones.
+ */
+
+typedef enum
+{
+  DATAFLOW_FORWARD,
+  DATAFLOW_BACKWARD,
+} DataflowDirection;
+
+typedef enum
+{
+  DATAFLOW_UNION,           // Facts that hold along some path
+  DATAFLOW_INTERSECTION,    // Facts that hold along every path
+} DataflowMeet;
+
+typedef struct
+{
+  DataflowDirection direction;
+  DataflowMeet meet;
+  BasicBlock **order;       // Reachable blocks in reverse postorder
+  int num_blocks;
+  size_t num_bits;
+  Bitset *in;
+  Bitset *out;
+  Bitset *gen;
+  Bitset *kill;
+  uint64_t *storage;
+  size_t visits;            // Blocks evaluated by the solver
+} Dataflow;
+
+void dataflow_init(Dataflow *flow, BasicBlock *entry, DataflowDirection direction,
+    DataflowMeet meet);
+void dataflow_allocate(Dataflow *flow, size_t num_bits);
+void dataflow_solve(Dataflow *flow);
+void free_dataflow(Dataflow *flow);
+
+// Returns the index of `block` if it was reachable from the entry, or -1
+int dataflow_index(Dataflow *flow, BasicBlock *block);
+
+/* Live Variables
+ *
+ * A variable is live where its current value may still be read. The
+ * operands of a phi are read at the end of the corresponding predecessor
+ * rather than in the block of the phi.
+ */
+
+typedef struct
+{
+  VarMap vars;
+  char **names;             // Per variable id
+  Dataflow flow;
+} LiveVariables;
+
+void compute_live_variables(BasicBlock *entry, LiveVariables *live);
+void free_live_variables(LiveVariables *live);
+bool is_live_out(LiveVariables *live, BasicBlock *block, char *name);
+
+/* Reaching Definitions
+ *
+ * Definitions are instructions with an assignee and the parameters of a
+ * `def`, numbered in the order of the blocks. A definition reaches a point if
+ * some path leads there from it without another definition of the variable.
+ */
+
+typedef struct
+{
+  VarMap vars;
+  Instruction **def_inst;   // Per definition
+  char **def_var;
+  int num_defs;
+  int *var_def_start;       // Definitions of variable `v` are
+  int *var_defs;            // var_defs[var_def_start[v]..var_def_start[v + 1])
+  Dataflow flow;
+} ReachingDefinitions;
+
+void compute_reaching_definitions(BasicBlock *entry, ReachingDefinitions *reach);
+void free_reaching_definitions(ReachingDefinitions *reach);
+
+/* Available Expressions
+ *
+ * An expression, a pure unary or binary operation on locals and literals,
+ * is available where every path has computed it since the last assignment
+ * to one of its operands.
+ */
+
+typedef struct
+{
+  Instruction **exprs;      // One computation of each expression
+  int num_exprs;
+  Dataflow flow;
+} AvailableExpressions;
+
+void compute_available_expressions(BasicBlock *entry, AvailableExpressions *avail);
+void free_available_expressions(AvailableExpressions *avail);
+
+void dump_live_variables(ControlFlowGraph *graph);
+
+#endif
@@ -0,0 +1,251 @@
+#include "dce.h"
+#include "util.h"
+#include "varmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Unreachable Blocks */
+
+static void remove_unreachable_blocks(BasicBlock *entry)
+{
+  uint32_t mark = new_visit_mark();
+  Vector stack;
+  vector_init(&stack, sizeof(BasicBlock *));
+  entry->mark = mark;
+  vector_push_back(&stack, entry);
+  while (stack.size) {
+    BasicBlock *block = stack.data[--stack.size];
+    for (size_t s = 0; s < block->successors.size; s++) {
+      BasicBlock *succ = block->successors.data[s];
+      if (succ->mark != mark) {
+        succ->mark = mark;
+        vector_push_back(&stack, succ);
+      }
+    }
+  }
+  vector_free(&stack);
+
+  // Unreachable blocks can branch to each other, so all of their edges are
+  // removed before any of them is freed
+  BasicBlock *end = function_end(entry);
+  for (BasicBlock *block = entry->next; block != end; block = block->next) {
+    while (block->mark != mark && block->successors.size)
+      remove_edge(block, block->successors.data[block->successors.size - 1]);
+  }
+
+  BasicBlock *prev = entry;
+  while (prev->next != end) {
+    BasicBlock *block = prev->next;
+    if (block->mark == mark) {
+      prev = block;
+      continue;
+    }
+    LOG_INFO("removing unreachable block `%s`", block->tag);
+    prev->next = block->next;
+    free_basic_block(block);
+  }
+}
+
+/* Dead Instructions */
+
+typedef struct
+{
+  VarMap vars;
+  Instruction **defs;
+  int *next_def;          // Next definition of the same variable, or -1
+  int *first_def;         // Per variable
+  bool *live;             // Per variable
+  int *worklist;
+  int worklist_size;
+} DeadCode;
+
+static void mark_operands_live(DeadCode *dce, Instruction *inst)
+{
+  // The operands of a `def` are the parameters it defines
+  if (inst->opcode == OP_DEF)
+    return;
+
+  for (uint32_t o = 0; o < inst->num_operands; o++) {
+    if (inst->operands[o].kind != OPERAND_VARIABLE)
+      continue;
+    int v = var_map_lookup(&dce->vars, inst->operands[o].var);
+    if (v >= 0 && !dce->live[v]) {
+      dce->live[v] = true;
+      dce->worklist[dce->worklist_size++] = v;
+    }
+  }
+}
+
+// Instructions without an assignee return, branch or store, and calls may
+// have effects beyond their result
+static bool is_critical(Instruction *inst)
+{
+  return !inst->assignee || inst->opcode == OP_CALL;
+}
+
+static void remove_dead_instructions(BasicBlock *entry)
+{
+  BasicBlock *end = function_end(entry);
+  int num_defs = 0;
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    for (size_t i = 0; i < block->instructions.size; i++)
+      num_defs += !is_critical(block->instructions.data[i]);
+  }
+
+  DeadCode dce = { 0 };
+  var_map_init(&dce.vars);
+  dce.defs = malloc((num_defs + 1) * sizeof(Instruction *));
+  dce.next_def = malloc((num_defs + 1) * sizeof(int));
+  dce.first_def = malloc((num_defs + 1) * sizeof(int));
+  dce.live = calloc(num_defs + 1, sizeof(bool));
+  dce.worklist = malloc((num_defs + 1) * sizeof(int));
+
+  int d = 0;
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      if (is_critical(inst))
+        continue;
+      size_t count = dce.vars.count;
+      int v = var_map_insert(&dce.vars, inst->assignee);
+      dce.defs[d] = inst;
+      dce.next_def[d] = (size_t)v < count ? dce.first_def[v] : -1;
+      dce.first_def[v] = d++;
+    }
+  }
+
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      if (is_critical(block->instructions.data[i]))
+        mark_operands_live(&dce, block->instructions.data[i]);
+    }
+  }
+
+  while (dce.worklist_size) {
+    int v = dce.worklist[--dce.worklist_size];
+    for (int def = dce.first_def[v]; def >= 0; def = dce.next_def[def])
+      mark_operands_live(&dce, dce.defs[def]);
+  }
+
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    size_t kept = 0;
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      if (is_critical(inst) || dce.live[var_map_lookup(&dce.vars, inst->assignee)]) {
+        block->instructions.data[kept++] = inst;
+        continue;
+      }
+      LOG_INFO("removing dead assignment to variable `%s`", inst->assignee);
+      free_instruction(inst);
+    }
+    block->instructions.size = kept;
+  }
+
+  var_map_free(&dce.vars);
+  free(dce.defs);
+  free(dce.next_def);
+  free(dce.first_def);
+  free(dce.live);
+  free(dce.worklist);
+}
+
+void eliminate_dead_code(ControlFlowGraph *graph)
+{
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    if (!is_function_entry(block))
+      continue;
+    remove_unreachable_blocks(block);
+    remove_dead_instructions(block);
+  }
+}
+
+/* Unused Functions */
+
+// Functions are referred to by label operands naming them, other than the
+// label of their own `def`
+static bool references_function(Instruction *inst, uint32_t operand)
+{
+  return inst->operands[operand].kind == OPERAND_LABEL
+    && inst->opcode != OP_DEF && inst->opcode != OP_JMP && inst->opcode != OP_BR;
+}
+
+// Marks the functions that the one starting at `function` refers to
+static void mark_references(BasicBlock *function, VarMap *functions, bool *reachable,
+    int *worklist, int *size)
+{
+  BasicBlock *end = function_end(function);
+  for (BasicBlock *block = function; block != end; block = block->next) {
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      for (uint32_t o = 0; o < inst->num_operands; o++) {
+        if (!references_function(inst, o))
+          continue;
+        int f = var_map_lookup(functions, inst->operands[o].label);
+        if (f >= 0 && !reachable[f]) {
+          reachable[f] = true;
+          worklist[(*size)++] = f;
+        }
+      }
+    }
+  }
+}
+
+// The initializers of globals run before the entry function, so whatever
+// they call is used as well
+void remove_unused_functions(ControlFlowGraph *graph, const char *entry)
+{
+  VarMap functions;
+  var_map_init(&functions);
+  Vector entries;
+  vector_init(&entries, sizeof(BasicBlock *));
+  int root = -1;
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    if (!is_function_entry(block))
+      continue;
+    if (strcmp(block->tag, entry) == 0)
+      root = entries.size;
+    var_map_insert(&functions, block->tag);
+    vector_push_back(&entries, block);
+  }
+
+  bool *reachable = calloc(entries.size + 1, sizeof(bool));
+  int *worklist = malloc((entries.size + 1) * sizeof(int));
+  int size = 0;
+  if (root >= 0) {
+    reachable[root] = true;
+    worklist[size++] = root;
+  }
+  if (graph->entry)
+    mark_references(graph->entry, &functions, reachable, worklist, &size);
+
+  while (size) {
+    BasicBlock *function = entries.data[worklist[--size]];
+    mark_references(function, &functions, reachable, worklist, &size);
+  }
+
+  // Without the entry function nothing is known to be unused
+  BasicBlock **link = &graph->blocks;
+  while (root >= 0 && *link) {
+    BasicBlock *block = *link;
+    int f = is_function_entry(block) ? var_map_lookup(&functions, block->tag) : -1;
+    if (f < 0 || reachable[f]) {
+      link = &block->next;
+      continue;
+    }
+
+    LOG_WARN("removing unused function `%s`", block->tag);
+    BasicBlock *end = function_end(block);
+    while (block != end) {
+      BasicBlock *next = block->next;
+      free_basic_block(block);
+      block = next;
+    }
+    *link = end;
+  }
+
+  free(worklist);
+  free(reachable);
+  vector_free(&entries);
+  var_map_free(&functions);
+}
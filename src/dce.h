@@ -0,0 +1,22 @@
+#ifndef MINI_DCE_H
+#define MINI_DCE_H
+
+#include "cfa.h"
+
+/* Dead Code Elimination
+ *
+ * `eliminate_dead_code()` works on functions in SSA form. Blocks that can't be
+ * reached from the entry of their function are removed first. Then returns,
+ * branches and stores are marked live, along with the definitions of every
+ * variable a live instruction reads, and all other instructions are deleted.
+ * In SSA form this also removes assignments to locals that are overwritten
+ * before they are read.
+ *
+ * `remove_unused_functions()` deletes the functions that can't be reached
+ * from the function named `entry` or from the initializers of globals.
+ */
+
+void eliminate_dead_code(ControlFlowGraph *graph);
+void remove_unused_functions(ControlFlowGraph *graph, const char *entry);
+
+#endif
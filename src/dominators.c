@@ -0,0 +1,141 @@
+#include "dominators.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int dominator_index(Dominators *dom, BasicBlock *block)
+{
+  int index = block->index;
+  if (index >= 0 && index < dom->num_blocks && dom->order[index] == block)
+    return index;
+  return -1;
+}
+
+static int intersect(int *idom, int a, int b)
+{
+  // In reverse postorder, dominators have smaller indices
+  while (a != b) {
+    while (a > b) a = idom[a];
+    while (b > a) b = idom[b];
+  }
+  return a;
+}
+
+static void compute_idoms(Dominators *dom)
+{
+  int n = dom->num_blocks;
+  int *idom = dom->idom = malloc(n * sizeof(int));
+  for (int i = 0; i < n; i++)
+    idom[i] = -1;
+  idom[0] = 0;
+
+  // Converges in two or three passes on graphs without irreducible loops
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 1; i < n; i++) {
+      BasicBlock *block = dom->order[i];
+      int new_idom = -1;
+      for (size_t p = 0; p < block->predecessors.size; p++) {
+        int pred = dominator_index(dom, vector_get(&block->predecessors, p));
+        if (pred < 0 || idom[pred] < 0)
+          continue;
+        new_idom = new_idom < 0 ? pred : intersect(idom, pred, new_idom);
+      }
+      if (idom[i] != new_idom) {
+        idom[i] = new_idom;
+        changed = true;
+      }
+    }
+  }
+
+  dom->first_child = malloc(n * sizeof(int));
+  dom->next_sibling = malloc(n * sizeof(int));
+  for (int i = 0; i < n; i++)
+    dom->first_child[i] = dom->next_sibling[i] = -1;
+
+  // Linking in reverse keeps children in reverse postorder
+  for (int i = n - 1; i > 0; i--) {
+    dom->next_sibling[i] = dom->first_child[idom[i]];
+    dom->first_child[idom[i]] = i;
+  }
+}
+
+// Walks up from the predecessors of every join point to its immediate
+// dominator; each block passed on the way has the join in its frontier.
+// The first pass sizes the frontiers and the second one fills them in.
+static void compute_frontiers(Dominators *dom)
+{
+  int n = dom->num_blocks;
+  int *idom = dom->idom;
+  int *last = malloc(n * sizeof(int));
+  int *count = calloc(n + 1, sizeof(int));
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < n; i++)
+      last[i] = -1;
+
+    for (int i = 0; i < n; i++) {
+      BasicBlock *block = dom->order[i];
+      if (block->predecessors.size < 2)
+        continue;
+
+      for (size_t p = 0; p < block->predecessors.size; p++) {
+        int runner = dominator_index(dom, vector_get(&block->predecessors, p));
+        if (runner < 0)
+          continue;
+        while (runner != idom[i] && last[runner] != i) {
+          last[runner] = i;
+          if (pass == 0)
+            count[runner]++;
+          else
+            dom->frontier[count[runner]++] = i;
+          if (runner == 0) break;
+          runner = idom[runner];
+        }
+      }
+    }
+
+    if (pass == 0) {
+      dom->frontier_start = malloc((n + 1) * sizeof(int));
+      int total = 0;
+      for (int i = 0; i < n; i++) {
+        dom->frontier_start[i] = total;
+        total += count[i];
+        count[i] = dom->frontier_start[i];
+      }
+      dom->frontier_start[n] = total;
+      dom->frontier = malloc((total ? total : 1) * sizeof(int));
+    }
+  }
+
+  free(count);
+  free(last);
+}
+
+void compute_dominators(BasicBlock *entry, Dominators *dom)
+{
+  memset(dom, 0, sizeof(Dominators));
+  dom->order = reverse_postorder(entry, &dom->num_blocks);
+  compute_idoms(dom);
+  compute_frontiers(dom);
+}
+
+void free_dominators(Dominators *dom)
+{
+  free(dom->order);
+  free(dom->idom);
+  free(dom->first_child);
+  free(dom->next_sibling);
+  free(dom->frontier_start);
+  free(dom->frontier);
+  memset(dom, 0, sizeof(Dominators));
+}
+
+bool dominates(Dominators *dom, int a, int b)
+{
+  while (b > a)
+    b = dom->idom[b];
+  return a == b;
+}
@@ -0,0 +1,34 @@
+#ifndef MINI_DOMINATORS_H
+#define MINI_DOMINATORS_H
+
+#include "cfa.h"
+
+#include <stdbool.h>
+
+/* Dominator Tree
+ *
+ * Computed for the blocks reachable from one entry block (a function) with
+ * the iterative algorithm of Cooper, Harvey and Kennedy. Blocks are referred
+ * to by their position in reverse postorder, which is also stored in
+ * `BasicBlock.index` until another analysis renumbers them.
+ */
+
+typedef struct
+{
+  BasicBlock **order;       // Reachable blocks in reverse postorder
+  int num_blocks;
+  int *idom;                // Immediate dominator (the entry is its own)
+  int *first_child;         // Dominator tree children, -1 terminated
+  int *next_sibling;
+  int *frontier_start;      // Dominance frontier of block `i` is
+  int *frontier;            // frontier[frontier_start[i]..frontier_start[i + 1])
+} Dominators;
+
+void compute_dominators(BasicBlock *entry, Dominators *dom);
+void free_dominators(Dominators *dom);
+
+// Returns the index of `block` if it was reachable from the entry, or -1
+int dominator_index(Dominators *dom, BasicBlock *block);
+bool dominates(Dominators *dom, int a, int b);
+
+#endif
@@ -0,0 +1,427 @@
+#define _DEFAULT_SOURCE
+#include "elf64.h"
+#include "intern.h"
+#include "util.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Executables load where `ld` puts them by default
+#define EXECUTABLE_BASE 0x400000
+#define SEGMENT_ALIGNMENT 0x1000
+
+static const char *section_names[] = {
+  [ELF_TEXT] = ".text",
+  [ELF_RODATA] = ".rodata",
+  [ELF_DATA] = ".data",
+  [ELF_BSS] = ".bss",
+};
+
+static uint64_t align_up(uint64_t value, uint64_t alignment)
+{
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static uint64_t section_size(ElfObject *object, int section)
+{
+  switch (section) {
+    case ELF_TEXT: return object->text.size;
+    case ELF_RODATA: return object->rodata.size;
+    case ELF_DATA: return object->data.size;
+    default: return object->bss_size;
+  }
+}
+
+static uint64_t section_flags(int section)
+{
+  switch (section) {
+    case ELF_TEXT: return SHF_ALLOC | SHF_EXECINSTR;
+    case ELF_RODATA: return SHF_ALLOC;
+    default: return SHF_ALLOC | SHF_WRITE;
+  }
+}
+
+/* Objects */
+
+void elf_init(ElfObject *object)
+{
+  memset(object, 0, sizeof(*object));
+  buffer_init(&object->text);
+  buffer_init(&object->rodata);
+  buffer_init(&object->data);
+  var_map_init(&object->symbol_ids);
+}
+
+void elf_free(ElfObject *object)
+{
+  buffer_free(&object->text);
+  buffer_free(&object->rodata);
+  buffer_free(&object->data);
+  var_map_free(&object->symbol_ids);
+  free(object->symbols);
+  free(object->relocations);
+  memset(object, 0, sizeof(*object));
+}
+
+int elf_symbol(ElfObject *object, const char *name)
+{
+  // Names are usually interned already, which saves hashing them
+  int id = var_map_lookup(&object->symbol_ids, (char *)name);
+  if (id >= 0)
+    return id;
+  char *interned = intern(name);
+  id = var_map_lookup(&object->symbol_ids, interned);
+  if (id >= 0)
+    return id;
+
+  if (object->num_symbols == object->symbols_capacity) {
+    object->symbols_capacity = object->symbols_capacity ? object->symbols_capacity * 2 : 64;
+    object->symbols = realloc(object->symbols, object->symbols_capacity * sizeof(ElfSymbol));
+  }
+  object->symbols[object->num_symbols] = (ElfSymbol){ .name = interned, .section = ELF_UNDEFINED };
+  var_map_insert(&object->symbol_ids, interned);
+  return object->num_symbols++;
+}
+
+void elf_define(ElfObject *object, const char *name, ElfSection section, uint64_t offset,
+    uint64_t size, bool is_global)
+{
+  int id = elf_symbol(object, name);
+  ElfSymbol *symbol = &object->symbols[id];
+  if (symbol->section != ELF_UNDEFINED)
+    fatal("symbol `%s` is defined more than once", name);
+  symbol->section = section;
+  symbol->offset = offset;
+  symbol->size = size;
+  symbol->is_global = is_global;
+}
+
+void elf_relocate(ElfObject *object, uint64_t offset, const char *symbol, int64_t addend)
+{
+  if (object->num_relocations == object->relocations_capacity) {
+    object->relocations_capacity = object->relocations_capacity
+      ? object->relocations_capacity * 2 : 64;
+    object->relocations = realloc(object->relocations,
+        object->relocations_capacity * sizeof(ElfRelocation));
+  }
+  int id = elf_symbol(object, symbol);
+  object->relocations[object->num_relocations++] = (ElfRelocation){
+    .offset = offset, .symbol = id, .addend = addend,
+  };
+}
+
+int elf_lookup(ElfObject *object, const char *name)
+{
+  return var_map_lookup(&object->symbol_ids, intern(name));
+}
+
+/* Linking */
+
+static void resolve(ElfObject *object, ElfRelocation *relocation, uint8_t *text,
+    const uint64_t *addresses)
+{
+  ElfSymbol *symbol = &object->symbols[relocation->symbol];
+  if (symbol->section == ELF_UNDEFINED)
+    fatal("undefined symbol `%s`", symbol->name);
+
+  int64_t value = addresses[symbol->section] + symbol->offset + relocation->addend
+    - (addresses[ELF_TEXT] + relocation->offset);
+  if (value < INT32_MIN || value > INT32_MAX)
+    fatal("`%s` is out of reach of a 32-bit displacement", symbol->name);
+  int32_t field = value;
+  memcpy(text + relocation->offset, &field, sizeof(field));
+}
+
+void elf_link(ElfObject *object, uint8_t *text, const uint64_t *addresses)
+{
+  for (int r = 0; r < object->num_relocations; r++)
+    resolve(object, &object->relocations[r], text, addresses);
+}
+
+/* Files */
+
+// Imports have to be global for a linker to resolve them
+static bool is_global(ElfSymbol *symbol)
+{
+  return symbol->is_global || symbol->section == ELF_UNDEFINED;
+}
+
+static uint8_t symbol_type(ElfSymbol *symbol)
+{
+  if (symbol->section == ELF_TEXT)
+    return symbol->is_global ? STT_FUNC : STT_NOTYPE;
+  return symbol->section == ELF_UNDEFINED ? STT_NOTYPE : STT_OBJECT;
+}
+
+static void pad_to(Buffer *file, uint64_t offset)
+{
+  while (file->size < offset)
+    buffer_append_u8(file, 0);
+}
+
+static uint32_t add_name(Buffer *strings, const char *name)
+{
+  uint32_t offset = strings->size;
+  buffer_append(strings, name, strlen(name) + 1);
+  return offset;
+}
+
+static bool write_file(const char *path, Buffer *file, bool is_executable)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, is_executable ? 0755 : 0644);
+  bool ok = fd >= 0 && (!is_executable || fchmod(fd, 0755) == 0);
+  size_t total = 0;
+  while (ok && total < file->size) {
+    ssize_t n = write(fd, file->data + total, file->size - total);
+    if (n <= 0) ok = false;
+    else total += n;
+  }
+  if (fd >= 0 && close(fd) != 0)
+    ok = false;
+  return ok;
+}
+
+// Writes an executable that starts at `entry`, or a relocatable object when
+// there is none. Both have the same sections, minus the relocations of an
+// executable, with the symbol table ordered the way ELF wants: the null
+// symbol, one per section, the local symbols and then the global ones.
+static size_t write_elf(ElfObject *object, const char *path, const char *entry)
+{
+  bool is_executable = entry != NULL;
+  bool has_data = object->data.size || object->bss_size;
+  int num_segments = is_executable ? 2 + has_data : 0;    // Code, data and the stack
+
+  uint64_t offsets[ELF_NUM_SECTIONS], addresses[ELF_NUM_SECTIONS] = { 0 };
+  offsets[ELF_TEXT] = align_up(sizeof(Elf64_Ehdr) + num_segments * sizeof(Elf64_Phdr), 16);
+  offsets[ELF_RODATA] = align_up(offsets[ELF_TEXT] + object->text.size, 16);
+  offsets[ELF_DATA] = align_up(offsets[ELF_RODATA] + object->rodata.size, 16);
+  offsets[ELF_BSS] = offsets[ELF_DATA] + object->data.size;
+  if (is_executable) {
+    // Constants share the pages of the code. Data gets pages of its own,
+    // which are writable but not executable.
+    addresses[ELF_TEXT] = EXECUTABLE_BASE + offsets[ELF_TEXT];
+    addresses[ELF_RODATA] = EXECUTABLE_BASE + offsets[ELF_RODATA];
+    addresses[ELF_DATA] = align_up(EXECUTABLE_BASE + offsets[ELF_DATA], SEGMENT_ALIGNMENT)
+      + offsets[ELF_DATA] % SEGMENT_ALIGNMENT;
+    addresses[ELF_BSS] = align_up(addresses[ELF_DATA] + object->data.size, 16);
+  }
+
+  Buffer strtab, symtab, rela, shstrtab, file;
+  buffer_init(&strtab);
+  buffer_init(&symtab);
+  buffer_init(&rela);
+  buffer_init(&shstrtab);
+  buffer_init(&file);
+
+  buffer_append_u8(&strtab, 0);
+  buffer_append(&symtab, &(Elf64_Sym){ 0 }, sizeof(Elf64_Sym));
+  for (int s = 0; s < ELF_NUM_SECTIONS; s++) {
+    Elf64_Sym sym = {
+      .st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION),
+      .st_shndx = 1 + s,
+      .st_value = addresses[s],
+    };
+    buffer_append(&symtab, &sym, sizeof(sym));
+  }
+
+  int *symtab_index = malloc((object->num_symbols + 1) * sizeof(int));
+  int next_index = 1 + ELF_NUM_SECTIONS, first_global = 0;
+  for (int global = 0; global < 2; global++) {
+    if (global)
+      first_global = next_index;
+    for (int i = 0; i < object->num_symbols; i++) {
+      ElfSymbol *symbol = &object->symbols[i];
+      if (is_global(symbol) != global)
+        continue;
+      bool is_defined = symbol->section != ELF_UNDEFINED;
+      Elf64_Sym sym = {
+        .st_name = add_name(&strtab, symbol->name),
+        .st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, symbol_type(symbol)),
+        .st_shndx = is_defined ? 1 + symbol->section : SHN_UNDEF,
+        .st_value = is_defined ? addresses[symbol->section] + symbol->offset : 0,
+        .st_size = symbol->size,
+      };
+      buffer_append(&symtab, &sym, sizeof(sym));
+      symtab_index[i] = next_index++;
+    }
+  }
+
+  uint64_t entry_address = 0;
+  if (is_executable) {
+    int id = elf_lookup(object, entry);
+    if (id < 0 || object->symbols[id].section != ELF_TEXT)
+      fatal("executables need an entry point `%s`", entry);
+    entry_address = addresses[ELF_TEXT] + object->symbols[id].offset;
+  }
+
+  buffer_reserve(&file, offsets[ELF_BSS]);
+  pad_to(&file, offsets[ELF_TEXT]);
+  buffer_append(&file, object->text.data, object->text.size);
+  pad_to(&file, offsets[ELF_RODATA]);
+  buffer_append(&file, object->rodata.data, object->rodata.size);
+  pad_to(&file, offsets[ELF_DATA]);
+  buffer_append(&file, object->data.data, object->data.size);
+
+  // What stays within `.text` is resolved either way, like calls between
+  // functions; locals that are left are referred to through their section
+  for (int r = 0; r < object->num_relocations; r++) {
+    ElfRelocation *relocation = &object->relocations[r];
+    ElfSymbol *symbol = &object->symbols[relocation->symbol];
+    if (is_executable || symbol->section == ELF_TEXT) {
+      resolve(object, relocation, file.data + offsets[ELF_TEXT], addresses);
+      continue;
+    }
+
+    bool is_local = !is_global(symbol);
+    Elf64_Rela entry = {
+      .r_offset = relocation->offset,
+      .r_info = ELF64_R_INFO(is_local ? 1 + symbol->section : symtab_index[relocation->symbol],
+          R_X86_64_PC32),
+      .r_addend = relocation->addend + (is_local ? symbol->offset : 0),
+    };
+    buffer_append(&rela, &entry, sizeof(entry));
+  }
+
+  Elf64_Shdr sections[9] = { { 0 } };
+  int num_sections = 1;
+  add_name(&shstrtab, "");
+  for (int s = 0; s < ELF_NUM_SECTIONS; s++) {
+    sections[num_sections++] = (Elf64_Shdr){
+      .sh_name = add_name(&shstrtab, section_names[s]),
+      .sh_type = s == ELF_BSS ? SHT_NOBITS : SHT_PROGBITS,
+      .sh_flags = section_flags(s),
+      .sh_addr = addresses[s],
+      .sh_offset = offsets[s],
+      .sh_size = section_size(object, s),
+      .sh_addralign = 16,
+    };
+  }
+
+  int symtab_section = num_sections + !is_executable;
+  if (!is_executable) {
+    buffer_align(&file, 8);
+    sections[num_sections++] = (Elf64_Shdr){
+      .sh_name = add_name(&shstrtab, ".rela.text"),
+      .sh_type = SHT_RELA,
+      .sh_flags = SHF_INFO_LINK,
+      .sh_offset = file.size,
+      .sh_size = rela.size,
+      .sh_link = symtab_section,
+      .sh_info = 1 + ELF_TEXT,
+      .sh_addralign = 8,
+      .sh_entsize = sizeof(Elf64_Rela),
+    };
+    buffer_append(&file, rela.data, rela.size);
+  }
+
+  buffer_align(&file, 8);
+  sections[num_sections++] = (Elf64_Shdr){
+    .sh_name = add_name(&shstrtab, ".symtab"),
+    .sh_type = SHT_SYMTAB,
+    .sh_offset = file.size,
+    .sh_size = symtab.size,
+    .sh_link = symtab_section + 1,
+    .sh_info = first_global,
+    .sh_addralign = 8,
+    .sh_entsize = sizeof(Elf64_Sym),
+  };
+  buffer_append(&file, symtab.data, symtab.size);
+
+  sections[num_sections++] = (Elf64_Shdr){
+    .sh_name = add_name(&shstrtab, ".strtab"),
+    .sh_type = SHT_STRTAB,
+    .sh_offset = file.size,
+    .sh_size = strtab.size,
+    .sh_addralign = 1,
+  };
+  buffer_append(&file, strtab.data, strtab.size);
+
+  sections[num_sections] = (Elf64_Shdr){
+    .sh_name = add_name(&shstrtab, ".shstrtab"),
+    .sh_type = SHT_STRTAB,
+    .sh_offset = file.size,
+    .sh_addralign = 1,
+  };
+  sections[num_sections++].sh_size = shstrtab.size;
+  buffer_append(&file, shstrtab.data, shstrtab.size);
+
+  buffer_align(&file, 8);
+  uint64_t section_headers = file.size;
+  buffer_append(&file, sections, num_sections * sizeof(Elf64_Shdr));
+
+  Elf64_Ehdr header = {
+    .e_ident = { ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT,
+      ELFOSABI_SYSV },
+    .e_type = is_executable ? ET_EXEC : ET_REL,
+    .e_machine = EM_X86_64,
+    .e_version = EV_CURRENT,
+    .e_entry = entry_address,
+    .e_phoff = num_segments ? sizeof(Elf64_Ehdr) : 0,
+    .e_shoff = section_headers,
+    .e_ehsize = sizeof(Elf64_Ehdr),
+    .e_phentsize = num_segments ? sizeof(Elf64_Phdr) : 0,
+    .e_phnum = num_segments,
+    .e_shentsize = sizeof(Elf64_Shdr),
+    .e_shnum = num_sections,
+    .e_shstrndx = num_sections - 1,
+  };
+  memcpy(file.data, &header, sizeof(header));
+
+  if (is_executable) {
+    // The headers and constants are mapped along with the code, as `ld`
+    // without -z separate-code does
+    Elf64_Phdr segments[3] = {
+      {
+        .p_type = PT_LOAD,
+        .p_flags = PF_R | PF_X,
+        .p_vaddr = EXECUTABLE_BASE,
+        .p_paddr = EXECUTABLE_BASE,
+        .p_filesz = offsets[ELF_RODATA] + object->rodata.size,
+        .p_memsz = offsets[ELF_RODATA] + object->rodata.size,
+        .p_align = SEGMENT_ALIGNMENT,
+      },
+      {
+        .p_type = PT_GNU_STACK,
+        .p_flags = PF_R | PF_W,
+        .p_align = 16,
+      },
+      {
+        .p_type = PT_LOAD,
+        .p_flags = PF_R | PF_W,
+        .p_offset = offsets[ELF_DATA],
+        .p_vaddr = addresses[ELF_DATA],
+        .p_paddr = addresses[ELF_DATA],
+        .p_filesz = object->data.size,
+        .p_memsz = addresses[ELF_BSS] + object->bss_size - addresses[ELF_DATA],
+        .p_align = SEGMENT_ALIGNMENT,
+      },
+    };
+    memcpy(file.data + sizeof(header), segments, num_segments * sizeof(Elf64_Phdr));
+  }
+
+  bool ok = write_file(path, &file, is_executable);
+  size_t size = file.size;
+  free(symtab_index);
+  buffer_free(&strtab);
+  buffer_free(&symtab);
+  buffer_free(&rela);
+  buffer_free(&shstrtab);
+  buffer_free(&file);
+  if (!ok)
+    fatal("couldn't write output file `%s`", path);
+  return size;
+}
+
+size_t elf_write_object(ElfObject *object, const char *path)
+{
+  return write_elf(object, path, NULL);
+}
+
+size_t elf_write_executable(ElfObject *object, const char *path, const char *entry)
+{
+  return write_elf(object, path, entry);
+}
@@ -0,0 +1,88 @@
+#ifndef MINI_ELF64_H
+#define MINI_ELF64_H
+
+#include "buffer.h"
+#include "varmap.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* ELF64 Objects
+ *
+ * Collects the machine code, data and symbols of a program for x86-64 and
+ * writes them out either as a relocatable object for a linker to combine
+ * with others, or as a static executable that starts at a given symbol.
+ * Constants go in `.rodata`, which executables map along with the code,
+ * readable but not writable.
+ * Fields of the code whose value depends on where a symbol ends up are
+ * recorded as relocations against it. The executable writer resolves all
+ * of them, and the object writer those that stay within `.text`, as an
+ * assembler would. `elf_link()` resolves them for code that is loaded some
+ * other way, such as into the compiler's own memory.
+ */
+
+typedef enum
+{
+  ELF_TEXT,
+  ELF_RODATA,
+  ELF_DATA,
+  ELF_BSS,
+  ELF_NUM_SECTIONS,
+} ElfSection;
+
+#define ELF_UNDEFINED (-1)
+
+typedef struct
+{
+  char *name;               // Interned
+  int section;              // ElfSection, or ELF_UNDEFINED for imports
+  uint64_t offset;          // Within the section
+  uint64_t size;
+  bool is_global;
+} ElfSymbol;
+
+// `S + addend - P`, a 32-bit displacement from the field at P to symbol S
+typedef struct
+{
+  uint64_t offset;          // Of the field in `.text`
+  int symbol;
+  int64_t addend;
+} ElfRelocation;
+
+typedef struct
+{
+  Buffer text;
+  Buffer rodata;
+  Buffer data;
+  uint64_t bss_size;
+  ElfSymbol *symbols;
+  int num_symbols;
+  int symbols_capacity;
+  VarMap symbol_ids;
+  ElfRelocation *relocations;
+  int num_relocations;
+  int relocations_capacity;
+} ElfObject;
+
+void elf_init(ElfObject *object);
+void elf_free(ElfObject *object);
+
+// Returns the id of the symbol `name`, which is undefined until defined
+int elf_symbol(ElfObject *object, const char *name);
+// Global symbols in `.text` are functions
+void elf_define(ElfObject *object, const char *name, ElfSection section, uint64_t offset,
+    uint64_t size, bool is_global);
+void elf_relocate(ElfObject *object, uint64_t offset, const char *symbol, int64_t addend);
+// Returns the id of the symbol `name`, or -1 if nothing refers to it
+int elf_lookup(ElfObject *object, const char *name);
+
+// Resolves every relocation in `text`, a copy of `.text`, for sections
+// loaded at `addresses`, which are indexed by ElfSection
+void elf_link(ElfObject *object, uint8_t *text, const uint64_t *addresses);
+
+// Both return the size of the file written
+size_t elf_write_object(ElfObject *object, const char *path);
+size_t elf_write_executable(ElfObject *object, const char *path, const char *entry);
+
+#endif
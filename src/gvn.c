@@ -0,0 +1,400 @@
+#include "gvn.h"
+#include "callgraph.h"
+#include "dominators.h"
+#include "passes.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Value Table */
+
+// Keys that aren't computations use tags past the last opcode
+enum
+{
+  KEY_NAME = 0x100,
+  KEY_CONSTANT,
+  KEY_ARGUMENT,
+};
+
+typedef struct
+{
+  uint32_t tag;         // OpCode of a computation or one of the keys above
+  int value;            // 0 marks an empty slot
+  uint64_t a;           // Operand value numbers, a name or a constant's kind
+  uint64_t b;           // and bits
+} ValueEntry;
+
+// Variable or constant that holds a value
+typedef struct
+{
+  OperandKind kind;
+  union
+  {
+    char *var;
+    Value literal;
+  };
+} Leader;
+
+// A scoped open-addressing table. Everything a block inserts is removed again
+// when the walk leaves its subtree of the dominator tree; since that happens
+// in the reverse order of insertion, no probe sequence is ever cut short.
+// The table is sized for a whole function up front.
+typedef struct
+{
+  ValueEntry *entries;
+  size_t mask;
+  size_t *undo;         // Occupied slots in insertion order
+  size_t num_undo;
+  Leader *leaders;
+  int num_values;
+} ValueTable;
+
+static size_t hash_key(uint32_t tag, uint64_t a, uint64_t b)
+{
+  uint64_t h = (tag ^ a) * 0x9E3779B97F4A7C15ull;
+  h = (h ^ (h >> 29) ^ b) * 0xBF58476D1CE4E5B9ull;
+  return (size_t)(h ^ (h >> 32));
+}
+
+static ValueEntry *find_slot(ValueTable *table, uint32_t tag, uint64_t a, uint64_t b)
+{
+  size_t i = hash_key(tag, a, b) & table->mask;
+  for (;; i = (i + 1) & table->mask) {
+    ValueEntry *entry = &table->entries[i];
+    if (!entry->value || (entry->tag == tag && entry->a == a && entry->b == b))
+      return entry;
+  }
+}
+
+static int lookup_value(ValueTable *table, uint32_t tag, uint64_t a, uint64_t b)
+{
+  return find_slot(table, tag, a, b)->value;
+}
+
+static void insert_value(ValueTable *table, uint32_t tag, uint64_t a, uint64_t b, int value)
+{
+  ValueEntry *entry = find_slot(table, tag, a, b);
+  if (!entry->value)
+    table->undo[table->num_undo++] = entry - table->entries;
+  *entry = (ValueEntry){ .tag = tag, .value = value, .a = a, .b = b };
+}
+
+static void leave_scope(ValueTable *table, size_t saved)
+{
+  while (table->num_undo > saved)
+    table->entries[table->undo[--table->num_undo]].value = 0;
+}
+
+static int new_value(ValueTable *table, Operand *operand)
+{
+  Leader *leader = &table->leaders[++table->num_values];
+  leader->kind = operand->kind;
+  if (operand->kind == OPERAND_LITERAL)
+    leader->literal = operand->literal;
+  else
+    leader->var = operand->var;
+  return table->num_values;
+}
+
+static void use_leader(ValueTable *table, int value, Operand *operand)
+{
+  Leader *leader = &table->leaders[value];
+  operand->kind = leader->kind;
+  if (leader->kind == OPERAND_LITERAL)
+    operand->literal = leader->literal;
+  else
+    operand->var = leader->var;
+}
+
+/* Numbering */
+
+static int new_variable_value(ValueTable *table, char *name)
+{
+  Operand operand = { .kind = OPERAND_VARIABLE, .var = name };
+  return new_value(table, &operand);
+}
+
+static void define_name(ValueTable *table, char *name, int value)
+{
+  insert_value(table, KEY_NAME, (uintptr_t)name, 0, value);
+}
+
+static int operand_value(ValueTable *table, Operand *operand)
+{
+  int value = 0;
+  switch (operand->kind) {
+    case OPERAND_VARIABLE:
+      // Variables that aren't defined on every path to here are only equal
+      // to themselves
+      value = lookup_value(table, KEY_NAME, (uintptr_t)operand->var, 0);
+      return value ? value : new_value(table, operand);
+    case OPERAND_LITERAL:
+      if (operand->literal.kind == VAL_STRING)
+        return new_value(table, operand);
+      value = lookup_value(table, KEY_CONSTANT, operand->literal.kind, operand->literal.u_val);
+      if (!value) {
+        value = new_value(table, operand);
+        insert_value(table, KEY_CONSTANT, operand->literal.kind, operand->literal.u_val, value);
+      }
+      return value;
+    case OPERAND_GLOBAL:
+      // Globals live in memory and may have been stored to since
+      return new_value(table, operand);
+    default:
+      return 0;
+  }
+}
+
+// Replaces a use by the leader of its value and returns the value number
+static int replace_operand(ValueTable *table, Operand *operand)
+{
+  int value = operand_value(table, operand);
+  if (value && operand->kind == OPERAND_VARIABLE)
+    use_leader(table, value, operand);
+  return value;
+}
+
+static bool is_commutative(OpCode opcode)
+{
+  return opcode == OP_ADD || opcode == OP_MUL || opcode == OP_CMP || opcode == OP_CMP_NOT;
+}
+
+static bool is_pure(OpCode opcode)
+{
+  switch (opcode) {
+    case OP_NEG:
+    case OP_NOT:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_CMP:
+    case OP_CMP_NOT:
+    case OP_CMP_LT:
+    case OP_CMP_GT:
+    case OP_CMP_LT_EQ:
+    case OP_CMP_GT_EQ:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool same_operand(Operand *a, Operand *b)
+{
+  if (a->kind != b->kind)
+    return false;
+  if (a->kind == OPERAND_LITERAL)
+    return a->literal.kind == b->literal.kind && a->literal.kind != VAL_STRING
+      && a->literal.u_val == b->literal.u_val;
+  return a->kind == OPERAND_VARIABLE && a->var == b->var;
+}
+
+static void number_computation(ValueTable *table, Instruction *inst)
+{
+  uint32_t tag = inst->opcode;
+  uint64_t a = replace_operand(table, &inst->operands[0]);
+  uint64_t b = inst->num_operands > 1 ? replace_operand(table, &inst->operands[1]) : 0;
+
+  // Canonicalize so that `x + y` matches `y + x` and `x > y` matches `y < x`
+  if (tag == OP_CMP_GT || tag == OP_CMP_GT_EQ) {
+    tag = tag == OP_CMP_GT ? OP_CMP_LT : OP_CMP_LT_EQ;
+    uint64_t swap = a; a = b; b = swap;
+  } else if (is_commutative(inst->opcode) && a > b) {
+    uint64_t swap = a; a = b; b = swap;
+  }
+
+  int value = lookup_value(table, tag, a, b);
+  if (value) {
+    LOG_INFO("eliminating redundant calculation for variable `%s`", inst->assignee);
+    pass_counters.values_forwarded++;
+    inst->opcode = OP_ASSIGN;
+    inst->num_operands = 1;
+    use_leader(table, value, &inst->operands[0]);
+  } else {
+    value = new_variable_value(table, inst->assignee);
+    insert_value(table, tag, a, b, value);
+  }
+  define_name(table, inst->assignee, value);
+}
+
+// Calls to functions that touch no memory are values of the function and
+// their arguments, which are chained one at a time into a value of their own
+static void number_call(ValueTable *table, Instruction *call)
+{
+  uint64_t key = (uintptr_t)call->operands[0].label;
+  for (uint32_t o = 1; o < call->num_operands; o++) {
+    uint64_t argument = replace_operand(table, &call->operands[o]);
+    int chain = lookup_value(table, KEY_ARGUMENT, key, argument);
+    if (!chain) {
+      chain = new_value(table, &call->operands[0]);
+      insert_value(table, KEY_ARGUMENT, key, argument, chain);
+    }
+    key = chain;
+  }
+
+  int value = lookup_value(table, OP_CALL, key, call->num_operands);
+  if (value) {
+    LOG_INFO("eliminating redundant call to `%s` for variable `%s`", call->operands[0].label,
+        call->assignee);
+    pass_counters.values_forwarded++;
+    call->opcode = OP_ASSIGN;
+    call->num_operands = 1;
+    use_leader(table, value, &call->operands[0]);
+  } else {
+    value = new_variable_value(table, call->assignee);
+    insert_value(table, OP_CALL, key, call->num_operands, value);
+  }
+  define_name(table, call->assignee, value);
+}
+
+// A phi whose incoming values are all the same variable or constant is that
+// value; its operands were already replaced in the predecessors
+static void number_phi(ValueTable *table, Instruction *phi)
+{
+  int value = 0;
+  bool same = phi->num_operands > 0;
+  for (uint32_t i = 1; same && i < phi->num_operands; i++)
+    same = same_operand(&phi->operands[0], &phi->operands[i]);
+
+  if (same && phi->operands[0].kind == OPERAND_VARIABLE)
+    value = lookup_value(table, KEY_NAME, (uintptr_t)phi->operands[0].var, 0);
+  else if (same)
+    value = operand_value(table, &phi->operands[0]);
+
+  if (!value)
+    value = new_variable_value(table, phi->assignee);
+  define_name(table, phi->assignee, value);
+}
+
+static void number_instruction(ValueTable *table, Instruction *inst, CallGraph *calls)
+{
+  switch (inst->opcode) {
+    case OP_DEF:
+      for (uint32_t i = 1; i < inst->num_operands; i++)
+        define_name(table, inst->operands[i].var, new_value(table, &inst->operands[i]));
+      break;
+    case OP_PHI:
+      number_phi(table, inst);
+      break;
+    case OP_ASSIGN:
+      int value = replace_operand(table, &inst->operands[0]);
+      // A load from a global can't stand in for the variable it was copied to
+      if (inst->operands[0].kind == OPERAND_GLOBAL)
+        value = new_variable_value(table, inst->assignee);
+      define_name(table, inst->assignee, value);
+      break;
+    case OP_CALL:
+      if (inst->assignee && (callee_attributes(calls, inst) & FN_READNONE)) {
+        number_call(table, inst);
+        break;
+      }
+      // Fall through
+    default:
+      if (inst->assignee && is_pure(inst->opcode)) {
+        number_computation(table, inst);
+        break;
+      }
+      for (uint32_t i = 0; i < inst->num_operands; i++)
+        replace_operand(table, &inst->operands[i]);
+      if (inst->assignee)
+        define_name(table, inst->assignee, new_variable_value(table, inst->assignee));
+  }
+}
+
+// Replaces the operands that flow from `block` into the phis of its successors
+static void number_phi_operands(ValueTable *table, BasicBlock *block)
+{
+  for (size_t s = 0; s < block->successors.size; s++) {
+    BasicBlock *succ = vector_get(&block->successors, s);
+    for (size_t p = 0; p < succ->predecessors.size; p++) {
+      if (vector_get(&succ->predecessors, p) != block)
+        continue;
+      for (size_t i = 0; i < succ->instructions.size; i++) {
+        Instruction *inst = vector_get(&succ->instructions, i);
+        if (inst->opcode == OP_DEF) continue;
+        if (inst->opcode != OP_PHI) break;
+        replace_operand(table, &inst->operands[p]);
+      }
+    }
+  }
+}
+
+static void value_number_function(BasicBlock *entry, CallGraph *calls)
+{
+  Dominators dom;
+  compute_dominators(entry, &dom);
+
+  // Every operand and assignee creates at most one value, except that phi
+  // operands are numbered both in their predecessor and in the phi, and
+  // arguments of calls are chained
+  size_t bound = 1;
+  for (int b = 0; b < dom.num_blocks; b++) {
+    Vector *instructions = &dom.order[b]->instructions;
+    for (size_t i = 0; i < instructions->size; i++) {
+      Instruction *inst = instructions->data[i];
+      bool is_doubled = inst->opcode == OP_PHI || inst->opcode == OP_CALL;
+      bound += 1 + inst->num_operands * (is_doubled ? 2 : 1);
+    }
+  }
+
+  size_t capacity = 16;
+  while (capacity < bound + bound / 2)
+    capacity *= 2;
+
+  ValueTable table = { 0 };
+  table.entries = calloc(capacity, sizeof(ValueEntry));
+  table.mask = capacity - 1;
+  table.undo = malloc(bound * sizeof(size_t));
+  table.leaders = malloc((bound + 1) * sizeof(Leader));
+
+  // Children are visited in reverse postorder, so that every predecessor of a
+  // block is numbered before it unless it reaches it through a back edge
+  int n = dom.num_blocks;
+  size_t *saved = malloc(n * sizeof(size_t));
+  int *walk = malloc(2 * n * sizeof(int));
+  int *children = malloc(n * sizeof(int));
+  int size = 0;
+  walk[size++] = 0;
+  while (size) {
+    int b = walk[--size];
+    if (b < 0) {
+      leave_scope(&table, saved[~b]);
+      continue;
+    }
+
+    saved[b] = table.num_undo;
+    BasicBlock *block = dom.order[b];
+    for (size_t i = 0; i < block->instructions.size; i++)
+      number_instruction(&table, vector_get(&block->instructions, i), calls);
+    number_phi_operands(&table, block);
+
+    walk[size++] = ~b;
+    int num_children = 0;
+    for (int child = dom.first_child[b]; child >= 0; child = dom.next_sibling[child])
+      children[num_children++] = child;
+    while (num_children)
+      walk[size++] = children[--num_children];
+  }
+
+  free(children);
+  free(walk);
+  free(saved);
+  free(table.leaders);
+  free(table.undo);
+  free(table.entries);
+  free_dominators(&dom);
+}
+
+void value_number(ControlFlowGraph *graph)
+{
+  CallGraph calls;
+  build_call_graph(graph, &calls);
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    if (is_function_entry(block))
+      value_number_function(block, &calls);
+  }
+  free_call_graph(&calls);
+}
@@ -0,0 +1,19 @@
+#ifndef MINI_GVN_H
+#define MINI_GVN_H
+
+#include "cfa.h"
+
+/* Global Value Numbering
+ *
+ * `value_number()` walks the dominator tree of every function in SSA form
+ * and gives each computation a value number keyed on its opcode and the value
+ * numbers of its operands. A computation whose value is already available in
+ * a dominating block becomes a copy of it, and every use of a variable is
+ * replaced by the first variable or constant that holds the same value.
+ * Calls to functions that the call graph finds to touch no memory are
+ * computations like any other.
+ */
+
+void value_number(ControlFlowGraph *graph);
+
+#endif
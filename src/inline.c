@@ -0,0 +1,259 @@
+#include "inline.h"
+#include "callgraph.h"
+#include "compile.h"
+#include "intern.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+typedef struct
+{
+  ControlFlowGraph *graph;
+  CallGraph calls;
+  int *sizes;                 // Per function, in instructions
+  int *num_calls;             // Per function, the calls of it in the graph
+} Inliner;
+
+static int callee(Inliner *in, Instruction *inst)
+{
+  return call_graph_callee(&in->calls, inst);
+}
+
+/* Call Graph */
+
+static void count_calls(Inliner *in, BasicBlock *first, BasicBlock *end, int delta)
+{
+  for (BasicBlock *block = first; block != end; block = block->next) {
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      int g = inst->opcode == OP_CALL ? callee(in, inst) : -1;
+      if (g >= 0)
+        in->num_calls[g] += delta;
+    }
+  }
+}
+
+// The parser marks functions that call themselves, which are the only
+// cycles a program can have
+static bool is_recursive(char *name)
+{
+  Symbol *symbol = ctx ? symbol_table_lookup(ctx->global_scope, name) : NULL;
+  return symbol && symbol->kind == SYMBOL_FUNCTION && symbol->node
+    && symbol->node->func_decl.is_recursive;
+}
+
+/* Cost Model */
+
+static int call_cost(Instruction *call)
+{
+  return INLINE_CALL_COST + call->num_operands - 1;
+}
+
+static bool should_inline(Inliner *in, int caller, int f, Instruction *call, int budget)
+{
+  CallGraphNode *node = &in->calls.nodes[f];
+  char *name = node->name;
+  char *caller_name = in->calls.nodes[caller].name;
+  if (!(node->attributes & FN_NORECURSE) || is_recursive(name)) {
+    LOG_INFO("not inlining `%s` into `%s`, as it is recursive", name, caller_name);
+    return false;
+  }
+  if (node->attributes & FN_NORETURN) {
+    LOG_INFO("not inlining `%s` into `%s`, as it never returns", name, caller_name);
+    return false;
+  }
+
+  // Inlining the only call of a function leaves the function unused, unless
+  // it is exported
+  int size = in->sizes[f], cost = call_cost(call), benefit = cost;
+  for (uint32_t o = 1; o < call->num_operands; o++) {
+    if (call->operands[o].kind == OPERAND_LITERAL)
+      benefit += INLINE_CONSTANT_ARGUMENT_BONUS;
+  }
+  if (in->num_calls[f] == 1 && !(ctx && ctx->is_module))
+    benefit += INLINE_ONLY_CALL_BONUS;
+
+  if (size > cost && size - benefit > INLINE_THRESHOLD) {
+    LOG_INFO("not inlining `%s` into `%s`, as it is too large (size %d, benefit %d)", name,
+        caller_name, size, benefit);
+    return false;
+  }
+  if (size > cost && size - cost > budget) {
+    LOG_INFO("not inlining `%s` into `%s`, as `%s` would grow past its budget", name,
+        caller_name, caller_name);
+    return false;
+  }
+  LOG_INFO("inlining `%s` into `%s` (size %d, benefit %d)", name, caller_name, size, benefit);
+  return true;
+}
+
+/* Inlining */
+
+// Places a new block after `prev`
+static BasicBlock *add_block(ControlFlowGraph *graph, BasicBlock *prev, const char *kind)
+{
+  char *tag = aprintf("%s.%d", kind, graph->num_blocks);
+  BasicBlock *block = make_basic_block(intern(tag), graph->num_blocks++);
+  free(tag);
+  block->next = prev->next;
+  prev->next = block;
+  return block;
+}
+
+// Locals of the copy of a function get names of their own, which keeps
+// every variable of the caller assigned once
+static char *rename_local(char *name, int site)
+{
+  char *renamed = aprintf("%s.i%d", name, site);
+  char *interned = intern(renamed);
+  free(renamed);
+  return interned;
+}
+
+static Instruction *make_assignment(char *assignee, Operand value)
+{
+  Instruction *assign = make_instruction(OP_ASSIGN);
+  assign->assignee = assignee;
+  *push_operand(assign) = value;
+  return assign;
+}
+
+static void rename_locals(Instruction *inst, int site)
+{
+  if (inst->assignee)
+    inst->assignee = rename_local(inst->assignee, site);
+  for (uint32_t o = 0; o < inst->num_operands; o++) {
+    if (inst->operands[o].kind == OPERAND_VARIABLE)
+      inst->operands[o].var = rename_local(inst->operands[o].var, site);
+  }
+}
+
+// Replaces the call at `index` of `block` with a copy of function `f`, and
+// returns the block that the rest of `block` moved to
+static BasicBlock *inline_call(Inliner *in, BasicBlock *block, size_t index, int f)
+{
+  // Block numbers are never reused, so they tell apart the copies of every
+  // call inlined into the graph
+  int site = in->graph->num_blocks;
+  Instruction *call = block->instructions.data[index];
+  int num_blocks = 0;
+  BasicBlock **copies = copy_function_blocks(in->graph, in->calls.nodes[f].entry, block,
+      &num_blocks);
+  BasicBlock *rest = add_block(in->graph, copies[num_blocks - 1], "return");
+
+  // The rest of the block takes its place among the predecessors of its
+  // successors, so that their phis keep the order of their operands
+  for (size_t s = 0; s < block->successors.size; s++) {
+    BasicBlock *succ = block->successors.data[s];
+    for (size_t p = 0; p < succ->predecessors.size; p++) {
+      if (succ->predecessors.data[p] == block)
+        succ->predecessors.data[p] = rest;
+    }
+    vector_push_back(&rest->successors, succ);
+  }
+  block->successors.size = 0;
+
+  // Parameters are assigned the arguments, and returns become jumps to the
+  // rest of the block, in the order of its predecessors
+  Instruction *result = make_instruction(OP_PHI);
+  result->assignee = call->assignee;
+  for (int b = 0; b < num_blocks; b++) {
+    BasicBlock *copy = copies[b];
+    Vector instructions = copy->instructions;
+    vector_init(&copy->instructions, sizeof(Instruction *));
+    for (size_t i = 0; i < instructions.size; i++) {
+      Instruction *inst = instructions.data[i];
+      rename_locals(inst, site);
+      if (inst->opcode == OP_DEF) {
+        for (uint32_t o = 1; o < inst->num_operands; o++) {
+          Instruction *assign = make_assignment(inst->operands[o].var, call->operands[o]);
+          vector_push_back(&copy->instructions, assign);
+        }
+        free_instruction(inst);
+      } else if (inst->opcode == OP_RET) {
+        Operand value = { .kind = OPERAND_LITERAL, .literal = { .kind = VAL_INT } };
+        *push_operand(result) = inst->num_operands ? inst->operands[0] : value;
+        vector_push_back(&copy->instructions, make_jump(copy, rest));
+        free_instruction(inst);
+      } else {
+        vector_push_back(&copy->instructions, inst);
+      }
+    }
+    vector_free(&instructions);
+  }
+
+  Vector tail = block->instructions;
+  vector_init(&block->instructions, sizeof(Instruction *));
+  for (size_t i = 0; i < index; i++)
+    vector_push_back(&block->instructions, tail.data[i]);
+  vector_push_back(&block->instructions, make_jump(block, copies[0]));
+
+  if (call->assignee && result->num_operands == 1) {
+    vector_push_back(&rest->instructions, make_assignment(call->assignee, result->operands[0]));
+    free_instruction(result);
+  } else if (call->assignee) {
+    vector_push_back(&rest->instructions, result);
+  } else {
+    free_instruction(result);
+  }
+  for (size_t i = index + 1; i < tail.size; i++)
+    vector_push_back(&rest->instructions, tail.data[i]);
+  vector_free(&tail);
+
+  in->num_calls[f]--;
+  count_calls(in, copies[0], rest, 1);
+  free_instruction(call);
+  free(copies);
+  return rest;
+}
+
+static void inline_calls_into(Inliner *in, int caller)
+{
+  BasicBlock *entry = in->calls.nodes[caller].entry;
+  BasicBlock *end = function_end(entry);
+  int size = in->sizes[caller];
+  int budget = size * INLINE_MAX_GROWTH / 100;
+  if (budget < INLINE_MIN_GROWTH)
+    budget = INLINE_MIN_GROWTH;
+
+  // Blocks inlined into the caller come before `next`, and aren't looked at
+  // again, as their calls were already considered inside the callee
+  BasicBlock *next;
+  for (BasicBlock *block = entry; block != end; block = next) {
+    next = block->next;
+    size_t i = 0;
+    while (i < block->instructions.size) {
+      Instruction *inst = block->instructions.data[i++];
+      int f = inst->opcode == OP_CALL ? callee(in, inst) : -1;
+      if (f < 0 || !should_inline(in, caller, f, inst, budget))
+        continue;
+      int growth = in->sizes[f] - call_cost(inst);
+      if (growth > 0)
+        budget -= growth;
+      block = inline_call(in, block, i - 1, f);
+      i = 0;
+    }
+  }
+  in->sizes[caller] = function_size(entry);
+}
+
+/* Pass */
+
+void inline_functions(ControlFlowGraph *graph)
+{
+  Inliner in = { .graph = graph };
+  build_call_graph(graph, &in.calls);
+  int n = in.calls.num_nodes;
+  in.sizes = malloc((n + 1) * sizeof(int));
+  in.num_calls = calloc(n + 1, sizeof(int));
+  for (int f = 0; f < n; f++)
+    in.sizes[f] = function_size(in.calls.nodes[f].entry);
+  count_calls(&in, graph->blocks, NULL, 1);
+
+  for (int i = 0; i < n; i++)
+    inline_calls_into(&in, in.calls.order[i]);
+
+  free(in.num_calls);
+  free(in.sizes);
+  free_call_graph(&in.calls);
+}
@@ -0,0 +1,37 @@
+#ifndef MINI_INLINE_H
+#define MINI_INLINE_H
+
+#include "cfa.h"
+
+/* Function Inlining
+ *
+ * `inline_functions()` replaces calls with copies of the functions they
+ * call, in SSA form. Functions are visited bottom-up on the call graph, so
+ * that a function has inlined what it calls before it is itself inlined
+ * anywhere. The arguments become assignments to copies of the parameters,
+ * every return jumps to the rest of the calling block, and the result is a
+ * phi of the values returned when there are several returns.
+ *
+ * Whether a call is inlined is a matter of cost against benefit, measured
+ * in instructions. Functions no larger than the call itself are always
+ * inlined. Other functions are inlined while their size minus the benefit
+ * stays within a threshold, where constant arguments and being the only
+ * call of a function count as benefits, and while the caller stays within
+ * a budget of growth. Recursive functions are never inlined. Every decision
+ * is logged as a remark.
+ */
+
+// What a call costs besides passing its arguments, in instructions
+#define INLINE_CALL_COST 4
+// How much larger than its benefit a function may be to be inlined
+#define INLINE_THRESHOLD 24
+#define INLINE_CONSTANT_ARGUMENT_BONUS 4
+#define INLINE_ONLY_CALL_BONUS 16
+// A caller may grow by this percentage of its size, or by at least
+// INLINE_MIN_GROWTH instructions
+#define INLINE_MAX_GROWTH 100
+#define INLINE_MIN_GROWTH 48
+
+void inline_functions(ControlFlowGraph *graph);
+
+#endif
@@ -0,0 +1,139 @@
+#include "intern.h"
+#include "util.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INTERN_DEFAULT_CAPACITY 1024
+#define INTERN_ARENA_SIZE       (64 * 1024)
+
+typedef struct InternArena InternArena;
+struct InternArena
+{
+    InternArena *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+// Open-addressing set of interned strings. Storage for the strings themselves
+// comes from a chain of arenas so that interning doesn't pay a malloc per name.
+static char **slots = NULL;
+static size_t capacity = 0;
+static size_t count = 0;
+static InternArena *arena = NULL;
+
+static char *arena_alloc(size_t size)
+{
+    if (!arena || arena->used + size > arena->size) {
+        size_t arena_size = MAX(size, INTERN_ARENA_SIZE);
+        InternArena *new_arena = malloc(sizeof(InternArena) + arena_size);
+        if (!new_arena)
+            fatal("couldn't allocate string arena");
+        new_arena->next = arena;
+        new_arena->used = 0;
+        new_arena->size = arena_size;
+        arena = new_arena;
+    }
+    char *ptr = arena->data + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+static size_t find_slot(char **table, size_t table_capacity, const char *s, size_t length)
+{
+    size_t mask = table_capacity - 1;
+    size_t index = hash_n((uint8_t *)s, length) & mask;
+    while (table[index]) {
+        if (strncmp(table[index], s, length) == 0 && table[index][length] == 0)
+            break;
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+static void rehash(size_t new_capacity, uintptr_t skip_base, size_t skip_size)
+{
+    char **new_slots = calloc(new_capacity, sizeof(char *));
+    if (!new_slots)
+        fatal("couldn't allocate string interner");
+
+    count = 0;
+    for (size_t i = 0; i < capacity; i++) {
+        char *s = slots[i];
+        if (!s || ((uintptr_t)s >= skip_base && (uintptr_t)s - skip_base < skip_size))
+            continue;
+        new_slots[find_slot(new_slots, new_capacity, s, strlen(s))] = s;
+        count++;
+    }
+
+    free(slots);
+    slots = new_slots;
+    capacity = new_capacity;
+}
+
+static void grow(void)
+{
+    rehash(capacity ? capacity * 2 : INTERN_DEFAULT_CAPACITY, 0, 0);
+}
+
+char *intern_n(const char *s, size_t length)
+{
+    // Keep the load factor below 1/2
+    if ((count + 1) * 2 > capacity)
+        grow();
+
+    size_t index = find_slot(slots, capacity, s, length);
+    if (slots[index])
+        return slots[index];
+
+    char *copy = arena_alloc(length + 1);
+    memcpy(copy, s, length);
+    copy[length] = 0;
+
+    slots[index] = copy;
+    count++;
+    return copy;
+}
+
+char *intern(const char *s)
+{
+    return intern_n(s, strlen(s));
+}
+
+char *intern_borrowed(const char *s)
+{
+    if ((count + 1) * 2 > capacity)
+        grow();
+
+    size_t length = strlen(s);
+    size_t index = find_slot(slots, capacity, s, length);
+    if (!slots[index]) {
+        slots[index] = (char *)s;
+        count++;
+    }
+    return slots[index];
+}
+
+void intern_release(const void *base, size_t size)
+{
+    if (capacity)
+        rehash(capacity, (uintptr_t)base, size);
+}
+
+size_t intern_count(void)
+{
+    return count;
+}
+
+void intern_free(void)
+{
+    while (arena) {
+        InternArena *next = arena->next;
+        free(arena);
+        arena = next;
+    }
+    free(slots);
+    slots = NULL;
+    capacity = count = 0;
+}
@@ -0,0 +1,18 @@
+#ifndef MINI_INTERN_H
+#define MINI_INTERN_H
+
+#include <stddef.h>
+
+// Returns the canonical copy of a string. Interned strings are owned by the
+// interner and live until `intern_free()`, so two names are equal if and only
+// if their pointers are equal.
+char *intern(const char *s);
+char *intern_n(const char *s, size_t length);
+// Interns `s` without copying it when it isn't already known. The caller keeps
+// the storage alive until it drops every such name with `intern_release()`.
+char *intern_borrowed(const char *s);
+void intern_release(const void *base, size_t size);
+size_t intern_count(void);
+void intern_free(void);
+
+#endif
@@ -0,0 +1,805 @@
+#include "interp.h"
+#include "intern.h"
+#include "util.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *op_names[] = {
+#define X(name, num_fields) [BC_##name] = #name,
+  BYTECODE_OPS(X)
+#undef X
+};
+
+static const int op_fields[] = {
+#define X(name, num_fields) [BC_##name] = num_fields,
+  BYTECODE_OPS(X)
+#undef X
+};
+
+/* Decoding */
+
+// A jump target that holds the index of a block until all are emitted
+typedef struct
+{
+  size_t code;
+  size_t field;               // Offset in the Bytecode
+} Fixup;
+
+typedef struct
+{
+  BytecodeProgram *program;
+  VarMap slots;               // Locals of the function
+  int32_t scratch;            // Two slots for operands that aren't locals
+  int32_t phi_temporaries;
+  int32_t arguments;          // For arguments that aren't locals
+  uint32_t *block_code;       // Per `BasicBlock.index`, once emitted
+  Fixup *fixups;
+  size_t num_fixups;
+  size_t fixups_capacity;
+} Decoder;
+
+static size_t emit(Decoder *decoder, BytecodeOp op, int32_t d, int32_t a, int32_t b)
+{
+  BytecodeProgram *program = decoder->program;
+  if (program->num_code == program->code_capacity) {
+    program->code_capacity = program->code_capacity ? program->code_capacity * 2 : 256;
+    program->code = realloc(program->code, program->code_capacity * sizeof(Bytecode));
+  }
+  program->code[program->num_code] = (Bytecode){ .op = op, .d = d, .a = a, .b = b };
+  return program->num_code++;
+}
+
+static bool is_imm32(int64_t value)
+{
+  return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static int64_t literal_value(Value *literal)
+{
+  switch (literal->kind) {
+    case VAL_INT: return literal->i_val;
+    case VAL_UINT: return (int64_t)literal->u_val;
+    case VAL_CHAR: return literal->c_val;
+    case VAL_BOOL: return literal->b_val;
+    default: fatal("literals of kind %d aren't supported by the interpreter", literal->kind);
+  }
+  return 0;
+}
+
+static void emit_literal(Decoder *decoder, int32_t slot, int64_t value)
+{
+  if (is_imm32(value)) {
+    emit(decoder, BC_LOAD_IMM, slot, value, 0);
+    return;
+  }
+  BytecodeProgram *program = decoder->program;
+  if (program->num_constants == program->constants_capacity) {
+    program->constants_capacity = program->constants_capacity ? program->constants_capacity * 2 : 16;
+    program->constants = realloc(program->constants, program->constants_capacity * sizeof(int64_t));
+  }
+  program->constants[program->num_constants] = value;
+  emit(decoder, BC_LOAD_CONST, slot, program->num_constants++, 0);
+}
+
+static int32_t local_slot(Decoder *decoder, char *name)
+{
+  int slot = var_map_lookup(&decoder->slots, name);
+  if (slot < 0)
+    fatal("the interpreter found no slot for local `%s`", name);
+  return slot;
+}
+
+static int32_t global_id(Decoder *decoder, char *name)
+{
+  return var_map_insert(&decoder->program->global_ids, name);
+}
+
+// Returns the slot that holds the value of `operand`, loading literals and
+// globals into `slot` first
+static int32_t source(Decoder *decoder, Operand *operand, int32_t slot)
+{
+  switch (operand->kind) {
+    case OPERAND_VARIABLE:
+      return local_slot(decoder, operand->var);
+    case OPERAND_GLOBAL:
+      emit(decoder, BC_LOAD_GLOBAL, slot, global_id(decoder, operand->var), 0);
+      return slot;
+    case OPERAND_LITERAL:
+      emit_literal(decoder, slot, literal_value(&operand->literal));
+      return slot;
+    default:
+      fatal("the interpreter can't read an operand of kind %d", operand->kind);
+  }
+  return slot;
+}
+
+// Puts the value of `operand` straight into `slot`
+static void move_to(Decoder *decoder, int32_t slot, Operand *operand)
+{
+  int32_t from = source(decoder, operand, slot);
+  if (from != slot)
+    emit(decoder, BC_MOVE, slot, from, 0);
+}
+
+static bool is_literal_imm32(Operand *operand)
+{
+  return operand->kind == OPERAND_LITERAL && is_imm32(literal_value(&operand->literal));
+}
+
+static BytecodeOp binary_op(OpCode opcode)
+{
+  switch (opcode) {
+    case OP_ADD: return BC_ADD;
+    case OP_SUB: return BC_SUB;
+    case OP_MUL: return BC_MUL;
+    case OP_DIV: return BC_DIV;
+    case OP_CMP: return BC_EQ;
+    case OP_CMP_NOT: return BC_NE;
+    case OP_CMP_LT: return BC_LT;
+    case OP_CMP_GT: return BC_GT;
+    case OP_CMP_LT_EQ: return BC_LE;
+    case OP_CMP_GT_EQ: return BC_GE;
+    default: return NUM_BYTECODE_OPS;
+  }
+}
+
+// The operation that gives the same result with its operands swapped
+static BytecodeOp swapped_op(BytecodeOp op)
+{
+  switch (op) {
+    case BC_ADD: case BC_MUL: case BC_EQ: case BC_NE: return op;
+    case BC_LT: return BC_GT;
+    case BC_GT: return BC_LT;
+    case BC_LE: return BC_GE;
+    case BC_GE: return BC_LE;
+    default: return NUM_BYTECODE_OPS;
+  }
+}
+
+static void emit_binary(Decoder *decoder, BytecodeOp op, int32_t dst, Operand *left, Operand *right)
+{
+  // Literals on the left trade places with the right operand where they can
+  if (is_literal_imm32(left) && !is_literal_imm32(right) && swapped_op(op) != NUM_BYTECODE_OPS) {
+    Operand *other = left;
+    left = right;
+    right = other;
+    op = swapped_op(op);
+  }
+
+  int32_t a = source(decoder, left, decoder->scratch);
+  if (is_literal_imm32(right)) {
+    emit(decoder, op - BC_ADD + BC_ADD_IMM, dst, a, literal_value(&right->literal));
+    return;
+  }
+  int32_t b = source(decoder, right, decoder->scratch + 1);
+  emit(decoder, op, dst, a, b);
+}
+
+static void add_fixup(Decoder *decoder, size_t code, size_t field)
+{
+  if (decoder->num_fixups == decoder->fixups_capacity) {
+    decoder->fixups_capacity = decoder->fixups_capacity ? decoder->fixups_capacity * 2 : 64;
+    decoder->fixups = realloc(decoder->fixups, decoder->fixups_capacity * sizeof(Fixup));
+  }
+  decoder->fixups[decoder->num_fixups++] = (Fixup){ .code = code, .field = field };
+}
+
+static int count_phis(BasicBlock *block)
+{
+  int count = 0;
+  for (size_t i = 0; i < block->instructions.size; i++) {
+    Instruction *inst = block->instructions.data[i];
+    count += inst->opcode == OP_PHI;
+  }
+  return count;
+}
+
+// Copies the phi operands of `to` that flow in from `from`. With more than
+// one phi, all operands go to temporaries first, as one phi may read what
+// another one defines.
+static void emit_edge(Decoder *decoder, BasicBlock *from, BasicBlock *to)
+{
+  int num_phis = count_phis(to);
+  if (!num_phis)
+    return;
+
+  int predecessor = -1;
+  for (size_t p = 0; p < to->predecessors.size; p++) {
+    if (to->predecessors.data[p] == from)
+      predecessor = p;
+  }
+  if (predecessor < 0)
+    fatal("block `%s` isn't a predecessor of `%s`", from->tag, to->tag);
+
+  int phi = 0;
+  for (size_t i = 0; i < to->instructions.size; i++) {
+    Instruction *inst = to->instructions.data[i];
+    if (inst->opcode != OP_PHI)
+      continue;
+    int32_t slot = num_phis == 1 ? local_slot(decoder, inst->assignee)
+      : decoder->phi_temporaries + phi++;
+    move_to(decoder, slot, &inst->operands[predecessor]);
+  }
+  if (num_phis == 1)
+    return;
+
+  phi = 0;
+  for (size_t i = 0; i < to->instructions.size; i++) {
+    Instruction *inst = to->instructions.data[i];
+    if (inst->opcode == OP_PHI)
+      emit(decoder, BC_MOVE, local_slot(decoder, inst->assignee), decoder->phi_temporaries + phi++, 0);
+  }
+}
+
+// Jumps from `from` to `to`, which is left out when `to` comes next
+static void emit_jump(Decoder *decoder, BasicBlock *from, BasicBlock *to)
+{
+  emit_edge(decoder, from, to);
+  if (to != from->next)
+    add_fixup(decoder, emit(decoder, BC_JMP, to->index, 0, 0), offsetof(Bytecode, d));
+}
+
+static BasicBlock *successor(BasicBlock *block, Operand *label)
+{
+  for (size_t s = 0; s < block->successors.size; s++) {
+    BasicBlock *next = block->successors.data[s];
+    if (strcmp(next->tag, label->label) == 0)
+      return next;
+  }
+  fatal("block `%s` jumps to `%s`, which isn't one of its successors", block->tag, label->label);
+  return NULL;
+}
+
+static void emit_branch(Decoder *decoder, BasicBlock *block, Instruction *inst)
+{
+  BasicBlock *then = successor(block, &inst->operands[1]);
+  BasicBlock *otherwise = successor(block, &inst->operands[2]);
+  if (inst->operands[0].kind == OPERAND_LITERAL) {
+    emit_jump(decoder, block, literal_value(&inst->operands[0].literal) ? then : otherwise);
+    return;
+  }
+
+  // Edges into blocks with phis branch to their copies, which follow
+  int32_t cond = source(decoder, &inst->operands[0], decoder->scratch);
+  size_t branch = emit(decoder, BC_BR, cond, then->index, otherwise->index);
+  BasicBlock *targets[2] = { then, otherwise };
+  size_t fields[2] = { offsetof(Bytecode, a), offsetof(Bytecode, b) };
+  for (int t = 0; t < 2; t++) {
+    if (!count_phis(targets[t])) {
+      add_fixup(decoder, branch, fields[t]);
+      continue;
+    }
+    int32_t *field = (int32_t *)((char *)&decoder->program->code[branch] + fields[t]);
+    *field = decoder->program->num_code;
+    emit_edge(decoder, block, targets[t]);
+    add_fixup(decoder, emit(decoder, BC_JMP, targets[t]->index, 0, 0), offsetof(Bytecode, d));
+  }
+}
+
+static void add_argument(BytecodeProgram *program, int32_t value)
+{
+  if (program->num_arguments == program->arguments_capacity) {
+    program->arguments_capacity = program->arguments_capacity ? program->arguments_capacity * 2 : 64;
+    program->arguments = realloc(program->arguments, program->arguments_capacity * sizeof(int32_t));
+  }
+  program->arguments[program->num_arguments++] = value;
+}
+
+static void emit_call(Decoder *decoder, Instruction *inst)
+{
+  BytecodeProgram *program = decoder->program;
+  uint32_t num_args = inst->num_operands - 1;
+  int32_t *slots = malloc((num_args + 1) * sizeof(int32_t));
+  for (uint32_t i = 0; i < num_args; i++)
+    slots[i] = source(decoder, &inst->operands[i + 1], decoder->arguments + i);
+
+  size_t list = program->num_arguments;
+  add_argument(program, num_args);
+  for (uint32_t i = 0; i < num_args; i++)
+    add_argument(program, slots[i]);
+  free(slots);
+
+  int callee = var_map_lookup(&program->function_ids, intern(inst->operands[0].label));
+  emit(decoder, BC_CALL, inst->assignee ? local_slot(decoder, inst->assignee) : -1, callee, list);
+}
+
+static void emit_instruction(Decoder *decoder, BasicBlock *block, Instruction *inst)
+{
+  BytecodeOp op = binary_op(inst->opcode);
+  if (op != NUM_BYTECODE_OPS) {
+    emit_binary(decoder, op, local_slot(decoder, inst->assignee),
+        &inst->operands[0], &inst->operands[1]);
+    return;
+  }
+
+  switch (inst->opcode) {
+    case OP_NEG:
+    case OP_NOT:
+    case OP_DEREF: {
+      int32_t a = source(decoder, &inst->operands[0], decoder->scratch);
+      op = inst->opcode == OP_NEG ? BC_NEG : inst->opcode == OP_NOT ? BC_NOT : BC_DEREF;
+      emit(decoder, op, local_slot(decoder, inst->assignee), a, 0);
+      break;
+    }
+    case OP_ADDR:
+      if (inst->operands[0].kind != OPERAND_GLOBAL)
+        fatal("taking the address of local `%s` isn't supported by the interpreter",
+            inst->operands[0].var);
+      emit(decoder, BC_ADDR_GLOBAL, local_slot(decoder, inst->assignee),
+          global_id(decoder, inst->operands[0].var), 0);
+      break;
+    case OP_ASSIGN:
+      move_to(decoder, local_slot(decoder, inst->assignee), &inst->operands[0]);
+      break;
+    case OP_STORE: {
+      int32_t a = source(decoder, &inst->operands[1], decoder->scratch);
+      emit(decoder, BC_STORE_GLOBAL, global_id(decoder, inst->operands[0].var), a, 0);
+      break;
+    }
+    case OP_CALL:
+      emit_call(decoder, inst);
+      break;
+    case OP_JMP:
+      emit_jump(decoder, block, successor(block, &inst->operands[0]));
+      break;
+    case OP_BR:
+      emit_branch(decoder, block, inst);
+      break;
+    case OP_RET:
+      if (!inst->num_operands)
+        emit(decoder, BC_RET_ZERO, 0, 0, 0);
+      else
+        emit(decoder, BC_RET, source(decoder, &inst->operands[0], decoder->scratch), 0, 0);
+      break;
+    case OP_DEF:
+    case OP_PHI:
+      break;
+    default:
+      fatal("the interpreter doesn't support opcode %d", inst->opcode);
+  }
+}
+
+static void add_local(Decoder *decoder, Operand *operand)
+{
+  if (operand->kind == OPERAND_VARIABLE)
+    var_map_insert(&decoder->slots, operand->var);
+}
+
+// Parameters take the first slots, in order, then every other local, then
+// the scratch slots, the temporaries of phis and the arguments of calls
+static void decode_function(BytecodeProgram *program, BasicBlock *entry, BasicBlock *end)
+{
+  Decoder decoder = { .program = program };
+  var_map_init(&decoder.slots);
+
+  int num_blocks = 0, max_phis = 0;
+  uint32_t max_args = 0;
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    block->index = num_blocks++;
+    int num_phis = count_phis(block);
+    if (num_phis > max_phis)
+      max_phis = num_phis;
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      if (inst->opcode == OP_CALL && inst->num_operands - 1 > max_args)
+        max_args = inst->num_operands - 1;
+    }
+  }
+  decoder.block_code = malloc((num_blocks + 1) * sizeof(uint32_t));
+
+  Instruction *def = is_function_entry(entry) ? entry->instructions.data[0] : NULL;
+  uint32_t num_params = def ? def->num_operands - 1 : 0;
+  for (uint32_t p = 0; p < num_params; p++)
+    add_local(&decoder, &def->operands[p + 1]);
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      if (inst->assignee)
+        var_map_insert(&decoder.slots, inst->assignee);
+      for (uint32_t o = 0; o < inst->num_operands; o++)
+        add_local(&decoder, &inst->operands[o]);
+    }
+  }
+  decoder.scratch = decoder.slots.count;
+  decoder.phi_temporaries = decoder.scratch + 2;
+  decoder.arguments = decoder.phi_temporaries + max_phis;
+
+  char *name = intern(entry->tag);
+  program->functions[var_map_lookup(&program->function_ids, name)] = (BytecodeFunction){
+    .name = name,
+    .code = program->num_code,
+    .num_params = num_params,
+    .num_slots = decoder.arguments + max_args,
+  };
+  program->num_functions++;
+
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    decoder.block_code[block->index] = program->num_code;
+    Instruction *last = NULL;
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      last = block->instructions.data[i];
+      emit_instruction(&decoder, block, last);
+    }
+
+    // Blocks that don't end in a terminator go on to their only successor,
+    // and the last block of a function without a `return` returns nothing
+    if (!last || !is_terminator(last)) {
+      if (block->successors.size == 1)
+        emit_jump(&decoder, block, block->successors.data[0]);
+      else
+        emit(&decoder, BC_RET_ZERO, 0, 0, 0);
+    }
+  }
+
+  for (size_t f = 0; f < decoder.num_fixups; f++) {
+    Fixup *fixup = &decoder.fixups[f];
+    int32_t *field = (int32_t *)((char *)&program->code[fixup->code] + fixup->field);
+    *field = decoder.block_code[*field];
+  }
+
+  free(decoder.fixups);
+  free(decoder.block_code);
+  var_map_free(&decoder.slots);
+}
+
+void compile_bytecode(ControlFlowGraph *graph, BytecodeProgram *program)
+{
+  memset(program, 0, sizeof(*program));
+  var_map_init(&program->function_ids);
+  var_map_init(&program->global_ids);
+
+  // Functions are numbered before any is decoded, in the order they are
+  // decoded in, so that calls can refer to the ones that follow
+  for (BasicBlock *block = graph->blocks; block; block = function_end(block)) {
+    if (is_function_entry(block) || block == graph->entry)
+      var_map_insert(&program->function_ids, intern(block->tag));
+  }
+  program->functions = calloc(program->function_ids.count + 1, sizeof(BytecodeFunction));
+
+  for (BasicBlock *block = graph->blocks; block; ) {
+    BasicBlock *end = function_end(block);
+    if (is_function_entry(block) || block == graph->entry)
+      decode_function(program, block, end);
+    block = end;
+  }
+  program->globals = calloc(program->global_ids.count + 1, sizeof(int64_t));
+}
+
+void free_bytecode(BytecodeProgram *program)
+{
+  free(program->code);
+  free(program->functions);
+  free(program->arguments);
+  free(program->constants);
+  free(program->globals);
+  var_map_free(&program->function_ids);
+  var_map_free(&program->global_ids);
+  memset(program, 0, sizeof(*program));
+}
+
+/* Execution */
+
+// Labels as values let every handler jump straight to the next one, which
+// predicts much better than one shared `switch`
+#if defined(__GNUC__)
+#define THREADED_DISPATCH
+#endif
+
+static bool can_divide(int64_t dividend, int64_t divisor)
+{
+  return divisor != 0 && !(dividend == INT64_MIN && divisor == -1);
+}
+
+// Arithmetic wraps around, as it does in machine registers
+#define WRAP(a, op, b) ((int64_t)((uint64_t)(a) op (uint64_t)(b)))
+
+// Where a call returns to
+typedef struct
+{
+  const Bytecode *ip;         // The call
+  size_t base;                // Of the caller's frame
+  int function;               // The caller
+} CallRecord;
+
+static InterpResult execute(BytecodeProgram *program, int function, const int64_t *args,
+    uint32_t num_args, InterpLimits limits, bool profile)
+{
+  const Bytecode *code = program->code;
+  const Bytecode *ip = code + program->functions[function].code;
+  int64_t *globals = program->globals;
+  uint64_t num_globals = program->global_ids.count;
+  InterpResult result = { .status = INTERP_OK };
+
+  // Frames are laid out one after the other, the callee's right after the
+  // end of its caller's
+  size_t stack_size = 256;
+  while (stack_size < program->functions[function].num_slots)
+    stack_size *= 2;
+  int64_t *stack = calloc(stack_size, sizeof(int64_t));
+  size_t base = 0, top = program->functions[function].num_slots;
+  int64_t *frame = stack;
+  for (uint32_t i = 0; i < num_args && i < program->functions[function].num_params; i++)
+    frame[i] = args[i];
+
+  CallRecord *calls = NULL;
+  uint32_t depth = 0, calls_capacity = 0;
+  uint64_t steps = 0;
+  int64_t returned = 0;
+
+#define D frame[ip->d]
+#define A frame[ip->a]
+#define B frame[ip->b]
+#define IMM ((int64_t)ip->b)
+#define NEXT() do { ip++; DISPATCH(); } while (0)
+#define TRAP(why) do { result.status = why; goto done; } while (0)
+
+#ifdef THREADED_DISPATCH
+  static void *const handlers[] = {
+#define X(name, num_fields) [BC_##name] = &&op_##name,
+    BYTECODE_OPS(X)
+#undef X
+  };
+  // The profiler and the step limit count each instruction on its way to
+  // the real handler
+  static void *const counters[] = { [0 ... NUM_BYTECODE_OPS - 1] = &&count };
+  void *const *table = profile || limits.max_steps ? counters : handlers;
+#define CASE(name) op_##name:
+#define DISPATCH() goto *table[ip->op]
+
+  DISPATCH();
+count:
+  if (profile) {
+    program->op_counts[ip->op]++;
+    program->functions[function].executed++;
+  }
+  if (limits.max_steps && ++steps > limits.max_steps)
+    TRAP(INTERP_STEP_LIMIT);
+  goto *handlers[ip->op];
+#else
+#define CASE(name) case BC_##name:
+#define DISPATCH() goto dispatch
+
+dispatch:
+  if (profile) {
+    program->op_counts[ip->op]++;
+    program->functions[function].executed++;
+  }
+  if (limits.max_steps && ++steps > limits.max_steps)
+    TRAP(INTERP_STEP_LIMIT);
+  switch (ip->op) {
+#endif
+
+  CASE(MOVE) D = A; NEXT();
+  CASE(LOAD_IMM) D = ip->a; NEXT();
+  CASE(LOAD_CONST) D = program->constants[ip->a]; NEXT();
+  CASE(LOAD_GLOBAL) D = globals[ip->a]; NEXT();
+  CASE(STORE_GLOBAL) globals[ip->d] = A; NEXT();
+  CASE(ADDR_GLOBAL) D = (int64_t)(uintptr_t)&globals[ip->a]; NEXT();
+  CASE(DEREF) {
+    uint64_t offset = (uint64_t)A - (uint64_t)(uintptr_t)globals;
+    if (offset % sizeof(int64_t) || offset / sizeof(int64_t) >= num_globals)
+      TRAP(INTERP_BAD_ADDRESS);
+    D = globals[offset / sizeof(int64_t)];
+    NEXT();
+  }
+  CASE(NEG) D = WRAP(0, -, A); NEXT();
+  CASE(NOT) D = A == 0; NEXT();
+  CASE(ADD) D = WRAP(A, +, B); NEXT();
+  CASE(SUB) D = WRAP(A, -, B); NEXT();
+  CASE(MUL) D = WRAP(A, *, B); NEXT();
+  CASE(DIV) {
+    if (!can_divide(A, B))
+      TRAP(INTERP_DIVIDE_ERROR);
+    D = A / B;
+    NEXT();
+  }
+  CASE(EQ) D = A == B; NEXT();
+  CASE(NE) D = A != B; NEXT();
+  CASE(LT) D = A < B; NEXT();
+  CASE(GT) D = A > B; NEXT();
+  CASE(LE) D = A <= B; NEXT();
+  CASE(GE) D = A >= B; NEXT();
+  CASE(ADD_IMM) D = WRAP(A, +, IMM); NEXT();
+  CASE(SUB_IMM) D = WRAP(A, -, IMM); NEXT();
+  CASE(MUL_IMM) D = WRAP(A, *, IMM); NEXT();
+  CASE(DIV_IMM) {
+    if (!can_divide(A, IMM))
+      TRAP(INTERP_DIVIDE_ERROR);
+    D = A / IMM;
+    NEXT();
+  }
+  CASE(EQ_IMM) D = A == IMM; NEXT();
+  CASE(NE_IMM) D = A != IMM; NEXT();
+  CASE(LT_IMM) D = A < IMM; NEXT();
+  CASE(GT_IMM) D = A > IMM; NEXT();
+  CASE(LE_IMM) D = A <= IMM; NEXT();
+  CASE(GE_IMM) D = A >= IMM; NEXT();
+  CASE(CALL) {
+    if (ip->a < 0)
+      TRAP(INTERP_UNKNOWN_FUNCTION);
+    if (depth == limits.max_depth)
+      TRAP(INTERP_RECURSION_LIMIT);
+    BytecodeFunction *callee = &program->functions[ip->a];
+    if (top + callee->num_slots > stack_size) {
+      while (top + callee->num_slots > stack_size)
+        stack_size *= 2;
+      stack = realloc(stack, stack_size * sizeof(int64_t));
+      frame = stack + base;
+    }
+    if (depth == calls_capacity) {
+      calls_capacity = calls_capacity ? calls_capacity * 2 : 64;
+      calls = realloc(calls, calls_capacity * sizeof(CallRecord));
+    }
+    calls[depth++] = (CallRecord){ .ip = ip, .base = base, .function = function };
+
+    int64_t *callee_frame = stack + top;
+    memset(callee_frame, 0, callee->num_slots * sizeof(int64_t));
+    const int32_t *arguments = program->arguments + ip->b;
+    for (int32_t i = 0; i < arguments[0] && (uint32_t)i < callee->num_params; i++)
+      callee_frame[i] = frame[arguments[1 + i]];
+
+    function = ip->a;
+    base = top;
+    top += callee->num_slots;
+    frame = callee_frame;
+    ip = code + callee->code;
+    DISPATCH();
+  }
+  CASE(JMP) ip = code + ip->d; DISPATCH();
+  CASE(BR) ip = code + (D ? ip->a : ip->b); DISPATCH();
+  CASE(RET) returned = D; goto ret;
+  CASE(RET_ZERO) returned = 0; goto ret;
+
+#ifndef THREADED_DISPATCH
+  }
+#endif
+
+ret:
+  if (!depth) {
+    result.value = returned;
+    goto done;
+  }
+  CallRecord *call = &calls[--depth];
+  top = base;
+  base = call->base;
+  function = call->function;
+  frame = stack + base;
+  ip = call->ip;
+  if (ip->d >= 0)
+    D = returned;
+  NEXT();
+
+#undef D
+#undef A
+#undef B
+#undef IMM
+#undef NEXT
+#undef TRAP
+#undef CASE
+#undef DISPATCH
+
+done:
+  result.function = program->functions[function].name;
+  free(calls);
+  free(stack);
+  return result;
+}
+
+static const InterpLimits default_limits = { .max_depth = INTERP_MAX_DEPTH };
+
+InterpResult interpret(BytecodeProgram *program, bool profile)
+{
+  memset(program->globals, 0, program->global_ids.count * sizeof(int64_t));
+  int entry = var_map_lookup(&program->function_ids, intern("main"));
+  if (entry < 0)
+    return (InterpResult){ .status = INTERP_NO_MAIN };
+
+  // Globals are initialized before `main` runs, like `_start` does
+  int initializers = var_map_lookup(&program->function_ids, intern("$entry"));
+  if (initializers >= 0) {
+    InterpResult result = execute(program, initializers, NULL, 0, default_limits, profile);
+    if (result.status != INTERP_OK)
+      return result;
+  }
+  return execute(program, entry, NULL, 0, default_limits, profile);
+}
+
+InterpResult interpret_cfg(ControlFlowGraph *graph)
+{
+  BytecodeProgram program;
+  compile_bytecode(graph, &program);
+  InterpResult result = interpret(&program, false);
+  free_bytecode(&program);
+  return result;
+}
+
+InterpResult interp_call(BytecodeProgram *program, const char *name, const int64_t *args,
+    uint32_t num_args, InterpLimits limits)
+{
+  int function = var_map_lookup(&program->function_ids, intern(name));
+  if (function < 0)
+    return (InterpResult){ .status = INTERP_UNKNOWN_FUNCTION, .function = name };
+  return execute(program, function, args, num_args, limits, false);
+}
+
+bool interp_global(BytecodeProgram *program, const char *name, int64_t *value)
+{
+  int g = var_map_lookup(&program->global_ids, intern(name));
+  if (g < 0)
+    return false;
+  *value = program->globals[g];
+  return true;
+}
+
+const char *interp_status_message(InterpStatus status)
+{
+  switch (status) {
+    case INTERP_OK: return "returned";
+    case INTERP_NO_MAIN: return "has no `main` function";
+    case INTERP_DIVIDE_ERROR: return "divided by zero or overflowed a division";
+    case INTERP_BAD_ADDRESS: return "dereferenced an address that isn't a global";
+    case INTERP_UNKNOWN_FUNCTION: return "called a function outside of the program";
+    case INTERP_STEP_LIMIT: return "ran for too many steps";
+    case INTERP_RECURSION_LIMIT: return "nested calls too deeply";
+  }
+  return "stopped";
+}
+
+// Programs that stop early agree as long as they stop for the same reason
+bool same_interp_result(InterpResult a, InterpResult b)
+{
+  return a.status == b.status && (a.status != INTERP_OK || a.value == b.value);
+}
+
+/* Dumps */
+
+void dump_bytecode(BytecodeProgram *program)
+{
+  for (int f = 0; f < program->num_functions; f++) {
+    BytecodeFunction *fn = &program->functions[f];
+    size_t end = f + 1 < program->num_functions ? program->functions[f + 1].code : program->num_code;
+    printf("[Bytecode %s] (%u params, %u slots)\n", fn->name, fn->num_params, fn->num_slots);
+    for (size_t i = fn->code; i < end; i++) {
+      Bytecode *code = &program->code[i];
+      printf("%6zu  %-13s", i, op_names[code->op]);
+      int32_t fields[] = { code->d, code->a, code->b };
+      for (int k = 0; k < op_fields[code->op]; k++)
+        printf("%s%d", k ? ", " : " ", fields[k]);
+      printf("\n");
+    }
+  }
+}
+
+static int compare_counts(const void *a, const void *b)
+{
+  uint64_t x = **(const uint64_t **)a, y = **(const uint64_t **)b;
+  return (x < y) - (x > y);
+}
+
+void dump_interp_profile(BytecodeProgram *program)
+{
+  uint64_t total = 0;
+  const uint64_t *ops[NUM_BYTECODE_OPS];
+  for (int op = 0; op < NUM_BYTECODE_OPS; op++) {
+    total += program->op_counts[op];
+    ops[op] = &program->op_counts[op];
+  }
+  qsort(ops, NUM_BYTECODE_OPS, sizeof(ops[0]), compare_counts);
+
+  fprintf(stderr, "%-14s %14s %8s\n", "opcode", "executed", "share");
+  for (int i = 0; i < NUM_BYTECODE_OPS && *ops[i]; i++) {
+    fprintf(stderr, "%-14s %14lu %7.2f%%\n", op_names[ops[i] - program->op_counts],
+        (unsigned long)*ops[i], 100.0 * *ops[i] / total);
+  }
+
+  fprintf(stderr, "%-14s %14s %8s\n", "function", "executed", "share");
+  for (int f = 0; f < program->num_functions; f++) {
+    BytecodeFunction *fn = &program->functions[f];
+    if (fn->executed)
+      fprintf(stderr, "%-14s %14lu %7.2f%%\n", fn->name, (unsigned long)fn->executed,
+          100.0 * fn->executed / total);
+  }
+}
@@ -0,0 +1,167 @@
+#ifndef MINI_INTERP_H
+#define MINI_INTERP_H
+
+#include "cfa.h"
+#include "varmap.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* IR Interpreter
+ *
+ * Runs a program straight from its IR, in or out of SSA form, to check what
+ * the optimizer and the backend make of it and to run it without either.
+ * `compile_bytecode()` first decodes the graph into a compact register
+ * bytecode: every local of a function gets a slot in a flat frame, operands
+ * are slots, globals are only touched by loads and stores, and literals
+ * that fit in 32 bits are immediates of the instruction that uses them.
+ * Phis become copies on the edges into their block, through temporaries so
+ * that they all read their operands before any is written.
+ *
+ * `interpret()` runs the initializers of globals and then `main`. Divisions
+ * that would trap on x86-64 stop the program instead, as do loads from
+ * addresses that aren't globals and calls to functions that aren't part of
+ * the program. Calls don't recurse in C: frames live on a stack of their
+ * own, with a record per call of where to return to, so the depth of calls
+ * is a limit of the interpreter rather than of the compiler's stack. With
+ * `profile` set it also counts the instructions executed per opcode and
+ * per function.
+ *
+ * `interp_call()` runs any one function, and is what the optimizer uses to
+ * evaluate calls at compile time, with limits on the instructions executed
+ * and on the depth of calls so that it always comes back.
+ */
+
+//     name            fields
+#define BYTECODE_OPS(X) \
+  X(MOVE,           2)      /* d = a */                      \
+  X(LOAD_IMM,       2)      /* d = a, an immediate */        \
+  X(LOAD_CONST,     2)      /* d = constants[a] */           \
+  X(LOAD_GLOBAL,    2)      /* d = globals[a] */             \
+  X(STORE_GLOBAL,   2)      /* globals[d] = a */             \
+  X(ADDR_GLOBAL,    2)      /* d = &globals[a] */            \
+  X(DEREF,          2)      /* d = *a */                     \
+  X(NEG,            2)      /* d = -a */                     \
+  X(NOT,            2)      /* d = a == 0 */                 \
+  X(ADD,            3)      /* d = a + b */                  \
+  X(SUB,            3)                                       \
+  X(MUL,            3)                                       \
+  X(DIV,            3)                                       \
+  X(EQ,             3)      /* d = a == b */                 \
+  X(NE,             3)                                       \
+  X(LT,             3)                                       \
+  X(GT,             3)                                       \
+  X(LE,             3)                                       \
+  X(GE,             3)                                       \
+  X(ADD_IMM,        3)      /* d = a + b, an immediate */    \
+  X(SUB_IMM,        3)                                       \
+  X(MUL_IMM,        3)                                       \
+  X(DIV_IMM,        3)                                       \
+  X(EQ_IMM,         3)                                       \
+  X(NE_IMM,         3)                                       \
+  X(LT_IMM,         3)                                       \
+  X(GT_IMM,         3)                                       \
+  X(LE_IMM,         3)                                       \
+  X(GE_IMM,         3)                                       \
+  X(CALL,           3)      /* d = functions[a](args[b]) */  \
+  X(JMP,            1)      /* To code[d] */                 \
+  X(BR,             3)      /* code[a] if d, else code[b] */ \
+  X(RET,            1)      /* Returns d */                  \
+  X(RET_ZERO,       0)
+
+typedef enum
+{
+#define X(name, num_fields) BC_##name,
+  BYTECODE_OPS(X)
+#undef X
+  NUM_BYTECODE_OPS,
+} BytecodeOp;
+
+// Fields are slots of the frame of the function unless the opcode says
+// otherwise, and jump targets index the code of the whole program. Calls
+// whose result isn't used have a `d` of -1, and calls to functions outside
+// of the program an `a` of -1.
+typedef struct
+{
+  uint16_t op;
+  int32_t d;
+  int32_t a;
+  int32_t b;
+} Bytecode;
+
+typedef struct
+{
+  char *name;               // Interned, `$entry` for the initializers of globals
+  uint32_t code;            // Index of the first instruction
+  uint32_t num_params;      // In the first slots
+  uint32_t num_slots;
+  uint64_t executed;        // Instructions, when profiling
+} BytecodeFunction;
+
+typedef struct
+{
+  Bytecode *code;
+  size_t num_code;
+  size_t code_capacity;
+  BytecodeFunction *functions;
+  int num_functions;
+  VarMap function_ids;
+  int32_t *arguments;       // Per call, the number of arguments and their slots
+  size_t num_arguments;
+  size_t arguments_capacity;
+  int64_t *constants;       // Literals that don't fit in 32 bits
+  size_t num_constants;
+  size_t constants_capacity;
+  VarMap global_ids;
+  int64_t *globals;
+  uint64_t op_counts[NUM_BYTECODE_OPS];
+} BytecodeProgram;
+
+typedef enum
+{
+  INTERP_OK,
+  INTERP_NO_MAIN,
+  INTERP_DIVIDE_ERROR,      // By zero, or INT64_MIN by -1
+  INTERP_BAD_ADDRESS,
+  INTERP_UNKNOWN_FUNCTION,
+  INTERP_STEP_LIMIT,
+  INTERP_RECURSION_LIMIT,
+} InterpStatus;
+
+// The default depth is deeper than most programs get on a native stack
+#define INTERP_MAX_DEPTH 100000
+
+typedef struct
+{
+  uint64_t max_steps;       // Instructions executed, or 0 for no limit
+  uint32_t max_depth;       // Calls in progress
+} InterpLimits;
+
+typedef struct
+{
+  InterpStatus status;
+  int64_t value;            // What `main` or the function called returned
+  const char *function;     // Where the program stopped, if it didn't return
+} InterpResult;
+
+void compile_bytecode(ControlFlowGraph *graph, BytecodeProgram *program);
+void free_bytecode(BytecodeProgram *program);
+
+InterpResult interpret(BytecodeProgram *program, bool profile);
+// Compiles the graph, runs it once and frees the bytecode again
+InterpResult interpret_cfg(ControlFlowGraph *graph);
+
+// Runs the function `name` on `args`, leaving the globals as they are
+InterpResult interp_call(BytecodeProgram *program, const char *name, const int64_t *args,
+    uint32_t num_args, InterpLimits limits);
+// Reads a global that the program refers to, returning false if it doesn't
+bool interp_global(BytecodeProgram *program, const char *name, int64_t *value);
+
+const char *interp_status_message(InterpStatus status);
+bool same_interp_result(InterpResult a, InterpResult b);
+
+void dump_bytecode(BytecodeProgram *program);
+void dump_interp_profile(BytecodeProgram *program);
+
+#endif
@@ -0,0 +1,437 @@
+#include "ipcp.h"
+#include "callgraph.h"
+#include "compile.h"
+#include "intern.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+  int f;                      // The function specialized
+  Instruction *call;          // The first call that passes the literals
+  int num_calls;
+  char *clone;                // Or NULL while not cloned
+} Specialization;
+
+typedef struct
+{
+  ControlFlowGraph *graph;
+  CallGraph calls;
+  VarMap keys;                // Callee and literals, per specialization
+  Specialization *specializations;
+  size_t num_specializations;
+  size_t capacity;
+  Vector candidates;          // Calls with a specialization
+  Instruction **sites;        // Calls of functions in the graph, by callee
+  int *first_site;            // Per function, and one past the last
+  bool *used;                 // Per parameter, whether its function uses it
+  int *first_param;           // Per function, in `used`
+} Specializer;
+
+static Instruction *function_def(CallGraphNode *node)
+{
+  return node->entry->instructions.data[0];
+}
+
+// Only literals the backend can place in an instruction are propagated
+static bool is_constant_argument(Operand *arg)
+{
+  return arg->kind == OPERAND_LITERAL && arg->literal.kind != VAL_STRING;
+}
+
+static bool same_constant(Value a, Value b)
+{
+  return a.kind == b.kind && a.u_val == b.u_val;
+}
+
+// Marks the parameters each function uses, in one walk over its blocks
+static void find_used_parameters(Specializer *sp)
+{
+  CallGraph *calls = &sp->calls;
+  sp->first_param = malloc((calls->num_nodes + 1) * sizeof(int));
+  int num_params = 0;
+  for (int f = 0; f < calls->num_nodes; f++) {
+    sp->first_param[f] = num_params;
+    num_params += function_def(&calls->nodes[f])->num_operands - 1;
+  }
+  sp->first_param[calls->num_nodes] = num_params;
+  sp->used = calloc(num_params + 1, sizeof(bool));
+
+  for (int f = 0; f < calls->num_nodes; f++) {
+    CallGraphNode *node = &calls->nodes[f];
+    Instruction *def = function_def(node);
+    bool *used = &sp->used[sp->first_param[f]];
+    BasicBlock *end = function_end(node->entry);
+    for (BasicBlock *block = node->entry; block != end; block = block->next) {
+      for (size_t i = block == node->entry; i < block->instructions.size; i++) {
+        Instruction *inst = block->instructions.data[i];
+        for (uint32_t o = 0; o < inst->num_operands; o++) {
+          if (inst->operands[o].kind != OPERAND_VARIABLE)
+            continue;
+          for (uint32_t p = 1; p < def->num_operands; p++) {
+            if (inst->operands[o].var == def->operands[p].var)
+              used[p - 1] = true;
+          }
+        }
+      }
+    }
+  }
+}
+
+static bool is_used(Specializer *sp, int f, uint32_t param)
+{
+  return sp->used[sp->first_param[f] + param];
+}
+
+// Groups the calls of every function in the graph by callee, in one walk
+// over the program. Within functions, the callee is that of the edge of
+// the call graph for the call, as the edges follow the calls in order.
+static void find_call_sites(Specializer *sp)
+{
+  CallGraph *calls = &sp->calls;
+  sp->first_site = calloc(calls->num_nodes + 2, sizeof(int));
+  int *next_site = NULL;
+  for (int pass = 0; pass < 2; pass++) {
+    int f = -1, e = 0;
+    for (BasicBlock *block = sp->graph->blocks; block; block = block->next) {
+      if (is_function_entry(block))
+        e = calls->nodes[++f].first_callee;
+      for (size_t i = 0; i < block->instructions.size; i++) {
+        Instruction *inst = block->instructions.data[i];
+        if (inst->opcode != OP_CALL)
+          continue;
+        int callee = f >= 0 ? calls->callees[e++] : call_graph_callee(calls, inst);
+        if (callee < 0)
+          continue;
+        if (pass)
+          sp->sites[next_site[callee]++] = inst;
+        else
+          sp->first_site[callee + 1]++;
+      }
+    }
+    if (!pass) {
+      for (int g = 0; g < calls->num_nodes; g++)
+        sp->first_site[g + 1] += sp->first_site[g];
+      sp->sites = malloc((sp->first_site[calls->num_nodes] + 1) * sizeof(Instruction *));
+      next_site = malloc((calls->num_nodes + 1) * sizeof(int));
+      memcpy(next_site, sp->first_site, calls->num_nodes * sizeof(int));
+    }
+  }
+  free(next_site);
+}
+
+/* Propagation */
+
+// Functions of a module may be called from outside of it, and a graph
+// without `main` holds only part of the program
+static bool has_all_callers(ControlFlowGraph *graph)
+{
+  if (ctx && ctx->is_module)
+    return false;
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    if (is_function_entry(block) && strcmp(block->tag, "main") == 0)
+      return true;
+  }
+  return false;
+}
+
+// Finds the literal every call of function `f` passes for each parameter,
+// or marks the parameter varying. Returns the number of calls.
+static int collect_arguments(Specializer *sp, int f, Operand *args, bool *varying,
+    uint32_t num_params)
+{
+  int num_calls = 0;
+  for (int s = sp->first_site[f]; s < sp->first_site[f + 1]; s++) {
+    Instruction *inst = sp->sites[s];
+    for (uint32_t p = 0; p < num_params && p + 1 < inst->num_operands; p++) {
+      Operand *arg = &inst->operands[p + 1];
+      if (!is_constant_argument(arg))
+        varying[p] = true;
+      else if (!num_calls)
+        args[p] = *arg;
+      else if (!same_constant(args[p].literal, arg->literal))
+        varying[p] = true;
+    }
+    num_calls++;
+  }
+  return num_calls;
+}
+
+static void replace_parameter(CallGraphNode *node, char *param, Operand value)
+{
+  BasicBlock *end = function_end(node->entry);
+  for (BasicBlock *block = node->entry; block != end; block = block->next) {
+    for (size_t i = block == node->entry; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      for (uint32_t o = 0; o < inst->num_operands; o++) {
+        if (inst->operands[o].kind == OPERAND_VARIABLE && inst->operands[o].var == param)
+          inst->operands[o] = value;
+      }
+    }
+  }
+}
+
+static void propagate_arguments(Specializer *sp)
+{
+  if (!has_all_callers(sp->graph))
+    return;
+
+  find_call_sites(sp);
+  for (int i = sp->calls.num_nodes - 1; i >= 0; i--) {
+    CallGraphNode *node = &sp->calls.nodes[sp->calls.order[i]];
+    Instruction *def = function_def(node);
+    uint32_t num_params = def->num_operands - 1;
+    if (!num_params || strcmp(node->name, "main") == 0)
+      continue;
+
+    int f = sp->calls.order[i];
+    Operand *args = malloc(num_params * sizeof(Operand));
+    bool *varying = calloc(num_params, sizeof(bool));
+    if (collect_arguments(sp, f, args, varying, num_params)) {
+      for (uint32_t p = 0; p < num_params; p++) {
+        char *param = def->operands[p + 1].var;
+        if (varying[p] || !is_used(sp, f, p))
+          continue;
+        LOG_INFO("every call of `%s` passes a constant as `%s`", node->name, param);
+        replace_parameter(node, param, args[p]);
+        sp->used[sp->first_param[f] + p] = false;
+      }
+    }
+    free(varying);
+    free(args);
+  }
+}
+
+/* Specialization */
+
+// Parameters are specialized when they are given a literal and used
+static uint32_t specialized_parameters(Specializer *sp, int f, Instruction *call,
+    bool *specialized)
+{
+  CallGraphNode *node = &sp->calls.nodes[f];
+  Instruction *def = function_def(node);
+  uint32_t count = 0;
+  for (uint32_t o = 1; o < call->num_operands; o++) {
+    Operand *arg = &call->operands[o];
+    specialized[o] = o < def->num_operands && is_constant_argument(arg) && is_used(sp, f, o - 1);
+    count += specialized[o];
+  }
+  return count;
+}
+
+static char *specialization_key(CallGraphNode *node, Instruction *call, bool *specialized)
+{
+  char *key = aprintf("%s", node->name);
+  for (uint32_t o = 1; o < call->num_operands; o++) {
+    if (!specialized[o])
+      continue;
+    Value *literal = &call->operands[o].literal;
+    char *longer = aprintf("%s,%u=%d:%ju", key, o, literal->kind, literal->u_val);
+    free(key);
+    key = longer;
+  }
+  char *interned = intern(key);
+  free(key);
+  return interned;
+}
+
+// Returns the key of the specialization a call could use, or NULL, with
+// the function it calls and the parameters it specializes
+static char *call_key(Specializer *sp, Instruction *call, int *f, bool *specialized)
+{
+  *f = call_graph_callee(&sp->calls, call);
+  if (*f < 0 || (sp->calls.nodes[*f].attributes & FN_NORETURN))
+    return NULL;
+  if (!specialized_parameters(sp, *f, call, specialized))
+    return NULL;
+  return specialization_key(&sp->calls.nodes[*f], call, specialized);
+}
+
+static void add_candidate(Specializer *sp, Instruction *call)
+{
+  int f;
+  bool *specialized = calloc(call->num_operands, sizeof(bool));
+  char *key = call_key(sp, call, &f, specialized);
+  free(specialized);
+  if (!key)
+    return;
+
+  int id = var_map_lookup(&sp->keys, key);
+  if (id < 0) {
+    if (sp->num_specializations == sp->capacity) {
+      sp->capacity = sp->capacity ? sp->capacity * 2 : 16;
+      sp->specializations = realloc(sp->specializations,
+          sp->capacity * sizeof(Specialization));
+    }
+    id = var_map_insert(&sp->keys, key);
+    sp->specializations[id] = (Specialization){ .f = f, .call = call };
+    sp->num_specializations++;
+  }
+  sp->specializations[id].num_calls++;
+  vector_push_back(&sp->candidates, call);
+}
+
+// The clone is declared like the function it copies, so that its results
+// keep their type
+static void declare_clone(char *name, char *original)
+{
+  Symbol *function = ctx ? symbol_table_lookup(ctx->global_scope, original) : NULL;
+  Symbol *symbol = NULL;
+  if (function)
+    symbol = symbol_table_insert(ctx->global_scope, name, SYMBOL_FUNCTION);
+  if (symbol)
+    symbol->type = function->type;
+}
+
+// Copies function `f` after its last block, with the specialized parameters
+// assigned their literals on entry instead of being passed
+static char *clone_function(Specializer *sp, int f, Instruction *call, bool *specialized)
+{
+  BasicBlock *entry = sp->calls.nodes[f].entry;
+  BasicBlock *end = function_end(entry);
+  BasicBlock *last = entry;
+  while (last->next != end)
+    last = last->next;
+  int num_blocks = 0;
+  BasicBlock **copies = copy_function_blocks(sp->graph, entry, last, &num_blocks);
+
+  char *tag = aprintf("%s.spec.%d", entry->tag, copies[0]->id);
+  char *name = intern(tag);
+  free(tag);
+  // Jumps back to the entry follow it to its new name
+  for (int b = 0; b < num_blocks; b++) {
+    Vector *code = &copies[b]->instructions;
+    Instruction *terminator = code->data[code->size - 1];
+    for (uint32_t o = 0; is_terminator(terminator) && o < terminator->num_operands; o++) {
+      Operand *operand = &terminator->operands[o];
+      if (operand->kind == OPERAND_LABEL && operand->label == copies[0]->tag)
+        operand->label = name;
+    }
+  }
+  copies[0]->tag = name;
+
+  Vector instructions = copies[0]->instructions;
+  vector_init(&copies[0]->instructions, sizeof(Instruction *));
+  Instruction *def = instructions.data[0];
+  def->operands[0].label = name;
+  vector_push_back(&copies[0]->instructions, def);
+  uint32_t num_params = 1;
+  for (uint32_t o = 1; o < def->num_operands; o++) {
+    if (o >= call->num_operands || !specialized[o]) {
+      def->operands[num_params++] = def->operands[o];
+      continue;
+    }
+    Instruction *assign = make_instruction(OP_ASSIGN);
+    assign->assignee = def->operands[o].var;
+    *push_operand(assign) = call->operands[o];
+    vector_push_back(&copies[0]->instructions, assign);
+  }
+  def->num_operands = num_params;
+  for (size_t i = 1; i < instructions.size; i++)
+    vector_push_back(&copies[0]->instructions, instructions.data[i]);
+  vector_free(&instructions);
+
+  declare_clone(name, entry->tag);
+  free(copies);
+  return name;
+}
+
+static void clone_specialization(Specializer *sp, Specialization *spec, int *budget)
+{
+  CallGraphNode *node = &sp->calls.nodes[spec->f];
+  int size = function_size(node->entry);
+  if (size > *budget) {
+    LOG_INFO("not specializing `%s` for %d calls, as the program would grow past its budget",
+        node->name, spec->num_calls);
+    return;
+  }
+  *budget -= size;
+  bool *specialized = calloc(spec->call->num_operands, sizeof(bool));
+  specialized_parameters(sp, spec->f, spec->call, specialized);
+  spec->clone = clone_function(sp, spec->f, spec->call, specialized);
+  LOG_INFO("specializing `%s` as `%s` for %d calls (size %d)", node->name, spec->clone,
+      spec->num_calls, size);
+  free(specialized);
+}
+
+static void redirect_call(Specializer *sp, Instruction *call)
+{
+  int f;
+  bool *specialized = calloc(call->num_operands, sizeof(bool));
+  char *key = call_key(sp, call, &f, specialized);
+  int id = key ? var_map_lookup(&sp->keys, key) : -1;
+  char *clone = id >= 0 ? sp->specializations[id].clone : NULL;
+  if (clone) {
+    uint32_t num_operands = 1;
+    for (uint32_t o = 1; o < call->num_operands; o++) {
+      if (!specialized[o])
+        call->operands[num_operands++] = call->operands[o];
+    }
+    call->num_operands = num_operands;
+    call->operands[0].label = clone;
+  }
+  free(specialized);
+}
+
+static int compare_calls(const void *a, const void *b)
+{
+  const Specialization *x = *(const Specialization **)a, *y = *(const Specialization **)b;
+  if (x->num_calls != y->num_calls)
+    return y->num_calls - x->num_calls;
+  return x < y ? -1 : x > y;
+}
+
+// Without profiles, every call is taken to be as hot as any other, so the
+// clones shared by the most calls are made first
+static void specialize_calls(Specializer *sp)
+{
+  int size = 0;
+  for (BasicBlock *block = sp->graph->blocks; block; block = block->next) {
+    size += block->instructions.size;
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      if (inst->opcode == OP_CALL)
+        add_candidate(sp, inst);
+    }
+  }
+
+  int budget = size * SPECIALIZE_MAX_GROWTH / 100;
+  if (budget < SPECIALIZE_MIN_GROWTH)
+    budget = SPECIALIZE_MIN_GROWTH;
+  size_t n = sp->num_specializations;
+  Specialization **order = malloc((n + 1) * sizeof(Specialization *));
+  for (size_t i = 0; i < n; i++)
+    order[i] = &sp->specializations[i];
+  qsort(order, n, sizeof(Specialization *), compare_calls);
+  for (size_t i = 0; i < n; i++)
+    clone_specialization(sp, order[i], &budget);
+  free(order);
+
+  for (size_t i = 0; i < sp->candidates.size; i++)
+    redirect_call(sp, sp->candidates.data[i]);
+}
+
+/* Pass */
+
+void specialize_functions(ControlFlowGraph *graph)
+{
+  Specializer sp = { .graph = graph };
+  build_call_graph(graph, &sp.calls);
+  var_map_init(&sp.keys);
+  vector_init(&sp.candidates, sizeof(Instruction *));
+  find_used_parameters(&sp);
+
+  propagate_arguments(&sp);
+  specialize_calls(&sp);
+
+  free(sp.first_param);
+  free(sp.used);
+  free(sp.first_site);
+  free(sp.sites);
+  vector_free(&sp.candidates);
+  free(sp.specializations);
+  var_map_free(&sp.keys);
+  free_call_graph(&sp.calls);
+}
@@ -0,0 +1,29 @@
+#ifndef MINI_IPCP_H
+#define MINI_IPCP_H
+
+#include "cfa.h"
+
+/* Interprocedural Constant Propagation
+ *
+ * `specialize_functions()` carries constant arguments from calls into the
+ * functions they call, in SSA form. Functions are visited top-down on the
+ * call graph, so that constants a caller has just received reach what it
+ * calls in turn. When the graph holds the whole program, a parameter that
+ * every call passes the same literal is replaced by that literal throughout
+ * its function. Modules are left alone, as callers outside them may pass
+ * anything.
+ *
+ * Calls that still pass literals to parameters a function uses, typically
+ * those the inliner found too large, call a clone of the function instead,
+ * named `f.spec.N`, whose parameters take the literals on entry. Calls with
+ * the same callee and literals share a clone. Clones may add this
+ * percentage of the size of the program, or at least SPECIALIZE_MIN_GROWTH
+ * instructions, and every decision is logged as a remark.
+ */
+
+#define SPECIALIZE_MAX_GROWTH 100
+#define SPECIALIZE_MIN_GROWTH 128
+
+void specialize_functions(ControlFlowGraph *graph);
+
+#endif
@@ -0,0 +1,240 @@
+#define _DEFAULT_SOURCE
+#include "jit.h"
+#include "buffer.h"
+#include "util.h"
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t align_up(uint64_t value, uint64_t alignment)
+{
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+/* Loading */
+
+void jit_load(JitImage *image, ElfObject *object)
+{
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t text_size = align_up(object->text.size ? object->text.size : 1, page_size);
+  uint64_t rodata_size = align_up(object->rodata.size, page_size);
+  uint64_t data_offset = text_size + rodata_size;
+  uint64_t bss_offset = data_offset + align_up(object->data.size, 16);
+  image->size = align_up(bss_offset + object->bss_size, page_size);
+  image->object = object;
+
+  // Anonymous memory starts out zeroed, which is all `.bss` needs
+  image->memory = mmap(NULL, image->size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (image->memory == MAP_FAILED)
+    fatal("couldn't map %zu bytes for the program", image->size);
+
+  uint64_t base = (uint64_t)image->memory;
+  image->addresses[ELF_TEXT] = base;
+  image->addresses[ELF_RODATA] = base + text_size;
+  image->addresses[ELF_DATA] = base + data_offset;
+  image->addresses[ELF_BSS] = base + bss_offset;
+  if (object->text.size)
+    memcpy(image->memory, object->text.data, object->text.size);
+  if (object->rodata.size)
+    memcpy(image->memory + text_size, object->rodata.data, object->rodata.size);
+  if (object->data.size)
+    memcpy(image->memory + data_offset, object->data.data, object->data.size);
+  elf_link(object, image->memory, image->addresses);
+
+  if (mprotect(image->memory, text_size, PROT_READ | PROT_EXEC) != 0)
+    fatal("couldn't make the code of the program executable");
+  if (rodata_size && mprotect(image->memory + text_size, rodata_size, PROT_READ) != 0)
+    fatal("couldn't make the constants of the program read-only");
+}
+
+void jit_unload(JitImage *image)
+{
+  if (image->memory)
+    munmap(image->memory, image->size);
+  memset(image, 0, sizeof(*image));
+}
+
+void *jit_function(JitImage *image, const char *name)
+{
+  int id = elf_lookup(image->object, name);
+  if (id < 0 || image->object->symbols[id].section != ELF_TEXT)
+    return NULL;
+  return image->memory + image->object->symbols[id].offset;
+}
+
+typedef int64_t (*EntryPoint)(void);
+
+static EntryPoint entry_point(JitImage *image, const char *entry)
+{
+  void *address = jit_function(image, entry);
+  if (!address)
+    fatal("the program has no function `%s` to run", entry);
+  return (EntryPoint)address;
+}
+
+int64_t jit_run(JitImage *image, const char *entry)
+{
+  return entry_point(image, entry)();
+}
+
+int jit_run_in_child(JitImage *image, const char *entry)
+{
+  // The child must not reach `fatal()`, which could return it to the caller
+  EntryPoint function = entry_point(image, entry);
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid < 0)
+    fatal("couldn't start a process to run the program: %s", strerror(errno));
+  if (pid == 0)
+    _exit(function());
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR)
+      fatal("couldn't wait for the program: %s", strerror(errno));
+  }
+  if (WIFSIGNALED(status)) {
+    fprintf(stderr, "mini: the program was killed by signal %d (%s)\n", WTERMSIG(status),
+        strsignal(WTERMSIG(status)));
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
+
+/* Profiling */
+
+void jit_write_perf_map(JitImage *image)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    LOG_WARN("couldn't write perf map `%s`", path);
+    return;
+  }
+
+  ElfObject *object = image->object;
+  for (int i = 0; i < object->num_symbols; i++) {
+    ElfSymbol *symbol = &object->symbols[i];
+    if (symbol->section == ELF_TEXT && symbol->size)
+      fprintf(file, "%lx %lx %s\n", (unsigned long)(image->addresses[ELF_TEXT] + symbol->offset),
+          (unsigned long)symbol->size, symbol->name);
+  }
+  if (fclose(file) != 0)
+    LOG_WARN("couldn't write perf map `%s`", path);
+}
+
+// The layout that perf's tools/perf/Documentation/jitdump-specification.txt
+// describes, version 1
+#define JITDUMP_MAGIC 0x4a695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+} JitdumpHeader;
+
+typedef struct
+{
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+  // Followed by the NUL-terminated name and the code
+} JitCodeLoad;
+
+// perf records with the monotonic clock when asked to with `-k 1`
+static uint64_t jitdump_timestamp()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void jit_write_jitdump(JitImage *image)
+{
+  const char *directory = getenv("JITDUMPDIR");
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/jit-%d.dump", directory ? directory : ".", (int)getpid());
+
+  uint32_t pid = getpid();
+  Buffer dump;
+  buffer_init(&dump);
+  JitdumpHeader header = {
+    .magic = JITDUMP_MAGIC,
+    .version = JITDUMP_VERSION,
+    .total_size = sizeof(JitdumpHeader),
+    .elf_mach = EM_X86_64,
+    .pid = pid,
+    .timestamp = jitdump_timestamp(),
+  };
+  buffer_append(&dump, &header, sizeof(header));
+
+  ElfObject *object = image->object;
+  uint64_t code_index = 0;
+  for (int i = 0; i < object->num_symbols; i++) {
+    ElfSymbol *symbol = &object->symbols[i];
+    if (symbol->section != ELF_TEXT || !symbol->size)
+      continue;
+    uint64_t address = image->addresses[ELF_TEXT] + symbol->offset;
+    size_t name_size = strlen(symbol->name) + 1;
+    JitCodeLoad record = {
+      .id = JIT_CODE_LOAD,
+      .total_size = sizeof(JitCodeLoad) + name_size + symbol->size,
+      .timestamp = jitdump_timestamp(),
+      .pid = pid,
+      .tid = pid,             // Programs run on the main thread
+      .vma = address,
+      .code_addr = address,
+      .code_size = symbol->size,
+      .code_index = code_index++,
+    };
+    buffer_append(&dump, &record, sizeof(record));
+    buffer_append(&dump, symbol->name, name_size);
+    buffer_append(&dump, (void *)address, symbol->size);
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd >= 0;
+  size_t total = 0;
+  while (ok && total < dump.size) {
+    ssize_t n = write(fd, dump.data + total, dump.size - total);
+    if (n <= 0) ok = false;
+    else total += n;
+  }
+
+  // perf finds the dump through an executable mapping of it in this process
+  if (ok) {
+    void *marker = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    if (marker == MAP_FAILED) ok = false;
+    else munmap(marker, sysconf(_SC_PAGESIZE));
+  }
+  if (fd >= 0 && close(fd) != 0)
+    ok = false;
+  if (!ok)
+    LOG_WARN("couldn't write jitdump `%s`", path);
+  buffer_free(&dump);
+}
@@ -0,0 +1,50 @@
+#ifndef MINI_JIT_H
+#define MINI_JIT_H
+
+#include "elf64.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* In-Process Execution
+ *
+ * Loads the code and data of an ElfObject into the memory of the compiler
+ * and runs it there, without writing any files or starting a linker. `.text`
+ * comes first and `.rodata`, `.data` and `.bss` follow on pages of their
+ * own. The code is copied and its relocations resolved while all pages are
+ * writable, and only then are its pages made executable and read-only, and
+ * those of `.rodata` read-only, so no page is ever writable and executable
+ * at once and constants can't be written.
+ *
+ * For `perf` to name the functions, loading can write a perf map,
+ * `/tmp/perf-PID.map`, which `perf report` reads directly, and a jitdump,
+ * `jit-PID.dump` in `$JITDUMPDIR` or the working directory, which `perf
+ * inject --jit` turns into symbols along with a copy of the code.
+ */
+
+typedef struct
+{
+  uint8_t *memory;
+  size_t size;
+  uint64_t addresses[ELF_NUM_SECTIONS];
+  ElfObject *object;
+} JitImage;
+
+void jit_load(JitImage *image, ElfObject *object);
+void jit_unload(JitImage *image);
+
+// Returns the address of the function `name`, or NULL
+void *jit_function(JitImage *image, const char *name);
+
+void jit_write_perf_map(JitImage *image);
+void jit_write_jitdump(JitImage *image);
+
+// Runs the function `entry`, which takes no arguments, and returns its result
+int64_t jit_run(JitImage *image, const char *entry);
+// Runs `entry` in a child process, so that a program that crashes or exits
+// only ends the child. Returns the child's exit status, or 128 plus the
+// signal that killed it, as shells do.
+int jit_run_in_child(JitImage *image, const char *entry);
+
+#endif
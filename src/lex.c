@@ -1,4 +1,5 @@
 #include "lex.h"
+#include "intern.h"
 #include "util.h"
 #include <stdlib.h>
 #include <string.h>
@@ -66,6 +67,7 @@ static size_t nread = 0;              // # bytes last read from `current_file`
 static int line = 0;                  // current line no
 static int col = 0;                   // current col no
 static int line_start = 0;            // pos at where the current line starts in `buf`
+static Vector lexed = { 0 };          // Tokens of the `lex()` in progress
 
 static void fill_buffer()
 {
@@ -76,8 +78,11 @@ static void fill_buffer()
 
 static bool reached(int ctrl)
 {
-  if (pos != nread - 1) return false;
-  return ctrl ? (nread < LEX_BUF_SZ) : (nread == LEX_BUF_SZ);
+  if (pos < nread) return false;
+  // Only a full buffer can be followed by more input
+  if (ctrl == END_OF_BUF) return nread == LEX_BUF_SZ;
+  if (nread == LEX_BUF_SZ) fill_buffer();
+  return pos >= nread;
 }
 
 static char next()
@@ -85,7 +90,7 @@ static char next()
   if (reached(END_OF_BUF)) {
     fill_buffer();
   }
-  else if (reached(END_OF_FILE)) {
+  if (reached(END_OF_FILE)) {
     fatal("lexer was expecting more characters but reached EOF! (next)");
   }
 
@@ -107,8 +112,8 @@ static char peek()
   if (reached(END_OF_BUF)) {
     fill_buffer();
   }
-  else if (reached(END_OF_FILE)) {
-    fatal("lexer was expected more characters but reached EOF! (peek)");
+  if (reached(END_OF_FILE)) {
+    return 0;
   }
   return buf[pos];
 }
@@ -144,6 +149,7 @@ static Token *lex_alphabetic()
     if (!is_alphanumeric(c)) break;
 
     if (len >= IDENTIFIER_MAX_LEN) {
+      token_free(token);
       fatal("at line %d, col %d: identifier is too long (max = %d)",
           line, col, IDENTIFIER_MAX_LEN);
     }
@@ -155,7 +161,7 @@ static Token *lex_alphabetic()
 
   // Check if Token is a keyword
   for (TokenKind kind = TOKEN_CONST; kind <= TOKEN_FALSE; kind++) {
-    if (memcmp(buf, token_as_str(kind), len) == 0) {
+    if (strcmp(buf, token_as_str(kind)) == 0) {
       token->kind = kind;
       token->b_val = (kind == TOKEN_TRUE) ? true : false;
       return token;
@@ -163,10 +169,8 @@ static Token *lex_alphabetic()
   }
 
   // Token must be an identifier
-  token->str.data = calloc(len + 1, sizeof(char));
+  token->str.data = intern_n(buf, len);
   token->str.length = len;
-  memcpy(token->str.data, buf, len);
-  token->str.data[len] = 0;
 
   return token;
 }
@@ -185,6 +189,7 @@ static Token *lex_numeric(bool is_negative)
     if (!is_numeric(c)) break;
 
     if (len >= NUMBER_MAX_LEN) {
+      token_free(token);
       fatal("at line %d, col %d: number is too long (max = %d)",
           line, col, NUMBER_MAX_LEN);
     }
@@ -204,7 +209,7 @@ static Token *lex_numeric(bool is_negative)
   return token;
 }
 
-Vector lex(FILE *file)
+void lex_init(FILE *file)
 {
   // Initialize Lexer State
   current_file = file;
@@ -212,53 +217,55 @@ Vector lex(FILE *file)
   pos = nread = 0;
   memset(buf, 0, sizeof(char) * LEX_BUF_SZ);
   fill_buffer();
+}
 
-  // tokenize
-  Vector tokens;
-  vector_init(&tokens, sizeof(Token));
-
+Token *lex_token()
+{
   while (!reached(END_OF_FILE)) {
     char c = peek();
 
     // Skip whitespace
     if (is_whitespace(c)) {
-      for (;;) {
-        if (match(' ') || match('\n') ||
-            match('\r') || match('\t')) break;
-        next();
-      }
+      next();
       continue;
     }
 
     // Skip comments
-    if (match('/')) {
+    if (c == '/') {
+      int slash_line = line;
+      int slash_col = col;
+      next();
+
       // Single-line
       if (match('/')) {
-        for (;;) {
-          if (match('\n')) break;
+        while (!reached(END_OF_FILE) && !match('\n'))
           next();
-        }
         continue;
       }
 
       // Multi-line
       if (match('*')) {
         for (;;) {
+          if (reached(END_OF_FILE))
+            fatal("at line %d, col %d: unterminated comment", line, col);
           if (match('*') && match('/')) break;
           next();
         }
         continue;
       }
+
+      Token *slash = make_token(TOKEN_SLASH);
+      slash->line = slash_line;
+      slash->col = slash_col;
+      return slash;
     }
 
     if (is_alphabetic(c) || c == '_') {
-      vector_push_back(&tokens, lex_alphabetic());
-      continue;
+      return lex_alphabetic();
     }
 
     if (is_numeric(c)) {
-      vector_push_back(&tokens, lex_numeric(false));
-      continue;
+      return lex_numeric(false);
     }
 
     int sym_line = line;
@@ -269,17 +276,18 @@ Vector lex(FILE *file)
         sym = make_token(TOKEN_PLUS); break;
       case '-':
         if (is_numeric(peek())) {
-          vector_push_back(&tokens, lex_numeric(true));
-          continue;
+          return lex_numeric(true);
         }
         sym = make_token(match('>') ? TOKEN_ARROW : TOKEN_MINUS);
         break;
       case '*': sym = make_token(TOKEN_STAR); break;
-      case '/': sym = make_token(TOKEN_SLASH); break;
       case '=': sym = make_token(match('=') ? TOKEN_DOUBLE_EQUAL : TOKEN_EQUAL); break;
       case '!': sym = make_token(match('=') ? TOKEN_NOT_EQUAL : TOKEN_BANG); break;
       case ';': sym = make_token(TOKEN_SEMICOLON); break;
-      case ':': sym = make_token(match('=') ? TOKEN_WALRUS : TOKEN_COLON); break;
+      case ':':
+        if (match(':')) sym = make_token(TOKEN_DOUBLE_COLON);
+        else sym = make_token(match('=') ? TOKEN_WALRUS : TOKEN_COLON);
+        break;
       case ',': sym = make_token(TOKEN_COMMA); break;
       case '.': sym = make_token(TOKEN_DOT); break;
       case '<': sym = make_token(match('=') ? TOKEN_LESS_THAN_EQUAL : TOKEN_LANGLE); break;
@@ -295,9 +303,40 @@ Vector lex(FILE *file)
     }
     sym->line = sym_line;
     sym->col = sym_col;
-    vector_push_back(&tokens, sym);
+    return sym;
   }
 
-  vector_push_back(&tokens, make_token(TOKEN_EOF));
+  return make_token(TOKEN_EOF);
+}
+
+void token_free(Token *token)
+{
+  // Identifier strings are interned and outlive their Tokens
+  free(token);
+}
+
+Vector lex(FILE *file)
+{
+  lex_init(file);
+
+  // tokenize
+  vector_init(&lexed, sizeof(Token));
+
+  Token *token = NULL;
+  do {
+    token = lex_token();
+    vector_push_back(&lexed, token);
+  } while (token->kind != TOKEN_EOF);
+
+  Vector tokens = lexed;
+  lexed = (Vector){ 0 };
   return tokens;
 }
+
+void lex_abort()
+{
+  for (size_t i = 0; i < lexed.size; i++)
+    token_free((Token *)vector_get(&lexed, i));
+  vector_free(&lexed);
+  lexed = (Vector){ 0 };
+}
@@ -81,5 +81,13 @@ typedef struct
 } Token;
 
 Vector lex(FILE *file); // Token
+// Releases the Tokens of a `lex()` that failed part-way through
+void lex_abort();
+
+// Incremental interface: `lex_token()` returns the next Token from the file
+// passed to `lex_init()`, or a TOKEN_EOF Token once the input is exhausted.
+void lex_init(FILE *file);
+Token *lex_token();
+void token_free(Token *token);
 
 #endif
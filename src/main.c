@@ -1,8 +1,19 @@
+#include "buffer.h"
+#include "cache.h"
+#include "callgraph.h"
 #include "cfa.h"
 #include "compile.h"
 #include "codegen.h"
+#include "dataflow.h"
+#include "dce.h"
+#include "interp.h"
 #include "lex.h"
+#include "module.h"
+#include "optimize.h"
 #include "parse.h"
+#include "passes.h"
+#include "serialize.h"
+#include "server.h"
 #include "util.h"
 #include "vector.h"
 
@@ -15,19 +26,64 @@ typedef struct
 {
     int dump_flags;
     int optimize_flags;
+    Pipeline pipeline;
+    bool print_stats;
+    bool streaming;
+    char *cache_dir;
+    size_t cache_size;
     char *input_filename;
-    char *output_filename;
+    CodegenOptions codegen;
+    char *emit_ir_filename;
+    char *load_ir_filename;
+    char *interface_filename;
+    bool interpret;
 } MiniOpts;
 
+// Programs run with `--run` must not take a compile server down with them
+static bool is_serving = false;
+
+// Parses a byte count with an optional K, M or G suffix
+static size_t parse_size(const char *arg)
+{
+  char *end = NULL;
+  unsigned long long size = strtoull(arg, &end, 10);
+  switch (*end) {
+    case 'G': size *= 1024; // fallthrough
+    case 'M': size *= 1024; // fallthrough
+    case 'K': size *= 1024; end++; break;
+    default: break;
+  }
+  if (end == arg || *end != 0)
+    fatal("invalid size `%s`", arg);
+  return size;
+}
+
 MiniOpts parse_mini_options(int argc, char **argv)
 {
   MiniOpts opts = {
     .dump_flags = 0,
-    .optimize_flags = DEFAULT_OPTIMIZATIONS,
+    .optimize_flags = 0,
+    .print_stats = false,
+    .streaming = false,
+    .cache_dir = NULL,
+    .cache_size = CACHE_DEFAULT_MAX_SIZE,
     .input_filename = NULL,
-    .output_filename = "a.out",
+    .codegen = { .output_filename = "a.out", .run_in_child = is_serving },
+    .emit_ir_filename = NULL,
+    .load_ir_filename = NULL,
+    .interface_filename = NULL,
+    .interpret = false,
   };
 
+  int level = DEFAULT_OPTIMIZATION_LEVEL;
+  int disabled = 0;
+  char *passes = NULL;
+  bool verify = false;
+  bool verify_execution = false;
+  char *regalloc = NULL;
+  char *emit = NULL;
+  bool run = false;
+
   bool skip = false;
   for (int i = 1; i < argc; i++) {
     if (skip) { skip = false; continue; }
@@ -38,7 +94,7 @@ MiniOpts parse_mini_options(int argc, char **argv)
       if (i + 1 >= argc) {
         fatal("not enough arguments for option '%s'", arg);
       }
-      opts.output_filename = argv[i + 1];
+      opts.codegen.output_filename = argv[i + 1];
       skip = true;
     }
     else if (strcmp(arg, "-dT") == 0) {
@@ -53,99 +109,502 @@ MiniOpts parse_mini_options(int argc, char **argv)
     else if (strcmp(arg, "-dIR") == 0) {
       opts.dump_flags |= DUMP_IR;
     }
+    else if (strcmp(arg, "-dSSA") == 0) {
+      opts.dump_flags |= DUMP_SSA;
+    }
+    else if (strcmp(arg, "-dLV") == 0) {
+      opts.dump_flags |= DUMP_LIVENESS;
+    }
+    else if (strcmp(arg, "-dBC") == 0) {
+      opts.dump_flags |= DUMP_BYTECODE;
+    }
+    else if (strcmp(arg, "-dCG") == 0) {
+      opts.dump_flags |= DUMP_CALL_GRAPH;
+    }
+    else if (strncmp(arg, "-O", 2) == 0) {
+      if (!arg[2] || arg[3] || arg[2] < '0' || arg[2] > '9')
+        fatal("invalid optimization level `%s`", arg);
+      level = arg[2] - '0';
+    }
+    else if (strncmp(arg, "--passes=", 9) == 0) {
+      passes = arg + 9;
+    }
+    else if (strncmp(arg, "--regalloc=", 11) == 0) {
+      regalloc = arg + 11;
+    }
+    else if (strncmp(arg, "--emit=", 7) == 0) {
+      emit = arg + 7;
+    }
+    else if (strcmp(arg, "--run") == 0) {
+      run = true;
+    }
+    else if (strcmp(arg, "--interp") == 0) {
+      opts.interpret = true;
+    }
+    else if (strcmp(arg, "--verify-exec") == 0) {
+      verify_execution = true;
+    }
+    else if (strcmp(arg, "--perf") == 0) {
+      opts.codegen.perf_symbols = true;
+    }
+    else if (strcmp(arg, "--require-tail-calls") == 0) {
+      opts.codegen.require_tail_calls = true;
+    }
+    else if (strcmp(arg, "--verify-ir") == 0) {
+      verify = true;
+    }
+    else if (strcmp(arg, "--stats") == 0) {
+      opts.print_stats = true;
+    }
     else if (strcmp(arg, "--no-fold") == 0) {
-      opts.optimize_flags ^= O_FOLD_CONSTANTS;
-      LOG_WARN("constant folding and common subexpression elimination disabled.");
+      disabled |= O_FOLD_CONSTANTS;
+      LOG_WARN("constant folding disabled.");
+    }
+    else if (strcmp(arg, "--no-gvn") == 0) {
+      disabled |= O_VALUE_NUMBERING;
+      LOG_WARN("global value numbering disabled.");
+    }
+    else if (strcmp(arg, "--no-sccp") == 0) {
+      disabled |= O_PROPAGATE_CONSTANTS;
+      LOG_WARN("constant propagation disabled.");
+    }
+    else if (strcmp(arg, "--no-dce") == 0) {
+      disabled |= O_DEAD_CODE;
+      LOG_WARN("dead code elimination disabled.");
+    }
+    else if (strcmp(arg, "--no-copyprop") == 0) {
+      disabled |= O_PROPAGATE_COPIES;
+      LOG_WARN("copy propagation disabled.");
+    }
+    else if (strcmp(arg, "--no-coalesce") == 0) {
+      disabled |= O_COALESCE_COPIES;
+      LOG_WARN("copy coalescing disabled.");
+    }
+    else if (strcmp(arg, "--no-ctfe") == 0) {
+      disabled |= O_EVALUATE_CALLS;
+      LOG_WARN("compile-time evaluation of calls disabled.");
+    }
+    else if (strcmp(arg, "--no-inline") == 0) {
+      disabled |= O_INLINE_FUNCTIONS;
+      LOG_WARN("function inlining disabled.");
+    }
+    else if (strcmp(arg, "--no-ipcp") == 0) {
+      disabled |= O_SPECIALIZE_FUNCTIONS;
+      LOG_WARN("interprocedural constant propagation disabled.");
+    }
+    else if (strcmp(arg, "--no-tailcall") == 0) {
+      disabled |= O_TAIL_CALLS;
+      LOG_WARN("tail call optimization disabled.");
+    }
+    else if (strcmp(arg, "--stream") == 0) {
+      opts.streaming = true;
+    }
+    else if (strcmp(arg, "--cache-dir") == 0) {
+      if (i + 1 >= argc) {
+        fatal("not enough arguments for option '%s'", arg);
+      }
+      // Caching works at the granularity of declarations
+      opts.cache_dir = argv[i + 1];
+      opts.streaming = true;
+      skip = true;
+    }
+    else if (strcmp(arg, "--cache-size") == 0) {
+      if (i + 1 >= argc) {
+        fatal("not enough arguments for option '%s'", arg);
+      }
+      opts.cache_size = parse_size(argv[i + 1]);
+      skip = true;
+    }
+    else if (strcmp(arg, "--emit-ir-bin") == 0) {
+      if (i + 1 >= argc) {
+        fatal("not enough arguments for option '%s'", arg);
+      }
+      opts.emit_ir_filename = argv[i + 1];
+      skip = true;
+    }
+    else if (strcmp(arg, "--load-ir") == 0) {
+      if (i + 1 >= argc) {
+        fatal("not enough arguments for option '%s'", arg);
+      }
+      opts.load_ir_filename = argv[i + 1];
+      skip = true;
+    }
+    else if (strcmp(arg, "--emit-interface") == 0) {
+      if (i + 1 >= argc) {
+        fatal("not enough arguments for option '%s'", arg);
+      }
+      opts.interface_filename = argv[i + 1];
+      skip = true;
+    }
+    else if (strncmp(arg, "-I", 2) == 0) {
+      if (arg[2]) {
+        module_add_search_path(arg + 2);
+      } else {
+        if (i + 1 >= argc) {
+          fatal("not enough arguments for option '%s'", arg);
+        }
+        module_add_search_path(argv[i + 1]);
+        skip = true;
+      }
     }
     else {
       opts.input_filename = arg;
     }
   }
 
-  if (!opts.input_filename)
+  // An explicit list of passes replaces the pipeline of the level, which
+  // still decides whether the AST is folded
+  if (passes) {
+    if (!pipeline_parse(&opts.pipeline, passes)) {
+      list_passes();
+      fatal("invalid pass list `%s`", passes);
+    }
+    opts.optimize_flags = pipeline_flags(&opts.pipeline)
+      | (optimization_level_flags(level) & O_FOLD_CONSTANTS);
+  } else {
+    pipeline_init(&opts.pipeline, level);
+    opts.optimize_flags = optimization_level_flags(level);
+  }
+  opts.optimize_flags &= ~disabled;
+  pipeline_filter(&opts.pipeline, opts.optimize_flags);
+  opts.pipeline.verify = verify;
+  opts.pipeline.verify_execution = verify_execution;
+  opts.pipeline.dump_ssa = opts.dump_flags & DUMP_SSA;
+  opts.pipeline.collect_stats = opts.print_stats;
+
+  // The backend makes tail calls jumps wherever the pipeline would turn
+  // recursive ones into loops, and always when code depends on them
+  if (opts.codegen.require_tail_calls && (disabled & O_TAIL_CALLS))
+    fatal("--require-tail-calls can't be combined with --no-tailcall");
+  opts.codegen.tail_calls = (opts.optimize_flags & O_TAIL_CALLS) || opts.codegen.require_tail_calls;
+
+  // Graph coloring spends more compile time for fewer spills and copies
+  if (!regalloc)
+    opts.codegen.allocator = level >= 3 ? REGALLOC_GRAPH_COLORING : REGALLOC_LINEAR_SCAN;
+  else if (strcmp(regalloc, "linear") == 0)
+    opts.codegen.allocator = REGALLOC_LINEAR_SCAN;
+  else if (strcmp(regalloc, "graph") == 0)
+    opts.codegen.allocator = REGALLOC_GRAPH_COLORING;
+  else
+    fatal("invalid register allocator `%s`, expected `linear` or `graph`", regalloc);
+
+  if (run && emit)
+    fatal("--run can't be combined with --emit");
+  if (opts.interpret && (run || emit))
+    fatal("--interp can't be combined with --run or --emit");
+  if (run)
+    opts.codegen.emit = EMIT_RUN;
+  else if (!emit || strcmp(emit, "asm") == 0)
+    opts.codegen.emit = EMIT_ASSEMBLY;
+  else if (strcmp(emit, "obj") == 0)
+    opts.codegen.emit = EMIT_OBJECT;
+  else if (strcmp(emit, "exe") == 0)
+    opts.codegen.emit = EMIT_EXECUTABLE;
+  else
+    fatal("invalid output kind `%s`, expected `asm`, `obj` or `exe`", emit);
+
+  if (!opts.input_filename && !opts.load_ir_filename)
     fatal("input file is required");
+  if (opts.emit_ir_filename && opts.streaming)
+    fatal("--emit-ir-bin can't be combined with streaming compilation");
+  if ((run || opts.interpret) && opts.streaming)
+    fatal("--run and --interp can't be combined with streaming compilation");
+  if (opts.codegen.perf_symbols && !run)
+    LOG_WARN("--perf only applies to programs that run with --run");
+  if (opts.codegen.require_tail_calls && opts.interpret)
+    LOG_WARN("--require-tail-calls only applies to generated code");
 
   return opts;
 }
 
-int main(int argc, char **argv)
+// Compiles one top-level declaration at a time so that memory use stays flat
+// regardless of the size of the input. Only the signatures of declarations
+// are kept in the global scope once they have been lowered, and the code of
+// each is generated and written out before the next is parsed.
+static void compile_streaming(MiniOpts *opts, FILE *file)
 {
-  srand(time(NULL));
-  MiniOpts opts = parse_mini_options(argc, argv);
+  if (opts->dump_flags & DUMP_TOKENS)
+    LOG_WARN("token dumps are not supported when streaming");
+
+  lex_init(file);
+  parse_stream_init();
+
+  if (opts->cache_dir)
+    cache_open(opts->cache_dir, opts->cache_size);
+  nasm_x86_64_begin_stream(&opts->codegen);
 
-  FILE *file = fopen(opts.input_filename, "rb");
-  if (!file) {
-    fatal("couldn't open file `%s`", opts.input_filename);
+  Node *decl = NULL;
+  while ((decl = parse_next_declaration())) {
+    if (opts->dump_flags & DUMP_AST)
+      dump_ast(decl, 0);
+
+    // Functions whose tokens and referenced signatures are unchanged reuse
+    // their optimized IR from the cache, and their machine code
+    bool cacheable = cache_is_open() && decl->kind == NODE_FUNC_DECL;
+    bool cached = false;
+    Hash128 key = { 0 };
+    ControlFlowGraph graph = { 0 };
+    if (cacheable) {
+      size_t num_tokens = 0;
+      Token **tokens = parse_declaration_tokens(&num_tokens);
+      uint64_t pipeline = pipeline_fingerprint(&opts->pipeline);
+      key = cache_key(tokens, num_tokens, pipeline, opts->optimize_flags);
+
+      size_t size = 0;
+      uint8_t *data = cache_load(key, "ir", &size);
+      if (data) {
+        cached = deserialize_cfg(data, size, &graph);
+        if (!cached)
+          LOG_WARN("ignoring corrupt cache entry for function `%s`", decl->func_decl.name);
+        free(data);
+      }
+    }
+
+    if (!cached) {
+      if (opts->optimize_flags & O_FOLD_CONSTANTS)
+        fold_constants(decl);
+
+      graph = construct_cfg(decl);
+      run_pipeline(&opts->pipeline, &graph);
+
+      if (cacheable) {
+        Buffer ir;
+        buffer_init(&ir);
+        serialize_cfg(&graph, &ir);
+        cache_store(key, "ir", ir.data, ir.size);
+        buffer_free(&ir);
+      }
+    }
+
+    if (opts->dump_flags & DUMP_IR)
+      dump_cfg(&graph);
+    if (opts->dump_flags & DUMP_LIVENESS)
+      dump_live_variables(&graph);
+    nasm_x86_64_stream(&graph, cacheable ? &key : NULL);
+    free_cfg(&graph);
+
+    parse_release_declaration(decl);
   }
+  nasm_x86_64_end_stream();
+
+  if (opts->dump_flags & DUMP_SYMBOLS)
+    symbol_table_dump(ctx->global_scope, 0);
+
+  if (opts->interface_filename && !write_module_interface(opts->interface_filename, ctx->global_scope))
+    fatal("couldn't write module interface to `%s`", opts->interface_filename);
 
+  if (cache_is_open()) {
+    cache_close();
+    CacheStats stats = cache_stats();
+    LOG_INFO("function cache: %zu hits, %zu misses, %zu stored, %zu evicted (%zu bytes)",
+        stats.hits, stats.misses, stats.stores, stats.evictions, stats.evicted_bytes);
+  }
+}
+
+// Runs the program on the IR interpreter instead of generating code for it,
+// returning what `main` returned
+static int interpret_program(MiniOpts *opts, ControlFlowGraph *program)
+{
+  BytecodeProgram bytecode;
+  compile_bytecode(program, &bytecode);
+  if (opts->dump_flags & DUMP_BYTECODE)
+    dump_bytecode(&bytecode);
+
+  InterpResult result = interpret(&bytecode, opts->print_stats);
+  if (opts->print_stats)
+    dump_interp_profile(&bytecode);
+  free_bytecode(&bytecode);
+
+  if (result.status == INTERP_NO_MAIN)
+    fatal("programs need a `main` function to run");
+  if (result.status != INTERP_OK)
+    fatal("the program %s in `%s`", interp_status_message(result.status), result.function);
+  return result.value;
+}
+
+static FILE *input_file = NULL;
+static IRMapping ir_mapping = { 0 };
+static Vector tokens = { 0 };
+static Node *ast = NULL;
+
+// Releases the Tokens and the AST of the front end
+static void free_front_end()
+{
+  free_ast(ast);
+  ast = NULL;
+  for (size_t i = 0; i < tokens.size; i++)
+    token_free((Token *)vector_get(&tokens, i));
+  vector_free(&tokens);
+  tokens = (Vector){ 0 };
+}
+
+// Skips the front end and optimizer entirely by picking the program up from
+// a binary IR file written by `--emit-ir-bin`
+static int compile_ir_file(MiniOpts *opts)
+{
   compiler_context_init();
 
+  ControlFlowGraph program;
+  if (!map_ir_file(opts->load_ir_filename, &ir_mapping, &program))
+    fatal("couldn't load IR from `%s`", opts->load_ir_filename);
+
+  if (opts->dump_flags & DUMP_IR)
+    dump_cfg(&program);
+
+  int status = opts->interpret ? interpret_program(opts, &program)
+    : nasm_x86_64_generate(&program, &opts->codegen);
+
+  free_cfg(&program);
+  unmap_ir_file(&ir_mapping);
+  compiler_context_free();
+
+  return status;
+}
+
+static int compile(MiniOpts *opts)
+{
+  if (opts->load_ir_filename)
+    return compile_ir_file(opts);
+
+  input_file = fopen(opts->input_filename, "rb");
+  if (!input_file) {
+    fatal("couldn't open file `%s`", opts->input_filename);
+  }
+
+  compiler_context_init();
+  ctx->is_module = opts->interface_filename != NULL;
+
+  if (opts->streaming) {
+    compile_streaming(opts, input_file);
+    fclose(input_file);
+    input_file = NULL;
+    parse_stream_free();
+    compiler_context_free();
+    return 0;
+  }
+
   // Lexical Analysis
-  Vector tokens = lex(file);
-  if (opts.dump_flags & DUMP_TOKENS) {
+  tokens = lex(input_file);
+  if (opts->dump_flags & DUMP_TOKENS) {
     for (size_t i = 0; i < tokens.size; i++) {
       Token *token = (Token *)vector_get(&tokens, i);
       if (token->kind == TOKEN_EOF) break;
       printf("%s\n", token_as_str(token->kind));
     }
   }
-  fclose(file);
+  fclose(input_file);
+  input_file = NULL;
 
   // Semantic Analysis
-  Node *ast = parse(tokens);
-  if (opts.dump_flags & DUMP_AST)
+  ast = parse(tokens);
+  if (opts->dump_flags & DUMP_AST)
     dump_ast(ast, 0);
 
-  if (opts.dump_flags & DUMP_SYMBOLS)
+  if (opts->dump_flags & DUMP_SYMBOLS)
     symbol_table_dump(ctx->global_scope, 0);
 
+  if (opts->interface_filename && !write_module_interface(opts->interface_filename, ctx->global_scope))
+    fatal("couldn't write module interface to `%s`", opts->interface_filename);
+
   // Optimization: Constant Folding
-  if (opts.optimize_flags & O_FOLD_CONSTANTS)
+  if (opts->optimize_flags & O_FOLD_CONSTANTS)
     fold_constants(ast);
 
   // IR Translation
+  ControlFlowGraph program = construct_cfg(ast);
+  run_pipeline(&opts->pipeline, &program);
+
+  // All functions of a module are exported, whether or not it has a `main`
   Symbol *entry_point = symbol_table_lookup(ctx->global_scope, "main");
-  ControlFlowGraph program = construct_cfg(entry_point->node);
-  if (opts.dump_flags & DUMP_IR) {
-    BasicBlock *block = program.blocks;
-    while (block) {
-      printf("[BasicBlock %s#%d] (%ld predecessors, %ld successors, %ld instructions)\n",
-          block->tag, block->id,
-          block->predecessors.size,
-          block->successors.size,
-          block->instructions.size);
-
-      for (size_t i = 0; i < block->instructions.size; i++) {
-        Instruction *inst = (Instruction *)vector_get(&block->instructions, i);
-        dump_instruction(inst);
-      }
+  if (entry_point && !ctx->is_module && (opts->optimize_flags & O_DEAD_CODE))
+    remove_unused_functions(&program, entry_point->name);
 
-      block = block->next;
-    }
+  if (opts->dump_flags & DUMP_IR)
+    dump_cfg(&program);
+  if (opts->dump_flags & DUMP_LIVENESS)
+    dump_live_variables(&program);
+  if (opts->dump_flags & DUMP_CALL_GRAPH) {
+    CallGraph calls;
+    build_call_graph(&program, &calls);
+    dump_call_graph(&calls);
+    free_call_graph(&calls);
   }
 
-  // Iterate top-level of AST and print warnings for unused nodes
-  Node *iter = ast;
-  while (iter) {
-    if (!iter->visited) {
-      switch (iter->kind) {
-        case NODE_FUNC_DECL:
-          LOG_WARN("unused function %s at line %d, col %d",
-              iter->func_decl.name, iter->line, iter->col);
-          break;
-        case NODE_VAR_DECL:
-          LOG_WARN("unused variable %s at line %d, col %d", 
-              iter->var_decl.name, iter->line, iter->col);
-          break;
-      }
-    }
+  if (opts->emit_ir_filename && !write_ir_file(opts->emit_ir_filename, &program))
+    fatal("couldn't write IR to `%s`", opts->emit_ir_filename);
 
-    iter = iter->next;
-  }
+  int status = opts->interpret ? interpret_program(opts, &program)
+    : nasm_x86_64_generate(&program, &opts->codegen);
 
-  nasm_x86_64_generate(&program);
+  free_cfg(&program);
+  free_front_end();
 
   compiler_context_free();
 
-  return 0;
+  return status;
+}
+
+static int compile_args(int argc, char **argv)
+{
+  MiniOpts opts = parse_mini_options(argc, argv);
+  // A server compiles many times over, and each reports only its own work
+  reset_pass_stats();
+  reset_codegen_stats();
+  int result = compile(&opts);
+  // A run `--verify-exec` couldn't check must not pass for a verified one
+  if (opts.pipeline.inconclusive)
+    result = EXIT_FAILURE;
+  if (opts.print_stats) {
+    dump_pass_stats();
+    dump_codegen_stats();
+  }
+  return result;
+}
+
+// Releases what a compilation that failed part-way through left behind
+static void compile_abort()
+{
+  if (input_file) {
+    fclose(input_file);
+    input_file = NULL;
+  }
+  lex_abort();
+  parse_abort();
+  free_front_end();
+  cache_close();
+  nasm_x86_64_abort();
+  unmap_ir_file(&ir_mapping);
+  module_release_imports();
+  if (ctx)
+    compiler_context_free();
+}
+
+int main(int argc, char **argv)
+{
+  srand(time(NULL));
+
+  // `mini --server [--socket PATH]` and `mini --connect [--socket PATH] ARGS...`
+  if (argc > 1 && (strcmp(argv[1], "--server") == 0 || strcmp(argv[1], "--connect") == 0)) {
+    bool is_server = strcmp(argv[1], "--server") == 0;
+    char *socket_path = NULL;
+    int first_arg = 2;
+    if (argc > 3 && strcmp(argv[2], "--socket") == 0) {
+      socket_path = argv[3];
+      first_arg = 4;
+    }
+    if (!socket_path)
+      socket_path = server_default_socket_path();
+
+    if (is_server) {
+      is_serving = true;
+      int status = server_run(socket_path, compile_args, compile_abort);
+      module_unload_all();
+      return status;
+    }
+    return server_connect(socket_path, argc - first_arg, argv + first_arg);
+  }
+
+  int status = compile_args(argc, argv);
+  module_unload_all();
+  return status;
 }
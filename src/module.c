@@ -0,0 +1,503 @@
+#define _DEFAULT_SOURCE
+#include "module.h"
+#include "buffer.h"
+#include "compile.h"
+#include "intern.h"
+#include "util.h"
+#include "vector.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct
+{
+  char *path;
+  void *base;
+  size_t size;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  const ModuleHeader *header;
+  const uint32_t *buckets;
+  const ModuleExport *exports;
+  const ModuleParam *params;
+  const char *strings;
+} Module;
+
+// Mappings outlive a compilation so that a compile server only maps each
+// interface once. The remaining state belongs to the current compilation.
+static Vector loaded;         // Module *
+static Vector opened;         // Module *, imported as a whole
+static Vector bound;          // Node *, signatures of bound imports
+static Vector search_paths;   // char *
+
+static void init_state()
+{
+  if (loaded.elem_size) return;
+  vector_init(&loaded, sizeof(Module *));
+  vector_init(&opened, sizeof(Module *));
+  vector_init(&bound, sizeof(Node *));
+  vector_init(&search_paths, sizeof(char *));
+}
+
+static size_t align8(size_t size)
+{
+  return (size + 7) & ~(size_t)7;
+}
+
+static uint64_t hash_name(const char *name)
+{
+  return hash_n((uint8_t *)name, strlen(name));
+}
+
+/* Writing */
+
+static bool is_exported(Symbol *symbol)
+{
+  if (!symbol->name || symbol->is_imported)
+    return false;
+
+  switch (symbol->kind) {
+    case SYMBOL_FUNCTION:
+      return symbol->node != NULL;
+    case SYMBOL_VARIABLE:
+      // Only constants can be used without linking against the module
+      return symbol->is_constant && symbol->node && symbol->node->var_decl.init
+        && symbol->node->var_decl.init->kind == NODE_LITERAL_EXPR;
+    case SYMBOL_TYPE:
+      // Primitive types are registered in every global scope
+      return symbol->type.id >= ctx->registered_types;
+    default:
+      return false;
+  }
+}
+
+static uint32_t add_string(Buffer *strings, const char *s)
+{
+  uint32_t offset = strings->size;
+  buffer_append(strings, s, strlen(s) + 1);
+  return offset;
+}
+
+bool write_module_interface(const char *path, SymbolTable *scope)
+{
+  Vector symbols;
+  vector_init(&symbols, sizeof(Symbol *));
+  for (size_t i = 0; i < SYMBOL_TABLE_SIZE; i++) {
+    for (Symbol *symbol = scope->symbols[i]; symbol; symbol = symbol->next) {
+      if (is_exported(symbol))
+        vector_push_back(&symbols, symbol);
+    }
+  }
+
+  // Keep chains short: at least two buckets per export
+  uint32_t num_buckets = 1;
+  while (num_buckets < symbols.size * 2)
+    num_buckets <<= 1;
+
+  uint32_t *buckets = malloc(num_buckets * sizeof(uint32_t));
+  for (uint32_t i = 0; i < num_buckets; i++)
+    buckets[i] = MODULE_NONE;
+
+  ModuleExport *exports = calloc(symbols.size ? symbols.size : 1, sizeof(ModuleExport));
+  Buffer params, strings;
+  buffer_init(&params);
+  buffer_init(&strings);
+
+  uint32_t num_params = 0;
+  for (size_t i = 0; i < symbols.size; i++) {
+    Symbol *symbol = vector_get(&symbols, i);
+    ModuleExport *export = &exports[i];
+    export->hash = hash_name(symbol->name);
+    export->name = add_string(&strings, symbol->name);
+    export->kind = symbol->kind;
+    export->type = symbol->type.id;
+    export->is_constant = symbol->is_constant;
+    export->first_param = num_params;
+
+    Node *node = symbol->node;
+    if (symbol->kind == SYMBOL_FUNCTION) {
+      export->type = node->func_decl.return_type.id;
+      for (Node *param = node->func_decl.params; param; param = param->next) {
+        ModuleParam encoded = {
+          .name = add_string(&strings, param->var_decl.name),
+          .type = param->var_decl.type.id,
+        };
+        buffer_append(&params, &encoded, sizeof(encoded));
+        export->num_params++;
+        num_params++;
+      }
+    } else if (symbol->kind == SYMBOL_VARIABLE) {
+      Value *value = &node->var_decl.init->literal;
+      export->value_kind = value->kind;
+      memcpy(&export->value, &value->u_val, sizeof(export->value));
+    }
+
+    uint32_t bucket = export->hash & (num_buckets - 1);
+    export->next = buckets[bucket];
+    buckets[bucket] = i;
+  }
+
+  ModuleHeader header = {
+    .magic = MODULE_MAGIC,
+    .version = MODULE_VERSION,
+    .num_buckets = num_buckets,
+    .num_exports = symbols.size,
+    .num_params = num_params,
+    .strings_size = strings.size,
+  };
+
+  Buffer out;
+  buffer_init(&out);
+  buffer_append(&out, &header, sizeof(header));
+  buffer_align(&out, 8);
+  buffer_append(&out, buckets, num_buckets * sizeof(uint32_t));
+  buffer_align(&out, 8);
+  buffer_append(&out, exports, symbols.size * sizeof(ModuleExport));
+  buffer_align(&out, 8);
+  buffer_append(&out, params.data, params.size);
+  buffer_align(&out, 8);
+  buffer_append(&out, strings.data, strings.size);
+
+  FILE *file = fopen(path, "wb");
+  bool ok = file && fwrite(out.data, 1, out.size, file) == out.size;
+  if (file && fclose(file) != 0)
+    ok = false;
+
+  LOG_INFO("exported %zu symbols to `%s`", symbols.size, path);
+
+  buffer_free(&out);
+  buffer_free(&strings);
+  buffer_free(&params);
+  free(exports);
+  free(buckets);
+  vector_free(&symbols);
+  return ok;
+}
+
+/* Loading */
+
+static bool map_module(Module *module, int fd, struct stat *st)
+{
+  if (st->st_size < (off_t)sizeof(ModuleHeader))
+    return false;
+
+  void *base = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED)
+    return false;
+
+  module->base = base;
+  module->size = st->st_size;
+  module->dev = st->st_dev;
+  module->ino = st->st_ino;
+  module->mtime = st->st_mtim;
+
+  // Only the section layout is validated up front; exports are checked when
+  // a lookup touches them so that opening a large module stays cheap.
+  const ModuleHeader *header = base;
+  if (memcmp(header->magic, MODULE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != MODULE_VERSION || header->num_buckets == 0
+      || (header->num_buckets & (header->num_buckets - 1)) != 0)
+    return false;
+
+  size_t pos = align8(sizeof(ModuleHeader));
+  size_t buckets = pos;
+  pos = align8(pos + (uint64_t)header->num_buckets * sizeof(uint32_t));
+  size_t exports = pos;
+  pos = align8(pos + (uint64_t)header->num_exports * sizeof(ModuleExport));
+  size_t params = pos;
+  pos = align8(pos + (uint64_t)header->num_params * sizeof(ModuleParam));
+  size_t strings = pos;
+  if (pos > module->size || header->strings_size != module->size - pos)
+    return false;
+  if (header->strings_size && ((char *)base)[module->size - 1] != 0)
+    return false;
+
+  module->header = header;
+  module->buckets = (const uint32_t *)((uint8_t *)base + buckets);
+  module->exports = (const ModuleExport *)((uint8_t *)base + exports);
+  module->params = (const ModuleParam *)((uint8_t *)base + params);
+  module->strings = (const char *)base + strings;
+  return true;
+}
+
+static void unmap_module(Module *module)
+{
+  if (module->base)
+    munmap(module->base, module->size);
+  module->base = NULL;
+  module->header = NULL;
+}
+
+// Returns the module at `path`, reusing an earlier mapping while the file is
+// unchanged. Returns NULL when there is no such file.
+static Module *load_module(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT)
+      fatal("couldn't open module interface `%s`: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    fatal("couldn't stat module interface `%s`: %s", path, strerror(errno));
+
+  Module *module = NULL;
+  for (size_t i = 0; i < loaded.size && !module; i++) {
+    Module *candidate = vector_get(&loaded, i);
+    if (strcmp(candidate->path, path) == 0)
+      module = candidate;
+  }
+
+  if (module && module->header && module->dev == st.st_dev && module->ino == st.st_ino
+      && module->size == (size_t)st.st_size && module->mtime.tv_sec == st.st_mtim.tv_sec
+      && module->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+    close(fd);
+    return module;
+  }
+
+  if (!module) {
+    module = calloc(1, sizeof(Module));
+    module->path = aprintf("%s", path);
+    vector_push_back(&loaded, module);
+  }
+
+  unmap_module(module);
+  bool ok = map_module(module, fd, &st);
+  close(fd);
+  if (!ok) {
+    unmap_module(module);
+    fatal("`%s` is not a valid module interface", path);
+  }
+  return module;
+}
+
+static Module *find_module(char **components, size_t num_components)
+{
+  Buffer relative;
+  buffer_init(&relative);
+  for (size_t i = 0; i < num_components; i++) {
+    if (i) buffer_append(&relative, "/", 1);
+    buffer_append(&relative, components[i], strlen(components[i]));
+  }
+  buffer_append(&relative, MODULE_EXTENSION, sizeof(MODULE_EXTENSION));
+
+  Module *module = NULL;
+  for (size_t i = 0; i <= search_paths.size && !module; i++) {
+    // The working directory is searched last
+    char *dir = i < search_paths.size ? vector_get(&search_paths, i) : ".";
+    char *path = aprintf("%s/%s", dir, (char *)relative.data);
+    module = load_module(path);
+    free(path);
+  }
+
+  buffer_free(&relative);
+  return module;
+}
+
+static const char *module_string(Module *module, uint32_t offset)
+{
+  if (offset >= module->header->strings_size)
+    fatal("corrupt module interface `%s`", module->path);
+  return module->strings + offset;
+}
+
+static Type module_type(Module *module, uint32_t id)
+{
+  if (id < TYPE_VOID || id > TYPE_BOOL)
+    fatal("corrupt module interface `%s`", module->path);
+  return primitive_types[id];
+}
+
+static const ModuleExport *find_export(Module *module, const char *name)
+{
+  const ModuleHeader *header = module->header;
+  uint64_t hash = hash_name(name);
+  uint32_t index = module->buckets[hash & (header->num_buckets - 1)];
+
+  for (uint32_t steps = 0; index != MODULE_NONE; steps++) {
+    if (index >= header->num_exports || steps >= header->num_exports)
+      fatal("corrupt module interface `%s`", module->path);
+
+    const ModuleExport *export = &module->exports[index];
+    if (export->hash == hash && strcmp(module_string(module, export->name), name) == 0)
+      return export;
+    index = export->next;
+  }
+  return NULL;
+}
+
+/* Binding */
+
+static Node *make_signature(NodeKind kind)
+{
+  Node *node = calloc(1, sizeof(Node));
+  node->kind = kind;
+  node->type = primitive_types[TYPE_VOID];
+  node->visited = true;
+  return node;
+}
+
+// Binds an export in the global scope, synthesizing the declaration Node a
+// local definition would have had, minus any function body
+static Symbol *bind_export(Module *module, const ModuleExport *export, char *name)
+{
+  Symbol *symbol = symbol_table_lookup(ctx->global_scope, name);
+  if (symbol) {
+    if (!symbol->is_imported)
+      fatal("imported symbol `%s` conflicts with an existing declaration", name);
+    return symbol;
+  }
+
+  if (export->kind != SYMBOL_FUNCTION && export->kind != SYMBOL_VARIABLE
+      && export->kind != SYMBOL_TYPE)
+    fatal("corrupt module interface `%s`", module->path);
+
+  symbol = symbol_table_insert(ctx->global_scope, name, export->kind);
+  symbol->is_imported = true;
+  symbol->is_constant = export->is_constant;
+  symbol->is_initialized = true;
+  symbol->type = module_type(module, export->type);
+
+  Node *node = NULL;
+  switch (export->kind) {
+    case SYMBOL_FUNCTION:
+      if ((uint64_t)export->first_param + export->num_params > module->header->num_params)
+        fatal("corrupt module interface `%s`", module->path);
+
+      node = make_signature(NODE_FUNC_DECL);
+      node->func_decl.name = name;
+      node->func_decl.return_type = symbol->type;
+
+      Node params = {0};
+      Node *cur = &params;
+      for (uint32_t i = 0; i < export->num_params; i++) {
+        const ModuleParam *param = &module->params[export->first_param + i];
+        cur = cur->next = make_signature(NODE_VAR_DECL);
+        cur->var_decl.name = intern(module_string(module, param->name));
+        cur->var_decl.type = module_type(module, param->type);
+      }
+      node->func_decl.params = params.next;
+      break;
+    case SYMBOL_VARIABLE:
+      node = make_signature(NODE_VAR_DECL);
+      node->var_decl.name = name;
+      node->var_decl.type = symbol->type;
+
+      Node *init = make_signature(NODE_LITERAL_EXPR);
+      init->type = symbol->type;
+      init->literal.kind = export->value_kind;
+      memcpy(&init->literal.u_val, &export->value, sizeof(export->value));
+      node->var_decl.init = init;
+      break;
+    default: break;
+  }
+
+  if (node) {
+    symbol->node = node;
+    vector_push_back(&bound, node);
+  }
+  return symbol;
+}
+
+static char *join_path(char **components, size_t num_components)
+{
+  Buffer joined;
+  buffer_init(&joined);
+  for (size_t i = 0; i < num_components; i++) {
+    if (i) buffer_append(&joined, "::", 2);
+    buffer_append(&joined, components[i], strlen(components[i]));
+  }
+  buffer_append_u8(&joined, 0);
+  return (char *)joined.data;
+}
+
+void module_add_search_path(const char *dir)
+{
+  init_state();
+  vector_push_back(&search_paths, aprintf("%s", dir));
+}
+
+void module_import(char **path, size_t num_components, int line, int col)
+{
+  init_state();
+
+  // `import a::b;` names export `b` of module `a` if there is one, and
+  // module `a::b` otherwise
+  char *name = path[num_components - 1];
+  Module *parent = num_components > 1 ? find_module(path, num_components - 1) : NULL;
+  if (parent) {
+    const ModuleExport *export = find_export(parent, name);
+    if (export) {
+      bind_export(parent, export, name);
+      return;
+    }
+  }
+
+  Module *module = find_module(path, num_components);
+  if (module) {
+    for (size_t i = 0; i < opened.size; i++) {
+      if (vector_get(&opened, i) == module) return;
+    }
+    vector_push_back(&opened, module);
+    return;
+  }
+
+  char *joined = join_path(path, num_components - 1);
+  if (parent)
+    fatal("at line %d, col %d: module `%s` has no export `%s`", line, col, joined, name);
+  if (num_components > 1)
+    fatal("at line %d, col %d: couldn't find module `%s` or `%s::%s`",
+        line, col, joined, joined, name);
+  fatal("at line %d, col %d: couldn't find module `%s`", line, col, name);
+}
+
+Symbol *module_resolve(char *name)
+{
+  for (size_t i = 0; i < opened.size; i++) {
+    Module *module = vector_get(&opened, i);
+    const ModuleExport *export = find_export(module, name);
+    if (export)
+      return bind_export(module, export, name);
+  }
+  return NULL;
+}
+
+void module_release_imports()
+{
+  if (!loaded.elem_size) return;
+  for (size_t i = 0; i < bound.size; i++)
+    free_ast(vector_get(&bound, i));
+  for (size_t i = 0; i < search_paths.size; i++)
+    free(vector_get(&search_paths, i));
+
+  vector_clear(&bound);
+  vector_clear(&opened);
+  vector_clear(&search_paths);
+}
+
+void module_unload_all()
+{
+  if (!loaded.elem_size) return;
+
+  module_release_imports();
+  for (size_t i = 0; i < loaded.size; i++) {
+    Module *module = vector_get(&loaded, i);
+    unmap_module(module);
+    free(module->path);
+    free(module);
+  }
+  vector_free(&loaded);
+  vector_free(&opened);
+  vector_free(&bound);
+  vector_free(&search_paths);
+  memset(&loaded, 0, sizeof(Vector));
+}
@@ -0,0 +1,69 @@
+#ifndef MINI_MODULE_H
+#define MINI_MODULE_H
+
+#include "symbols.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Module Interfaces
+ *
+ * `--emit-interface` writes the exported signatures of a module to a `.mi`
+ * file that importers map read-only and query in place:
+ *   ModuleHeader
+ *   uint32_t buckets[num_buckets] (first export in each hash chain)
+ *   ModuleExport exports[num_exports]
+ *   ModuleParam params[num_params]
+ *   char strings[strings_size] (NUL-terminated)
+ *
+ * `import a::b;` binds `b` from module `a` eagerly. `import a;` makes every
+ * export of `a` visible, binding each name the first time a lookup misses.
+ * Module `a::b` lives in `a/b.mi` under one of the search paths.
+ */
+
+#define MODULE_MAGIC      "MMI"
+#define MODULE_VERSION    1
+#define MODULE_EXTENSION  ".mi"
+#define MODULE_NONE       UINT32_MAX
+
+typedef struct
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t num_buckets;
+  uint32_t num_exports;
+  uint32_t num_params;
+  uint32_t strings_size;
+} ModuleHeader;
+
+typedef struct
+{
+  uint64_t hash;
+  uint64_t value;         // Literal value of constants
+  uint32_t name;          // Offset into the strings
+  uint32_t next;          // Next export in the same bucket
+  uint32_t first_param;
+  uint32_t num_params;
+  uint8_t kind;           // SymbolKind
+  uint8_t type;           // TypeID of variables and function return types
+  uint8_t is_constant;
+  uint8_t value_kind;
+  uint32_t reserved;
+} ModuleExport;
+
+typedef struct
+{
+  uint32_t name;
+  uint32_t type;
+} ModuleParam;
+
+bool write_module_interface(const char *path, SymbolTable *scope);
+
+void module_add_search_path(const char *dir);
+void module_import(char **path, size_t num_components, int line, int col);
+Symbol *module_resolve(char *name);
+void module_release_imports();
+void module_unload_all();
+
+#endif
@@ -1,32 +1,49 @@
+#define _DEFAULT_SOURCE
 #include "symbols.h"
 #include "types.h"
+#include "buffer.h"
+#include "cache.h"
 #include "codegen.h"
 #include "compile.h"
+#include "dataflow.h"
+#include "elf64.h"
+#include "jit.h"
+#include "intern.h"
+#include "tailcall.h"
+#include "util.h"
+#include "varmap.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 // NASM x86_64 (Linux)
 
 typedef enum RegisterID RegisterID;
 typedef struct Register Register;
+typedef struct LiveInterval LiveInterval;
 
 enum RegisterID
 {
   R_RAX,
-  R_RBX, 
+  R_RBX,
   R_RCX,
   R_RDX,
-  R_RSP, 
-  R_RBP, 
-  R_RSI, 
+  R_RSP,
+  R_RBP,
+  R_RSI,
   R_RDI,
   R_R8,
   R_R9,
-  R_R10, 
-  R_R11, 
+  R_R10,
+  R_R11,
   R_R12,
   NUM_REGISTERS,
 };
@@ -37,7 +54,8 @@ struct Register
   char *name;
   bool is_preserved;
   bool is_active;
-  int start, end;
+  int start, end;             // Live interval held while the register is active
+  LiveInterval *interval;
 };
 
 static const Register REGISTERS_NASM_x86_64[] = {
@@ -56,189 +74,4066 @@ static const Register REGISTERS_NASM_x86_64[] = {
   [R_R12] = { R_R12, "r12", true, false },
 };
 
-/* Codegen State */
-static Register registers[NUM_REGISTERS];
+static const char *BYTE_REGISTER_NAMES[] = {
+  [R_RAX] = "al",
+  [R_RBX] = "bl",
+  [R_RCX] = "cl",
+  [R_RDX] = "dl",
+  [R_RSP] = "spl",
+  [R_RBP] = "bpl",
+  [R_RSI] = "sil",
+  [R_RDI] = "dil",
+  [R_R8]  = "r8b",
+  [R_R9]  = "r9b",
+  [R_R10] = "r10b",
+  [R_R11] = "r11b",
+  [R_R12] = "r12b",
+};
+
+// Never handed out, so that spill code and operands that x86 can't encode
+// always have a register to go through
+#define SCRATCH_REGISTER R_R11
+
+// System V AMD64
+static const RegisterID ARGUMENT_REGISTERS[] = { R_RDI, R_RSI, R_RDX, R_RCX, R_R8, R_R9 };
+
+#define NUM_ARGUMENT_REGISTERS 6
+#define NO_REGISTER (-1)
+#define REGISTER_BIT(id) (1u << (id))
+
+#define SCRATCH_REGISTERS (REGISTER_BIT(R_RAX) | REGISTER_BIT(R_RCX) | REGISTER_BIT(R_RDX) \
+    | REGISTER_BIT(R_RSI) | REGISTER_BIT(R_RDI) | REGISTER_BIT(R_R8) | REGISTER_BIT(R_R9) \
+    | REGISTER_BIT(R_R10) | REGISTER_BIT(R_R11))
+
+/* Machine Code */
 
-/* Simple Linear Scan Register Allocator */
-static void spill_register_to_stack(RegisterID id)
+// Registers at or past `NUM_REGISTERS` are virtual, one per local of the
+// function and one per temporary that lowering needed
+#define VIRTUAL_REGISTER(v) (NUM_REGISTERS + (v))
+#define IS_VIRTUAL(reg) ((reg) >= NUM_REGISTERS)
+
+typedef enum
 {
-  Register *reg = &registers[id];
+  X_MOV,
+  X_MOVZX,
+  X_LEA,
+  X_ADD,
+  X_SUB,
+  X_IMUL,
+  X_NEG,
+  X_CMP,
+  X_TEST,
+  X_CQO,
+  X_IDIV,
+  X_SETCC,
+  X_JMP,
+  X_JCC,
+  X_CALL,
+  X_TAIL_CALL,
+  X_RET,
+  X_PUSH,
+  X_POP,
+  X_SYSCALL,
+} MachineOp;
+
+typedef enum
+{
+  CC_E,
+  CC_NE,
+  CC_L,
+  CC_G,
+  CC_LE,
+  CC_GE,
+} Condition;
+
+static const char *condition_names[] = {
+  [CC_E] = "e",
+  [CC_NE] = "ne",
+  [CC_L] = "l",
+  [CC_G] = "g",
+  [CC_LE] = "le",
+  [CC_GE] = "ge",
+};
+
+enum
+{
+  USE = 1,
+  DEF = 2,
+};
+
+typedef struct
+{
+  const char *name;
+  uint8_t roles[2];           // Of the explicit operands
+  uint32_t uses;              // Registers read and written implicitly
+  uint32_t defs;
+} MachineOpInfo;
+
+// Before registers are allocated, `setcc` stands for materializing a flag as
+// 0 or 1 in a full register, and `ret` reads the register of its value. A
+// tail call is spelled `jmp near`, or NASM would shorten it when the callee
+// is close, unlike the encoder, which leaves it to a relocation.
+static const MachineOpInfo machine_ops[] = {
+  [X_MOV]     = { "mov",     { DEF, USE } },
+  [X_MOVZX]   = { "movzx",   { DEF, USE } },
+  [X_LEA]     = { "lea",     { DEF, 0 } },
+  [X_ADD]     = { "add",     { USE | DEF, USE } },
+  [X_SUB]     = { "sub",     { USE | DEF, USE } },
+  [X_IMUL]    = { "imul",    { USE | DEF, USE } },
+  [X_NEG]     = { "neg",     { USE | DEF } },
+  [X_CMP]     = { "cmp",     { USE, USE } },
+  [X_TEST]    = { "test",    { USE, USE } },
+  [X_CQO]     = { "cqo",     { 0 }, REGISTER_BIT(R_RAX), REGISTER_BIT(R_RDX) },
+  [X_IDIV]    = { "idiv",    { USE }, REGISTER_BIT(R_RAX) | REGISTER_BIT(R_RDX),
+                  REGISTER_BIT(R_RAX) | REGISTER_BIT(R_RDX) },
+  [X_SETCC]   = { "set",     { DEF } },
+  [X_JMP]     = { "jmp",     { 0 } },
+  [X_JCC]     = { "j",       { 0 } },
+  [X_CALL]    = { "call",    { 0 }, 0, SCRATCH_REGISTERS },
+  [X_TAIL_CALL] = { "jmp near", { 0 } },
+  [X_RET]     = { "ret",     { USE } },
+  [X_PUSH]    = { "push",    { USE } },
+  [X_POP]     = { "pop",     { DEF } },
+  [X_SYSCALL] = { "syscall", { 0 }, REGISTER_BIT(R_RAX) | REGISTER_BIT(R_RDI),
+                  REGISTER_BIT(R_RAX) | REGISTER_BIT(R_RCX) | REGISTER_BIT(R_R11) },
+};
+
+typedef enum
+{
+  MO_NONE,
+  MO_REG,
+  MO_IMM,
+  MO_MEM,
+  MO_LABEL,
+} MachineOperandKind;
+
+// Memory is addressed either relative to a global or as `base + index *
+// scale + displacement`, where both registers are optional
+typedef struct
+{
+  MachineOperandKind kind;
+  uint8_t size;               // Of a register in bytes, 8 or 1
+  uint8_t scale;              // Of the index of MO_MEM, 1, 2, 4 or 8
+  int reg;                    // MO_REG, and the base of MO_MEM or NO_REGISTER
+  int index;                  // Of MO_MEM, or NO_REGISTER
+  int64_t value;              // MO_IMM, and the displacement of MO_MEM
+  char *symbol;               // The global of MO_MEM, or MO_LABEL
+} MachineOperand;
+
+typedef struct
+{
+  MachineOp op;
+  Condition cond;             // Of X_SETCC and X_JCC
+  int num_operands;
+  MachineOperand operands[2];
+  uint32_t uses;              // Of calls, the argument registers they read
+} MachineInst;
+
+typedef struct
+{
+  MachineInst *data;
+  int size;
+  int capacity;
+} MachineCode;
+
+typedef struct
+{
+  BasicBlock *block;
+  char *label;                // NULL for the first block, which has the function's
+  int first, end;             // Instructions [first, end) of the code
+} MachineBlock;
+
+// Ranges of positions where a physical register holds a fixed value
+typedef struct
+{
+  int start, end;
+} FixedRange;
+
+typedef struct
+{
+  FixedRange *ranges;
+  int size;
+  int capacity;
+  int cursor;                 // Ranges before it end before the interval being allocated
+} FixedRanges;
+
+// Positions number the points between instructions: instruction `i` reads
+// its operands at 2i and writes its results at 2i + 1. An interval covers
+// every position from the first definition or live-in block start to the
+// last use or live-out block end, without holes.
+struct LiveInterval
+{
+  int vreg;
+  int start, end;             // -1 if the register is never live
+  int reg;                    // NO_REGISTER while unassigned or when spilled
+  int hint;                   // Register, physical or virtual, a copy relates it to
+  int slot;                   // Stack slot when spilled, or -1
+  bool is_defined;
+  bool is_constant;           // Every definition loads the same imm32
+  int64_t constant;
+};
+
+typedef struct
+{
+  char *name;
+  bool is_program_entry;      // `_start`, which never returns
+  bool tail_calls;
+  bool require_tail_calls;
+  MachineCode code;
+  MachineBlock *blocks;
+  int num_blocks;
+  LiveVariables live;
+  int num_vregs;
+  LiveInterval *intervals;    // Per virtual register
+  FixedRanges fixed[NUM_REGISTERS];
+  uint32_t used_preserved;
+  int num_saved;
+  int num_slots;
+  int num_stack_params;       // Received above the return address
+  bool needs_frame;
+} MachineFunction;
+
+static const MachineOperand no_operand = { MO_NONE };
+
+static MachineOperand reg_operand(int reg)
+{
+  return (MachineOperand){ .kind = MO_REG, .size = 8, .reg = reg };
 }
 
-static Register *find_available_register()
+static MachineOperand byte_operand(int reg)
 {
-  for (RegisterID id = R_RAX; id <= R_R12; id++) {
-    Register *reg = &registers[id];
-    if (!reg->is_active) {
-      reg->is_active = true;
-      return reg;
-    }
+  return (MachineOperand){ .kind = MO_REG, .size = 1, .reg = reg };
+}
+
+static MachineOperand imm_operand(int64_t value)
+{
+  return (MachineOperand){ .kind = MO_IMM, .size = 8, .reg = NO_REGISTER, .value = value };
+}
+
+static MachineOperand address_operand(int base, int index, int scale, int64_t displacement)
+{
+  return (MachineOperand){
+    .kind = MO_MEM, .size = 8, .scale = scale, .reg = base, .index = index, .value = displacement,
+  };
+}
+
+static MachineOperand memory_operand(int base, int64_t displacement)
+{
+  return address_operand(base, NO_REGISTER, 1, displacement);
+}
+
+static MachineOperand global_operand(char *name)
+{
+  return (MachineOperand){
+    .kind = MO_MEM, .size = 8, .scale = 1, .reg = NO_REGISTER, .index = NO_REGISTER, .symbol = name,
+  };
+}
+
+static MachineOperand label_operand(char *label)
+{
+  return (MachineOperand){ .kind = MO_LABEL, .reg = NO_REGISTER, .symbol = label };
+}
+
+static bool is_imm32(int64_t value)
+{
+  return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static bool same_register(MachineOperand *a, MachineOperand *b)
+{
+  return a->kind == MO_REG && b->kind == MO_REG && a->reg == b->reg;
+}
+
+static bool same_location(MachineOperand *a, MachineOperand *b)
+{
+  if (a->kind != b->kind)
+    return false;
+  if (a->kind == MO_REG)
+    return a->reg == b->reg;
+  return a->kind == MO_MEM && a->reg == b->reg && a->index == b->index && a->scale == b->scale
+    && a->value == b->value && a->symbol == b->symbol;
+}
+
+// Whether the value of `operand` depends on register `reg`
+static bool reads_register(MachineOperand *operand, int reg)
+{
+  if (operand->kind == MO_REG)
+    return operand->reg == reg;
+  return operand->kind == MO_MEM && (operand->reg == reg || operand->index == reg);
+}
+
+// Memory at an address held in virtual registers
+static bool is_load(MachineOperand *operand)
+{
+  return operand->kind == MO_MEM && (operand->index != NO_REGISTER
+      || (operand->reg != NO_REGISTER && IS_VIRTUAL(operand->reg)));
+}
+
+static MachineInst *push_machine(MachineCode *code, MachineOp op, int num_operands,
+    MachineOperand a, MachineOperand b)
+{
+  if (code->size == code->capacity) {
+    code->capacity = code->capacity ? code->capacity * 2 : 64;
+    code->data = realloc(code->data, code->capacity * sizeof(MachineInst));
   }
-  return NULL;
+  MachineInst *inst = &code->data[code->size++];
+  *inst = (MachineInst){ .op = op, .num_operands = num_operands, .operands = { a, b } };
+  return inst;
 }
 
-static void release_register(RegisterID id)
+static MachineInst *machine(MachineFunction *fn, MachineOp op, int num_operands,
+    MachineOperand a, MachineOperand b)
 {
-  Register *reg = &registers[id];
-  reg->is_active = false;
+  return push_machine(&fn->code, op, num_operands, a, b);
 }
 
-// Directives to allocate memory (in # bytes)
-enum
-{ 
-  DB = 1,
-  DW = 2,
-  DD = 4,
-  DQ = 8,
-  DO = 16,
-  DY = 32,
-  DZ = 64,
-};
+/* Instruction Lowering */
 
-const char *init_mem[] = {
-  [DB] = "db",
-  [DW] = "dw",
-  [DD] = "dd",
-  [DQ] = "dq",
-  [DO] = "do",
-  [DY] = "dy",
-  [DZ] = "dz",
+static Condition comparison_conditions[] = {
+  [OP_CMP] = CC_E,
+  [OP_CMP_NOT] = CC_NE,
+  [OP_CMP_LT] = CC_L,
+  [OP_CMP_GT] = CC_G,
+  [OP_CMP_LT_EQ] = CC_LE,
+  [OP_CMP_GT_EQ] = CC_GE,
 };
 
-enum
+// The condition that holds when the operands are swapped
+static Condition swapped_condition(Condition cond)
 {
-  RESB = 1,
-  RESD = 4,
-  RESQ = 8,
-};
+  switch (cond) {
+    case CC_L: return CC_G;
+    case CC_G: return CC_L;
+    case CC_LE: return CC_GE;
+    case CC_GE: return CC_LE;
+    default: return cond;
+  }
+}
 
-const char *uninit_mem[] = {
-  [RESB] = "resb",
-  [RESD] = "resd",
-  [RESQ] = "resq",
-};
+static Condition inverted_condition(Condition cond)
+{
+  switch (cond) {
+    case CC_E: return CC_NE;
+    case CC_NE: return CC_E;
+    case CC_L: return CC_GE;
+    case CC_G: return CC_LE;
+    case CC_LE: return CC_G;
+    case CC_GE: return CC_L;
+  }
+  return cond;
+}
 
-static void add_bytes(char *bytes, size_t length)
+static int64_t literal_value(Value *literal)
 {
+  switch (literal->kind) {
+    case VAL_INT: return literal->i_val;
+    case VAL_UINT: return (int64_t)literal->u_val;
+    case VAL_CHAR: return literal->c_val;
+    case VAL_BOOL: return literal->b_val;
+    default: fatal("literals of kind %d aren't supported by the NASM backend", literal->kind);
+  }
+  return 0;
+}
 
+static int virtual_register(MachineFunction *fn, char *name)
+{
+  int v = var_map_lookup(&fn->live.vars, name);
+  if (v < 0)
+    fatal("no virtual register for `%s` in function `%s`", name, fn->name);
+  return VIRTUAL_REGISTER(v);
 }
 
-static void add_section(char *section)
+static MachineOperand new_temporary(MachineFunction *fn)
 {
-  add_bytes("section ", 8);
-  add_bytes(section, strlen(section));
-  add_bytes("\n", 2);
+  return reg_operand(VIRTUAL_REGISTER(fn->num_vregs++));
 }
 
-static void add_label(char *label) {
-  add_bytes(label, strlen(label));
-  add_bytes(":\n", 2);
+static MachineOperand in_register(MachineFunction *fn, MachineOperand operand)
+{
+  if (operand.kind == MO_REG)
+    return operand;
+  MachineOperand temporary = new_temporary(fn);
+  machine(fn, X_MOV, 2, temporary, operand);
+  return temporary;
 }
 
-static void add_instruction(char *instruction, char *op1, char *op2) {
-  add_bytes("    ", 4);
-  add_bytes(instruction, strlen(instruction));
+// Branch targets are local to the function, except for its first block
+static char *block_label(MachineFunction *fn, char *tag)
+{
+  if (strcmp(tag, fn->name) == 0)
+    return tag;
+  char *label = aprintf(".%s", tag);
+  char *interned = intern(label);
+  free(label);
+  return interned;
+}
 
-  if (op1) { 
-    add_bytes(" ", 1);
-    add_bytes(op1, strlen(op1)); 
+static void lower_jump(MachineFunction *fn, char *target, BasicBlock *next)
+{
+  if (!next || next->tag != target)
+    machine(fn, X_JMP, 1, label_operand(block_label(fn, target)), no_operand);
+}
+
+// Whether `dst = a` would overwrite a register that `b` still reads
+static bool clobbers(MachineOperand *dst, MachineOperand *a, MachineOperand *b)
+{
+  return !same_register(dst, a) && reads_register(b, dst->reg);
+}
+
+// Two-address form, `dst = a; dst op= b`
+static void lower_arithmetic(MachineFunction *fn, MachineOp op, MachineOperand dst,
+    MachineOperand a, MachineOperand b)
+{
+  bool is_commutative = op != X_SUB;
+  if (is_commutative && (clobbers(&dst, &a, &b) || (a.kind == MO_IMM && b.kind != MO_IMM))
+      && !clobbers(&dst, &b, &a)) {
+    MachineOperand swap = a;
+    a = b;
+    b = swap;
   }
 
-  if (op2) { 
-    add_bytes(", ", 1);
-    add_bytes(op2, strlen(op2));
+  // `x := y - x` can't overwrite `x` before reading it
+  if (clobbers(&dst, &a, &b)) {
+    MachineOperand temporary = new_temporary(fn);
+    machine(fn, X_MOV, 2, temporary, a);
+    machine(fn, op, 2, temporary, b);
+    machine(fn, X_MOV, 2, dst, temporary);
+    return;
   }
 
-  add_bytes("\n", 1);
+  if (!same_register(&dst, &a))
+    machine(fn, X_MOV, 2, dst, a);
+  machine(fn, op, 2, dst, b);
 }
 
-int nasm_x86_64_generate(ControlFlowGraph *graph)
+static void lower_division(MachineFunction *fn, MachineOperand dst, MachineOperand a,
+    MachineOperand b)
 {
-#ifdef DEBUG
-  printf("Available Registers:\n");
-#endif
-  for (RegisterID id = R_RAX; id <= R_R12; id++) {
-    registers[id] = REGISTERS_NASM_x86_64[id];
-#ifdef DEBUG
-    printf("%*s%s\t%s\t%s\n", 4, "",
-        registers[id].name,
-        registers[id].is_preserved ? "preserved" : "scratch",
-        registers[id].is_active ? "active" : "");
-#endif
+  MachineOperand rax = reg_operand(R_RAX);
+  if (b.kind == MO_IMM)
+    b = in_register(fn, b);
+  machine(fn, X_MOV, 2, rax, a);
+  machine(fn, X_CQO, 0, no_operand, no_operand);
+  machine(fn, X_IDIV, 1, b, no_operand);
+  machine(fn, X_MOV, 2, dst, rax);
+}
+
+// Sets the flags for `a <cond> b`, returning the condition to test them for.
+// A load goes first, where legalizing the other operand after register
+// allocation can't clobber its address.
+static Condition lower_comparison(MachineFunction *fn, Condition cond, MachineOperand a,
+    MachineOperand b)
+{
+  if ((a.kind == MO_IMM && b.kind == MO_IMM) || (is_load(&a) && is_load(&b)))
+    a = in_register(fn, a);
+  if (a.kind == MO_IMM || (is_load(&b) && !is_load(&a))) {
+    MachineOperand swap = a;
+    a = b;
+    b = swap;
+    cond = swapped_condition(cond);
   }
+  machine(fn, X_CMP, 2, a, b);
+  return cond;
+}
 
-  // Allocate space for uninitialized global variables
-  add_section(".bss");
-
-  for (size_t i = 0; i < SYMBOL_TABLE_SIZE; i++) {
-    Symbol *symbol = ctx->global_scope->symbols[i];
-    if (symbol->name && symbol->kind == SYMBOL_VARIABLE) {
-      Type type = symbol->type;
-      add_bytes("    ", 4);
-      add_bytes(symbol->name, strlen(symbol->name));
-      add_bytes(": ", 2);
-
-#define DATA_SZ 32
-      // TODO: fix this
-      char data[DATA_SZ] = { 0 };
-      int length = 0;
-
-      // Try to reserve memory using the directive which is the GCD of the type size
-      int rem = 0;
-      uint8_t directives[2] = { RESQ, RESD };
-      for (uint8_t d = 0; d < 2; d++) {
-        if ((rem = type.size % directives[d]) == 0) {
-          add_bytes(uninit_mem[d], 4);
-          length = snprintf(data, DATA_SZ, " %d\n", rem);
-          add_bytes(data, length);
-        }
-      }
+// Jumps to `then` when the flags satisfy `taken`, and to `otherwise` when
+// they don't, falling through to the next block where possible
+static void lower_branch(MachineFunction *fn, Condition taken, char *then, char *otherwise,
+    BasicBlock *next)
+{
+  if (next && next->tag == then) {
+    MachineInst *jump = machine(fn, X_JCC, 1, label_operand(block_label(fn, otherwise)), no_operand);
+    jump->cond = inverted_condition(taken);
+    return;
+  }
+  MachineInst *jump = machine(fn, X_JCC, 1, label_operand(block_label(fn, then)), no_operand);
+  jump->cond = taken;
+  lower_jump(fn, otherwise, next);
+}
 
-      if (length == 0) {
-        add_bytes(uninit_mem[RESB], 4);
-        length = snprintf(data, DATA_SZ, " %d\n", rem);
-        add_bytes(data, length);
-      }
+// Parameters arrive in the argument registers and then on the stack, above
+// the return address and the saved frame pointer
+static void lower_parameters(MachineFunction *fn, Instruction *def)
+{
+  for (uint32_t p = 1; p < def->num_operands; p++) {
+    MachineOperand param = reg_operand(virtual_register(fn, def->operands[p].var));
+    uint32_t index = p - 1;
+    if (index < NUM_ARGUMENT_REGISTERS) {
+      machine(fn, X_MOV, 2, param, reg_operand(ARGUMENT_REGISTERS[index]));
+    } else {
+      fn->needs_frame = true;
+      fn->num_stack_params++;
+      int64_t offset = 16 + 8 * (int64_t)(index - NUM_ARGUMENT_REGISTERS);
+      machine(fn, X_MOV, 2, param, memory_operand(R_RBP, offset));
+    }
+  }
+}
+
+static MachineOperand argument_operand(MachineFunction *fn, Operand *arg)
+{
+  switch (arg->kind) {
+    case OPERAND_VARIABLE: return reg_operand(virtual_register(fn, arg->var));
+    case OPERAND_GLOBAL: return global_operand(arg->var);
+    case OPERAND_LITERAL: return imm_operand(literal_value(&arg->literal));
+    default: fatal("can't pass an operand of kind %d in function `%s`", arg->kind, fn->name);
+  }
+  return no_operand;
+}
 
-      // For .data section:
-      //if (symbol->is_initialized) {
-      //    bool allocated = false;
-      //    for (int sz = DB; sz <= DZ; sz <<= 1) {
-      //        int size = symbol->type.size;
-      //        if (size == sz) {
-      //            const char *directive = mem_alloc_directive[size];
-      //            add_bytes(code->buffer, INDENT);
-      //            add_bytes(code->buffer, symbol->name, strlen(symbol->name));
-      //            add_bytes(code->buffer, " ", 1);
-      //            add_bytes(code->buffer, directive, strlen(directive));
+// Arguments past the registers are pushed last to first, below padding that
+// keeps the stack 16-byte aligned at the call. The call defines every
+// scratch register, so values live across it are allocated preserved ones
+// or stack slots, and nothing else is saved around it. Functions that call
+// align the stack in their frame, except for `_start`, which the kernel
+// enters with it aligned.
+static void lower_call(MachineFunction *fn, char *callee, Operand *args, uint32_t num_args,
+    char *result)
+{
+  fn->needs_frame |= !fn->is_program_entry;
+  uint32_t num_pushed = num_args > NUM_ARGUMENT_REGISTERS ? num_args - NUM_ARGUMENT_REGISTERS : 0;
+  int64_t stack_size = 8 * (int64_t)(num_pushed + num_pushed % 2);
+  if (num_pushed % 2)
+    machine(fn, X_SUB, 2, reg_operand(R_RSP), imm_operand(8));
+  for (uint32_t a = num_args; a-- > NUM_ARGUMENT_REGISTERS;)
+    machine(fn, X_PUSH, 1, argument_operand(fn, &args[a]), no_operand);
 
-      //            char literal[128];
-      //            int length = 0;
-      //            switch (symbol->type.kind) {
-      //                case TYPE_VOID: 
-      //                    fatal("cannot allocate memory for void type");
-      //                    break;
-      //                case TYPE_INT:
-      //                    break;
-      //                default: fatal("invalid type in codegen: %d", symbol->type.kind);
-      //            }
+  uint32_t uses = 0;
+  for (uint32_t a = 0; a < num_args && a < NUM_ARGUMENT_REGISTERS; a++) {
+    machine(fn, X_MOV, 2, reg_operand(ARGUMENT_REGISTERS[a]), argument_operand(fn, &args[a]));
+    uses |= REGISTER_BIT(ARGUMENT_REGISTERS[a]);
+  }
+  machine(fn, X_CALL, 1, label_operand(callee), no_operand)->uses = uses;
+  if (stack_size)
+    machine(fn, X_ADD, 2, reg_operand(R_RSP), imm_operand(stack_size));
+  if (result)
+    machine(fn, X_MOV, 2, reg_operand(virtual_register(fn, result)), reg_operand(R_RAX));
+}
 
-      //            add_bytes(code->buffer, literal, length);
-      //            allocated = true;
-      //        }
-      //    }
+// A tail call jumps to the callee once the frame is gone, so that it
+// returns straight to the caller's caller. Arguments past the registers
+// overwrite the ones the caller received, which only has room for as many.
+static bool lower_tail_call(MachineFunction *fn, Instruction *call)
+{
+  char *callee = call->operands[0].label;
+  Operand *args = &call->operands[1];
+  uint32_t num_args = call->num_operands - 1;
+  uint32_t num_pushed = num_args > NUM_ARGUMENT_REGISTERS ? num_args - NUM_ARGUMENT_REGISTERS : 0;
+  if (num_pushed > (uint32_t)fn->num_stack_params) {
+    if (fn->require_tail_calls)
+      fatal("the call to `%s` in `%s` can't be a tail call, as it passes more arguments on "
+          "the stack than `%s` received", callee, fn->name, fn->name);
+    LOG_INFO("not making the call to `%s` in `%s` a tail call, as it passes more arguments on "
+        "the stack than `%s` received", callee, fn->name, fn->name);
+    return false;
+  }
 
-      //    if (!allocated) {
-      //        fatal("global struct initialization not yet supported!");
-      //    }
-      //}
-    }
+  for (uint32_t a = NUM_ARGUMENT_REGISTERS; a < num_args; a++) {
+    int64_t offset = 16 + 8 * (int64_t)(a - NUM_ARGUMENT_REGISTERS);
+    machine(fn, X_MOV, 2, memory_operand(R_RBP, offset), argument_operand(fn, &args[a]));
   }
+  uint32_t uses = 0;
+  for (uint32_t a = 0; a < num_args && a < NUM_ARGUMENT_REGISTERS; a++) {
+    machine(fn, X_MOV, 2, reg_operand(ARGUMENT_REGISTERS[a]), argument_operand(fn, &args[a]));
+    uses |= REGISTER_BIT(ARGUMENT_REGISTERS[a]);
+  }
+  machine(fn, X_TAIL_CALL, 1, label_operand(callee), no_operand)->uses = uses;
+  return true;
+}
 
-  add_section(".text");
-  add_instruction("global", "_start", NULL);
+/* Instruction Selection */
 
-  add_label("_start");
+// Bottom-up rewriting over expression trees. A value that a block computes
+// and then uses exactly once, with nothing it reads changing in between,
+// becomes a subtree of its use, so that one instruction can cover several IR
+// operations. Every node is labeled with the cheapest rule deriving each
+// nonterminal from it, and the rules of the cheapest cover then emit code
+// from the leaves up.
 
-  return 0;
+typedef enum
+{
+  NT_NONE,
+  NT_REG,                     // A register
+  NT_IMM,                     // A 32-bit immediate
+  NT_MEM,                     // A global
+  NT_LOAD,                    // Memory at an address in registers
+  NT_SOURCE,                  // Any of the above
+  NT_INDEX,                   // A register scaled by 1, 2, 4 or 8
+  NT_ADDR,                    // base + index * scale + displacement
+  NT_CC,                      // Flags, and the condition that holds for them
+  NUM_NONTERMINALS,
+} Nonterminal;
+
+// Besides IR opcodes
+enum
+{
+  TREE_VARIABLE = OP_STORE + 1,
+  TREE_LITERAL,
+  TREE_GLOBAL,
+  TREE_COMPARE,               // Any comparison
+  TREE_CHAIN,                 // Derives one nonterminal from another of the same node
+};
+
+typedef struct TreeNode TreeNode;
+
+struct TreeNode
+{
+  int op;
+  TreeNode *kids[2];
+  Operand *leaf;
+  int dst;                    // Register the operation assigns, or NO_REGISTER
+  int index;                  // Of the instruction whose tree it's the root of
+  int cost[NUM_NONTERMINALS];
+  uint8_t rule[NUM_NONTERMINALS];
+};
+
+typedef struct
+{
+  MachineOperand operand;
+  Condition cond;             // Of NT_CC
+} Selected;
+
+typedef bool (*RuleCondition)(TreeNode *node);
+typedef Selected (*RuleAction)(MachineFunction *fn, TreeNode *node, Selected *kids);
+
+typedef struct
+{
+  const char *name;
+  Nonterminal lhs;
+  int op;
+  Nonterminal kids[2];        // The source nonterminal of a chain rule comes first
+  int cost;
+  RuleCondition condition;
+  RuleAction action;
+} SelectionRule;
+
+#define NO_COVER (INT32_MAX / 4)
+
+static int64_t leaf_value(TreeNode *node)
+{
+  return node->op == TREE_LITERAL ? literal_value(&node->leaf->literal) : 0;
+}
+
+static bool is_imm32_leaf(TreeNode *node)
+{
+  return is_imm32(leaf_value(node));
+}
+
+static bool is_scale(int64_t value)
+{
+  return value == 1 || value == 2 || value == 4 || value == 8;
+}
+
+static bool is_scale_plus_one(int64_t value)
+{
+  return value == 3 || value == 5 || value == 9;
+}
+
+static bool scales_right(TreeNode *node)
+{
+  return is_scale(leaf_value(node->kids[1]));
+}
+
+static bool scales_left(TreeNode *node)
+{
+  return is_scale(leaf_value(node->kids[0]));
+}
+
+static bool scales_base_right(TreeNode *node)
+{
+  return is_scale_plus_one(leaf_value(node->kids[1]));
+}
+
+static bool scales_base_left(TreeNode *node)
+{
+  return is_scale_plus_one(leaf_value(node->kids[0]));
+}
+
+static bool is_zero_right(TreeNode *node)
+{
+  return node->kids[1]->op == TREE_LITERAL && leaf_value(node->kids[1]) == 0;
+}
+
+static bool is_zero_left(TreeNode *node)
+{
+  return node->kids[0]->op == TREE_LITERAL && leaf_value(node->kids[0]) == 0;
+}
+
+static bool negates_to_imm32(TreeNode *node)
+{
+  return leaf_value(node->kids[1]) != INT32_MIN;
+}
+
+// Where an operation leaves its value; leaves that need a register get a
+// temporary
+static MachineOperand destination(MachineFunction *fn, TreeNode *node)
+{
+  return node->dst != NO_REGISTER ? reg_operand(node->dst) : new_temporary(fn);
+}
+
+static Selected selected(MachineOperand operand)
+{
+  return (Selected){ .operand = operand };
+}
+
+static Selected select_first(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  return kids[0];
+}
+
+static Selected select_variable(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  return selected(reg_operand(virtual_register(fn, node->leaf->var)));
+}
+
+static Selected select_literal(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  return selected(imm_operand(leaf_value(node)));
+}
+
+static Selected select_load_literal(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  MachineOperand dst = destination(fn, node);
+  machine(fn, X_MOV, 2, dst, imm_operand(leaf_value(node)));
+  return selected(dst);
+}
+
+static Selected select_global(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  return selected(global_operand(node->leaf->var));
+}
+
+static Selected select_move(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  MachineOperand dst = destination(fn, node);
+  if (!same_register(&dst, &kids[0].operand))
+    machine(fn, X_MOV, 2, dst, kids[0].operand);
+  return selected(dst);
+}
+
+static Selected select_arithmetic(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  MachineOperand dst = destination(fn, node);
+  MachineOp op = node->op == OP_ADD ? X_ADD : node->op == OP_SUB ? X_SUB : X_IMUL;
+  lower_arithmetic(fn, op, dst, kids[0].operand, kids[1].operand);
+  return selected(dst);
+}
+
+static Selected select_division(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  MachineOperand dst = destination(fn, node);
+  lower_division(fn, dst, kids[0].operand, kids[1].operand);
+  return selected(dst);
+}
+
+static Selected select_negation(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  MachineOperand dst = destination(fn, node);
+  if (!same_register(&dst, &kids[0].operand))
+    machine(fn, X_MOV, 2, dst, kids[0].operand);
+  machine(fn, X_NEG, 1, dst, no_operand);
+  return selected(dst);
+}
+
+static Selected select_address_of(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  MachineOperand dst = destination(fn, node);
+  machine(fn, X_LEA, 2, dst, kids[0].operand);
+  return selected(dst);
+}
+
+static Selected select_address_of_local(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  fatal("taking the address of local `%s` isn't supported by the NASM backend",
+      node->kids[0]->leaf->var);
+  return kids[0];
+}
+
+static Selected select_index(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  int scaled = kids[0].operand.kind == MO_REG ? 0 : 1;
+  int64_t scale = kids[1 - scaled].operand.value;
+  return selected(address_operand(NO_REGISTER, kids[scaled].operand.reg, scale, 0));
+}
+
+static Selected select_scaled_base(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  int scaled = kids[0].operand.kind == MO_REG ? 0 : 1;
+  int64_t scale = kids[1 - scaled].operand.value - 1;
+  int reg = kids[scaled].operand.reg;
+  return selected(address_operand(reg, reg, scale, 0));
+}
+
+static Selected select_base(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  return selected(memory_operand(kids[0].operand.reg, 0));
+}
+
+// `[x*2]` is shorter as `[x+x]`, and `[x*1]` is just `[x]`
+static Selected select_scaled_index(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  MachineOperand address = kids[0].operand;
+  if (address.scale <= 2) {
+    address.reg = address.index;
+    address.index = address.scale == 2 ? address.index : NO_REGISTER;
+    address.scale = 1;
+  }
+  return selected(address);
+}
+
+static Selected select_base_index(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  int base = kids[0].operand.kind == MO_REG ? 0 : 1;
+  MachineOperand address = kids[1 - base].operand;
+  address.reg = kids[base].operand.reg;
+  return selected(address);
+}
+
+static Selected select_base_base(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  return selected(address_operand(kids[0].operand.reg, kids[1].operand.reg, 1, 0));
+}
+
+static Selected select_lea(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  MachineOperand dst = destination(fn, node);
+  MachineOperand address = kids[0].operand;
+  if (address.index == NO_REGISTER && !address.value)
+    machine(fn, X_MOV, 2, dst, reg_operand(address.reg));
+  else
+    machine(fn, X_LEA, 2, dst, address);
+  return selected(dst);
+}
+
+// Displacements that no longer fit in 32 bits start over from the address
+// so far
+static Selected add_displacement(MachineFunction *fn, TreeNode *node, MachineOperand address,
+    int64_t displacement)
+{
+  if (is_imm32(address.value + displacement)) {
+    address.value += displacement;
+    return selected(address);
+  }
+  MachineOperand base = destination(fn, node);
+  machine(fn, X_LEA, 2, base, address);
+  return selected(memory_operand(base.reg, displacement));
+}
+
+static Selected select_displacement(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  int address = kids[0].operand.kind == MO_MEM ? 0 : 1;
+  return add_displacement(fn, node, kids[address].operand, kids[1 - address].operand.value);
+}
+
+static Selected select_negative_displacement(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  return add_displacement(fn, node, kids[0].operand, -kids[1].operand.value);
+}
+
+static Selected select_compare(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  Condition cond = comparison_conditions[node->op];
+  return (Selected){ .cond = lower_comparison(fn, cond, kids[0].operand, kids[1].operand) };
+}
+
+static Selected select_test(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  int tested = kids[0].operand.kind == MO_REG ? 0 : 1;
+  Condition cond = comparison_conditions[node->op];
+  machine(fn, X_TEST, 2, kids[tested].operand, kids[tested].operand);
+  return (Selected){ .cond = tested ? swapped_condition(cond) : cond };
+}
+
+static Selected select_test_value(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  machine(fn, X_TEST, 2, kids[0].operand, kids[0].operand);
+  return (Selected){ .cond = node->op == OP_NOT ? CC_E : CC_NE };
+}
+
+static Selected select_not(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  return (Selected){ .cond = inverted_condition(kids[0].cond) };
+}
+
+static Selected select_setcc(MachineFunction *fn, TreeNode *node, Selected *kids)
+{
+  MachineOperand dst = destination(fn, node);
+  machine(fn, X_SETCC, 1, dst, no_operand)->cond = kids[0].cond;
+  return selected(dst);
+}
+
+// Costs count instructions, with multiplication and division weighted by
+// their latency. Ties go to the rule listed first.
+//
+//  name                    lhs        operator       kids                   cost condition
+//                                                                                action
+#define SELECTION_RULES(X) \
+  X(VARIABLE,               NT_REG,    TREE_VARIABLE, NT_NONE,   NT_NONE,   0, NULL, \
+                                                                                select_variable) \
+  X(IMMEDIATE,              NT_IMM,    TREE_LITERAL,  NT_NONE,   NT_NONE,   0, is_imm32_leaf, \
+                                                                                select_literal) \
+  X(LOAD_LITERAL,           NT_REG,    TREE_LITERAL,  NT_NONE,   NT_NONE,   1, NULL, \
+                                                                                select_load_literal) \
+  X(GLOBAL,                 NT_MEM,    TREE_GLOBAL,   NT_NONE,   NT_NONE,   0, NULL, \
+                                                                                select_global) \
+  X(LOAD_GLOBAL,            NT_REG,    TREE_CHAIN,    NT_MEM,    NT_NONE,   1, NULL, \
+                                                                                select_move) \
+  X(LOAD_MEMORY,            NT_REG,    TREE_CHAIN,    NT_LOAD,   NT_NONE,   1, NULL, \
+                                                                                select_move) \
+  X(REG_SOURCE,             NT_SOURCE, TREE_CHAIN,    NT_REG,    NT_NONE,   0, NULL, \
+                                                                                select_first) \
+  X(IMM_SOURCE,             NT_SOURCE, TREE_CHAIN,    NT_IMM,    NT_NONE,   0, NULL, \
+                                                                                select_first) \
+  X(MEM_SOURCE,             NT_SOURCE, TREE_CHAIN,    NT_MEM,    NT_NONE,   0, NULL, \
+                                                                                select_first) \
+  X(LOAD_SOURCE,            NT_SOURCE, TREE_CHAIN,    NT_LOAD,   NT_NONE,   0, NULL, \
+                                                                                select_first) \
+  X(COPY,                   NT_REG,    OP_ASSIGN,     NT_SOURCE, NT_NONE,   1, NULL, \
+                                                                                select_move) \
+  X(ADD,                    NT_REG,    OP_ADD,        NT_SOURCE, NT_SOURCE, 2, NULL, \
+                                                                                select_arithmetic) \
+  X(SUB,                    NT_REG,    OP_SUB,        NT_SOURCE, NT_SOURCE, 2, NULL, \
+                                                                                select_arithmetic) \
+  X(MUL,                    NT_REG,    OP_MUL,        NT_SOURCE, NT_SOURCE, 4, NULL, \
+                                                                                select_arithmetic) \
+  X(DIV,                    NT_REG,    OP_DIV,        NT_SOURCE, NT_SOURCE, 24, NULL, \
+                                                                                select_division) \
+  X(NEG,                    NT_REG,    OP_NEG,        NT_SOURCE, NT_NONE,   2, NULL, \
+                                                                                select_negation) \
+  X(ADDRESS_OF,             NT_REG,    OP_ADDR,       NT_MEM,    NT_NONE,   1, NULL, \
+                                                                                select_address_of) \
+  X(ADDRESS_OF_LOCAL,       NT_REG,    OP_ADDR,       NT_REG,    NT_NONE,   1, NULL, \
+                                                                                select_address_of_local) \
+  X(DEREF,                  NT_LOAD,   OP_DEREF,      NT_ADDR,   NT_NONE,   0, NULL, \
+                                                                                select_first) \
+  X(INDEX,                  NT_INDEX,  OP_MUL,        NT_REG,    NT_IMM,    0, scales_right, \
+                                                                                select_index) \
+  X(INDEX_SWAPPED,          NT_INDEX,  OP_MUL,        NT_IMM,    NT_REG,    0, scales_left, \
+                                                                                select_index) \
+  X(SCALED_BASE,            NT_ADDR,   OP_MUL,        NT_REG,    NT_IMM,    0, scales_base_right, \
+                                                                                select_scaled_base) \
+  X(SCALED_BASE_SWAPPED,    NT_ADDR,   OP_MUL,        NT_IMM,    NT_REG,    0, scales_base_left, \
+                                                                                select_scaled_base) \
+  X(BASE,                   NT_ADDR,   TREE_CHAIN,    NT_REG,    NT_NONE,   0, NULL, \
+                                                                                select_base) \
+  X(SCALED_INDEX,           NT_ADDR,   TREE_CHAIN,    NT_INDEX,  NT_NONE,   0, NULL, \
+                                                                                select_scaled_index) \
+  X(BASE_INDEX,             NT_ADDR,   OP_ADD,        NT_REG,    NT_INDEX,  0, NULL, \
+                                                                                select_base_index) \
+  X(INDEX_BASE,             NT_ADDR,   OP_ADD,        NT_INDEX,  NT_REG,    0, NULL, \
+                                                                                select_base_index) \
+  X(BASE_BASE,              NT_ADDR,   OP_ADD,        NT_REG,    NT_REG,    0, NULL, \
+                                                                                select_base_base) \
+  X(DISPLACEMENT,           NT_ADDR,   OP_ADD,        NT_ADDR,   NT_IMM,    0, NULL, \
+                                                                                select_displacement) \
+  X(DISPLACEMENT_SWAPPED,   NT_ADDR,   OP_ADD,        NT_IMM,    NT_ADDR,   0, NULL, \
+                                                                                select_displacement) \
+  X(NEGATIVE_DISPLACEMENT,  NT_ADDR,   OP_SUB,        NT_ADDR,   NT_IMM,    0, negates_to_imm32, \
+                                                                                select_negative_displacement) \
+  X(LEA,                    NT_REG,    TREE_CHAIN,    NT_ADDR,   NT_NONE,   1, NULL, \
+                                                                                select_lea) \
+  X(TEST,                   NT_CC,     TREE_COMPARE,  NT_REG,    NT_IMM,    1, is_zero_right, \
+                                                                                select_test) \
+  X(TEST_SWAPPED,           NT_CC,     TREE_COMPARE,  NT_IMM,    NT_REG,    1, is_zero_left, \
+                                                                                select_test) \
+  X(COMPARE,                NT_CC,     TREE_COMPARE,  NT_SOURCE, NT_SOURCE, 1, NULL, \
+                                                                                select_compare) \
+  X(NOT,                    NT_CC,     OP_NOT,        NT_CC,     NT_NONE,   0, NULL, \
+                                                                                select_not) \
+  X(NOT_VALUE,              NT_CC,     OP_NOT,        NT_REG,    NT_NONE,   1, NULL, \
+                                                                                select_test_value) \
+  X(TEST_VALUE,             NT_CC,     TREE_CHAIN,    NT_REG,    NT_NONE,   1, NULL, \
+                                                                                select_test_value) \
+  X(SETCC,                  NT_REG,    TREE_CHAIN,    NT_CC,     NT_NONE,   2, NULL, \
+                                                                                select_setcc)
+
+#define SELECTION_RULE_ID(name, ...) RULE_##name,
+#define SELECTION_RULE(name, lhs, op, left, right, cost, condition, action) \
+  { #name, lhs, op, { left, right }, cost, condition, action },
+
+enum
+{
+  SELECTION_RULES(SELECTION_RULE_ID)
+  NUM_SELECTION_RULES,
+};
+
+static const SelectionRule selection_rules[] = {
+  SELECTION_RULES(SELECTION_RULE)
+};
+
+static bool rule_matches(const SelectionRule *rule, TreeNode *node)
+{
+  if (rule->op == TREE_COMPARE)
+    return node->op >= OP_CMP && node->op <= OP_CMP_GT_EQ;
+  return rule->op == node->op;
+}
+
+static void label_tree(TreeNode *node)
+{
+  for (int k = 0; k < 2; k++) {
+    if (node->kids[k])
+      label_tree(node->kids[k]);
+  }
+  for (int nt = 0; nt < NUM_NONTERMINALS; nt++)
+    node->cost[nt] = NO_COVER;
+
+  for (int r = 0; r < NUM_SELECTION_RULES; r++) {
+    const SelectionRule *rule = &selection_rules[r];
+    if (rule->op == TREE_CHAIN || !rule_matches(rule, node))
+      continue;
+    int cost = rule->cost;
+    for (int k = 0; k < 2; k++) {
+      if (rule->kids[k] != NT_NONE)
+        cost += node->kids[k] ? node->kids[k]->cost[rule->kids[k]] : NO_COVER;
+    }
+    if (cost < node->cost[rule->lhs] && (!rule->condition || rule->condition(node))) {
+      node->cost[rule->lhs] = cost;
+      node->rule[rule->lhs] = r;
+    }
+  }
+
+  // Chain rules until nothing gets cheaper
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int r = 0; r < NUM_SELECTION_RULES; r++) {
+      const SelectionRule *rule = &selection_rules[r];
+      if (rule->op != TREE_CHAIN)
+        continue;
+      int cost = node->cost[rule->kids[0]] + rule->cost;
+      if (cost < node->cost[rule->lhs]) {
+        node->cost[rule->lhs] = cost;
+        node->rule[rule->lhs] = r;
+        changed = true;
+      }
+    }
+  }
+}
+
+static Selected reduce_tree(MachineFunction *fn, TreeNode *node, Nonterminal nt)
+{
+  if (node->cost[nt] >= NO_COVER)
+    fatal("no instructions for an operation with opcode %d in function `%s`", node->op, fn->name);
+  const SelectionRule *rule = &selection_rules[node->rule[nt]];
+  Selected kids[2] = { 0 };
+  if (rule->op == TREE_CHAIN) {
+    kids[0] = reduce_tree(fn, node, rule->kids[0]);
+  } else {
+    for (int k = 0; k < 2; k++) {
+      if (rule->kids[k] != NT_NONE)
+        kids[k] = reduce_tree(fn, node->kids[k], rule->kids[k]);
+    }
+  }
+  return rule->action(fn, node, kids);
+}
+
+static Selected select_tree(MachineFunction *fn, TreeNode *node, Nonterminal nt)
+{
+  label_tree(node);
+  return reduce_tree(fn, node, nt);
+}
+
+/* Trees */
+
+// Counts of definitions and uses of each local in the function
+typedef struct
+{
+  int *defs;
+  int *uses;
+  TreeNode **pending;         // Per local, the tree computing it while it may still be folded
+} TreeCounts;
+
+typedef struct
+{
+  TreeNode *nodes;
+  int num_nodes;
+  TreeNode **roots;           // Per instruction
+  bool *folded;               // Per instruction, whether it's part of a later tree
+  Vector pending;             // Trees that may still be folded into a use
+} BlockTrees;
+
+static bool is_foldable(OpCode opcode)
+{
+  switch (opcode) {
+    case OP_ASSIGN:
+    case OP_NEG:
+    case OP_NOT:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_CMP:
+    case OP_CMP_NOT:
+    case OP_CMP_LT:
+    case OP_CMP_GT:
+    case OP_CMP_LT_EQ:
+    case OP_CMP_GT_EQ:
+    case OP_DEREF:
+    case OP_ADDR:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void count_definitions(MachineFunction *fn, TreeCounts *counts)
+{
+  size_t count = fn->live.vars.count + 1;
+  counts->defs = calloc(count, sizeof(int));
+  counts->uses = calloc(count, sizeof(int));
+  counts->pending = calloc(count, sizeof(TreeNode *));
+  Dataflow *flow = &fn->live.flow;
+  for (int b = 0; b < flow->num_blocks; b++) {
+    Vector *instructions = &flow->order[b]->instructions;
+    for (size_t i = 0; i < instructions->size; i++) {
+      Instruction *inst = instructions->data[i];
+      if (inst->assignee)
+        counts->defs[virtual_register(fn, inst->assignee) - NUM_REGISTERS]++;
+      for (uint32_t o = 0; o < inst->num_operands; o++) {
+        if (inst->operands[o].kind != OPERAND_VARIABLE)
+          continue;
+        int v = virtual_register(fn, inst->operands[o].var) - NUM_REGISTERS;
+        if (inst->opcode == OP_DEF)
+          counts->defs[v]++;
+        else
+          counts->uses[v]++;
+      }
+    }
+  }
+}
+
+static void free_tree_counts(TreeCounts *counts)
+{
+  free(counts->defs);
+  free(counts->uses);
+  free(counts->pending);
+}
+
+static TreeNode *new_tree_node(BlockTrees *trees, int op)
+{
+  TreeNode *node = &trees->nodes[trees->num_nodes++];
+  *node = (TreeNode){ .op = op, .dst = NO_REGISTER };
+  return node;
+}
+
+static bool tree_reads(TreeNode *node, char *var, bool memory)
+{
+  if (!node)
+    return false;
+  if (node->op == TREE_VARIABLE)
+    return node->leaf->var == var;
+  if (node->op == TREE_GLOBAL || node->op == OP_DEREF)
+    return memory || (node->op == TREE_GLOBAL && node->leaf->var == var)
+      || tree_reads(node->kids[0], var, memory);
+  return tree_reads(node->kids[0], var, memory) || tree_reads(node->kids[1], var, memory);
+}
+
+// Trees that read what an instruction writes are computed where they are
+// rather than at their use
+static void kill_pending(BlockTrees *trees, TreeCounts *counts, char *var, bool memory)
+{
+  Vector *pending = &trees->pending;
+  size_t kept = 0;
+  for (size_t p = 0; p < pending->size; p++) {
+    TreeNode *node = pending->data[p];
+    if (counts->pending[node->dst - NUM_REGISTERS] != node)
+      continue;
+    if (tree_reads(node, var, memory))
+      counts->pending[node->dst - NUM_REGISTERS] = NULL;
+    else
+      pending->data[kept++] = node;
+  }
+  pending->size = kept;
+}
+
+static TreeNode *operand_tree(MachineFunction *fn, BlockTrees *trees, TreeCounts *counts,
+    Operand *operand)
+{
+  if (operand->kind == OPERAND_VARIABLE) {
+    int v = virtual_register(fn, operand->var) - NUM_REGISTERS;
+    TreeNode *folded = counts->pending[v];
+    if (folded) {
+      counts->pending[v] = NULL;
+      trees->folded[folded->index] = true;
+      return folded;
+    }
+  }
+
+  int op = operand->kind == OPERAND_VARIABLE ? TREE_VARIABLE
+    : operand->kind == OPERAND_GLOBAL ? TREE_GLOBAL : TREE_LITERAL;
+  TreeNode *leaf = new_tree_node(trees, op);
+  leaf->leaf = operand;
+  return leaf;
+}
+
+// Turns the instructions of a block into trees, folding single uses
+static void build_trees(MachineFunction *fn, BasicBlock *block, bool *skip, BlockTrees *trees,
+    TreeCounts *counts)
+{
+  Vector *instructions = &block->instructions;
+  int max_nodes = 0;
+  for (size_t i = 0; i < instructions->size; i++)
+    max_nodes += 1 + ((Instruction *)instructions->data[i])->num_operands;
+  trees->nodes = malloc((max_nodes + 1) * sizeof(TreeNode));
+  trees->num_nodes = 0;
+  trees->roots = calloc(instructions->size + 1, sizeof(TreeNode *));
+  trees->folded = calloc(instructions->size + 1, sizeof(bool));
+  vector_init(&trees->pending, sizeof(TreeNode *));
+
+  Dataflow *flow = &fn->live.flow;
+  Bitset *live_out = &flow->out[dataflow_index(flow, block)];
+  for (size_t i = 0; i < instructions->size; i++) {
+    Instruction *inst = instructions->data[i];
+    if (skip && skip[i])
+      continue;
+
+    TreeNode *root = NULL;
+    switch (inst->opcode) {
+      case OP_DEF:
+      case OP_JMP:
+        break;
+      case OP_BR:
+      case OP_RET:
+        if (inst->num_operands)
+          root = operand_tree(fn, trees, counts, &inst->operands[0]);
+        break;
+      case OP_STORE:
+        root = operand_tree(fn, trees, counts, &inst->operands[1]);
+        break;
+      case OP_CALL:
+        break;
+      default:
+        root = new_tree_node(trees, inst->opcode);
+        for (uint32_t o = 0; o < inst->num_operands && o < 2; o++)
+          root->kids[o] = operand_tree(fn, trees, counts, &inst->operands[o]);
+        root->dst = virtual_register(fn, inst->assignee);
+        // A copy of a folded tree computes it in place
+        if (inst->opcode == OP_ASSIGN && root->kids[0]->dst != NO_REGISTER) {
+          root->kids[0]->dst = root->dst;
+          root = root->kids[0];
+        }
+        break;
+    }
+    trees->roots[i] = root;
+    if (root)
+      root->index = i;
+
+    if (inst->assignee)
+      kill_pending(trees, counts, inst->assignee, false);
+    if (inst->opcode == OP_STORE)
+      kill_pending(trees, counts, inst->operands[0].var, true);
+    if (inst->opcode == OP_CALL)
+      kill_pending(trees, counts, NULL, true);
+
+    if (inst->assignee && is_foldable(inst->opcode)) {
+      int v = root->dst - NUM_REGISTERS;
+      if (counts->defs[v] == 1 && counts->uses[v] == 1 && !bitset_test(live_out, v)) {
+        counts->pending[v] = root;
+        vector_push_back(&trees->pending, root);
+      }
+    }
+  }
+
+  // Values used in a later block or never keep their own instruction
+  for (size_t p = 0; p < trees->pending.size; p++) {
+    TreeNode *node = trees->pending.data[p];
+    counts->pending[node->dst - NUM_REGISTERS] = NULL;
+  }
+}
+
+static void free_block_trees(BlockTrees *trees)
+{
+  free(trees->nodes);
+  free(trees->roots);
+  free(trees->folded);
+  vector_free(&trees->pending);
+}
+
+static void select_instruction(MachineFunction *fn, Instruction *inst, TreeNode *tree,
+    BasicBlock *next)
+{
+  switch (inst->opcode) {
+    case OP_DEF:
+      lower_parameters(fn, inst);
+      break;
+    case OP_JMP:
+      lower_jump(fn, inst->operands[0].label, next);
+      break;
+    case OP_BR: {
+      char *then = inst->operands[1].label;
+      char *otherwise = inst->operands[2].label;
+      if (tree->op == TREE_LITERAL) {
+        lower_jump(fn, leaf_value(tree) ? then : otherwise, next);
+        break;
+      }
+      Selected cond = select_tree(fn, tree, NT_CC);
+      lower_branch(fn, cond.cond, then, otherwise, next);
+      break;
+    }
+    case OP_RET:
+      if (!tree) {
+        machine(fn, X_RET, 0, no_operand, no_operand);
+        break;
+      }
+      machine(fn, X_MOV, 2, reg_operand(R_RAX), select_tree(fn, tree, NT_SOURCE).operand);
+      machine(fn, X_RET, 1, reg_operand(R_RAX), no_operand);
+      break;
+    case OP_STORE:
+      machine(fn, X_MOV, 2, global_operand(inst->operands[0].var),
+          select_tree(fn, tree, NT_SOURCE).operand);
+      break;
+    case OP_CALL:
+      lower_call(fn, inst->operands[0].label, &inst->operands[1], inst->num_operands - 1,
+          inst->assignee);
+      break;
+    case OP_PHI:
+      fatal("phi for `%s` reached the NASM backend", inst->assignee);
+    default: {
+      if (inst->opcode == OP_UNKNOWN || inst->opcode > OP_STORE)
+        fatal("can't lower instruction with opcode %d", inst->opcode);
+      MachineOperand dst = reg_operand(tree->dst);
+      MachineOperand value = select_tree(fn, tree, NT_REG).operand;
+      if (!same_register(&dst, &value))
+        machine(fn, X_MOV, 2, dst, value);
+      break;
+    }
+  }
+}
+
+// Lowers the reachable blocks of the function in the order of the graph.
+// `skip` marks instructions of the first block that were turned into data.
+static void lower_function(MachineFunction *fn, BasicBlock *entry, BasicBlock *end, bool *skip)
+{
+  Dataflow *flow = &fn->live.flow;
+  fn->blocks = malloc(flow->num_blocks * sizeof(MachineBlock));
+  fn->num_blocks = 0;
+  TreeCounts counts;
+  count_definitions(fn, &counts);
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    if (dataflow_index(flow, block) < 0)
+      continue;
+    BasicBlock *next = block->next;
+    while (next != end && dataflow_index(flow, next) < 0)
+      next = next->next;
+    if (next == end)
+      next = NULL;
+
+    BlockTrees trees;
+    build_trees(fn, block, block == entry ? skip : NULL, &trees, &counts);
+    MachineBlock *mb = &fn->blocks[fn->num_blocks++];
+    mb->block = block;
+    mb->label = block == entry ? NULL : block_label(fn, block->tag);
+    mb->first = fn->code.size;
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      // The return after a tail call is never reached
+      if (fn->tail_calls && is_tail_call(block, i) && lower_tail_call(fn, inst))
+        break;
+      if (!(block == entry && skip && skip[i]) && !trees.folded[i])
+        select_instruction(fn, inst, trees.roots[i], next);
+    }
+    mb->end = fn->code.size;
+    free_block_trees(&trees);
+  }
+  free_tree_counts(&counts);
+}
+
+/* Live Intervals */
+
+static void extend_interval(LiveInterval *interval, int position)
+{
+  if (interval->start < 0 || position < interval->start)
+    interval->start = position;
+  if (position > interval->end)
+    interval->end = position;
+}
+
+static void define_interval(LiveInterval *interval, MachineInst *inst, int position)
+{
+  extend_interval(interval, position);
+  MachineOperand *src = &inst->operands[1];
+  bool loads_constant = inst->op == X_MOV && src->kind == MO_IMM && is_imm32(src->value);
+  if (!interval->is_defined) {
+    interval->is_constant = loads_constant;
+    interval->constant = src->value;
+  } else if (!loads_constant || src->value != interval->constant) {
+    interval->is_constant = false;
+  }
+  interval->is_defined = true;
+}
+
+static void use_fixed(FixedRanges *fixed, int position)
+{
+  if (!fixed->size) {
+    fixed->capacity = 8;
+    fixed->ranges = malloc(fixed->capacity * sizeof(FixedRange));
+    fixed->ranges[fixed->size++] = (FixedRange){ 0, position };
+  }
+  fixed->ranges[fixed->size - 1].end = position;
+}
+
+static void define_fixed(FixedRanges *fixed, int position)
+{
+  if (fixed->size == fixed->capacity) {
+    fixed->capacity = fixed->capacity ? fixed->capacity * 2 : 8;
+    fixed->ranges = realloc(fixed->ranges, fixed->capacity * sizeof(FixedRange));
+  }
+  fixed->ranges[fixed->size++] = (FixedRange){ position, position };
+}
+
+static void use_register(MachineFunction *fn, int reg, int position)
+{
+  if (IS_VIRTUAL(reg))
+    extend_interval(&fn->intervals[reg - NUM_REGISTERS], position);
+  else if (reg != R_RSP && reg != R_RBP)
+    use_fixed(&fn->fixed[reg], position);
+}
+
+static void set_hint(MachineFunction *fn, MachineOperand *dst, MachineOperand *src)
+{
+  if (dst->kind != MO_REG || src->kind != MO_REG || dst->reg == src->reg)
+    return;
+  if (IS_VIRTUAL(dst->reg) && fn->intervals[dst->reg - NUM_REGISTERS].hint == NO_REGISTER)
+    fn->intervals[dst->reg - NUM_REGISTERS].hint = src->reg;
+  if (IS_VIRTUAL(src->reg) && !IS_VIRTUAL(dst->reg)
+      && fn->intervals[src->reg - NUM_REGISTERS].hint == NO_REGISTER)
+    fn->intervals[src->reg - NUM_REGISTERS].hint = dst->reg;
+}
+
+static void build_intervals(MachineFunction *fn)
+{
+  fn->intervals = malloc(fn->num_vregs * sizeof(LiveInterval));
+  for (int v = 0; v < fn->num_vregs; v++) {
+    fn->intervals[v] = (LiveInterval){
+      .vreg = v, .start = -1, .end = -1, .reg = NO_REGISTER, .hint = NO_REGISTER, .slot = -1,
+    };
+  }
+
+  Dataflow *flow = &fn->live.flow;
+  for (int k = 0; k < fn->num_blocks; k++) {
+    MachineBlock *mb = &fn->blocks[k];
+    int b = dataflow_index(flow, mb->block);
+    int block_start = 2 * mb->first;
+    int block_end = mb->end > mb->first ? 2 * mb->end - 1 : block_start;
+    for (size_t v = bitset_next(&flow->in[b], 0); v < flow->num_bits; v = bitset_next(&flow->in[b], v + 1))
+      extend_interval(&fn->intervals[v], block_start);
+    for (size_t v = bitset_next(&flow->out[b], 0); v < flow->num_bits; v = bitset_next(&flow->out[b], v + 1))
+      extend_interval(&fn->intervals[v], block_end);
+
+    for (int i = mb->first; i < mb->end; i++) {
+      MachineInst *inst = &fn->code.data[i];
+      const MachineOpInfo *info = &machine_ops[inst->op];
+      for (int o = 0; o < inst->num_operands; o++) {
+        MachineOperand *operand = &inst->operands[o];
+        if (operand->kind == MO_MEM && operand->reg != NO_REGISTER)
+          use_register(fn, operand->reg, 2 * i);
+        if (operand->kind == MO_MEM && operand->index != NO_REGISTER)
+          use_register(fn, operand->index, 2 * i);
+        if (operand->kind == MO_REG && (info->roles[o] & USE))
+          use_register(fn, operand->reg, 2 * i);
+      }
+      for (RegisterID id = 0; id < NUM_REGISTERS; id++) {
+        if ((info->uses | inst->uses) & REGISTER_BIT(id))
+          use_register(fn, id, 2 * i);
+      }
+
+      for (int o = 0; o < inst->num_operands; o++) {
+        MachineOperand *operand = &inst->operands[o];
+        if (operand->kind != MO_REG || !(info->roles[o] & DEF))
+          continue;
+        if (IS_VIRTUAL(operand->reg))
+          define_interval(&fn->intervals[operand->reg - NUM_REGISTERS], inst, 2 * i + 1);
+        else if (operand->reg != R_RSP && operand->reg != R_RBP)
+          define_fixed(&fn->fixed[operand->reg], 2 * i + 1);
+      }
+      for (RegisterID id = 0; id < NUM_REGISTERS; id++) {
+        if (info->defs & REGISTER_BIT(id))
+          define_fixed(&fn->fixed[id], 2 * i + 1);
+      }
+
+      if (inst->op == X_MOV)
+        set_hint(fn, &inst->operands[0], &inst->operands[1]);
+    }
+  }
+}
+
+/* Statistics */
+
+typedef struct
+{
+  int functions;
+  size_t virtual_registers;
+  size_t spilled;
+  size_t rematerialized;
+  size_t moves_removed;       // Copies whose sides ended up in the same place
+  size_t instructions;
+  size_t stack_operands;      // Accesses to spill slots
+  clock_t allocation_time;
+  size_t emitted_bytes;       // Of assembly
+  clock_t emission_time;      // Formatting and writing it
+} CodegenStats;
+
+static CodegenStats codegen_stats;
+static const char *allocator_names[] = {
+  [REGALLOC_LINEAR_SCAN] = "linear",
+  [REGALLOC_GRAPH_COLORING] = "graph",
+};
+static RegisterAllocator stats_allocator;
+
+void reset_codegen_stats()
+{
+  memset(&codegen_stats, 0, sizeof(codegen_stats));
+}
+
+void dump_codegen_stats()
+{
+  CodegenStats *stats = &codegen_stats;
+  fprintf(stderr, "%-10s %9s %6s %8s %8s %8s %8s %8s %10s\n", "regalloc", "functions", "vregs",
+      "spilled", "remat", "moves", "insts", "stack", "time (ms)");
+  fprintf(stderr, "%-10s %9d %6zu %8zu %8zu %8zu %8zu %8zu %10.2f\n", allocator_names[stats_allocator],
+      stats->functions, stats->virtual_registers, stats->spilled, stats->rematerialized,
+      stats->moves_removed, stats->instructions, stats->stack_operands,
+      stats->allocation_time * 1000.0 / CLOCKS_PER_SEC);
+
+  // Throughput is left out when emission was too quick for the clock to see
+  double seconds = (double)stats->emission_time / CLOCKS_PER_SEC;
+  fprintf(stderr, "%-10s %9s %10s %8s\n", "emission", "bytes", "time (ms)", "MB/s");
+  fprintf(stderr, "%-10s %9zu %10.2f ", "", stats->emitted_bytes, seconds * 1000.0);
+  if (seconds > 0)
+    fprintf(stderr, "%8.1f\n", stats->emitted_bytes / seconds / 1e6);
+  else
+    fprintf(stderr, "%8s\n", "-");
+}
+
+/* Linear Scan Register Allocator (Poletto & Sarkar) */
+
+static Register registers[NUM_REGISTERS];
+
+// Scratch registers come first, so that preserved ones, which have to be
+// saved and restored, are only used once the scratch ones run out
+static RegisterID allocation_order[NUM_REGISTERS];
+static int num_allocatable;
+
+static void init_allocation_order()
+{
+  num_allocatable = 0;
+  for (int preserved = 0; preserved < 2; preserved++) {
+    for (RegisterID id = R_RAX; id < NUM_REGISTERS; id++) {
+      if (id == R_RSP || id == R_RBP || id == SCRATCH_REGISTER)
+        continue;
+      if (REGISTERS_NASM_x86_64[id].is_preserved == preserved)
+        allocation_order[num_allocatable++] = id;
+    }
+  }
+}
+
+static bool overlaps_fixed(MachineFunction *fn, RegisterID id, LiveInterval *interval)
+{
+  FixedRanges *fixed = &fn->fixed[id];
+  while (fixed->cursor < fixed->size && fixed->ranges[fixed->cursor].end < interval->start)
+    fixed->cursor++;
+  return fixed->cursor < fixed->size && fixed->ranges[fixed->cursor].start <= interval->end;
+}
+
+static bool is_available(MachineFunction *fn, int id, LiveInterval *interval)
+{
+  if (id < 0 || IS_VIRTUAL(id) || id == R_RSP || id == R_RBP || id == SCRATCH_REGISTER)
+    return false;
+  return !registers[id].is_active && !overlaps_fixed(fn, id, interval);
+}
+
+static void assign_register(MachineFunction *fn, Register *reg, LiveInterval *interval)
+{
+  reg->is_active = true;
+  reg->start = interval->start;
+  reg->end = interval->end;
+  reg->interval = interval;
+  interval->reg = reg->id;
+  if (reg->is_preserved)
+    fn->used_preserved |= REGISTER_BIT(reg->id);
+}
+
+// Prefers the register of the value the interval is copied from or to
+static Register *find_available_register(MachineFunction *fn, LiveInterval *interval)
+{
+  int hint = interval->hint;
+  if (hint != NO_REGISTER && IS_VIRTUAL(hint))
+    hint = fn->intervals[hint - NUM_REGISTERS].reg;
+  if (is_available(fn, hint, interval))
+    return &registers[hint];
+
+  for (int i = 0; i < num_allocatable; i++) {
+    RegisterID id = allocation_order[i];
+    if (is_available(fn, id, interval))
+      return &registers[id];
+  }
+  return NULL;
+}
+
+static void release_register(RegisterID id)
+{
+  Register *reg = &registers[id];
+  reg->is_active = false;
+  reg->interval = NULL;
+}
+
+// Constants are rematerialized where they are used instead of getting a slot
+static void spill_interval(MachineFunction *fn, LiveInterval *interval)
+{
+  interval->reg = NO_REGISTER;
+  char *name = interval->vreg < (int)fn->live.vars.count ? fn->live.names[interval->vreg] : "$tmp";
+  if (interval->is_constant) {
+    codegen_stats.rematerialized++;
+    LOG_INFO("rematerializing `%s` in function `%s`", name, fn->name);
+    return;
+  }
+  interval->slot = fn->num_slots++;
+  codegen_stats.spilled++;
+  LOG_INFO("spilling `%s` to the stack in function `%s`", name, fn->name);
+}
+
+static void spill_register_to_stack(MachineFunction *fn, RegisterID id)
+{
+  spill_interval(fn, registers[id].interval);
+  release_register(id);
+}
+
+static void expire_old_intervals(int position)
+{
+  for (int i = 0; i < num_allocatable; i++) {
+    Register *reg = &registers[allocation_order[i]];
+    if (reg->is_active && reg->end < position)
+      release_register(reg->id);
+  }
+}
+
+// With every usable register taken, either the new interval or the one that
+// ends last goes to memory. Constants go first since they are cheap to
+// rematerialize.
+static void spill_at_interval(MachineFunction *fn, LiveInterval *interval)
+{
+  if (interval->is_constant) {
+    spill_interval(fn, interval);
+    return;
+  }
+
+  Register *victim = NULL;
+  for (int i = 0; i < num_allocatable; i++) {
+    Register *reg = &registers[allocation_order[i]];
+    if (!reg->is_active || overlaps_fixed(fn, reg->id, interval))
+      continue;
+    LiveInterval *held = reg->interval;
+    if (!victim || (held->is_constant && !victim->interval->is_constant)
+        || (held->is_constant == victim->interval->is_constant && reg->end > victim->end))
+      victim = reg;
+  }
+
+  if (victim && (victim->interval->is_constant || victim->end > interval->end)) {
+    spill_register_to_stack(fn, victim->id);
+    assign_register(fn, victim, interval);
+  } else {
+    spill_interval(fn, interval);
+  }
+}
+
+static int compare_starts(const void *a, const void *b)
+{
+  const LiveInterval *x = *(LiveInterval *const *)a, *y = *(LiveInterval *const *)b;
+  if (x->start != y->start)
+    return x->start < y->start ? -1 : 1;
+  return x->vreg - y->vreg;
+}
+
+static void linear_scan(MachineFunction *fn)
+{
+  for (RegisterID id = R_RAX; id < NUM_REGISTERS; id++)
+    registers[id] = REGISTERS_NASM_x86_64[id];
+
+  LiveInterval **order = malloc(fn->num_vregs * sizeof(LiveInterval *));
+  int num_intervals = 0;
+  for (int v = 0; v < fn->num_vregs; v++) {
+    if (fn->intervals[v].start >= 0)
+      order[num_intervals++] = &fn->intervals[v];
+  }
+  qsort(order, num_intervals, sizeof(LiveInterval *), compare_starts);
+
+  for (int i = 0; i < num_intervals; i++) {
+    LiveInterval *interval = order[i];
+    expire_old_intervals(interval->start);
+    Register *reg = find_available_register(fn, interval);
+    if (reg)
+      assign_register(fn, reg, interval);
+    else
+      spill_at_interval(fn, interval);
+  }
+  free(order);
+}
+
+/* Graph Coloring Register Allocator (George & Appel) */
+
+// Iterated register coalescing. The nodes of the interference graph are the
+// allocatable physical registers, which come precolored, and the virtual
+// registers, numbered like their operands. Instead of rewriting the program
+// and starting over when a node spills, a spilled value lives in a stack slot
+// that instructions use directly, through the scratch register where x86
+// needs one, just as after linear scan.
+
+typedef enum
+{
+  NODE_PRECOLORED,
+  NODE_INITIAL,
+  NODE_SIMPLIFY,
+  NODE_FREEZE,
+  NODE_SPILL,
+  NODE_SPILLED,
+  NODE_COALESCED,
+  NODE_COLORED,
+  NODE_SELECTED,
+  NUM_NODE_LISTS,
+} NodeList;
+
+typedef enum
+{
+  MOVE_WORKLIST,
+  MOVE_ACTIVE,
+  MOVE_COALESCED,
+  MOVE_CONSTRAINED,
+  MOVE_FROZEN,
+  NUM_MOVE_LISTS,
+} MoveList;
+
+// Every element is on exactly one of the lists, linked through indices so
+// that moving it to another one takes constant time
+typedef struct
+{
+  int *next, *prev;
+  uint8_t *list;
+  int heads[NUM_NODE_LISTS];
+  int sizes[NUM_NODE_LISTS];
+} Worklists;
+
+typedef struct
+{
+  int dst, src;
+} MoveNode;
+
+typedef struct
+{
+  IntList adjacent;           // Not kept for precolored nodes
+  IntList moves;
+  int degree;
+  int alias;                  // The node it was coalesced into
+  int color;
+  double cost;                // Of keeping the node in memory
+  bool is_constant;
+  int64_t constant;
+} GraphNode;
+
+typedef struct
+{
+  MachineFunction *fn;
+  int num_nodes;
+  GraphNode *nodes;
+  Worklists node_lists;
+  MoveNode *moves;
+  int num_moves, moves_capacity;
+  Worklists move_lists;
+  uint64_t *edges;            // Open addressing set of (min, max) node pairs
+  size_t edges_capacity, num_edges;
+  IntList select_stack;
+  int *seen;                  // Stamps for the union in the Briggs test
+  int stamp;
+} Coloring;
+
+#define INFINITE_DEGREE (INT32_MAX / 2)
+#define NO_EDGE UINT64_MAX
+
+static void worklists_init(Worklists *lists, int size)
+{
+  lists->next = malloc(size * sizeof(int));
+  lists->prev = malloc(size * sizeof(int));
+  lists->list = malloc(size);
+  for (int l = 0; l < NUM_NODE_LISTS; l++) {
+    lists->heads[l] = -1;
+    lists->sizes[l] = 0;
+  }
+}
+
+static void worklists_free(Worklists *lists)
+{
+  free(lists->next);
+  free(lists->prev);
+  free(lists->list);
+}
+
+static void worklist_push(Worklists *lists, int list, int e)
+{
+  lists->list[e] = list;
+  lists->prev[e] = -1;
+  lists->next[e] = lists->heads[list];
+  if (lists->heads[list] >= 0)
+    lists->prev[lists->heads[list]] = e;
+  lists->heads[list] = e;
+  lists->sizes[list]++;
+}
+
+static void worklist_move(Worklists *lists, int e, int list)
+{
+  int from = lists->list[e];
+  if (lists->prev[e] >= 0)
+    lists->next[lists->prev[e]] = lists->next[e];
+  else
+    lists->heads[from] = lists->next[e];
+  if (lists->next[e] >= 0)
+    lists->prev[lists->next[e]] = lists->prev[e];
+  lists->sizes[from]--;
+  worklist_push(lists, list, e);
+}
+
+static int worklist_pop(Worklists *lists, int from, int to)
+{
+  int e = lists->heads[from];
+  worklist_move(lists, e, to);
+  return e;
+}
+
+static bool is_graph_node(int reg)
+{
+  return reg != R_RSP && reg != R_RBP && reg != SCRATCH_REGISTER;
+}
+
+static bool is_precolored(Coloring *g, int n)
+{
+  return g->node_lists.list[n] == NODE_PRECOLORED;
+}
+
+static uint64_t edge_key(int u, int v)
+{
+  return u < v ? (uint64_t)u << 32 | (uint32_t)v : (uint64_t)v << 32 | (uint32_t)u;
+}
+
+static size_t edge_slot(Coloring *g, uint64_t key)
+{
+  size_t mask = g->edges_capacity - 1;
+  size_t slot = (key * 0x9E3779B97F4A7C15ull >> 17) & mask;
+  while (g->edges[slot] != NO_EDGE && g->edges[slot] != key)
+    slot = (slot + 1) & mask;
+  return slot;
+}
+
+static bool interferes(Coloring *g, int u, int v)
+{
+  return g->edges[edge_slot(g, edge_key(u, v))] != NO_EDGE;
+}
+
+static void grow_edges(Coloring *g)
+{
+  uint64_t *old = g->edges;
+  size_t old_capacity = g->edges_capacity;
+  g->edges_capacity = old_capacity ? old_capacity * 2 : 1024;
+  g->edges = malloc(g->edges_capacity * sizeof(uint64_t));
+  memset(g->edges, 0xff, g->edges_capacity * sizeof(uint64_t));
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i] != NO_EDGE)
+      g->edges[edge_slot(g, old[i])] = old[i];
+  }
+  free(old);
+}
+
+static void add_interference(Coloring *g, int u, int v)
+{
+  if (u == v)
+    return;
+  if (2 * (g->num_edges + 1) > g->edges_capacity)
+    grow_edges(g);
+  uint64_t key = edge_key(u, v);
+  size_t slot = edge_slot(g, key);
+  if (g->edges[slot] != NO_EDGE)
+    return;
+  g->edges[slot] = key;
+  g->num_edges++;
+  if (!is_precolored(g, u)) {
+    int_list_push(&g->nodes[u].adjacent, v);
+    g->nodes[u].degree++;
+  }
+  if (!is_precolored(g, v)) {
+    int_list_push(&g->nodes[v].adjacent, u);
+    g->nodes[v].degree++;
+  }
+}
+
+/* Interference */
+
+// Values live at the same time can't share a register, except for the two
+// sides of a copy
+typedef struct
+{
+  int *members;
+  int *index;                 // Into `members`, or -1
+  int size;
+} LiveSet;
+
+static void live_add(LiveSet *live, int n)
+{
+  if (live->index[n] < 0) {
+    live->index[n] = live->size;
+    live->members[live->size++] = n;
+  }
+}
+
+static void live_remove(LiveSet *live, int n)
+{
+  int i = live->index[n];
+  if (i < 0)
+    return;
+  int last = live->members[--live->size];
+  live->members[i] = last;
+  live->index[last] = i;
+  live->index[n] = -1;
+}
+
+// Spilling a value costs a load or store for each of its occurrences, ten
+// times over for every loop around it
+static void compute_block_weights(MachineFunction *fn, double *weights)
+{
+  Dataflow *flow = &fn->live.flow;
+  int *depth = calloc(flow->num_blocks, sizeof(int));
+  int *stamp = calloc(flow->num_blocks, sizeof(int));
+  int *stack = malloc(flow->num_blocks * sizeof(int));
+
+  // A retreating edge closes a loop made of the blocks that reach its
+  // source without going through its target
+  int loops = 0;
+  for (int b = 0; b < flow->num_blocks; b++) {
+    BasicBlock *block = flow->order[b];
+    for (size_t s = 0; s < block->successors.size; s++) {
+      int header = dataflow_index(flow, block->successors.data[s]);
+      if (header > b)
+        continue;
+      loops++;
+      int sp = 0;
+      stamp[header] = loops;
+      depth[header]++;
+      if (stamp[b] != loops) {
+        stamp[b] = loops;
+        depth[b]++;
+        stack[sp++] = b;
+      }
+      while (sp) {
+        BasicBlock *member = flow->order[stack[--sp]];
+        for (size_t p = 0; p < member->predecessors.size; p++) {
+          int pred = dataflow_index(flow, member->predecessors.data[p]);
+          if (pred >= 0 && stamp[pred] != loops) {
+            stamp[pred] = loops;
+            depth[pred]++;
+            stack[sp++] = pred;
+          }
+        }
+      }
+    }
+  }
+
+  for (int k = 0; k < fn->num_blocks; k++) {
+    weights[k] = 1;
+    int b = dataflow_index(flow, fn->blocks[k].block);
+    for (int d = 0; d < depth[b] && d < 8; d++)
+      weights[k] *= 10;
+  }
+  free(stack);
+  free(stamp);
+  free(depth);
+}
+
+static void add_move(Coloring *g, int dst, int src)
+{
+  if (g->num_moves == g->moves_capacity) {
+    g->moves_capacity = g->moves_capacity ? g->moves_capacity * 2 : 64;
+    g->moves = realloc(g->moves, g->moves_capacity * sizeof(MoveNode));
+  }
+  int m = g->num_moves++;
+  g->moves[m] = (MoveNode){ dst, src };
+  int_list_push(&g->nodes[dst].moves, m);
+  int_list_push(&g->nodes[src].moves, m);
+}
+
+static void build_graph(Coloring *g, double *weights)
+{
+  MachineFunction *fn = g->fn;
+  Dataflow *flow = &fn->live.flow;
+  LiveSet live = { malloc(g->num_nodes * sizeof(int)), malloc(g->num_nodes * sizeof(int)), 0 };
+  for (int n = 0; n < g->num_nodes; n++)
+    live.index[n] = -1;
+  int defs[NUM_REGISTERS + 2];
+
+  for (int k = 0; k < fn->num_blocks; k++) {
+    MachineBlock *mb = &fn->blocks[k];
+    int b = dataflow_index(flow, mb->block);
+    while (live.size)
+      live_remove(&live, live.members[0]);
+    for (size_t v = bitset_next(&flow->out[b], 0); v < flow->num_bits; v = bitset_next(&flow->out[b], v + 1))
+      live_add(&live, VIRTUAL_REGISTER(v));
+
+    for (int i = mb->end - 1; i >= mb->first; i--) {
+      MachineInst *inst = &fn->code.data[i];
+      const MachineOpInfo *info = &machine_ops[inst->op];
+      MachineOperand *dst = &inst->operands[0], *src = &inst->operands[1];
+      if (inst->op == X_MOV && dst->kind == MO_REG && src->kind == MO_REG
+          && is_graph_node(dst->reg) && is_graph_node(src->reg)) {
+        live_remove(&live, src->reg);
+        add_move(g, dst->reg, src->reg);
+      }
+
+      int num_defs = 0;
+      for (int o = 0; o < inst->num_operands; o++) {
+        MachineOperand *operand = &inst->operands[o];
+        if (operand->kind == MO_REG && (info->roles[o] & DEF) && is_graph_node(operand->reg))
+          defs[num_defs++] = operand->reg;
+      }
+      for (RegisterID id = 0; id < NUM_REGISTERS; id++) {
+        if ((info->defs & REGISTER_BIT(id)) && is_graph_node(id))
+          defs[num_defs++] = id;
+      }
+      for (int d = 0; d < num_defs; d++)
+        live_add(&live, defs[d]);
+      for (int d = 0; d < num_defs; d++) {
+        for (int l = 0; l < live.size; l++)
+          add_interference(g, live.members[l], defs[d]);
+      }
+      for (int d = 0; d < num_defs; d++) {
+        live_remove(&live, defs[d]);
+        if (IS_VIRTUAL(defs[d]))
+          g->nodes[defs[d]].cost += weights[k];
+      }
+
+      for (int o = 0; o < inst->num_operands; o++) {
+        MachineOperand *operand = &inst->operands[o];
+        int uses[2] = { NO_REGISTER, NO_REGISTER };
+        if (operand->kind == MO_REG && (info->roles[o] & USE))
+          uses[0] = operand->reg;
+        if (operand->kind == MO_MEM) {
+          uses[0] = operand->reg;
+          uses[1] = operand->index;
+        }
+        for (int u = 0; u < 2; u++) {
+          if (uses[u] == NO_REGISTER || !is_graph_node(uses[u]))
+            continue;
+          live_add(&live, uses[u]);
+          if (IS_VIRTUAL(uses[u]))
+            g->nodes[uses[u]].cost += weights[k];
+        }
+      }
+      for (RegisterID id = 0; id < NUM_REGISTERS; id++) {
+        if (((info->uses | inst->uses) & REGISTER_BIT(id)) && is_graph_node(id))
+          live_add(&live, id);
+      }
+    }
+  }
+  free(live.members);
+  free(live.index);
+}
+
+/* Simplification and Coalescing */
+
+static bool is_move_active(Coloring *g, int m)
+{
+  int list = g->move_lists.list[m];
+  return list == MOVE_ACTIVE || list == MOVE_WORKLIST;
+}
+
+static bool is_move_related(Coloring *g, int n)
+{
+  IntList *moves = &g->nodes[n].moves;
+  for (int i = 0; i < moves->size; i++) {
+    if (is_move_active(g, moves->data[i]))
+      return true;
+  }
+  return false;
+}
+
+// Neighbours that are still in the graph
+static bool is_adjacent(Coloring *g, int n)
+{
+  int list = g->node_lists.list[n];
+  return list != NODE_SELECTED && list != NODE_COALESCED;
+}
+
+static void enable_moves(Coloring *g, int n)
+{
+  IntList *moves = &g->nodes[n].moves;
+  for (int i = 0; i < moves->size; i++) {
+    int m = moves->data[i];
+    if (g->move_lists.list[m] == MOVE_ACTIVE)
+      worklist_move(&g->move_lists, m, MOVE_WORKLIST);
+  }
+}
+
+static void decrement_degree(Coloring *g, int n)
+{
+  if (is_precolored(g, n))
+    return;
+  int degree = g->nodes[n].degree--;
+  if (degree != num_allocatable)
+    return;
+
+  enable_moves(g, n);
+  IntList *adjacent = &g->nodes[n].adjacent;
+  for (int i = 0; i < adjacent->size; i++) {
+    if (is_adjacent(g, adjacent->data[i]))
+      enable_moves(g, adjacent->data[i]);
+  }
+  if (g->node_lists.list[n] == NODE_SPILL)
+    worklist_move(&g->node_lists, n, is_move_related(g, n) ? NODE_FREEZE : NODE_SIMPLIFY);
+}
+
+static void simplify(Coloring *g)
+{
+  int n = worklist_pop(&g->node_lists, NODE_SIMPLIFY, NODE_SELECTED);
+  int_list_push(&g->select_stack, n);
+  IntList *adjacent = &g->nodes[n].adjacent;
+  for (int i = 0; i < adjacent->size; i++) {
+    if (is_adjacent(g, adjacent->data[i]))
+      decrement_degree(g, adjacent->data[i]);
+  }
+}
+
+static int get_alias(Coloring *g, int n)
+{
+  while (g->node_lists.list[n] == NODE_COALESCED)
+    n = g->nodes[n].alias;
+  return n;
+}
+
+static void add_worklist(Coloring *g, int n)
+{
+  if (!is_precolored(g, n) && !is_move_related(g, n) && g->nodes[n].degree < num_allocatable
+      && g->node_lists.list[n] == NODE_FREEZE)
+    worklist_move(&g->node_lists, n, NODE_SIMPLIFY);
+}
+
+// George: every neighbour of `t` that could be in the way already
+// interferes with the register `r`
+static bool is_ok(Coloring *g, int t, int r)
+{
+  return g->nodes[t].degree < num_allocatable || is_precolored(g, t) || interferes(g, t, r);
+}
+
+static bool can_coalesce_with_register(Coloring *g, int r, int v)
+{
+  IntList *adjacent = &g->nodes[v].adjacent;
+  for (int i = 0; i < adjacent->size; i++) {
+    int t = adjacent->data[i];
+    if (is_adjacent(g, t) && !is_ok(g, t, r))
+      return false;
+  }
+  return true;
+}
+
+// Briggs: the merged node has fewer than K neighbours of significant degree
+static bool is_conservative(Coloring *g, int u, int v)
+{
+  int significant = 0;
+  g->stamp++;
+  int pair[2] = { u, v };
+  for (int p = 0; p < 2; p++) {
+    IntList *adjacent = &g->nodes[pair[p]].adjacent;
+    for (int i = 0; i < adjacent->size; i++) {
+      int t = adjacent->data[i];
+      if (!is_adjacent(g, t) || g->seen[t] == g->stamp)
+        continue;
+      g->seen[t] = g->stamp;
+      if (g->nodes[t].degree >= num_allocatable)
+        significant++;
+    }
+  }
+  return significant < num_allocatable;
+}
+
+static void combine(Coloring *g, int u, int v)
+{
+  worklist_move(&g->node_lists, v, NODE_COALESCED);
+  GraphNode *merged = &g->nodes[u], *node = &g->nodes[v];
+  node->alias = u;
+  for (int i = 0; i < node->moves.size; i++)
+    int_list_push(&merged->moves, node->moves.data[i]);
+  enable_moves(g, v);
+  merged->cost += node->cost;
+  merged->is_constant = merged->is_constant && node->is_constant && merged->constant == node->constant;
+
+  for (int i = 0; i < node->adjacent.size; i++) {
+    int t = node->adjacent.data[i];
+    if (!is_adjacent(g, t))
+      continue;
+    add_interference(g, t, u);
+    decrement_degree(g, t);
+  }
+  if (merged->degree >= num_allocatable && g->node_lists.list[u] == NODE_FREEZE)
+    worklist_move(&g->node_lists, u, NODE_SPILL);
+}
+
+static void coalesce(Coloring *g)
+{
+  int m = g->move_lists.heads[MOVE_WORKLIST];
+  int x = get_alias(g, g->moves[m].dst), y = get_alias(g, g->moves[m].src);
+  int u = is_precolored(g, y) ? y : x;
+  int v = is_precolored(g, y) ? x : y;
+
+  if (u == v) {
+    worklist_move(&g->move_lists, m, MOVE_COALESCED);
+    add_worklist(g, u);
+  } else if (is_precolored(g, v) || interferes(g, u, v)) {
+    worklist_move(&g->move_lists, m, MOVE_CONSTRAINED);
+    add_worklist(g, u);
+    add_worklist(g, v);
+  } else if (is_precolored(g, u) ? can_coalesce_with_register(g, u, v) : is_conservative(g, u, v)) {
+    worklist_move(&g->move_lists, m, MOVE_COALESCED);
+    combine(g, u, v);
+    add_worklist(g, u);
+  } else {
+    worklist_move(&g->move_lists, m, MOVE_ACTIVE);
+  }
+}
+
+// Gives up on coalescing the moves of `u`, which may let their other sides
+// be simplified
+static void freeze_moves(Coloring *g, int u)
+{
+  IntList *moves = &g->nodes[u].moves;
+  for (int i = 0; i < moves->size; i++) {
+    int m = moves->data[i];
+    if (!is_move_active(g, m))
+      continue;
+    int x = get_alias(g, g->moves[m].dst), y = get_alias(g, g->moves[m].src);
+    int v = y == get_alias(g, u) ? x : y;
+    worklist_move(&g->move_lists, m, MOVE_FROZEN);
+    if (g->node_lists.list[v] == NODE_FREEZE && !is_move_related(g, v)
+        && g->nodes[v].degree < num_allocatable)
+      worklist_move(&g->node_lists, v, NODE_SIMPLIFY);
+  }
+}
+
+static void freeze(Coloring *g)
+{
+  int u = worklist_pop(&g->node_lists, NODE_FREEZE, NODE_SIMPLIFY);
+  freeze_moves(g, u);
+}
+
+// The cheapest node per neighbour it would take out of the graph
+static void select_spill(Coloring *g)
+{
+  int best = -1;
+  double best_priority = 0;
+  for (int n = g->node_lists.heads[NODE_SPILL]; n >= 0; n = g->node_lists.next[n]) {
+    double priority = g->nodes[n].cost / g->nodes[n].degree;
+    if (best < 0 || priority < best_priority) {
+      best = n;
+      best_priority = priority;
+    }
+  }
+  worklist_move(&g->node_lists, best, NODE_SIMPLIFY);
+  freeze_moves(g, best);
+}
+
+// Prefers the register of a value the node is copied from or to, and
+// scratch registers over preserved ones
+static void assign_colors(Coloring *g)
+{
+  while (g->select_stack.size) {
+    int n = g->select_stack.data[--g->select_stack.size];
+    uint32_t available = 0;
+    for (int i = 0; i < num_allocatable; i++)
+      available |= REGISTER_BIT(allocation_order[i]);
+
+    IntList *adjacent = &g->nodes[n].adjacent;
+    for (int i = 0; i < adjacent->size; i++) {
+      int w = get_alias(g, adjacent->data[i]);
+      int list = g->node_lists.list[w];
+      if (list == NODE_COLORED || list == NODE_PRECOLORED)
+        available &= ~REGISTER_BIT(g->nodes[w].color);
+    }
+    if (!available) {
+      worklist_move(&g->node_lists, n, NODE_SPILLED);
+      continue;
+    }
+
+    int color = NO_REGISTER;
+    IntList *moves = &g->nodes[n].moves;
+    for (int i = 0; i < moves->size && color == NO_REGISTER; i++) {
+      MoveNode *move = &g->moves[moves->data[i]];
+      int other = get_alias(g, get_alias(g, move->dst) == n ? move->src : move->dst);
+      int list = g->node_lists.list[other];
+      if ((list == NODE_COLORED || list == NODE_PRECOLORED)
+          && (available & REGISTER_BIT(g->nodes[other].color)))
+        color = g->nodes[other].color;
+    }
+    for (int i = 0; i < num_allocatable && color == NO_REGISTER; i++) {
+      if (available & REGISTER_BIT(allocation_order[i]))
+        color = allocation_order[i];
+    }
+    worklist_move(&g->node_lists, n, NODE_COLORED);
+    g->nodes[n].color = color;
+  }
+}
+
+static void free_coloring(Coloring *g)
+{
+  for (int n = 0; n < g->num_nodes; n++) {
+    free(g->nodes[n].adjacent.data);
+    free(g->nodes[n].moves.data);
+  }
+  free(g->nodes);
+  worklists_free(&g->node_lists);
+  worklists_free(&g->move_lists);
+  free(g->moves);
+  free(g->edges);
+  free(g->select_stack.data);
+  free(g->seen);
+}
+
+static void color_graph(MachineFunction *fn)
+{
+  Coloring g = { .fn = fn, .num_nodes = NUM_REGISTERS + fn->num_vregs };
+  g.nodes = calloc(g.num_nodes, sizeof(GraphNode));
+  g.seen = calloc(g.num_nodes, sizeof(int));
+  worklists_init(&g.node_lists, g.num_nodes);
+  grow_edges(&g);
+
+  for (int n = 0; n < g.num_nodes; n++) {
+    GraphNode *node = &g.nodes[n];
+    node->alias = n;
+    node->color = NO_REGISTER;
+    if (!IS_VIRTUAL(n)) {
+      node->color = n;
+      node->degree = INFINITE_DEGREE;
+      worklist_push(&g.node_lists, NODE_PRECOLORED, n);
+      continue;
+    }
+    LiveInterval *interval = &fn->intervals[n - NUM_REGISTERS];
+    node->is_constant = interval->is_constant;
+    node->constant = interval->constant;
+    worklist_push(&g.node_lists, interval->start >= 0 ? NODE_INITIAL : NODE_SELECTED, n);
+  }
+
+  double *weights = malloc((fn->num_blocks + 1) * sizeof(double));
+  compute_block_weights(fn, weights);
+  build_graph(&g, weights);
+  free(weights);
+
+  worklists_init(&g.move_lists, g.num_moves + 1);
+  for (int m = 0; m < g.num_moves; m++)
+    worklist_push(&g.move_lists, MOVE_WORKLIST, m);
+
+  // Constants cost next to nothing to rematerialize
+  while (g.node_lists.sizes[NODE_INITIAL]) {
+    int n = g.node_lists.heads[NODE_INITIAL];
+    GraphNode *node = &g.nodes[n];
+    if (node->is_constant)
+      node->cost /= 16;
+    if (node->degree >= num_allocatable)
+      worklist_move(&g.node_lists, n, NODE_SPILL);
+    else
+      worklist_move(&g.node_lists, n, is_move_related(&g, n) ? NODE_FREEZE : NODE_SIMPLIFY);
+  }
+
+  for (;;) {
+    if (g.node_lists.sizes[NODE_SIMPLIFY])
+      simplify(&g);
+    else if (g.move_lists.sizes[MOVE_WORKLIST])
+      coalesce(&g);
+    else if (g.node_lists.sizes[NODE_FREEZE])
+      freeze(&g);
+    else if (g.node_lists.sizes[NODE_SPILL])
+      select_spill(&g);
+    else
+      break;
+  }
+  assign_colors(&g);
+
+  // Nodes coalesced into a spilled one share its slot
+  for (int v = 0; v < fn->num_vregs; v++) {
+    int n = VIRTUAL_REGISTER(v);
+    if (g.node_lists.list[n] != NODE_SPILLED)
+      continue;
+    fn->intervals[v].is_constant = g.nodes[n].is_constant;
+    spill_interval(fn, &fn->intervals[v]);
+  }
+  for (int v = 0; v < fn->num_vregs; v++) {
+    LiveInterval *interval = &fn->intervals[v];
+    int n = get_alias(&g, VIRTUAL_REGISTER(v));
+    if (interval->start < 0 || (n == VIRTUAL_REGISTER(v) && g.node_lists.list[n] == NODE_SPILLED))
+      continue;
+    if (g.node_lists.list[n] == NODE_SPILLED) {
+      LiveInterval *root = &fn->intervals[n - NUM_REGISTERS];
+      interval->reg = NO_REGISTER;
+      interval->slot = root->slot;
+      interval->constant = root->constant;
+    } else {
+      interval->reg = g.nodes[n].color;
+      if (REGISTERS_NASM_x86_64[interval->reg].is_preserved)
+        fn->used_preserved |= REGISTER_BIT(interval->reg);
+    }
+  }
+  free_coloring(&g);
+}
+
+static void allocate_registers(MachineFunction *fn, RegisterAllocator allocator)
+{
+  clock_t start = clock();
+  if (allocator == REGALLOC_GRAPH_COLORING)
+    color_graph(fn);
+  else
+    linear_scan(fn);
+
+  for (RegisterID id = R_RAX; id < NUM_REGISTERS; id++) {
+    if (fn->used_preserved & REGISTER_BIT(id))
+      fn->num_saved++;
+  }
+  if (fn->is_program_entry)
+    fn->num_saved = fn->used_preserved = 0;
+  if (fn->num_slots)
+    fn->needs_frame = true;
+  codegen_stats.allocation_time += clock() - start;
+}
+
+/* Rewriting */
+
+static int64_t slot_offset(MachineFunction *fn, int slot)
+{
+  return -8 * (int64_t)(fn->num_saved + slot + 1);
+}
+
+// Where the allocator put the value of a virtual register
+static MachineOperand allocated_operand(MachineFunction *fn, int reg, uint8_t size)
+{
+  if (!IS_VIRTUAL(reg))
+    return size == 1 ? byte_operand(reg) : reg_operand(reg);
+  LiveInterval *interval = &fn->intervals[reg - NUM_REGISTERS];
+  if (interval->reg != NO_REGISTER)
+    return size == 1 ? byte_operand(interval->reg) : reg_operand(interval->reg);
+  if (interval->slot >= 0)
+    return memory_operand(R_RBP, slot_offset(fn, interval->slot));
+  return imm_operand(interval->constant);
+}
+
+// Spilled values are used straight from their slot where x86 allows a
+// memory operand, and go through the scratch register where it doesn't
+static void legalize(MachineCode *out, MachineInst inst)
+{
+  MachineOperand scratch = reg_operand(SCRATCH_REGISTER);
+  MachineOperand *dst = &inst.operands[0], *src = &inst.operands[1];
+  switch (inst.op) {
+    case X_MOV:
+      if (same_location(dst, src)) {
+        codegen_stats.moves_removed += dst->kind == MO_REG;
+        return;
+      }
+      if (dst->kind == MO_MEM && (src->kind == MO_MEM || (src->kind == MO_IMM && !is_imm32(src->value)))) {
+        push_machine(out, X_MOV, 2, scratch, *src);
+        *src = scratch;
+      }
+      break;
+    case X_ADD:
+    case X_SUB:
+    case X_CMP:
+      // A memory operand whose address is in the scratch register is
+      // loaded into it first, since it can't go through it twice
+      if (dst->kind == MO_IMM || (dst->kind == MO_MEM && src->kind == MO_MEM
+            && reads_register(dst, SCRATCH_REGISTER))) {
+        push_machine(out, X_MOV, 2, scratch, *dst);
+        *dst = scratch;
+      } else if (dst->kind == MO_MEM && src->kind == MO_MEM) {
+        push_machine(out, X_MOV, 2, scratch, *src);
+        *src = scratch;
+      }
+      break;
+    case X_TEST:
+      if (dst->kind == MO_MEM) {
+        push_machine(out, X_CMP, 2, *dst, imm_operand(0));
+        return;
+      }
+      if (dst->kind == MO_IMM) {
+        push_machine(out, X_MOV, 2, scratch, *dst);
+        *dst = *src = scratch;
+      }
+      break;
+    case X_IMUL:
+      if (dst->kind == MO_MEM && reads_register(src, SCRATCH_REGISTER)) {
+        push_machine(out, X_MOV, 2, scratch, *src);
+        push_machine(out, X_IMUL, 2, scratch, *dst);
+        push_machine(out, X_MOV, 2, *dst, scratch);
+        return;
+      }
+      if (dst->kind == MO_MEM) {
+        push_machine(out, X_MOV, 2, scratch, *dst);
+        push_machine(out, X_IMUL, 2, scratch, *src);
+        push_machine(out, X_MOV, 2, *dst, scratch);
+        return;
+      }
+      break;
+    case X_IDIV:
+      if (dst->kind == MO_IMM) {
+        push_machine(out, X_MOV, 2, scratch, *dst);
+        *dst = scratch;
+      }
+      break;
+    case X_LEA:
+      if (src->index == NO_REGISTER && !src->symbol && !src->value) {
+        legalize(out, (MachineInst){ .op = X_MOV, .num_operands = 2,
+            .operands = { *dst, reg_operand(src->reg) } });
+        return;
+      }
+      if (dst->kind == MO_MEM) {
+        push_machine(out, X_LEA, 2, scratch, *src);
+        push_machine(out, X_MOV, 2, *dst, scratch);
+        return;
+      }
+      break;
+    case X_SETCC: {
+      MachineOperand reg = dst->kind == MO_REG ? *dst : scratch;
+      push_machine(out, X_SETCC, 1, byte_operand(reg.reg), no_operand)->cond = inst.cond;
+      push_machine(out, X_MOVZX, 2, reg, byte_operand(reg.reg));
+      if (dst->kind != MO_REG)
+        push_machine(out, X_MOV, 2, *dst, scratch);
+      return;
+    }
+    case X_PUSH:
+      if (dst->kind == MO_IMM && !is_imm32(dst->value)) {
+        push_machine(out, X_MOV, 2, scratch, *dst);
+        *dst = scratch;
+      }
+      break;
+    case X_RET:
+      inst.num_operands = 0;
+      break;
+    default:
+      break;
+  }
+  *push_machine(out, inst.op, inst.num_operands, inst.operands[0], inst.operands[1]) = inst;
+}
+
+// The stack is 16-byte aligned at calls, and the return address and saved
+// frame pointer of a function that returns are already on it
+static int frame_size(MachineFunction *fn)
+{
+  int pushed = fn->is_program_entry ? 0 : 16 + 8 * fn->num_saved;
+  int size = 8 * fn->num_slots;
+  return size + (16 - (pushed + size) % 16) % 16;
+}
+
+static void push_prologue(MachineFunction *fn, MachineCode *out)
+{
+  if (fn->needs_frame) {
+    if (!fn->is_program_entry)
+      push_machine(out, X_PUSH, 1, reg_operand(R_RBP), no_operand);
+    push_machine(out, X_MOV, 2, reg_operand(R_RBP), reg_operand(R_RSP));
+  }
+  for (RegisterID id = R_RAX; id < NUM_REGISTERS; id++) {
+    if (fn->used_preserved & REGISTER_BIT(id))
+      push_machine(out, X_PUSH, 1, reg_operand(id), no_operand);
+  }
+  if (fn->needs_frame && frame_size(fn))
+    push_machine(out, X_SUB, 2, reg_operand(R_RSP), imm_operand(frame_size(fn)));
+}
+
+static void push_epilogue(MachineFunction *fn, MachineCode *out)
+{
+  if (fn->needs_frame && frame_size(fn))
+    push_machine(out, X_LEA, 2, reg_operand(R_RSP), memory_operand(R_RBP, -8 * fn->num_saved));
+  for (int id = NUM_REGISTERS - 1; id >= 0; id--) {
+    if (fn->used_preserved & REGISTER_BIT(id))
+      push_machine(out, X_POP, 1, reg_operand(id), no_operand);
+  }
+  if (fn->needs_frame)
+    push_machine(out, X_POP, 1, reg_operand(R_RBP), no_operand);
+}
+
+// An address can take at most one register that wasn't allocated one, which
+// goes through the scratch register. With two, the scratch register holds
+// the whole address but for the displacement.
+static void rewrite_address(MachineFunction *fn, MachineCode *out, MachineOperand *address)
+{
+  MachineOperand scratch = reg_operand(SCRATCH_REGISTER);
+  MachineOperand base = address->reg != NO_REGISTER ? allocated_operand(fn, address->reg, 8) : scratch;
+  MachineOperand index = address->index != NO_REGISTER
+    ? allocated_operand(fn, address->index, 8) : scratch;
+  if (address->reg != NO_REGISTER && base.kind != MO_REG && address->index != NO_REGISTER
+      && index.kind != MO_REG && address->reg != address->index) {
+    push_machine(out, X_MOV, 2, scratch, index);
+    if (address->scale > 1)
+      push_machine(out, X_LEA, 2, scratch, address_operand(NO_REGISTER, SCRATCH_REGISTER,
+            address->scale, 0));
+    push_machine(out, X_ADD, 2, scratch, base);
+    *address = memory_operand(SCRATCH_REGISTER, address->value);
+    return;
+  }
+  if (base.kind != MO_REG) {
+    push_machine(out, X_MOV, 2, scratch, base);
+    base = scratch;
+  }
+  if (index.kind != MO_REG && address->reg == address->index) {
+    index = scratch;
+  } else if (index.kind != MO_REG) {
+    push_machine(out, X_MOV, 2, scratch, index);
+    index = scratch;
+  }
+  if (address->reg != NO_REGISTER)
+    address->reg = base.reg;
+  if (address->index != NO_REGISTER)
+    address->index = index.reg;
+}
+
+// Replaces virtual registers with what they were allocated, and adds the
+// prologue and epilogues
+static void rewrite_function(MachineFunction *fn)
+{
+  MachineCode out = { 0 };
+  for (int k = 0; k < fn->num_blocks; k++) {
+    MachineBlock *mb = &fn->blocks[k];
+    int first = out.size;
+    if (k == 0)
+      push_prologue(fn, &out);
+
+    for (int i = mb->first; i < mb->end; i++) {
+      MachineInst inst = fn->code.data[i];
+
+      // Rematerialized constants are never stored
+      MachineOperand *dst = &inst.operands[0];
+      if (inst.op == X_MOV && dst->kind == MO_REG && IS_VIRTUAL(dst->reg)
+          && allocated_operand(fn, dst->reg, 8).kind == MO_IMM)
+        continue;
+
+      for (int o = 0; o < inst.num_operands; o++) {
+        MachineOperand *operand = &inst.operands[o];
+        if (operand->kind == MO_REG)
+          *operand = allocated_operand(fn, operand->reg, operand->size);
+        else if (operand->kind == MO_MEM)
+          rewrite_address(fn, &out, operand);
+      }
+
+      if (inst.op == X_RET || inst.op == X_TAIL_CALL)
+        push_epilogue(fn, &out);
+      legalize(&out, inst);
+    }
+
+    mb->first = first;
+    mb->end = out.size;
+  }
+
+  for (int i = 0; i < out.size; i++) {
+    for (int o = 0; o < out.data[i].num_operands; o++)
+      codegen_stats.stack_operands += out.data[i].operands[o].kind == MO_MEM
+        && out.data[i].operands[o].reg == R_RBP;
+  }
+  codegen_stats.instructions += out.size;
+
+  free(fn->code.data);
+  fn->code = out;
+}
+
+/* Emission */
+
+// Assembly is appended to a list of chunks, so that text already written
+// never moves, and reaches the output file with one `writev()` once the
+// whole program has been generated, or whenever a chunk fills up when it is
+// generated one declaration at a time. Lines are formatted straight into the
+// chunk, after making sure that it has room for the longest one possible.
+#define CHUNK_SIZE (64 * 1024)
+#define MAX_IOVECS 1024
+
+typedef struct Chunk Chunk;
+struct Chunk
+{
+  Chunk *next;
+  size_t size;
+  char data[];
+};
+
+typedef struct
+{
+  Chunk *head;
+  Chunk *tail;
+  char *cursor;               // Free space left in the tail
+  char *limit;
+} OutputBuffer;
+
+static OutputBuffer output;
+
+static void add_chunk(size_t length)
+{
+  if (output.tail)
+    output.tail->size = output.cursor - output.tail->data;
+
+  size_t capacity = MAX(length, CHUNK_SIZE);
+  Chunk *chunk = malloc(sizeof(Chunk) + capacity);
+  if (!chunk)
+    fatal("couldn't allocate %zu bytes of assembly output", capacity);
+  chunk->next = NULL;
+  chunk->size = 0;
+  if (output.tail)
+    output.tail->next = chunk;
+  else
+    output.head = chunk;
+  output.tail = chunk;
+  output.cursor = chunk->data;
+  output.limit = chunk->data + capacity;
+}
+
+// Returns where the next `length` bytes go; whoever writes them moves the
+// cursor past what they actually used
+static char *reserve_output(size_t length)
+{
+  if ((size_t)(output.limit - output.cursor) < length)
+    add_chunk(length);
+  return output.cursor;
+}
+
+static bool write_output(int fd)
+{
+  struct iovec iovecs[MAX_IOVECS];
+  Chunk *chunk = output.head;
+  size_t offset = 0;          // Already written from `chunk`
+  while (chunk) {
+    int count = 0;
+    for (Chunk *c = chunk; c && count < MAX_IOVECS; c = c->next) {
+      size_t skip = c == chunk ? offset : 0;
+      if (c->size > skip)
+        iovecs[count++] = (struct iovec) { c->data + skip, c->size - skip };
+    }
+    if (count == 0)
+      break;
+
+    ssize_t written = writev(fd, iovecs, count);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+    while (chunk && (size_t)written >= chunk->size - offset) {
+      written -= chunk->size - offset;
+      offset = 0;
+      chunk = chunk->next;
+    }
+    offset += written;
+  }
+  return true;
+}
+
+static int output_fd = -1;
+
+static void free_output()
+{
+  for (Chunk *chunk = output.head, *next; chunk; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+  memset(&output, 0, sizeof(output));
+}
+
+// Writes out what the buffer holds and empties it, opening the output file
+// the first time
+static size_t drain_output(const char *filename)
+{
+  size_t total = 0;
+  if (output.tail)
+    output.tail->size = output.cursor - output.tail->data;
+  for (Chunk *chunk = output.head; chunk; chunk = chunk->next)
+    total += chunk->size;
+
+  if (output_fd < 0)
+    output_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (output_fd < 0 || !write_output(output_fd))
+    fatal("couldn't write output file `%s`", filename);
+  free_output();
+  return total;
+}
+
+static size_t flush_output(const char *filename)
+{
+  size_t total = drain_output(filename);
+  int status = close(output_fd);
+  output_fd = -1;
+  if (status != 0)
+    fatal("couldn't write output file `%s`", filename);
+  return total;
+}
+
+// Drops output that won't be written, after a compilation failed
+static void discard_output()
+{
+  free_output();
+  if (output_fd >= 0)
+    close(output_fd);
+  output_fd = -1;
+}
+
+// Directives to allocate memory (in # bytes)
+enum
+{
+  DB = 1,
+  DW = 2,
+  DD = 4,
+  DQ = 8,
+  DO = 16,
+  DY = 32,
+  DZ = 64,
+};
+
+const char *init_mem[] = {
+  [DB] = "db",
+  [DW] = "dw",
+  [DD] = "dd",
+  [DQ] = "dq",
+  [DO] = "do",
+  [DY] = "dy",
+  [DZ] = "dz",
+};
+
+enum
+{
+  RESB = 1,
+  RESD = 4,
+  RESQ = 8,
+};
+
+const char *uninit_mem[] = {
+  [RESB] = "resb",
+  [RESD] = "resd",
+  [RESQ] = "resq",
+};
+
+/* Formatting
+ *
+ * `put_*()` write at `at` without checking for room and return the end of
+ * what they wrote. Names of registers, mnemonics and conditions are a few
+ * bytes long, so copying them a byte at a time beats calling into libc.
+ */
+
+static char *put_string(char *at, const char *s)
+{
+  while (*s)
+    *at++ = *s++;
+  return at;
+}
+
+static char *put_decimal(char *at, int64_t value)
+{
+  // The magnitude of INT64_MIN only fits unsigned
+  uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+  if (value < 0)
+    *at++ = '-';
+
+  char digits[20];
+  int count = 0;
+  do {
+    digits[count++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+  while (count)
+    *at++ = digits[--count];
+  return at;
+}
+
+static size_t operand_length(MachineOperand *operand)
+{
+  // "qword [rel " + symbol + "]", or "qword [r12+r12*8-9223372036854775808]"
+  return 48 + (operand->symbol ? strlen(operand->symbol) : 0);
+}
+
+static void add_section(char *section)
+{
+  char *at = reserve_output(strlen(section) + 9);
+  at = put_string(at, "section ");
+  at = put_string(at, section);
+  *at++ = '\n';
+  output.cursor = at;
+}
+
+static void add_label(char *label) {
+  char *at = reserve_output(strlen(label) + 2);
+  at = put_string(at, label);
+  at = put_string(at, ":\n");
+  output.cursor = at;
+}
+
+static void add_instruction(char *instruction, char *op1, char *op2) {
+  char *at = reserve_output(strlen(instruction) + (op1 ? strlen(op1) : 0)
+      + (op2 ? strlen(op2) : 0) + 8);
+  at = put_string(at, "    ");
+  at = put_string(at, instruction);
+
+  if (op1) {
+    *at++ = ' ';
+    at = put_string(at, op1);
+  }
+
+  if (op2) {
+    at = put_string(at, ", ");
+    at = put_string(at, op2);
+  }
+
+  *at++ = '\n';
+  output.cursor = at;
+}
+
+// `lea` computes an address and doesn't need a size
+static char *put_operand(char *at, MachineOperand *operand, bool is_address)
+{
+  switch (operand->kind) {
+    case MO_REG:
+      return put_string(at, operand->size == 1
+          ? BYTE_REGISTER_NAMES[operand->reg] : REGISTERS_NASM_x86_64[operand->reg].name);
+    case MO_IMM:
+      return put_decimal(at, operand->value);
+    case MO_MEM:
+      if (!is_address)
+        at = put_string(at, "qword ");
+      *at++ = '[';
+      if (operand->symbol) {
+        at = put_string(at, "rel ");
+        at = put_string(at, operand->symbol);
+        *at++ = ']';
+        return at;
+      }
+      if (operand->reg != NO_REGISTER)
+        at = put_string(at, REGISTERS_NASM_x86_64[operand->reg].name);
+      if (operand->index != NO_REGISTER) {
+        if (operand->reg != NO_REGISTER)
+          *at++ = '+';
+        at = put_string(at, REGISTERS_NASM_x86_64[operand->index].name);
+        if (operand->scale > 1) {
+          *at++ = '*';
+          *at++ = '0' + operand->scale;
+        }
+      }
+      if (operand->value || (operand->reg == NO_REGISTER && operand->index == NO_REGISTER)) {
+        if (operand->value >= 0)
+          *at++ = '+';
+        at = put_decimal(at, operand->value);
+      }
+      *at++ = ']';
+      return at;
+    case MO_LABEL:
+      return put_string(at, operand->symbol);
+    default:
+      fatal("can't emit an operand of kind %d", operand->kind);
+      return at;
+  }
+}
+
+static void emit_machine_instruction(MachineInst *inst)
+{
+  size_t length = 32;
+  for (int o = 0; o < inst->num_operands; o++)
+    length += operand_length(&inst->operands[o]);
+
+  char *at = reserve_output(length);
+  at = put_string(at, "    ");
+  at = put_string(at, machine_ops[inst->op].name);
+  if (inst->op == X_SETCC || inst->op == X_JCC)
+    at = put_string(at, condition_names[inst->cond]);
+  for (int o = 0; o < inst->num_operands; o++) {
+    at = put_string(at, o == 0 ? " " : ", ");
+    at = put_operand(at, &inst->operands[o], inst->op == X_LEA);
+  }
+  *at++ = '\n';
+  output.cursor = at;
+}
+
+static void emit_function(MachineFunction *fn)
+{
+  for (int k = 0; k < fn->num_blocks; k++) {
+    MachineBlock *mb = &fn->blocks[k];
+    add_label(mb->label ? mb->label : fn->name);
+    for (int i = mb->first; i < mb->end; i++)
+      emit_machine_instruction(&fn->code.data[i]);
+  }
+}
+
+/* Encoding
+ *
+ * Machine code for `--emit=obj` and `--emit=exe`, in the encodings that
+ * NASM picks for the text `emit_machine_instruction()` prints, so that both
+ * outputs hold the same bytes: the shortest immediates and displacements,
+ * `mov r32, imm32` for moves of 32-bit unsigned values, the accumulator
+ * forms of arithmetic with 32-bit immediates, `[r+r]` for `[r*2]`, and
+ * short jumps wherever they reach.
+ */
+
+// Numbers of the registers in ModRM, SIB and opcodes. A REX prefix carries
+// the fourth bit.
+static const uint8_t REGISTER_NUMBERS[] = {
+  [R_RAX] = 0,
+  [R_RBX] = 3,
+  [R_RCX] = 1,
+  [R_RDX] = 2,
+  [R_RSP] = 4,
+  [R_RBP] = 5,
+  [R_RSI] = 6,
+  [R_RDI] = 7,
+  [R_R8]  = 8,
+  [R_R9]  = 9,
+  [R_R10] = 10,
+  [R_R11] = 11,
+  [R_R12] = 12,
+};
+
+static const uint8_t condition_codes[] = {
+  [CC_E] = 0x4,
+  [CC_NE] = 0x5,
+  [CC_L] = 0xc,
+  [CC_G] = 0xf,
+  [CC_LE] = 0xe,
+  [CC_GE] = 0xd,
+};
+
+#define REX   0x40
+#define REX_W 0x08
+#define REX_R 0x04
+#define REX_X 0x02
+#define REX_B 0x01
+
+// The bytes of one instruction, and the displacement in them that refers
+// to a label or a symbol: a jump's rel8 or rel32, a call's rel32 or the
+// disp32 of `[rel symbol]`
+typedef struct
+{
+  uint8_t bytes[16];
+  int length;
+  int field;                  // Offset of the displacement, or -1
+  int field_size;
+  char *target;
+  int64_t addend;             // To the address of the target
+} Encoding;
+
+static ElfObject *object_file = NULL;
+
+static bool is_imm8(int64_t value)
+{
+  return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+static void code_bytes(Encoding *e, uint64_t value, int size)
+{
+  for (int i = 0; i < size; i++)
+    e->bytes[e->length++] = value >> (8 * i);
+}
+
+static void code_byte(Encoding *e, uint8_t byte)
+{
+  code_bytes(e, byte, 1);
+}
+
+static void code_field(Encoding *e, char *target, int size, int64_t addend)
+{
+  e->field = e->length;
+  e->field_size = size;
+  e->target = target;
+  e->addend = addend;
+  code_bytes(e, 0, size);
+}
+
+static int register_number(MachineOperand *operand)
+{
+  return REGISTER_NUMBERS[operand->reg];
+}
+
+// Follows the opcode with ModRM, and SIB and a displacement for memory.
+// `reg` is a register or an opcode extension for the reg field.
+static void encode_modrm(Encoding *e, int reg, MachineOperand *rm)
+{
+  reg &= 7;
+  if (rm->kind == MO_REG) {
+    code_byte(e, 0xc0 | reg << 3 | (register_number(rm) & 7));
+    return;
+  }
+  if (rm->symbol) {
+    code_byte(e, reg << 3 | 5);
+    code_field(e, rm->symbol, 4, rm->value);
+    return;
+  }
+
+  // rbp and r13 as the base always take a displacement, and rsp and r12 a
+  // SIB byte. Without a base, mod 0 means a 32-bit displacement instead.
+  int64_t displacement = rm->value;
+  if (!is_imm32(displacement))
+    fatal("can't encode the displacement %lld", (long long)displacement);
+  int base = rm->reg == NO_REGISTER ? 5 : REGISTER_NUMBERS[rm->reg] & 7;
+  int mod = rm->reg == NO_REGISTER || (displacement == 0 && base != 5) ? 0
+    : is_imm8(displacement) ? 1 : 2;
+  if (rm->index == NO_REGISTER && rm->reg != NO_REGISTER && base != 4) {
+    code_byte(e, mod << 6 | reg << 3 | base);
+  } else {
+    int index = rm->index == NO_REGISTER ? 4 : REGISTER_NUMBERS[rm->index] & 7;
+    int scale = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0;
+    code_byte(e, mod << 6 | reg << 3 | 4);
+    code_byte(e, scale << 6 | index << 3 | base);
+  }
+  if (mod == 1)
+    code_bytes(e, displacement, 1);
+  else if (mod == 2 || rm->reg == NO_REGISTER)
+    code_bytes(e, displacement, 4);
+}
+
+// An instruction with a ModRM byte: optional REX, `opcode` (one or two
+// bytes, the first of two being 0x0f) and the operands
+static void encode_rm(Encoding *e, bool is_wide, uint32_t opcode, int reg, MachineOperand *operand)
+{
+  // A lone index scaled by 1 or 2 is a base, or base plus index
+  MachineOperand rm = *operand;
+  if (rm.kind == MO_MEM && rm.reg == NO_REGISTER && rm.index != NO_REGISTER && rm.scale <= 2) {
+    rm.reg = rm.index;
+    rm.index = rm.scale == 2 ? rm.index : NO_REGISTER;
+    rm.scale = 1;
+  }
+
+  uint8_t rex = (is_wide ? REX_W : 0) | (reg & 8 ? REX_R : 0);
+  if (rm.kind == MO_REG)
+    rex |= register_number(&rm) & 8 ? REX_B : 0;
+  if (rm.kind == MO_MEM && rm.reg != NO_REGISTER)
+    rex |= REGISTER_NUMBERS[rm.reg] & 8 ? REX_B : 0;
+  if (rm.kind == MO_MEM && rm.index != NO_REGISTER)
+    rex |= REGISTER_NUMBERS[rm.index] & 8 ? REX_X : 0;
+
+  // Without a REX prefix, the numbers of spl, bpl, sil and dil mean ah, ch,
+  // dh and bh
+  if (rex || (rm.kind == MO_REG && rm.size == 1 && register_number(&rm) >= 4))
+    code_byte(e, REX | rex);
+  if (opcode > 0xff)
+    code_byte(e, opcode >> 8);
+  code_byte(e, opcode);
+  encode_modrm(e, reg, &rm);
+}
+
+static void encode_move_immediate(Encoding *e, MachineOperand *dst, int64_t value)
+{
+  int number = register_number(dst);
+  if (value >= 0 && value <= UINT32_MAX) {
+    // Writing the 32-bit register clears the upper half
+    if (number & 8)
+      code_byte(e, REX | REX_B);
+    code_byte(e, 0xb8 | (number & 7));
+    code_bytes(e, value, 4);
+  } else if (is_imm32(value)) {
+    encode_rm(e, true, 0xc7, 0, dst);
+    code_bytes(e, value, 4);
+  } else {
+    code_byte(e, REX | REX_W | (number & 8 ? REX_B : 0));
+    code_byte(e, 0xb8 | (number & 7));
+    code_bytes(e, value, 8);
+  }
+}
+
+// `add`, `sub` and `cmp` are encoded alike, with their opcode extension as
+// the group 1 forms and `8 * extension` plus 1, 3 or 5 as the others
+static void encode_arithmetic(Encoding *e, int extension, MachineOperand *dst,
+    MachineOperand *src)
+{
+  if (src->kind == MO_IMM && !is_imm32(src->value))
+    fatal("can't encode the immediate %lld", (long long)src->value);
+
+  if (src->kind == MO_IMM && is_imm8(src->value)) {
+    encode_rm(e, true, 0x83, extension, dst);
+    code_bytes(e, src->value, 1);
+  } else if (src->kind == MO_IMM && dst->kind == MO_REG && dst->reg == R_RAX) {
+    code_byte(e, REX | REX_W);
+    code_byte(e, 8 * extension + 5);
+    code_bytes(e, src->value, 4);
+  } else if (src->kind == MO_IMM) {
+    encode_rm(e, true, 0x81, extension, dst);
+    code_bytes(e, src->value, 4);
+  } else if (src->kind == MO_REG) {
+    encode_rm(e, true, 8 * extension + 1, register_number(src), dst);
+  } else {
+    encode_rm(e, true, 8 * extension + 3, register_number(dst), src);
+  }
+}
+
+static void encode_push_pop(Encoding *e, uint8_t opcode, MachineOperand *operand)
+{
+  if (register_number(operand) & 8)
+    code_byte(e, REX | REX_B);
+  code_byte(e, opcode | (register_number(operand) & 7));
+}
+
+static void encode_instruction(Encoding *e, MachineInst *inst, bool is_short)
+{
+  *e = (Encoding){ .field = -1 };
+  MachineOperand *dst = &inst->operands[0], *src = &inst->operands[1];
+  switch (inst->op) {
+    case X_MOV:
+      if (src->kind == MO_IMM && dst->kind == MO_REG) {
+        encode_move_immediate(e, dst, src->value);
+      } else if (src->kind == MO_IMM) {
+        encode_rm(e, true, 0xc7, 0, dst);
+        code_bytes(e, src->value, 4);
+      } else if (src->kind == MO_REG) {
+        encode_rm(e, true, 0x89, register_number(src), dst);
+      } else {
+        encode_rm(e, true, 0x8b, register_number(dst), src);
+      }
+      break;
+    case X_MOVZX:
+      encode_rm(e, true, 0x0fb6, register_number(dst), src);
+      break;
+    case X_LEA:
+      encode_rm(e, true, 0x8d, register_number(dst), src);
+      break;
+    case X_ADD:
+      encode_arithmetic(e, 0, dst, src);
+      break;
+    case X_SUB:
+      encode_arithmetic(e, 5, dst, src);
+      break;
+    case X_CMP:
+      encode_arithmetic(e, 7, dst, src);
+      break;
+    case X_TEST:
+      encode_rm(e, true, 0x85, register_number(src), dst);
+      break;
+    case X_IMUL:
+      // The two-operand form with an immediate is the three-operand one
+      if (src->kind == MO_IMM) {
+        encode_rm(e, true, is_imm8(src->value) ? 0x6b : 0x69, register_number(dst), dst);
+        code_bytes(e, src->value, is_imm8(src->value) ? 1 : 4);
+      } else {
+        encode_rm(e, true, 0x0faf, register_number(dst), src);
+      }
+      break;
+    case X_NEG:
+      encode_rm(e, true, 0xf7, 3, dst);
+      break;
+    case X_IDIV:
+      encode_rm(e, true, 0xf7, 7, dst);
+      break;
+    case X_CQO:
+      code_byte(e, REX | REX_W);
+      code_byte(e, 0x99);
+      break;
+    case X_SETCC:
+      encode_rm(e, false, 0x0f90 | condition_codes[inst->cond], 0, dst);
+      break;
+    case X_JMP:
+      code_byte(e, is_short ? 0xeb : 0xe9);
+      code_field(e, dst->symbol, is_short ? 1 : 4, 0);
+      break;
+    case X_JCC:
+      if (!is_short)
+        code_byte(e, 0x0f);
+      code_byte(e, (is_short ? 0x70 : 0x80) | condition_codes[inst->cond]);
+      code_field(e, dst->symbol, is_short ? 1 : 4, 0);
+      break;
+    case X_CALL:
+      code_byte(e, 0xe8);
+      code_field(e, dst->symbol, 4, 0);
+      break;
+    case X_TAIL_CALL:
+      code_byte(e, 0xe9);
+      code_field(e, dst->symbol, 4, 0);
+      break;
+    case X_RET:
+      code_byte(e, 0xc3);
+      break;
+    case X_PUSH:
+      // Immediates are sign-extended to 64 bits
+      if (dst->kind == MO_IMM && is_imm8(dst->value)) {
+        code_byte(e, 0x6a);
+        code_bytes(e, dst->value, 1);
+      } else if (dst->kind == MO_IMM) {
+        code_byte(e, 0x68);
+        code_bytes(e, dst->value, 4);
+      } else if (dst->kind == MO_MEM) {
+        encode_rm(e, false, 0xff, 6, dst);
+      } else {
+        encode_push_pop(e, 0x50, dst);
+      }
+      break;
+    case X_POP:
+      encode_push_pop(e, 0x58, dst);
+      break;
+    case X_SYSCALL:
+      code_byte(e, 0x0f);
+      code_byte(e, 0x05);
+      break;
+  }
+}
+
+// Patches the displacement of an encoded instruction
+static void set_field(Encoding *e, int64_t value)
+{
+  int length = e->length;
+  e->length = e->field;
+  code_bytes(e, value, e->field_size);
+  e->length = length;
+}
+
+// Jumps start out short and the ones that don't reach their block are
+// encoded again long, until all do, which only ever moves blocks further
+// apart. Everything else the function refers to becomes a relocation.
+static void encode_function(MachineFunction *fn)
+{
+  VarMap labels;
+  var_map_init(&labels);
+  var_map_insert(&labels, fn->name);
+  for (int k = 1; k < fn->num_blocks; k++)
+    var_map_insert(&labels, fn->blocks[k].label);
+
+  int count = fn->code.size;
+  Encoding *code = malloc((count + 1) * sizeof(Encoding));
+  int *targets = malloc((count + 1) * sizeof(int));
+  uint64_t *offsets = malloc((count + 1) * sizeof(uint64_t));
+  for (int i = 0; i < count; i++) {
+    MachineInst *inst = &fn->code.data[i];
+    encode_instruction(&code[i], inst, true);
+    targets[i] = -1;
+    if (inst->op == X_JMP || inst->op == X_JCC) {
+      targets[i] = var_map_lookup(&labels, inst->operands[0].symbol);
+      if (targets[i] < 0)
+        fatal("jump to unknown label `%s` in `%s`", inst->operands[0].symbol, fn->name);
+    }
+  }
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    offsets[0] = 0;
+    for (int i = 0; i < count; i++)
+      offsets[i + 1] = offsets[i] + code[i].length;
+    for (int i = 0; i < count; i++) {
+      if (targets[i] < 0 || code[i].field_size != 1)
+        continue;
+      int64_t distance = offsets[fn->blocks[targets[i]].first] - offsets[i + 1];
+      if (!is_imm8(distance)) {
+        encode_instruction(&code[i], &fn->code.data[i], false);
+        changed = true;
+      }
+    }
+  }
+
+  uint64_t start = object_file->text.size;
+  buffer_reserve(&object_file->text, start + offsets[count]);
+  for (int i = 0; i < count; i++) {
+    Encoding *e = &code[i];
+    if (targets[i] >= 0) {
+      set_field(e, offsets[fn->blocks[targets[i]].first] - offsets[i + 1]);
+    } else if (e->field >= 0) {
+      // Displacements count from the end of the instruction
+      elf_relocate(object_file, start + offsets[i] + e->field, e->target,
+          e->addend - (e->length - e->field));
+    }
+    buffer_append(&object_file->text, e->bytes, e->length);
+  }
+
+  elf_define(object_file, fn->name, ELF_TEXT, start, offsets[count], true);
+
+  free(offsets);
+  free(targets);
+  free(code);
+  var_map_free(&labels);
+}
+
+/* Functions */
+
+static void free_machine_function(MachineFunction *fn)
+{
+  free(fn->code.data);
+  free(fn->blocks);
+  free(fn->intervals);
+  for (RegisterID id = R_RAX; id < NUM_REGISTERS; id++)
+    free(fn->fixed[id].ranges);
+  free_live_variables(&fn->live);
+}
+
+static void output_function(MachineFunction *fn)
+{
+  clock_t start = clock();
+  if (object_file)
+    encode_function(fn);
+  else
+    emit_function(fn);
+  codegen_stats.emission_time += clock() - start;
+}
+
+static void save_function(Buffer *out, MachineFunction *fn);
+
+// `_start` runs the initializers of globals that didn't become data, calls
+// `main` and exits with what it returned. A program that runs in-process
+// returns it to the compiler instead, like any other function. The code of
+// the function is also appended to `saved`, unless it is NULL.
+static void generate_function(BasicBlock *entry, BasicBlock *end, bool *skip,
+    CodegenOptions *options, Buffer *saved)
+{
+  MachineFunction fn = { 0 };
+  bool is_start = !is_function_entry(entry);
+  fn.is_program_entry = is_start && options->emit != EMIT_RUN;
+  fn.name = is_start ? "_start" : entry->tag;
+  fn.tail_calls = options->tail_calls;
+  fn.require_tail_calls = options->require_tail_calls;
+  compute_live_variables(entry, &fn.live);
+  fn.num_vregs = fn.live.vars.count;
+
+  lower_function(&fn, entry, end, skip);
+  if (is_start) {
+    lower_call(&fn, "main", NULL, 0, NULL);
+    if (fn.is_program_entry) {
+      machine(&fn, X_MOV, 2, reg_operand(R_RDI), reg_operand(R_RAX));
+      machine(&fn, X_MOV, 2, reg_operand(R_RAX), imm_operand(60));
+      machine(&fn, X_SYSCALL, 0, no_operand, no_operand);
+    } else {
+      machine(&fn, X_RET, 1, reg_operand(R_RAX), no_operand);
+    }
+    fn.blocks[0].end = fn.code.size;
+  }
+
+  build_intervals(&fn);
+  allocate_registers(&fn, options->allocator);
+  codegen_stats.functions++;
+  codegen_stats.virtual_registers += fn.num_vregs;
+  rewrite_function(&fn);
+  if (saved)
+    save_function(saved, &fn);
+  output_function(&fn);
+  free_machine_function(&fn);
+}
+
+// Functions that the program calls without defining them, and globals it
+// imports, come from modules and are left to the linker. `known` holds the
+// symbols already defined or declared, and takes those of `graph`. Objects
+// add them as they refer to them.
+static void declare_external_symbols(ControlFlowGraph *graph, VarMap *known)
+{
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    if (is_function_entry(block))
+      var_map_insert(known, intern(block->tag));
+  }
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      for (uint32_t o = 0; o < inst->num_operands; o++) {
+        Operand *operand = &inst->operands[o];
+        char *name = NULL;
+        if (inst->opcode == OP_CALL && o == 0) {
+          name = intern(operand->label);
+        } else if (operand->kind == OPERAND_GLOBAL) {
+          Symbol *symbol = ctx ? symbol_table_lookup(ctx->global_scope, operand->var) : NULL;
+          name = symbol && symbol->is_imported ? intern(operand->var) : NULL;
+        }
+        if (name && var_map_lookup(known, name) < 0) {
+          var_map_insert(known, name);
+          add_instruction("extern", name, NULL);
+        }
+      }
+    }
+  }
+}
+
+/* Data */
+
+// Globals of modules are visible to the programs that import them
+static void define_global(char *name, ElfSection section, int64_t value)
+{
+  bool is_global = ctx && ctx->is_module;
+  if (section == ELF_RODATA) {
+    elf_define(object_file, name, ELF_RODATA, object_file->rodata.size, 8, is_global);
+    buffer_append_u64(&object_file->rodata, value);
+  } else if (section == ELF_DATA) {
+    elf_define(object_file, name, ELF_DATA, object_file->data.size, 8, is_global);
+    buffer_append_u64(&object_file->data, value);
+  } else {
+    elf_define(object_file, name, ELF_BSS, object_file->bss_size, 8, is_global);
+    object_file->bss_size += 8;
+  }
+}
+
+// Globals that the first instruction of `$entry` touching them stores a
+// literal to start out with that value, without running any code. `skip`
+// marks those stores. Constants that nothing else stores to go in
+// `.rodata`.
+static void emit_globals(ControlFlowGraph *graph, bool *skip)
+{
+  VarMap globals;
+  var_map_init(&globals);
+  Vector stores;
+  vector_init(&stores, sizeof(char *));
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      for (uint32_t o = 0; o < inst->num_operands; o++) {
+        if (inst->operands[o].kind == OPERAND_GLOBAL)
+          var_map_insert(&globals, inst->operands[o].var);
+      }
+      if (inst->opcode == OP_STORE)
+        vector_push_back(&stores, inst->operands[0].var);
+    }
+  }
+
+  char **names = malloc((globals.count + 1) * sizeof(char *));
+  int64_t *values = malloc((globals.count + 1) * sizeof(int64_t));
+  bool *initialized = calloc(globals.count + 1, sizeof(bool));
+  bool *touched = calloc(globals.count + 1, sizeof(bool));
+  int *num_stores = calloc(globals.count + 1, sizeof(int));
+  for (size_t i = 0; i < stores.size; i++)
+    num_stores[var_map_lookup(&globals, stores.data[i])]++;
+  vector_free(&stores);
+  for (size_t i = 0; i < globals.capacity; i++) {
+    if (globals.keys[i])
+      names[globals.ids[i]] = globals.keys[i];
+  }
+
+  Vector *instructions = graph->entry ? &graph->entry->instructions : NULL;
+  for (size_t i = 0; instructions && i < instructions->size; i++) {
+    Instruction *inst = instructions->data[i];
+    for (uint32_t o = inst->num_operands; o-- > 0;) {
+      if (inst->operands[o].kind != OPERAND_GLOBAL)
+        continue;
+      int g = var_map_lookup(&globals, inst->operands[o].var);
+      if (inst->opcode == OP_STORE && o == 0 && !touched[g]
+          && inst->operands[1].kind == OPERAND_LITERAL) {
+        initialized[g] = skip[i] = true;
+        values[g] = literal_value(&inst->operands[1].literal);
+      }
+      touched[g] = true;
+    }
+  }
+
+  // Scalars take 64 bits in memory as they do in registers
+  static char *section_names[] = {
+    [ELF_RODATA] = ".rodata", [ELF_DATA] = ".data", [ELF_BSS] = ".bss",
+  };
+  for (ElfSection section = ELF_RODATA; section <= ELF_BSS; section++) {
+    bool has_section = false;
+    for (size_t g = 0; g < globals.count; g++) {
+      Symbol *symbol = ctx ? symbol_table_lookup(ctx->global_scope, names[g]) : NULL;
+      if (symbol && symbol->is_imported)
+        continue;
+      ElfSection placement = !initialized[g] ? ELF_BSS
+        : symbol && symbol->is_constant && num_stores[g] == 1 ? ELF_RODATA : ELF_DATA;
+      if (placement != section)
+        continue;
+      if (object_file) {
+        define_global(names[g], section, values[g]);
+        continue;
+      }
+      if (!has_section)
+        add_section(section_names[section]);
+      has_section = true;
+
+      if (ctx && ctx->is_module)
+        add_instruction("global", names[g], NULL);
+      char *at = reserve_output(strlen(names[g]) + 40);
+      at = put_string(at, "    ");
+      at = put_string(at, names[g]);
+      at = put_string(at, ": ");
+      at = put_string(at, section == ELF_BSS ? uninit_mem[RESQ] : init_mem[DQ]);
+      *at++ = ' ';
+      at = put_decimal(at, section == ELF_BSS ? 1 : values[g]);
+      *at++ = '\n';
+      output.cursor = at;
+    }
+  }
+
+  for (size_t g = 0; g < globals.count && object_file; g++) {
+    Symbol *symbol = ctx ? symbol_table_lookup(ctx->global_scope, names[g]) : NULL;
+    if (symbol && symbol->is_imported)
+      elf_symbol(object_file, names[g]);
+  }
+
+  free(num_stores);
+  free(touched);
+  free(initialized);
+  free(values);
+  free(names);
+  var_map_free(&globals);
+}
+
+static void begin_program(CodegenOptions *options, ElfObject *object)
+{
+#ifdef DEBUG
+  printf("Available Registers:\n");
+  for (RegisterID id = R_RAX; id <= R_R12; id++) {
+    printf("%*s%s\t%s\n", 4, "",
+        REGISTERS_NASM_x86_64[id].name,
+        REGISTERS_NASM_x86_64[id].is_preserved ? "preserved" : "scratch");
+  }
+#endif
+  init_allocation_order();
+  stats_allocator = options->allocator;
+  if (options->emit != EMIT_ASSEMBLY) {
+    elf_init(object);
+    object_file = object;
+  }
+}
+
+static void check_main(bool has_main, CodegenOptions *options)
+{
+  if (options->emit == EMIT_EXECUTABLE && !has_main)
+    fatal("executables need a `main` function");
+  if (options->emit == EMIT_RUN && !has_main)
+    fatal("programs need a `main` function to run");
+}
+
+// `_start` exists only in programs with a `main`, which is what runs the
+// initializers of globals that didn't become data
+static void generate_start(BasicBlock *start, bool *skip, bool has_main,
+    CodegenOptions *options)
+{
+  if (has_main) {
+    generate_function(start, function_end(start), skip, options, NULL);
+    return;
+  }
+  for (size_t i = 0; i < start->instructions.size; i++) {
+    if (!skip[i]) {
+      LOG_WARN("global initializers that aren't constants only run in programs with a `main`");
+      break;
+    }
+  }
+}
+
+// Writes the output, or runs the program, returning what `main` returned
+static int finish_program(CodegenOptions *options)
+{
+  clock_t flush_start = clock();
+  if (options->emit == EMIT_ASSEMBLY)
+    codegen_stats.emitted_bytes += flush_output(options->output_filename);
+  else if (options->emit == EMIT_OBJECT)
+    codegen_stats.emitted_bytes += elf_write_object(object_file, options->output_filename);
+  else if (options->emit == EMIT_EXECUTABLE)
+    codegen_stats.emitted_bytes += elf_write_executable(object_file, options->output_filename,
+        "_start");
+  codegen_stats.emission_time += clock() - flush_start;
+
+  int status = 0;
+  if (options->emit == EMIT_RUN) {
+    JitImage image;
+    jit_load(&image, object_file);
+    if (options->perf_symbols) {
+      jit_write_perf_map(&image);
+      jit_write_jitdump(&image);
+    }
+    if (options->run_in_child)
+      status = jit_run_in_child(&image, "_start");
+    else
+      status = jit_run(&image, "_start");
+    jit_unload(&image);
+  }
+
+  if (object_file)
+    elf_free(object_file);
+  object_file = NULL;
+  return status;
+}
+
+int nasm_x86_64_generate(ControlFlowGraph *graph, CodegenOptions *options)
+{
+  bool has_main = false;
+  for (BasicBlock *block = graph->blocks; block; block = block->next)
+    has_main |= is_function_entry(block) && strcmp(block->tag, "main") == 0;
+  check_main(has_main, options);
+
+  ElfObject object;
+  begin_program(options, &object);
+
+  BasicBlock *start = graph->entry;
+  size_t num_initializers = start ? start->instructions.size : 0;
+  bool *skip = calloc(num_initializers + 1, sizeof(bool));
+  emit_globals(graph, skip);
+
+  // Objects make functions global as they define them
+  if (!object_file) {
+    VarMap known;
+    var_map_init(&known);
+    declare_external_symbols(graph, &known);
+    var_map_free(&known);
+    add_section(".text");
+    if (has_main)
+      add_instruction("global", "_start", NULL);
+    for (BasicBlock *block = graph->blocks; block; block = block->next) {
+      if (is_function_entry(block))
+        add_instruction("global", block->tag, NULL);
+    }
+  }
+
+  for (BasicBlock *block = graph->blocks; block; block = function_end(block)) {
+    if (is_function_entry(block))
+      generate_function(block, function_end(block), NULL, options, NULL);
+    else if (block == start)
+      generate_start(start, skip, has_main, options);
+  }
+
+  free(skip);
+  return finish_program(options);
+}
+
+/* Code Cache
+ *
+ * Streamed functions are cached as the machine code that register allocation
+ * and rewriting left, which both `emit_function()` and `encode_function()`
+ * take, so a hit skips everything but writing it out. An entry holds the
+ * functions of one declaration:
+ *   char magic[4], uint32_t version, uint64_t checksum of what follows
+ *   uint32_t num_functions
+ *   per function: name, uint32_t num_instructions, uint32_t num_blocks,
+ *     per block: label, uint32_t first, uint32_t end
+ *     per instruction: uint8_t op, cond, num_operands, uint32_t uses,
+ *       per operand: uint8_t kind, size, scale, int32_t reg, index,
+ *         int64_t value, symbol
+ * Strings are a uint32_t length and their bytes, or UINT32_MAX for NULL.
+ */
+
+#define CODE_MAGIC    "MMC"
+#define CODE_VERSION  1
+#define CODE_HEADER_SIZE 16
+
+// Code depends on the IR it was generated from, which `key` identifies, and
+// on the options of the backend
+static Hash128 code_key(Hash128 key, CodegenOptions *options)
+{
+  Buffer material;
+  buffer_init(&material);
+  buffer_append(&material, &key, sizeof(key));
+  buffer_append_u8(&material, options->allocator);
+  buffer_append_u8(&material, options->emit);
+  buffer_append_u8(&material, options->tail_calls);
+  buffer_append_u8(&material, options->require_tail_calls);
+  Hash128 hash = hash_128(material.data, material.size, CODE_VERSION);
+  buffer_free(&material);
+  return hash;
+}
+
+static void save_string(Buffer *out, const char *s)
+{
+  if (!s) {
+    buffer_append_u32(out, UINT32_MAX);
+    return;
+  }
+  buffer_append_u32(out, strlen(s));
+  buffer_append_str(out, s);
+}
+
+static void begin_saved_code(Buffer *out, uint32_t num_functions)
+{
+  buffer_append(out, CODE_MAGIC, 4);
+  buffer_append_u32(out, CODE_VERSION);
+  buffer_append_u64(out, 0);
+  buffer_append_u32(out, num_functions);
+}
+
+static void finish_saved_code(Buffer *out)
+{
+  uint64_t checksum = hash_n(out->data + CODE_HEADER_SIZE, out->size - CODE_HEADER_SIZE);
+  memcpy(out->data + 8, &checksum, sizeof(checksum));
+}
+
+static void save_function(Buffer *out, MachineFunction *fn)
+{
+  save_string(out, fn->name);
+  buffer_append_u32(out, fn->code.size);
+  buffer_append_u32(out, fn->num_blocks);
+  for (int k = 0; k < fn->num_blocks; k++) {
+    save_string(out, fn->blocks[k].label);
+    buffer_append_u32(out, fn->blocks[k].first);
+    buffer_append_u32(out, fn->blocks[k].end);
+  }
+  for (int i = 0; i < fn->code.size; i++) {
+    MachineInst *inst = &fn->code.data[i];
+    buffer_append_u8(out, inst->op);
+    buffer_append_u8(out, inst->cond);
+    buffer_append_u8(out, inst->num_operands);
+    buffer_append_u32(out, inst->uses);
+    for (int o = 0; o < inst->num_operands; o++) {
+      MachineOperand *operand = &inst->operands[o];
+      buffer_append_u8(out, operand->kind);
+      buffer_append_u8(out, operand->size);
+      buffer_append_u8(out, operand->scale);
+      buffer_append_u32(out, operand->reg);
+      buffer_append_u32(out, operand->index);
+      buffer_append_u64(out, operand->value);
+      save_string(out, operand->symbol);
+    }
+  }
+}
+
+typedef struct
+{
+  const uint8_t *data;
+  size_t size;
+  size_t pos;
+  bool ok;
+} CodeReader;
+
+static uint64_t read_value(CodeReader *r, size_t size)
+{
+  uint64_t value = 0;
+  if (!r->ok || size > r->size - r->pos) {
+    r->ok = false;
+    return 0;
+  }
+  memcpy(&value, r->data + r->pos, size);
+  r->pos += size;
+  return value;
+}
+
+static char *read_string(CodeReader *r)
+{
+  uint32_t length = read_value(r, 4);
+  if (!r->ok || length == UINT32_MAX)
+    return NULL;
+  if (length > r->size - r->pos) {
+    r->ok = false;
+    return NULL;
+  }
+  char *s = intern_n((const char *)r->data + r->pos, length);
+  r->pos += length;
+  return s;
+}
+
+// Whether `count` items of at least `size` bytes each could still follow,
+// so that a corrupt count can't make us allocate without bound
+static bool has_room(CodeReader *r, uint32_t count, size_t size)
+{
+  r->ok = r->ok && count <= (r->size - r->pos) / size;
+  return r->ok;
+}
+
+static bool is_register(int reg, bool is_optional)
+{
+  return (reg >= 0 && reg < NUM_REGISTERS) || (is_optional && reg == NO_REGISTER);
+}
+
+static void load_operand(CodeReader *r, MachineOperand *operand)
+{
+  operand->kind = read_value(r, 1);
+  operand->size = read_value(r, 1);
+  operand->scale = read_value(r, 1);
+  operand->reg = (int32_t)read_value(r, 4);
+  operand->index = (int32_t)read_value(r, 4);
+  operand->value = read_value(r, 8);
+  operand->symbol = read_string(r);
+  switch (operand->kind) {
+    case MO_REG:
+      r->ok = r->ok && is_register(operand->reg, false)
+        && (operand->size == 1 || operand->size == 8);
+      break;
+    case MO_IMM:
+      break;
+    case MO_MEM:
+      r->ok = r->ok && is_register(operand->reg, true) && is_register(operand->index, true)
+        && (operand->scale == 1 || operand->scale == 2 || operand->scale == 4
+          || operand->scale == 8);
+      break;
+    case MO_LABEL:
+      r->ok = r->ok && operand->symbol;
+      break;
+    default:
+      r->ok = false;
+  }
+}
+
+// Checks everything that emitting or encoding the code would otherwise trust
+static bool load_function(CodeReader *r, MachineFunction *fn)
+{
+  *fn = (MachineFunction){ 0 };
+  fn->name = read_string(r);
+  uint32_t num_instructions = read_value(r, 4);
+  uint32_t num_blocks = read_value(r, 4);
+  if (!fn->name || !num_blocks || !has_room(r, num_blocks, 12))
+    return false;
+
+  fn->num_blocks = num_blocks;
+  fn->blocks = calloc(num_blocks, sizeof(MachineBlock));
+  VarMap labels;
+  var_map_init(&labels);
+  var_map_insert(&labels, fn->name);
+  for (uint32_t k = 0; k < num_blocks && r->ok; k++) {
+    MachineBlock *mb = &fn->blocks[k];
+    mb->label = read_string(r);
+    mb->first = read_value(r, 4);
+    mb->end = read_value(r, 4);
+    r->ok = r->ok && (k == 0 || mb->label) && mb->first >= 0 && mb->first <= mb->end
+      && (uint32_t)mb->end <= num_instructions;
+    if (r->ok && k > 0)
+      var_map_insert(&labels, mb->label);
+  }
+
+  if (has_room(r, num_instructions, 7)) {
+    fn->code.data = calloc(num_instructions + 1, sizeof(MachineInst));
+    fn->code.size = fn->code.capacity = num_instructions;
+  }
+  for (uint32_t i = 0; i < num_instructions && r->ok; i++) {
+    MachineInst *inst = &fn->code.data[i];
+    inst->op = read_value(r, 1);
+    inst->cond = read_value(r, 1);
+    inst->num_operands = read_value(r, 1);
+    inst->uses = read_value(r, 4);
+    r->ok = r->ok && inst->op <= X_SYSCALL && inst->cond <= CC_GE && inst->num_operands <= 2;
+    for (int o = 0; o < inst->num_operands && r->ok; o++)
+      load_operand(r, &inst->operands[o]);
+    if (r->ok && (inst->op == X_JMP || inst->op == X_JCC))
+      r->ok = inst->num_operands == 1 && inst->operands[0].kind == MO_LABEL
+        && var_map_lookup(&labels, inst->operands[0].symbol) >= 0;
+  }
+  var_map_free(&labels);
+  return r->ok;
+}
+
+static void free_loaded_function(MachineFunction *fn)
+{
+  free(fn->code.data);
+  free(fn->blocks);
+}
+
+// Reads every function of an entry before any is written out, so that a
+// corrupt entry leaves nothing behind. Returns the functions, or NULL.
+static MachineFunction *load_code(const uint8_t *data, size_t size, uint32_t *num_functions)
+{
+  uint64_t checksum = 0;
+  if (size < CODE_HEADER_SIZE + 4 || memcmp(data, CODE_MAGIC, 4) != 0)
+    return NULL;
+  uint32_t version = 0;
+  memcpy(&version, data + 4, sizeof(version));
+  memcpy(&checksum, data + 8, sizeof(checksum));
+  if (version != CODE_VERSION
+      || checksum != hash_n((uint8_t *)data + CODE_HEADER_SIZE, size - CODE_HEADER_SIZE))
+    return NULL;
+
+  CodeReader r = { .data = data, .size = size, .pos = CODE_HEADER_SIZE, .ok = true };
+  *num_functions = read_value(&r, 4);
+  if (!has_room(&r, *num_functions, 12))
+    return NULL;
+  MachineFunction *functions = calloc(*num_functions + 1, sizeof(MachineFunction));
+  uint32_t loaded = 0;
+  while (loaded < *num_functions && load_function(&r, &functions[loaded]))
+    loaded++;
+  if (loaded == *num_functions && r.pos == r.size)
+    return functions;
+
+  for (uint32_t f = 0; f <= loaded && f < *num_functions; f++)
+    free_loaded_function(&functions[f]);
+  free(functions);
+  return NULL;
+}
+
+/* Streaming */
+
+// A program generated one declaration at a time is written out as it goes.
+// The initializers of its globals are collected for `_start`, which comes
+// last, after the data that the globals that are constant become.
+typedef struct
+{
+  CodegenOptions *options;
+  ElfObject object;
+  ControlFlowGraph start;     // One `$entry` block of initializers
+  VarMap known;               // Symbols defined or declared so far
+  bool has_main;
+  bool is_open;
+} CodegenStream;
+
+static CodegenStream stream;
+
+void nasm_x86_64_begin_stream(CodegenOptions *options)
+{
+  stream = (CodegenStream){ .options = options, .is_open = true };
+  begin_program(options, &stream.object);
+  BasicBlock *entry = make_basic_block(intern("$entry"), stream.start.num_blocks++);
+  stream.start.entry = stream.start.blocks = entry;
+  var_map_init(&stream.known);
+  if (!object_file)
+    add_section(".text");
+}
+
+static void begin_streamed_function(char *name)
+{
+  stream.has_main |= strcmp(name, "main") == 0;
+  if (!object_file)
+    add_instruction("global", name, NULL);
+}
+
+// Writes out the functions of a cache entry, returning false if there is
+// none or it is corrupt
+static bool output_cached_code(Hash128 key)
+{
+  size_t size = 0;
+  uint8_t *data = cache_load(key, "code", &size);
+  if (!data)
+    return false;
+
+  uint32_t num_functions = 0;
+  MachineFunction *functions = load_code(data, size, &num_functions);
+  free(data);
+  if (!functions) {
+    LOG_WARN("ignoring corrupt cache entry for generated code");
+    return false;
+  }
+  for (uint32_t f = 0; f < num_functions; f++) {
+    begin_streamed_function(functions[f].name);
+    output_function(&functions[f]);
+    free_loaded_function(&functions[f]);
+  }
+  free(functions);
+  return true;
+}
+
+void nasm_x86_64_stream(ControlFlowGraph *graph, Hash128 *key)
+{
+  Vector *initializers = &stream.start.entry->instructions;
+  for (size_t i = 0; graph->entry && i < graph->entry->instructions.size; i++)
+    vector_push_back(initializers, copy_instruction(graph->entry->instructions.data[i]));
+
+  if (!object_file)
+    declare_external_symbols(graph, &stream.known);
+  Hash128 cached = key ? code_key(*key, stream.options) : (Hash128){ 0 };
+  if (!key || !output_cached_code(cached)) {
+    uint32_t num_functions = 0;
+    for (BasicBlock *block = graph->blocks; block; block = block->next)
+      num_functions += is_function_entry(block);
+    Buffer saved;
+    buffer_init(&saved);
+    if (key)
+      begin_saved_code(&saved, num_functions);
+
+    for (BasicBlock *block = graph->blocks; block; block = function_end(block)) {
+      if (!is_function_entry(block))
+        continue;
+      begin_streamed_function(block->tag);
+      generate_function(block, function_end(block), NULL, stream.options, key ? &saved : NULL);
+    }
+    if (key) {
+      finish_saved_code(&saved);
+      cache_store(cached, "code", saved.data, saved.size);
+    }
+    buffer_free(&saved);
+  }
+
+  // Full chunks are written out, so that the assembly doesn't pile up
+  if (!object_file && output.head != output.tail)
+    codegen_stats.emitted_bytes += drain_output(stream.options->output_filename);
+}
+
+int nasm_x86_64_end_stream()
+{
+  CodegenOptions *options = stream.options;
+  check_main(stream.has_main, options);
+  BasicBlock *start = stream.start.entry;
+  bool *skip = calloc(start->instructions.size + 1, sizeof(bool));
+  emit_globals(&stream.start, skip);
+  if (!object_file) {
+    declare_external_symbols(&stream.start, &stream.known);
+    add_section(".text");
+    if (stream.has_main)
+      add_instruction("global", "_start", NULL);
+  }
+  generate_start(start, skip, stream.has_main, options);
+  free(skip);
+
+  int status = finish_program(options);
+  free_cfg(&stream.start);
+  var_map_free(&stream.known);
+  stream = (CodegenStream){ 0 };
+  return status;
+}
+
+void nasm_x86_64_abort()
+{
+  discard_output();
+  if (object_file)
+    elf_free(object_file);
+  object_file = NULL;
+  if (stream.is_open) {
+    free_cfg(&stream.start);
+    var_map_free(&stream.known);
+  }
+  stream = (CodegenStream){ 0 };
 }
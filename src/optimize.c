@@ -1,115 +1,164 @@
 #include "optimize.h"
 #include "types.h"
 #include "util.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-intmax_t fold_int(BinaryOp op, intmax_t left, intmax_t right)
+static bool compare(BinaryOp op, int order, Value *result)
 {
-  intmax_t result = 0;
+  result->kind = VAL_BOOL;
   switch (op) {
-    case BIN_ADD:
-      result = left + right;
-      break;
-    case BIN_SUB:
-      result = left - right;
-      break;
-    case BIN_MUL:
-      result = left * right;
-      break;
-    case BIN_DIV:
-      result = left / right;
-      break;
-    case BIN_CMP:
-      result = left == right;
-      break;
-    case BIN_CMP_NOT:
-      result = left != right;
-      break;
-    case BIN_CMP_LT:
-      result = left < right;
-      break;
-    case BIN_CMP_GT:
-      result = left > right;
-      break;
-    case BIN_CMP_LT_EQ:
-      result = left <= right;
-      break;
-    case BIN_CMP_GT_EQ:
-      result = left >= right;
-      break;
-    default: fatal("unknown BinaryOp in fold_int: %d", op);
+    case BIN_CMP:       result->b_val = order == 0; break;
+    case BIN_CMP_NOT:   result->b_val = order != 0; break;
+    case BIN_CMP_LT:    result->b_val = order < 0; break;
+    case BIN_CMP_GT:    result->b_val = order > 0; break;
+    case BIN_CMP_LT_EQ: result->b_val = order <= 0; break;
+    case BIN_CMP_GT_EQ: result->b_val = order >= 0; break;
+    default: return false;
   }
-  return result;
+  return true;
 }
 
-// Performs Constant Folding and Common-Subexpression Elimination in one pass
-void fold_constants(Node *node)
+// Arithmetic is done on unsigned values so that it wraps around like the
+// generated code does instead of overflowing
+static bool fold_uint(BinaryOp op, uintmax_t left, uintmax_t right, uintmax_t *result)
 {
-  if (!node) return;
+  switch (op) {
+    case BIN_ADD: *result = left + right; break;
+    case BIN_SUB: *result = left - right; break;
+    case BIN_MUL: *result = left * right; break;
+    default: return false;
+  }
+  return true;
+}
 
-  Node *next = node->next;
+bool fold_binary(BinaryOp op, Value left, Value right, Value *result)
+{
+  if (left.kind != right.kind)
+    return false;
 
-  switch (node->kind) {
-    case NODE_FUNC_DECL:
-      fold_constants(node->func_decl.body);
-      break;
-    case NODE_VAR_DECL:
-      fold_constants(node->var_decl.init);
-      break;
-    case NODE_ASSIGN_STMT:
-      AssignStmt assign = node->assign;
-      if (assign.value->kind == NODE_REF_EXPR &&
-          strcmp(assign.name, assign.value->ref) == 0) {
-        LOG_INFO("elminiating self-assignment of variable `%s` on line %d, col %d",
-            assign.name, node->line, node->col);
-        node->kind = NODE_NOOP;
-        free(assign.value);
-      } else {
-        fold_constants(node->assign.value);
+  memset(result, 0, sizeof(Value));
+  result->kind = left.kind;
+  switch (left.kind) {
+    case VAL_INT:
+      if (op == BIN_DIV) {
+        // Division by zero and INTMAX_MIN / -1 trap at run time
+        if (right.i_val == 0 || (left.i_val == INTMAX_MIN && right.i_val == -1))
+          return false;
+        result->i_val = left.i_val / right.i_val;
+        return true;
       }
-      break;
-    case NODE_UNARY_EXPR:
-      fold_constants(node->unary.expr);
-      break;
-    case NODE_BINARY_EXPR:
-      BinaryOp op = node->binary.bin_op;
-      Node *lhs = node->binary.lhs;
-      Node *rhs = node->binary.rhs;
+      if (fold_uint(op, left.u_val, right.u_val, &result->u_val))
+        return true;
+      return compare(op, (left.i_val > right.i_val) - (left.i_val < right.i_val), result);
+    case VAL_UINT:
+      if (op == BIN_DIV) {
+        if (right.u_val == 0)
+          return false;
+        result->u_val = left.u_val / right.u_val;
+        return true;
+      }
+      if (fold_uint(op, left.u_val, right.u_val, &result->u_val))
+        return true;
+      return compare(op, (left.u_val > right.u_val) - (left.u_val < right.u_val), result);
+    case VAL_BOOL:
+      if (op != BIN_CMP && op != BIN_CMP_NOT)
+        return false;
+      return compare(op, left.b_val != right.b_val, result);
+    default:
+      return false;
+  }
+}
 
-      // TODO: We only fold literal constant expressions that are of the same type.
-      // No implicit type coercion happens here. Add a warning down the line if the
-      // types of rhs and lhs are not the same.
+bool fold_unary(UnaryOp op, Value operand, Value *result)
+{
+  memset(result, 0, sizeof(Value));
+  result->kind = operand.kind;
+  if (op == UN_NEG && (operand.kind == VAL_INT || operand.kind == VAL_UINT)) {
+    result->u_val = 0 - operand.u_val;
+    return true;
+  }
+  if (op == UN_NOT && operand.kind == VAL_BOOL) {
+    result->b_val = !operand.b_val;
+    return true;
+  }
+  return false;
+}
 
-      if (lhs->kind == NODE_UNARY_EXPR || lhs->kind == NODE_BINARY_EXPR)
-        fold_constants(lhs);
+// Performs Constant Folding and Common-Subexpression Elimination in one pass
+void fold_constants(Node *node)
+{
+  // Statement lists are walked iteratively so long bodies don't exhaust the stack
+  for (; node; node = node->next) {
+    switch (node->kind) {
+      case NODE_FUNC_DECL:
+        fold_constants(node->func_decl.body);
+        break;
+      case NODE_VAR_DECL:
+        fold_constants(node->var_decl.init);
+        break;
+      case NODE_ASSIGN_STMT:
+        AssignStmt assign = node->assign;
+        if (assign.value->kind == NODE_REF_EXPR &&
+            strcmp(assign.name, assign.value->ref) == 0) {
+          LOG_INFO("elminiating self-assignment of variable `%s` on line %d, col %d",
+              assign.name, node->line, node->col);
+          node->kind = NODE_NOOP;
+          free(assign.value);
+        } else {
+          fold_constants(node->assign.value);
+        }
+        break;
+      case NODE_COND_STMT:
+        fold_constants(node->cond_stmt.expr);
+        fold_constants(node->cond_stmt.body);
+        fold_constants(node->cond_stmt.orelse);
+        break;
+      case NODE_UNARY_EXPR:
+        fold_constants(node->unary.expr);
+        break;
+      case NODE_FUNC_CALL_EXPR:
+        fold_constants(node->call.args);
+        break;
+      case NODE_BINARY_EXPR:
+        BinaryOp op = node->binary.bin_op;
+        Node *lhs = node->binary.lhs;
+        Node *rhs = node->binary.rhs;
 
-      if (rhs->kind == NODE_UNARY_EXPR || rhs->kind == NODE_BINARY_EXPR)
-        fold_constants(rhs);
+        // TODO: We only fold literal constant expressions that are of the same type.
+        // No implicit type coercion happens here. Add a warning down the line if the
+        // types of rhs and lhs are not the same.
 
-      if (lhs->kind == NODE_LITERAL_EXPR
-          && lhs->kind == rhs->kind
-          && lhs->literal.kind == rhs->literal.kind) {
-        LOG_INFO("folding constant binary expression of on line %d, col %d",
-            node->line, node->col);
+        if (lhs->kind == NODE_UNARY_EXPR || lhs->kind == NODE_BINARY_EXPR
+            || lhs->kind == NODE_FUNC_CALL_EXPR)
+          fold_constants(lhs);
 
-        Value folded = { .kind = lhs->literal.kind };
-        switch (folded.kind) {
-          case VAL_INT:
-            folded.i_val = fold_int(op, lhs->literal.i_val, rhs->literal.i_val);
-            break;
-          default: 
-            LOG_WARN("constant folding not yet supported for Literal Type: %d", folded.kind);
-            goto end;
-        }
+        if (rhs->kind == NODE_UNARY_EXPR || rhs->kind == NODE_BINARY_EXPR
+            || rhs->kind == NODE_FUNC_CALL_EXPR)
+          fold_constants(rhs);
 
-        node->kind = NODE_LITERAL_EXPR;
-        node->literal = folded;
-      }
-      break;
-  }
+        if (lhs->kind == NODE_LITERAL_EXPR
+            && lhs->kind == rhs->kind
+            && lhs->literal.kind == rhs->literal.kind) {
+          LOG_INFO("folding constant binary expression of on line %d, col %d",
+              node->line, node->col);
+
+          Value folded;
+          if (!fold_binary(op, lhs->literal, rhs->literal, &folded)) {
+            LOG_WARN("couldn't fold constant binary expression on line %d, col %d",
+                node->line, node->col);
+            continue;
+          }
 
-end:
-  fold_constants(next);
+          free_ast(lhs);
+          free_ast(rhs);
+          node->kind = NODE_LITERAL_EXPR;
+          node->literal = folded;
+        }
+        break;
+      default: break;
+    }
+  }
 }
 
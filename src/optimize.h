@@ -3,6 +3,13 @@
 
 #include "parse.h"
 
+#include <stdbool.h>
+
+// Evaluate an operation on constants the way the generated code would. Return
+// false if the result isn't known at compile time, e.g. for division by zero.
+bool fold_binary(BinaryOp op, Value left, Value right, Value *result);
+bool fold_unary(UnaryOp op, Value operand, Value *result);
+
 void fold_constants(Node *node);
 
 #endif
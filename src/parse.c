@@ -1,5 +1,6 @@
 #include "parse.h"
 #include "compile.h"
+#include "module.h"
 #include "symbols.h"
 #include "util.h"
 
@@ -10,7 +11,12 @@
 static SymbolTable *current_scope;  // The current scope of the parser
 static Vector stream;               // The stream of tokens to parse
 static size_t stream_pos;           // The position in the token stream
+static bool streaming;              // Pull tokens from the lexer on demand
 static Node *stack_top;             // The top of the expression stack
+static Symbol *self_symbol;         // The function being parsed, in its own scope
+static Vector unfinished;           // Nodes of the declaration being parsed
+static Node parsed;                 // Heads the declarations `parse()` has completed
+static Vector streamed;             // Declarations returned while streaming
 
 void enter_scope(SymbolTable *new_scope)
 { 
@@ -24,6 +30,8 @@ void exit_scope()
 
 static Token *tok()
 { 
+  if (streaming && stream_pos == stream.size)
+    vector_push_back(&stream, lex_token());
   return (Token *)vector_get(&stream, stream_pos); 
 }
 
@@ -58,6 +66,7 @@ static Node *make_node(NodeKind kind)
   node->type = primitive_types[TYPE_VOID];
   node->visited = false;
   node->next = NULL;
+  vector_push_back(&unfinished, node);
   return node;
 }
 
@@ -84,10 +93,81 @@ Node *pop_expr_node()
   return ret;
 }
 
+// Looks up a Symbol in the current scope, falling back to the exports of the
+// modules imported as a whole
+static Symbol *lookup(char *name)
+{
+  Symbol *symbol = symbol_table_lookup(current_scope, name);
+  if (!symbol)
+    symbol = module_resolve(name);
+  return symbol;
+}
+
 static void parse_factor();
 static void parse_term();
+static Node *parse_expression();
 static Node *parse_block(bool);
 
+// Parses the arguments of a call to `func_name`, from its `(`, and checks
+// them against the parameters of the function
+static Node *parse_call(char *func_name, int line, int col)
+{
+  Symbol *func_sym = lookup(func_name);
+  if (!func_sym)
+    fatal("at line %d, col %d: unknown function `%s`", line, col, func_name);
+  if (func_sym->kind != SYMBOL_FUNCTION || !func_sym->node)
+    fatal("at line %d, col %d: `%s` isn't a function", line, col, func_name);
+
+  // Functions can only call those declared before them, so the only cycle
+  // is a function calling itself, which finds it in its own scope
+  if (func_sym == self_symbol)
+    func_sym->node->func_decl.is_recursive = true;
+
+  Node *node = make_node(NODE_FUNC_CALL_EXPR);
+  node->line = line; node->col = col;
+  node->call.name = func_name;
+  node->type = func_sym->type;
+
+  // Arguments are whole expressions of their own, parsed on an empty stack
+  Node *outer = stack_top;
+  stack_top = NULL;
+
+  Node args = {0};
+  Node *cur = &args;
+  Node *param = func_sym->node->func_decl.params;
+  expect(TOKEN_LPAREN);
+  while (tok()->kind != TOKEN_RPAREN) {
+    int arg_line = tok()->line;
+    int arg_col = tok()->col;
+    Node *arg = parse_expression();
+    arg->next = NULL;
+    cur = cur->next = arg;
+    node->call.num_args++;
+
+    if (param && param->var_decl.type.id != arg->type.id) {
+      fatal("at line %d, col %d: argument of type `%s` for parameter `%s` of type `%s`",
+          arg_line, arg_col, arg->type.name, param->var_decl.name, param->var_decl.type.name);
+    }
+    if (param) param = param->next;
+
+    if (!match(TOKEN_COMMA))
+      break;
+  }
+  expect(TOKEN_RPAREN);
+  node->call.args = args.next;
+  stack_top = outer;
+
+  uint32_t num_params = 0;
+  for (param = func_sym->node->func_decl.params; param; param = param->next)
+    num_params++;
+  if (node->call.num_args != num_params) {
+    fatal("at line %d, col %d: `%s` takes %u arguments, but %u were given",
+        line, col, func_name, num_params, node->call.num_args);
+  }
+
+  return node;
+}
+
 static Node *parse_unary_expr(char un_op, int line, int col)
 {
   Node *node = make_node(NODE_UNARY_EXPR);
@@ -122,14 +202,18 @@ static Node *parse_binary_expr(char bin_op, int line, int col)
 
 static void parse_factor()
 {
-  Node *node = make_node(NODE_LITERAL_EXPR);
-
   Token *token = consume();
+  if (token->kind == TOKEN_IDENTIFIER && tok()->kind == TOKEN_LPAREN) {
+    push_expr_node(parse_call(token->str.data, token->line, token->col));
+    return;
+  }
+
+  Node *node = make_node(NODE_LITERAL_EXPR);
   switch (token->kind) {
     case TOKEN_IDENTIFIER:
       // Check to see if the variable we are referencing is valid
       char *var_name = token->str.data;
-      Symbol *var_sym = symbol_table_lookup(current_scope, var_name);
+      Symbol *var_sym = lookup(var_name);
       if (!var_sym)
         fatal("at line %d, col %d: unknown Symbol `%s`", 
             token->line, token->col, var_name);
@@ -248,6 +332,7 @@ static Node *parse_conditional()
   Token *conditional = consume();
 
   Node *node = make_node(NODE_COND_STMT);
+  node->line = conditional->line; node->col = conditional->col;
 
   switch (conditional->kind) {
     case TOKEN_IF:
@@ -263,6 +348,11 @@ static Node *parse_conditional()
   }
 
   node->cond_stmt.body = parse_block(false);
+
+  // Chain any `elif` and `else` branches onto the conditional they belong to
+  if (node->cond_stmt.expr && (tok()->kind == TOKEN_ELIF || tok()->kind == TOKEN_ELSE))
+    node->cond_stmt.orelse = parse_conditional();
+
   return node;
 }
 
@@ -272,7 +362,7 @@ static Type parse_type()
   char *type_name = token->str.data;
 
   // Search for type Symbol in current scope
-  Symbol *type_sym = symbol_table_lookup(current_scope, type_name);
+  Symbol *type_sym = lookup(type_name);
   if (!type_sym) 
     fatal("at line %d, col %d: unknown type `%s`",
         token->line, token->col, type_name);
@@ -350,10 +440,14 @@ static Node *parse_variable_assignment(char *var_name)
 
   consume(); // consume `=`
 
-  if (!symbol_table_lookup(current_scope, var_name)) {
+  Symbol *var_sym = lookup(var_name);
+  if (!var_sym) {
     fatal("at line %d, col %d: unknown Symbol `%s`",
         line, col, var_name);
   }
+  // Constants may be evaluated at compile time and placed in read-only memory
+  if (var_sym->is_constant)
+    fatal("at line %d, col %d: cannot assign to constant `%s`", line, col, var_name);
 
   Node *node = make_node(NODE_ASSIGN_STMT);
   node->line = line; node->col = col;
@@ -369,8 +463,10 @@ static Node *parse_variable_assignment(char *var_name)
 
 static Node *parse_function_call(char *func_name)
 {
+  Token *name = vector_get(&stream, stream_pos - 1);
+  Node *node = parse_call(func_name, name->line, name->col);
   expect(TOKEN_SEMICOLON);
-  return NULL;
+  return node;
 }
 
 static Node *parse_block(bool in_func_toplevel)
@@ -407,16 +503,21 @@ static Node *parse_block(bool in_func_toplevel)
         }
         break;
       case TOKEN_IF:
+        stmt = parse_conditional();
+        break;
       case TOKEN_ELIF:
       case TOKEN_ELSE:
-        stmt = parse_conditional();
+        fatal("at line %d, col %d: `%s` without a matching `if`",
+            tok()->line, tok()->col, token_as_str(tok()->kind));
         break;
-      case TOKEN_RETURN:
-        consume();
+      case TOKEN_RETURN: {
+        Token *keyword = consume();
         stmt = make_node(NODE_RET_STMT);
+        stmt->line = keyword->line; stmt->col = keyword->col;
         stmt->ret_stmt.value = parse_expression();
         expect(TOKEN_SEMICOLON);
         break;
+      }
       default:
         fatal("at line %d, col %d: invalid Token `%s` while parsing function body",
             tok()->line, tok()->col, token_as_str(tok()->kind));
@@ -425,10 +526,12 @@ static Node *parse_block(bool in_func_toplevel)
     if (!stmt) break;
     cur = cur->next = stmt;
   }
-  expect(TOKEN_RBRACE);
+  Token *rbrace = expect(TOKEN_RBRACE);
 
+  // The implicit `return` sits at the closing brace
   if (in_func_toplevel && (!stmt || stmt->kind != NODE_RET_STMT)) {
     Node *implicit = make_node(NODE_RET_STMT);
+    implicit->line = rbrace->line; implicit->col = rbrace->col;
     implicit->ret_stmt.value = NULL;
     cur = cur->next = implicit;
   }
@@ -460,7 +563,7 @@ static Node *parse_function_declaration()
   SymbolTable *func_scope = symbol_table_create(func_name);
 
   // Insert function into its own scope for recursion
-  symbol_table_insert(func_scope, func_name, SYMBOL_FUNCTION);
+  Symbol *self_sym = symbol_table_insert(func_scope, func_name, SYMBOL_FUNCTION);
 
   // Add function scope as child of current scope
   symbol_table_add_child(current_scope, func_scope);
@@ -490,6 +593,9 @@ static Node *parse_function_declaration()
     // Parse type
     expect(TOKEN_COLON);
     node->var_decl.type = parse_type();
+    param_sym->type = node->var_decl.type;
+    param_sym->is_initialized = true;
+    param_sym->node = node;
 
     // Add paramter to list
     cur = cur->next = node;
@@ -509,52 +615,236 @@ static Node *parse_function_declaration()
   if (match(TOKEN_ARROW))
     node->func_decl.return_type = parse_type();
 
+  // The signature is complete, so the body can call the function
+  func_sym->node = self_sym->node = node;
+  func_sym->type = self_sym->type = node->func_decl.return_type;
+
   // Parse function body
+  Symbol *outer_self = self_symbol;
+  self_symbol = self_sym;
   node->func_decl.body = parse_block(true);
+  self_symbol = outer_self;
 
   // Exit the function's scope
   exit_scope();
 
-  func_sym->node = node;
-
   return node;
 }
 
-Node *parse(Vector tokens)
+static void parse_import()
 {
-  current_scope = ctx->global_scope;
-  stream = tokens;
+  int line = tok()->line;
+  int col = tok()->col;
 
-  Node ast = {0};
-  Node *cur = &ast;
+  consume(); // consume keyword `import`
 
-  while (tok()->kind != TOKEN_EOF) {
-    Node *decl = NULL;
-    switch (tok()->kind) {
-      case TOKEN_FUNC:
-        decl = parse_function_declaration();
-        break;
-      case TOKEN_CONST:
-        decl = parse_variable_declaration(NULL);
-        break;
-      case TOKEN_IDENTIFIER:
-        decl = parse_variable_declaration(consume()->str.data);
-        break;
-      default:
-        fatal("at line %d, col %d: invalid Token `%s` while parsing top-level",
-            tok()->line, tok()->col, token_as_str(tok()->kind));
-    }
-    cur = cur->next = decl;
+  Vector path;
+  vector_init(&path, sizeof(char *));
+  do {
+    vector_push_back(&path, expect(TOKEN_IDENTIFIER)->str.data);
+  } while (match(TOKEN_DOUBLE_COLON));
+  expect(TOKEN_SEMICOLON);
+
+  module_import((char **)path.data, path.size, line, col);
+  vector_free(&path);
+}
+
+// Returns NULL once only imports were left before the end of the input
+static Node *parse_declaration()
+{
+  while (tok()->kind == TOKEN_IMPORT)
+    parse_import();
+
+  Node *decl = NULL;
+  switch (tok()->kind) {
+    case TOKEN_EOF:
+      break;
+    case TOKEN_FUNC:
+      decl = parse_function_declaration();
+      break;
+    case TOKEN_CONST:
+      decl = parse_variable_declaration(NULL);
+      break;
+    case TOKEN_IDENTIFIER:
+      decl = parse_variable_declaration(consume()->str.data);
+      break;
+    default:
+      fatal("at line %d, col %d: invalid Token `%s` while parsing top-level",
+          tok()->line, tok()->col, token_as_str(tok()->kind));
   }
 
-  // Do some checks here
+  // Its nodes are now reachable from the declaration
+  vector_clear(&unfinished);
+  return decl;
+}
+
+static void check_entry_point()
+{
+  if (ctx->is_module) return;
+
   Symbol *entry_point = symbol_table_lookup(ctx->global_scope, "main");
   if (!entry_point || entry_point->kind != SYMBOL_FUNCTION) {
     LOG_ERROR("no `main` function was found!");
     fatal("failed to compile.");
   }
+}
+
+Node *parse(Vector tokens)
+{
+  current_scope = ctx->global_scope;
+  stream = tokens;
+  stream_pos = 0;
+  streaming = false;
+  stack_top = NULL;
+  vector_init(&unfinished, sizeof(Node *));
+
+  Node *cur = &parsed;
+  while (tok()->kind != TOKEN_EOF) {
+    Node *decl = parse_declaration();
+    if (decl) cur = cur->next = decl;
+  }
+
+  // Do some checks here
+  check_entry_point();
+
+  Node *ast = parsed.next;
+  parsed.next = NULL;
+  vector_free(&unfinished);
+  unfinished = (Vector){ 0 };
+  return ast;
+}
+
+void parse_stream_init()
+{
+  current_scope = ctx->global_scope;
+  vector_init(&stream, sizeof(Token));
+  stream_pos = 0;
+  streaming = true;
+  stack_top = NULL;
+  vector_init(&unfinished, sizeof(Node *));
+  vector_init(&streamed, sizeof(Node *));
+}
+
+// Release the Tokens consumed so far, keeping any lookahead Tokens
+static void release_tokens()
+{
+  for (size_t i = 0; i < stream_pos; i++)
+    token_free((Token *)vector_get(&stream, i));
+
+  size_t remaining = stream.size - stream_pos;
+  memmove(stream.data, stream.data + stream_pos, remaining * sizeof(void *));
+  stream.size = remaining;
+  stream_pos = 0;
+}
+
+Node *parse_next_declaration()
+{
+  release_tokens();
+
+  Node *decl = tok()->kind == TOKEN_EOF ? NULL : parse_declaration();
+  if (!decl) {
+    check_entry_point();
+    token_free(consume());
+    vector_free(&stream);
+    streaming = false;
+    vector_free(&unfinished);
+    unfinished = (Vector){ 0 };
+    return NULL;
+  }
+
+  vector_push_back(&streamed, decl);
+  return decl;
+}
+
+Token **parse_declaration_tokens(size_t *num_tokens)
+{
+  *num_tokens = stream_pos;
+  return (Token **)stream.data;
+}
+
+void parse_release_declaration(Node *decl)
+{
+  if (decl->kind != NODE_FUNC_DECL)
+    return;
+
+  // Only the signature of a function outlives its lowering: the body and the
+  // function's scope are no longer reachable from the global scope.
+  free_ast(decl->func_decl.body);
+  decl->func_decl.body = NULL;
+
+  SymbolTable *global_scope = ctx->global_scope;
+  symbol_table_free(global_scope->child);
+  global_scope->child = NULL;
+}
 
-  return ast.next;
+void parse_stream_free()
+{
+  for (size_t i = 0; i < streamed.size; i++)
+    free_ast((Node *)vector_get(&streamed, i));
+  vector_free(&streamed);
+  streamed = (Vector){ 0 };
+}
+
+void parse_abort()
+{
+  // The nodes of an unfinished declaration aren't linked up yet, so each one
+  // is released on its own
+  for (size_t i = 0; i < unfinished.size; i++)
+    free(vector_get(&unfinished, i));
+  vector_free(&unfinished);
+  unfinished = (Vector){ 0 };
+
+  free_ast(parsed.next);
+  parsed.next = NULL;
+  parse_stream_free();
+
+  // Only a streaming parse owns its Tokens
+  if (streaming) {
+    for (size_t i = 0; i < stream.size; i++)
+      token_free((Token *)vector_get(&stream, i));
+    vector_free(&stream);
+    streaming = false;
+  }
+}
+
+void free_ast(Node *root)
+{
+  while (root) {
+    Node *next = root->next;
+    switch (root->kind) {
+      case NODE_FUNC_DECL:
+        free_ast(root->func_decl.params);
+        free_ast(root->func_decl.body);
+        break;
+      case NODE_VAR_DECL:
+        free_ast(root->var_decl.init);
+        break;
+      case NODE_RET_STMT:
+        free_ast(root->ret_stmt.value);
+        break;
+      case NODE_COND_STMT:
+        free_ast(root->cond_stmt.expr);
+        free_ast(root->cond_stmt.body);
+        free_ast(root->cond_stmt.orelse);
+        break;
+      case NODE_ASSIGN_STMT:
+        free_ast(root->assign.value);
+        break;
+      case NODE_FUNC_CALL_EXPR:
+        free_ast(root->call.args);
+        break;
+      case NODE_UNARY_EXPR:
+        free_ast(root->unary.expr);
+        break;
+      case NODE_BINARY_EXPR:
+        free_ast(root->binary.lhs);
+        free_ast(root->binary.rhs);
+        break;
+      default: break;
+    }
+    free(root);
+    root = next;
+  }
 }
 
 void dump_ast(Node *root, int level)
@@ -618,9 +908,11 @@ void dump_ast(Node *root, int level)
       printf("[COND_STMT]:\n");
       dump_ast(root->cond_stmt.expr, level + 1);
       dump_ast(root->cond_stmt.body, level + 2);
+      dump_ast(root->cond_stmt.orelse, level + 1);
       break;
     case NODE_FUNC_CALL_EXPR:
-      printf("[FUNC_CALL]:");
+      printf("[FUNC_CALL]: name = %s, args = %u\n", root->call.name, root->call.num_args);
+      dump_ast(root->call.args, level + 1);
       break;
     case NODE_ASSIGN_STMT:
       printf("[ASSIGN]: name = %s\n", root->assign.name);
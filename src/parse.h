@@ -16,6 +16,7 @@ typedef struct VarDecl VarDecl;
 typedef struct AssignStmt AssignStmt;
 typedef struct RetStmt RetStmt;
 typedef struct CondStmt CondStmt;
+typedef struct FuncCallExpr FuncCallExpr;
 
 typedef enum UnaryOp UnaryOp;
 typedef enum BinaryOp BinaryOp;
@@ -31,6 +32,7 @@ struct FuncDecl
   Type return_type;
   Node *params;
   Node *body;
+  bool is_recursive;      // Its body calls it, through its own scope
 };
 
 struct VarDecl 
@@ -53,8 +55,16 @@ struct RetStmt
 
 struct CondStmt 
 {
-  Node *expr;
+  Node *expr;     // NULL for `else`
   Node *body;
+  Node *orelse;   // The `elif` or `else` that follows
+};
+
+struct FuncCallExpr
+{
+  char *name;
+  Node *args;     // In order, linked through `next`
+  uint32_t num_args;
 };
 
 enum UnaryOp
@@ -157,6 +167,7 @@ struct Node
     VarDecl var_decl;
     RetStmt ret_stmt;
     CondStmt cond_stmt;
+    FuncCallExpr call;
     AssignStmt assign;
     UnaryExpr unary;
     BinaryExpr binary;
@@ -168,5 +179,23 @@ struct Node
 
 Node *parse(Vector tokens);
 void dump_ast(Node *program, int level);
+void free_ast(Node *root);
+
+// Streaming interface: parses one top-level declaration at a time from the
+// lexer (see `lex_init()`), releasing the Tokens of the previous declaration.
+// Returns NULL once the input is exhausted.
+void parse_stream_init();
+Node *parse_next_declaration();
+Token **parse_declaration_tokens(size_t *num_tokens);
+void parse_release_declaration(Node *decl);
+
+// Releases the declarations a streaming parse returned, once nothing refers to
+// their signatures anymore
+void parse_stream_free();
+
+// Releases what a parse that failed part-way through left behind, including
+// the Tokens of a streaming parse. The Tokens passed to `parse()` stay with
+// the caller.
+void parse_abort();
 
 #endif
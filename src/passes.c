@@ -0,0 +1,280 @@
+#include "passes.h"
+#include "compile.h"
+#include "copies.h"
+#include "ctfe.h"
+#include "dce.h"
+#include "gvn.h"
+#include "inline.h"
+#include "interp.h"
+#include "ipcp.h"
+#include "sccp.h"
+#include "ssa.h"
+#include "tailcall.h"
+#include "util.h"
+#include "verify.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Passes */
+
+// Passes without a flag are only run by the pipeline itself
+static const Pass pass_table[] = {
+  { "ssa", "construction of SSA form", construct_ssa, 0, false },
+  { "out-of-ssa", "translation out of SSA form", destruct_ssa, 0, true },
+  { "ctfe", "compile-time evaluation of calls to pure functions", evaluate_constant_calls, O_EVALUATE_CALLS, true },
+  { "tailcall", "elimination of recursive tail calls", eliminate_tail_calls, O_TAIL_CALLS, true },
+  { "inline", "inlining of calls by a cost model", inline_functions, O_INLINE_FUNCTIONS, true },
+  { "ipcp", "interprocedural constant propagation and function specialization", specialize_functions, O_SPECIALIZE_FUNCTIONS, true },
+  { "sccp", "sparse conditional constant propagation", propagate_constants, O_PROPAGATE_CONSTANTS, true },
+  { "gvn", "global value numbering", value_number, O_VALUE_NUMBERING, true },
+  { "copyprop", "copy propagation", propagate_copies, O_PROPAGATE_COPIES, true },
+  { "dce", "dead code elimination", eliminate_dead_code, O_DEAD_CODE, true },
+  { "coalesce", "coalescing of copy related variables", coalesce_copies, O_COALESCE_COPIES, false },
+};
+
+#define NUM_PASSES (sizeof(pass_table) / sizeof(pass_table[0]))
+
+static const Pass *construct_pass = &pass_table[0];
+static const Pass *destruct_pass = &pass_table[1];
+
+// Each level is expected to compile slower and produce faster code than the
+// one before it
+static const char *level_pipelines[] = {
+  "",
+  "ctfe,tailcall,sccp,dce,coalesce",
+  "ctfe,tailcall,inline,ipcp,sccp,gvn,copyprop,dce,coalesce",
+  "ctfe,tailcall,inline,ipcp,sccp,gvn,copyprop,dce,ctfe,inline,sccp,gvn,copyprop,dce,coalesce",
+};
+
+#define MAX_OPTIMIZATION_LEVEL 3
+
+PassCounters pass_counters = { 0 };
+
+static const Pass *find_pass(const char *name, size_t length)
+{
+  for (size_t i = 0; i < NUM_PASSES; i++) {
+    const Pass *pass = &pass_table[i];
+    if (pass->flag && strlen(pass->name) == length && strncmp(pass->name, name, length) == 0)
+      return pass;
+  }
+  return NULL;
+}
+
+void list_passes()
+{
+  fprintf(stderr, "available passes:\n");
+  for (size_t i = 0; i < NUM_PASSES; i++) {
+    if (pass_table[i].flag)
+      fprintf(stderr, "  %-10s %s\n", pass_table[i].name, pass_table[i].description);
+  }
+}
+
+/* Pipelines */
+
+// Reads a comma separated list of pass names, returning false if one of
+// them is unknown or there are too many
+bool pipeline_parse(Pipeline *pipeline, const char *list)
+{
+  pipeline->num_passes = 0;
+  const char *name = list;
+  while (*name) {
+    size_t length = strcspn(name, ",");
+    if (length) {
+      const Pass *pass = find_pass(name, length);
+      if (!pass || pipeline->num_passes == MAX_PIPELINE_PASSES)
+        return false;
+      pipeline->passes[pipeline->num_passes++] = pass;
+    }
+    name += length;
+    if (*name == ',')
+      name++;
+  }
+  return true;
+}
+
+void pipeline_init(Pipeline *pipeline, int level)
+{
+  *pipeline = (Pipeline){ 0 };
+  if (level < 0 || level > MAX_OPTIMIZATION_LEVEL)
+    fatal("unknown optimization level %d", level);
+  pipeline_parse(pipeline, level_pipelines[level]);
+}
+
+// Drops the passes whose flag isn't in `flags`
+void pipeline_filter(Pipeline *pipeline, int flags)
+{
+  int kept = 0;
+  for (int i = 0; i < pipeline->num_passes; i++) {
+    if (pipeline->passes[i]->flag & flags)
+      pipeline->passes[kept++] = pipeline->passes[i];
+  }
+  pipeline->num_passes = kept;
+}
+
+int pipeline_flags(Pipeline *pipeline)
+{
+  int flags = 0;
+  for (int i = 0; i < pipeline->num_passes; i++)
+    flags |= pipeline->passes[i]->flag;
+  return flags;
+}
+
+// The flags of every pass a level runs, and constant folding of the AST
+// above -O0
+int optimization_level_flags(int level)
+{
+  Pipeline pipeline;
+  pipeline_init(&pipeline, level);
+  return pipeline_flags(&pipeline) | (level > 0 ? O_FOLD_CONSTANTS : 0);
+}
+
+// Identifies the order of passes, so that cached IR is only reused when the
+// same pipeline produced it
+uint64_t pipeline_fingerprint(Pipeline *pipeline)
+{
+  uint8_t order[MAX_PIPELINE_PASSES];
+  for (int i = 0; i < pipeline->num_passes; i++)
+    order[i] = pipeline->passes[i] - pass_table;
+  return hash_n(order, pipeline->num_passes);
+}
+
+/* Running */
+
+typedef struct
+{
+  int runs;
+  clock_t time;
+  long instructions_removed;
+  long blocks_removed;
+  size_t values_folded;
+  size_t values_forwarded;
+} PassStats;
+
+static PassStats pass_stats[NUM_PASSES];
+
+static void count_graph(ControlFlowGraph *graph, long *num_blocks, long *num_instructions)
+{
+  *num_blocks = *num_instructions = 0;
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    (*num_blocks)++;
+    *num_instructions += block->instructions.size;
+  }
+}
+
+// What the program returned before the first pass, which no pass may change
+static InterpResult reference_result;
+
+static void describe_result(InterpResult result, char *text, size_t size)
+{
+  if (result.status == INTERP_OK)
+    snprintf(text, size, "returned %lld", (long long)result.value);
+  else
+    snprintf(text, size, "%s", interp_status_message(result.status));
+}
+
+static void verify_execution(ControlFlowGraph *graph, const char *after)
+{
+  // Calls turned into jumps may let a program that nested them too deeply
+  // run on, so there is nothing its optimized form must agree with
+  if (reference_result.status == INTERP_RECURSION_LIMIT)
+    return;
+  InterpResult result = interpret_cfg(graph);
+  if (same_interp_result(result, reference_result))
+    return;
+  char before[128], now[128];
+  describe_result(reference_result, before, sizeof(before));
+  describe_result(result, now, sizeof(now));
+  fatal("after %s, the program %s where it %s before", after, now, before);
+}
+
+static void run_pass(Pipeline *pipeline, const Pass *pass, ControlFlowGraph *graph)
+{
+  if (!pipeline->collect_stats) {
+    pass->run(graph);
+  } else {
+    long blocks, instructions;
+    count_graph(graph, &blocks, &instructions);
+    PassCounters counters = pass_counters;
+    clock_t start = clock();
+
+    pass->run(graph);
+
+    PassStats *stats = &pass_stats[pass - pass_table];
+    stats->time += clock() - start;
+    stats->runs++;
+    stats->values_folded += pass_counters.values_folded - counters.values_folded;
+    stats->values_forwarded += pass_counters.values_forwarded - counters.values_forwarded;
+    long blocks_after, instructions_after;
+    count_graph(graph, &blocks_after, &instructions_after);
+    stats->blocks_removed += blocks - blocks_after;
+    stats->instructions_removed += instructions - instructions_after;
+  }
+
+  if (pipeline->verify) {
+    bool is_ssa = pass == destruct_pass ? false : pass == construct_pass || pass->needs_ssa;
+    verify_cfg(graph, is_ssa, pass->name);
+  }
+  if (pipeline->verify_execution)
+    verify_execution(graph, pass->name);
+}
+
+void run_pipeline(Pipeline *pipeline, ControlFlowGraph *graph)
+{
+  if (pipeline->verify)
+    verify_cfg(graph, false, "lowering");
+  if (pipeline->verify_execution) {
+    reference_result = interpret_cfg(graph);
+    if (reference_result.status == INTERP_RECURSION_LIMIT) {
+      LOG_WARN("execution not verified: the program %s before optimizing",
+          interp_status_message(reference_result.status));
+      pipeline->inconclusive = true;
+    }
+  }
+
+  bool in_ssa = false, was_ssa = false;
+  for (int i = 0; i < pipeline->num_passes; i++) {
+    const Pass *pass = pipeline->passes[i];
+    if (pass->needs_ssa && !in_ssa) {
+      run_pass(pipeline, construct_pass, graph);
+      in_ssa = was_ssa = true;
+    } else if (!pass->needs_ssa && in_ssa) {
+      if (pipeline->dump_ssa)
+        dump_cfg(graph);
+      run_pass(pipeline, destruct_pass, graph);
+      in_ssa = false;
+    }
+    run_pass(pipeline, pass, graph);
+  }
+
+  // SSA form is still dumped when no pass needed it
+  if (pipeline->dump_ssa && !was_ssa) {
+    run_pass(pipeline, construct_pass, graph);
+    in_ssa = true;
+  }
+  if (in_ssa) {
+    if (pipeline->dump_ssa)
+      dump_cfg(graph);
+    run_pass(pipeline, destruct_pass, graph);
+  }
+}
+
+void reset_pass_stats()
+{
+  memset(pass_stats, 0, sizeof(pass_stats));
+}
+
+void dump_pass_stats()
+{
+  fprintf(stderr, "%-12s %6s %10s %14s %14s %8s %10s\n", "pass", "runs", "time (ms)",
+      "insts removed", "blocks removed", "folded", "forwarded");
+  for (size_t i = 0; i < NUM_PASSES; i++) {
+    PassStats *stats = &pass_stats[i];
+    if (!stats->runs)
+      continue;
+    fprintf(stderr, "%-12s %6d %10.2f %14ld %14ld %8zu %10zu\n", pass_table[i].name, stats->runs,
+        stats->time * 1000.0 / CLOCKS_PER_SEC, stats->instructions_removed, stats->blocks_removed,
+        stats->values_folded, stats->values_forwarded);
+  }
+}
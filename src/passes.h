@@ -0,0 +1,65 @@
+#ifndef MINI_PASSES_H
+#define MINI_PASSES_H
+
+#include "cfa.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Pass Pass;
+typedef struct Pipeline Pipeline;
+typedef struct PassCounters PassCounters;
+
+/* Pass Manager
+ *
+ * A pipeline is an ordered list of named passes that runs over a whole
+ * graph. Passes that need SSA form say so, and the pipeline builds SSA form
+ * before the first of them and translates out of it before the first pass
+ * that doesn't, or at the end.
+ */
+
+struct Pass
+{
+  const char *name;
+  const char *description;
+  void (*run)(ControlFlowGraph *graph);
+  int flag;               // The `O_*` bit that enables the pass
+  bool needs_ssa;
+};
+
+#define MAX_PIPELINE_PASSES 32
+
+struct Pipeline
+{
+  const Pass *passes[MAX_PIPELINE_PASSES];
+  int num_passes;
+  bool verify;            // Check the IR before the first pass and after each one
+  bool verify_execution;  // Interpret the IR the same way, expecting the same result
+  bool inconclusive;      // Set when a run couldn't be verified that way
+  bool dump_ssa;          // Dump the graph before leaving SSA form
+  bool collect_stats;
+};
+
+// Counts of what passes changed, bumped by the passes themselves
+struct PassCounters
+{
+  size_t values_folded;
+  size_t values_forwarded;
+};
+
+extern PassCounters pass_counters;
+
+int optimization_level_flags(int level);
+void pipeline_init(Pipeline *pipeline, int level);
+bool pipeline_parse(Pipeline *pipeline, const char *list);
+void pipeline_filter(Pipeline *pipeline, int flags);
+int pipeline_flags(Pipeline *pipeline);
+uint64_t pipeline_fingerprint(Pipeline *pipeline);
+void run_pipeline(Pipeline *pipeline, ControlFlowGraph *graph);
+
+void list_passes();
+void reset_pass_stats();
+void dump_pass_stats();
+
+#endif
@@ -0,0 +1,412 @@
+#include "sccp.h"
+#include "dominators.h"
+#include "optimize.h"
+#include "passes.h"
+#include "util.h"
+#include "varmap.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Lattice */
+
+typedef enum
+{
+  LATTICE_UNDEFINED,    // No definition has executed yet
+  LATTICE_CONSTANT,
+  LATTICE_VARYING,
+} LatticeState;
+
+typedef struct
+{
+  LatticeState state;
+  Value value;
+} Lattice;
+
+static const Lattice varying = { .state = LATTICE_VARYING };
+
+static bool same_constant(Value a, Value b)
+{
+  return a.kind == b.kind && a.kind != VAL_STRING && a.u_val == b.u_val;
+}
+
+static Lattice meet(Lattice a, Lattice b)
+{
+  if (a.state == LATTICE_UNDEFINED) return b;
+  if (b.state == LATTICE_UNDEFINED) return a;
+  if (a.state == LATTICE_CONSTANT && b.state == LATTICE_CONSTANT
+      && same_constant(a.value, b.value))
+    return a;
+  return varying;
+}
+
+/* Propagation */
+
+typedef struct
+{
+  Dominators dom;
+  VarMap vars;
+  Lattice *values;            // Per variable
+  int *use_start;             // Uses of variable `v` are
+  Instruction **use_inst;     // use_inst[use_start[v]..use_start[v + 1])
+  int *use_block;
+  int *edge_start;            // Successor `s` of block `b` is edge edge_start[b] + s
+  bool *edge_executable;
+  bool *block_executable;
+  int *flow_list;             // Edges that became executable, by their source
+  int *flow_succ;             // block and successor index
+  size_t flow_size;
+  int *ssa_list;              // Variables whose value changed
+  size_t ssa_size;
+} SCCP;
+
+static Lattice operand_lattice(SCCP *sccp, Operand *operand)
+{
+  switch (operand->kind) {
+    case OPERAND_LITERAL:
+      return (Lattice){ .state = LATTICE_CONSTANT, .value = operand->literal };
+    case OPERAND_VARIABLE:
+      // Variables defined outside of this function are unknown
+      int v = var_map_lookup(&sccp->vars, operand->var);
+      return v < 0 ? varying : sccp->values[v];
+    default:
+      return varying;
+  }
+}
+
+static void mark_edge(SCCP *sccp, int b, int s)
+{
+  int edge = sccp->edge_start[b] + s;
+  if (sccp->edge_executable[edge])
+    return;
+  sccp->edge_executable[edge] = true;
+  sccp->flow_list[sccp->flow_size] = b;
+  sccp->flow_succ[sccp->flow_size++] = s;
+}
+
+static bool edge_executable(SCCP *sccp, BasicBlock *pred, BasicBlock *block)
+{
+  int b = dominator_index(&sccp->dom, pred);
+  if (b < 0)
+    return false;
+  for (size_t s = 0; s < pred->successors.size; s++) {
+    if (pred->successors.data[s] == block && sccp->edge_executable[sccp->edge_start[b] + s])
+      return true;
+  }
+  return false;
+}
+
+static Lattice evaluate(SCCP *sccp, BasicBlock *block, Instruction *inst)
+{
+  Lattice result = varying;
+  switch (inst->opcode) {
+    case OP_PHI:
+      // Only values flowing in over executable edges count
+      result.state = LATTICE_UNDEFINED;
+      for (uint32_t p = 0; p < inst->num_operands; p++) {
+        if (edge_executable(sccp, vector_get(&block->predecessors, p), block))
+          result = meet(result, operand_lattice(sccp, &inst->operands[p]));
+      }
+      return result;
+    case OP_ASSIGN:
+      return operand_lattice(sccp, &inst->operands[0]);
+    case OP_NEG:
+    case OP_NOT:
+      Lattice operand = operand_lattice(sccp, &inst->operands[0]);
+      if (operand.state != LATTICE_CONSTANT)
+        return operand;
+      if (fold_unary((UnaryOp)inst->opcode, operand.value, &result.value))
+        result.state = LATTICE_CONSTANT;
+      return result;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_CMP:
+    case OP_CMP_NOT:
+    case OP_CMP_LT:
+    case OP_CMP_GT:
+    case OP_CMP_LT_EQ:
+    case OP_CMP_GT_EQ:
+      Lattice lhs = operand_lattice(sccp, &inst->operands[0]);
+      Lattice rhs = operand_lattice(sccp, &inst->operands[1]);
+      if (lhs.state == LATTICE_VARYING || rhs.state == LATTICE_VARYING)
+        return varying;
+      if (lhs.state == LATTICE_UNDEFINED || rhs.state == LATTICE_UNDEFINED)
+        return (Lattice){ .state = LATTICE_UNDEFINED };
+      // Operations that trap at run time are left for run time
+      if (fold_binary((BinaryOp)inst->opcode, lhs.value, rhs.value, &result.value))
+        result.state = LATTICE_CONSTANT;
+      return result;
+    default:
+      return varying;
+  }
+}
+
+static bool is_true(Value value)
+{
+  return value.kind == VAL_BOOL ? value.b_val : value.u_val != 0;
+}
+
+static void visit_instruction(SCCP *sccp, int b, Instruction *inst)
+{
+  BasicBlock *block = sccp->dom.order[b];
+  switch (inst->opcode) {
+    case OP_JMP:
+      mark_edge(sccp, b, 0);
+      return;
+    case OP_BR:
+      // A condition that is still undefined here reads an uninitialized
+      // variable, so both ways stay possible
+      Lattice cond = operand_lattice(sccp, &inst->operands[0]);
+      if (cond.state == LATTICE_CONSTANT) {
+        mark_edge(sccp, b, is_true(cond.value) ? 0 : 1);
+      } else {
+        mark_edge(sccp, b, 0);
+        mark_edge(sccp, b, 1);
+      }
+      return;
+    case OP_DEF:
+      for (uint32_t i = 1; i < inst->num_operands; i++) {
+        int v = var_map_lookup(&sccp->vars, inst->operands[i].var);
+        sccp->values[v] = varying;
+      }
+      return;
+    default:
+      break;
+  }
+
+  if (!inst->assignee)
+    return;
+
+  int v = var_map_lookup(&sccp->vars, inst->assignee);
+  Lattice old = sccp->values[v];
+  Lattice new = meet(old, evaluate(sccp, block, inst));
+  if (new.state != old.state) {
+    sccp->values[v] = new;
+    sccp->ssa_list[sccp->ssa_size++] = v;
+  }
+}
+
+static void propagate(SCCP *sccp)
+{
+  Dominators *dom = &sccp->dom;
+  sccp->block_executable[0] = true;
+  for (size_t i = 0; i < dom->order[0]->instructions.size; i++)
+    visit_instruction(sccp, 0, vector_get(&dom->order[0]->instructions, i));
+
+  while (sccp->flow_size || sccp->ssa_size) {
+    if (sccp->flow_size) {
+      sccp->flow_size--;
+      BasicBlock *pred = dom->order[sccp->flow_list[sccp->flow_size]];
+      BasicBlock *block = vector_get(&pred->successors, sccp->flow_succ[sccp->flow_size]);
+      int b = dominator_index(dom, block);
+
+      // The first time a block is reached all of it is evaluated, after
+      // that only its phis can change
+      bool first_visit = !sccp->block_executable[b];
+      sccp->block_executable[b] = true;
+      for (size_t i = 0; i < block->instructions.size; i++) {
+        Instruction *inst = vector_get(&block->instructions, i);
+        if (!first_visit && inst->opcode != OP_PHI && inst->opcode != OP_DEF)
+          break;
+        visit_instruction(sccp, b, inst);
+      }
+      continue;
+    }
+
+    int v = sccp->ssa_list[--sccp->ssa_size];
+    for (int u = sccp->use_start[v]; u < sccp->use_start[v + 1]; u++) {
+      if (sccp->block_executable[sccp->use_block[u]])
+        visit_instruction(sccp, sccp->use_block[u], sccp->use_inst[u]);
+    }
+  }
+}
+
+/* Setup */
+
+static void collect_variables(SCCP *sccp)
+{
+  Dominators *dom = &sccp->dom;
+  var_map_init(&sccp->vars);
+  for (int b = 0; b < dom->num_blocks; b++) {
+    Vector *instructions = &dom->order[b]->instructions;
+    for (size_t i = 0; i < instructions->size; i++) {
+      Instruction *inst = instructions->data[i];
+      if (inst->assignee)
+        var_map_insert(&sccp->vars, inst->assignee);
+      for (uint32_t o = 1; inst->opcode == OP_DEF && o < inst->num_operands; o++)
+        var_map_insert(&sccp->vars, inst->operands[o].var);
+    }
+  }
+
+  int n = sccp->vars.count;
+  sccp->values = calloc(n ? n : 1, sizeof(Lattice));
+  sccp->use_start = calloc(n + 1, sizeof(int));
+}
+
+static int used_variable(SCCP *sccp, Instruction *inst, uint32_t o)
+{
+  if (inst->opcode == OP_DEF || inst->operands[o].kind != OPERAND_VARIABLE)
+    return -1;
+  return var_map_lookup(&sccp->vars, inst->operands[o].var);
+}
+
+// Builds the use lists in two passes, counting first
+static void collect_uses(SCCP *sccp)
+{
+  Dominators *dom = &sccp->dom;
+  int n = sccp->vars.count;
+  int *count = sccp->use_start;
+  for (int pass = 0; pass < 2; pass++) {
+    for (int b = 0; b < dom->num_blocks; b++) {
+      Vector *instructions = &dom->order[b]->instructions;
+      for (size_t i = 0; i < instructions->size; i++) {
+        Instruction *inst = instructions->data[i];
+        for (uint32_t o = 0; o < inst->num_operands; o++) {
+          int v = used_variable(sccp, inst, o);
+          if (v < 0)
+            continue;
+          if (pass == 0) {
+            count[v + 1]++;
+          } else {
+            sccp->use_inst[count[v]] = inst;
+            sccp->use_block[count[v]++] = b;
+          }
+        }
+      }
+    }
+
+    if (pass == 0) {
+      for (int v = 0; v < n; v++)
+        count[v + 1] += count[v];
+      sccp->use_inst = malloc((count[n] + 1) * sizeof(Instruction *));
+      sccp->use_block = malloc((count[n] + 1) * sizeof(int));
+    }
+  }
+
+  // Filling in advanced each start to the start of the next list
+  memmove(count + 1, count, n * sizeof(int));
+  count[0] = 0;
+}
+
+static void collect_edges(SCCP *sccp)
+{
+  Dominators *dom = &sccp->dom;
+  int n = dom->num_blocks;
+  sccp->edge_start = malloc((n + 1) * sizeof(int));
+  int num_edges = 0;
+  for (int b = 0; b < n; b++) {
+    sccp->edge_start[b] = num_edges;
+    num_edges += dom->order[b]->successors.size;
+  }
+  sccp->edge_start[n] = num_edges;
+
+  sccp->edge_executable = calloc(num_edges + 1, sizeof(bool));
+  sccp->block_executable = calloc(n, sizeof(bool));
+  sccp->flow_list = malloc((num_edges + 1) * sizeof(int));
+  sccp->flow_succ = malloc((num_edges + 1) * sizeof(int));
+  // A variable is pushed each time its value is lowered, at most twice
+  sccp->ssa_list = malloc((2 * sccp->vars.count + 1) * sizeof(int));
+}
+
+/* Rewriting */
+
+static void replace_constants(SCCP *sccp, Instruction *inst)
+{
+  for (uint32_t o = 0; o < inst->num_operands; o++) {
+    int v = used_variable(sccp, inst, o);
+    if (v >= 0 && sccp->values[v].state == LATTICE_CONSTANT) {
+      inst->operands[o].kind = OPERAND_LITERAL;
+      inst->operands[o].literal = sccp->values[v].value;
+    }
+  }
+}
+
+static void rewrite_block(SCCP *sccp, int b)
+{
+  BasicBlock *block = sccp->dom.order[b];
+  for (size_t i = 0; i < block->instructions.size; i++) {
+    Instruction *inst = vector_get(&block->instructions, i);
+    replace_constants(sccp, inst);
+
+    // Phis that are constant stay in place until nothing uses them anymore
+    int v = inst->assignee ? var_map_lookup(&sccp->vars, inst->assignee) : -1;
+    if (v >= 0 && inst->opcode != OP_PHI && inst->opcode != OP_ASSIGN
+        && sccp->values[v].state == LATTICE_CONSTANT) {
+      LOG_INFO("propagating constant into variable `%s`", inst->assignee);
+      pass_counters.values_folded++;
+      inst->opcode = OP_ASSIGN;
+      inst->num_operands = 1;
+      inst->operands[0] = (Operand){ .kind = OPERAND_LITERAL, .literal = sccp->values[v].value };
+    }
+
+    if (inst->opcode == OP_BR && inst->operands[0].kind == OPERAND_LITERAL) {
+      int taken = is_true(inst->operands[0].literal) ? 0 : 1;
+      BasicBlock *untaken = vector_get(&block->successors, 1 - taken);
+      LOG_INFO("folding branch to `%s` at the end of `%s`",
+          inst->operands[1 + taken].label, block->tag);
+      pass_counters.values_folded++;
+      inst->opcode = OP_JMP;
+      inst->operands[0] = inst->operands[1 + taken];
+      inst->num_operands = 1;
+      remove_edge(block, untaken);
+    }
+  }
+}
+
+// Blocks that never execute lose their instructions and outgoing edges, which
+// also drops the operands they contributed to phis
+static void detach_block(BasicBlock *block)
+{
+  LOG_INFO("block `%s` is unreachable", block->tag);
+  while (block->successors.size)
+    remove_edge(block, vector_get(&block->successors, block->successors.size - 1));
+  for (size_t i = 0; i < block->instructions.size; i++)
+    free_instruction(block->instructions.data[i]);
+  block->instructions.size = 0;
+}
+
+static void free_sccp(SCCP *sccp)
+{
+  free_dominators(&sccp->dom);
+  var_map_free(&sccp->vars);
+  free(sccp->values);
+  free(sccp->use_start);
+  free(sccp->use_inst);
+  free(sccp->use_block);
+  free(sccp->edge_start);
+  free(sccp->edge_executable);
+  free(sccp->block_executable);
+  free(sccp->flow_list);
+  free(sccp->flow_succ);
+  free(sccp->ssa_list);
+}
+
+static void propagate_function_constants(BasicBlock *entry)
+{
+  SCCP sccp = { 0 };
+  compute_dominators(entry, &sccp.dom);
+  collect_variables(&sccp);
+  collect_uses(&sccp);
+  collect_edges(&sccp);
+  propagate(&sccp);
+
+  for (int b = 0; b < sccp.dom.num_blocks; b++) {
+    if (sccp.block_executable[b])
+      rewrite_block(&sccp, b);
+    else
+      detach_block(sccp.dom.order[b]);
+  }
+
+  free_sccp(&sccp);
+}
+
+void propagate_constants(ControlFlowGraph *graph)
+{
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    if (is_function_entry(block))
+      propagate_function_constants(block);
+  }
+}
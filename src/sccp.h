@@ -0,0 +1,17 @@
+#ifndef MINI_SCCP_H
+#define MINI_SCCP_H
+
+#include "cfa.h"
+
+/* Sparse Conditional Constant Propagation
+ *
+ * `propagate_constants()` runs the algorithm of Wegman and Zadeck over every
+ * function in SSA form. Only blocks that can execute given the constants
+ * found so far contribute to phis. Afterwards, variables with a constant
+ * value are replaced by it, branches on constants become jumps, and blocks
+ * that can never execute are cut off from the rest of the function.
+ */
+
+void propagate_constants(ControlFlowGraph *graph);
+
+#endif
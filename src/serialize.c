@@ -0,0 +1,437 @@
+#define _DEFAULT_SOURCE
+#include "serialize.h"
+#include "intern.h"
+#include "table.h"
+#include "types.h"
+#include "util.h"
+#include "verify.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Serialization */
+
+typedef struct
+{
+  Table *indices;     // char * -> index + 1
+  Vector strings;     // char *
+  uint32_t size;
+} StringPool;
+
+typedef struct
+{
+  Table *indices;     // encoded constant -> index + 1
+  Buffer constants;   // IRConstant
+  uint32_t count;
+} ConstantPool;
+
+static uint32_t pool_add(StringPool *pool, char *s)
+{
+  if (!s) return IR_NONE;
+
+  uintptr_t index = (uintptr_t)table_lookup(pool->indices, s);
+  if (index)
+    return (uint32_t)(index - 1);
+
+  vector_push_back(&pool->strings, s);
+  pool->size += strlen(s) + 1;
+  index = pool->strings.size;
+  table_insert(pool->indices, s, (void *)index);
+  return (uint32_t)(index - 1);
+}
+
+static uint32_t constant_add(ConstantPool *pool, StringPool *strings, Value *value)
+{
+  IRConstant constant = { .value_kind = value->kind };
+  if (value->kind == VAL_STRING) {
+    constant.str = pool_add(strings, intern_n(value->s_val, value->s_len));
+    constant.bits = value->s_len;
+  } else {
+    constant.str = IR_NONE;
+    memcpy(&constant.bits, &value->u_val, sizeof(constant.bits));
+  }
+
+  char *key = aprintf("%u:%u:%lx", constant.value_kind, constant.str, constant.bits);
+  uintptr_t index = (uintptr_t)table_lookup(pool->indices, key);
+  if (!index) {
+    buffer_append(&pool->constants, &constant, sizeof(constant));
+    index = ++pool->count;
+    table_insert(pool->indices, key, (void *)index);
+  }
+  free(key);
+  return (uint32_t)(index - 1);
+}
+
+static uint32_t block_index(BasicBlock *target, BasicBlock **order, uint32_t num_blocks)
+{
+  if (!target) return IR_NONE;
+  for (uint32_t i = 0; i < num_blocks; i++) {
+    if (order[i] == target)
+      return i;
+  }
+  fatal("basic block %d is not part of the graph", target->id);
+  return IR_NONE;
+}
+
+static IROperand encode_operand(Operand *operand, StringPool *strings, ConstantPool *constants)
+{
+  IROperand encoded = { .kind = operand->kind, .type = operand->type.id };
+  switch (operand->kind) {
+    case OPERAND_LITERAL:
+      encoded.index = constant_add(constants, strings, &operand->literal);
+      break;
+    case OPERAND_VARIABLE:
+    case OPERAND_GLOBAL:
+      encoded.index = pool_add(strings, operand->var);
+      break;
+    case OPERAND_LABEL:
+      encoded.index = pool_add(strings, operand->label);
+      break;
+    default: fatal("invalid OperandKind: %d", operand->kind);
+  }
+  return encoded;
+}
+
+void serialize_cfg(ControlFlowGraph *graph, Buffer *out)
+{
+  StringPool strings = { .indices = table_new(), .size = 0 };
+  vector_init(&strings.strings, sizeof(char *));
+  ConstantPool constants = { .indices = table_new(), .count = 0 };
+  buffer_init(&constants.constants);
+
+  uint32_t num_blocks = 0;
+  for (BasicBlock *block = graph->blocks; block; block = block->next)
+    num_blocks++;
+
+  BasicBlock **order = calloc(num_blocks ? num_blocks : 1, sizeof(BasicBlock *));
+  num_blocks = 0;
+  for (BasicBlock *block = graph->blocks; block; block = block->next)
+    order[num_blocks++] = block;
+
+  // Encode blocks, edges, instructions and operands into separate sections
+  Buffer blocks, edges, instructions, operands;
+  buffer_init(&blocks);
+  buffer_init(&edges);
+  buffer_init(&instructions);
+  buffer_init(&operands);
+
+  uint32_t num_edges = 0, num_instructions = 0, num_operands = 0;
+  for (uint32_t b = 0; b < num_blocks; b++) {
+    BasicBlock *block = order[b];
+    IRBlock encoded = {
+      .id = block->id,
+      .tag = pool_add(&strings, block->tag),
+      .first_instruction = num_instructions,
+      .num_instructions = block->instructions.size,
+      .first_edge = num_edges,
+      .num_predecessors = block->predecessors.size,
+      .num_successors = block->successors.size,
+    };
+    buffer_append(&blocks, &encoded, sizeof(encoded));
+
+    Vector *adjacent[2] = { &block->predecessors, &block->successors };
+    for (int a = 0; a < 2; a++) {
+      for (size_t i = 0; i < adjacent[a]->size; i++) {
+        BasicBlock *target = vector_get(adjacent[a], i);
+        buffer_append_u32(&edges, block_index(target, order, num_blocks));
+        num_edges++;
+      }
+    }
+
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = vector_get(&block->instructions, i);
+      IRInstruction encoded_inst = {
+        .opcode = inst->opcode,
+        .assignee = pool_add(&strings, inst->assignee),
+        .first_operand = num_operands,
+        .num_operands = inst->num_operands,
+      };
+      buffer_append(&instructions, &encoded_inst, sizeof(encoded_inst));
+      num_instructions++;
+
+      for (size_t o = 0; o < inst->num_operands; o++) {
+        IROperand encoded_operand = encode_operand(&inst->operands[o], &strings, &constants);
+        buffer_append(&operands, &encoded_operand, sizeof(encoded_operand));
+        num_operands++;
+      }
+    }
+  }
+
+  IRHeader header = {
+    .magic = IR_MAGIC,
+    .version = IR_VERSION,
+    .num_strings = strings.strings.size,
+    .strings_size = strings.size,
+    .num_constants = constants.count,
+    .num_blocks = num_blocks,
+    .num_edges = num_edges,
+    .num_instructions = num_instructions,
+    .num_operands = num_operands,
+    .entry = block_index(graph->entry, order, num_blocks),
+    .exit = block_index(graph->exit, order, num_blocks),
+  };
+  buffer_append(out, &header, sizeof(header));
+
+  uint32_t offset = 0;
+  for (size_t i = 0; i < strings.strings.size; i++) {
+    char *s = vector_get(&strings.strings, i);
+    buffer_append_u32(out, offset);
+    offset += strlen(s) + 1;
+  }
+  buffer_align(out, 8);
+  for (size_t i = 0; i < strings.strings.size; i++) {
+    char *s = vector_get(&strings.strings, i);
+    buffer_append(out, s, strlen(s) + 1);
+  }
+  buffer_align(out, 8);
+
+  Buffer *sections[] = { &constants.constants, &blocks, &edges, &instructions, &operands };
+  for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+    buffer_append(out, sections[i]->data, sections[i]->size);
+    buffer_align(out, 8);
+    buffer_free(sections[i]);
+  }
+
+  free(order);
+  vector_free(&strings.strings);
+  table_free(strings.indices);
+  table_free(constants.indices);
+}
+
+/* Deserialization */
+
+typedef struct
+{
+  const uint8_t *data;
+  size_t size;
+  size_t pos;
+} Reader;
+
+typedef struct
+{
+  const IRHeader *header;
+  const uint32_t *offsets;
+  const char *strings;
+  const IRConstant *constants;
+  bool borrow_strings;
+} Sections;
+
+static const void *take(Reader *r, size_t size)
+{
+  if (r->pos > r->size || size > r->size - r->pos)
+    return NULL;
+  const void *ptr = r->data + r->pos;
+  r->pos += size;
+  r->pos += (8 - r->pos % 8) % 8;
+  return ptr;
+}
+
+static char *string_at(Sections *sections, uint32_t index)
+{
+  if (index == IR_NONE) return NULL;
+  if (index >= sections->header->num_strings
+      || sections->offsets[index] >= sections->header->strings_size)
+    return NULL;
+
+  const char *s = sections->strings + sections->offsets[index];
+  return sections->borrow_strings ? intern_borrowed(s) : intern(s);
+}
+
+static bool decode_operand(const IROperand *encoded, Sections *sections, Operand *operand)
+{
+  *operand = (Operand){ .kind = encoded->kind };
+  if (encoded->type >= TYPE_VOID && encoded->type <= TYPE_BOOL)
+    operand->type = primitive_types[encoded->type];
+
+  switch (operand->kind) {
+    case OPERAND_LITERAL:
+      if (encoded->index >= sections->header->num_constants)
+        return false;
+
+      const IRConstant *constant = &sections->constants[encoded->index];
+      operand->literal.kind = constant->value_kind;
+      if (operand->literal.kind == VAL_STRING) {
+        operand->literal.s_val = string_at(sections, constant->str);
+        operand->literal.s_len = constant->bits;
+        return operand->literal.s_val != NULL;
+      }
+      memcpy(&operand->literal.u_val, &constant->bits, sizeof(constant->bits));
+      return operand->literal.kind <= VAL_SIZE;
+    case OPERAND_VARIABLE:
+    case OPERAND_GLOBAL:
+      operand->var = string_at(sections, encoded->index);
+      return operand->var != NULL;
+    case OPERAND_LABEL:
+      operand->label = string_at(sections, encoded->index);
+      return operand->label != NULL;
+    default:
+      return false;
+  }
+}
+
+static bool decode_cfg(const uint8_t *data, size_t size, bool borrow_strings, ControlFlowGraph *graph)
+{
+  memset(graph, 0, sizeof(ControlFlowGraph));
+
+  Reader r = { .data = data, .size = size, .pos = 0 };
+  const IRHeader *header = take(&r, sizeof(IRHeader));
+  if (!header || memcmp(header->magic, IR_MAGIC, sizeof(header->magic)) != 0)
+    return false;
+  if (header->version != IR_VERSION)
+    return false;
+
+  // Reject headers whose section sizes can't possibly fit in the input
+  uint64_t required = (uint64_t)header->num_strings * sizeof(uint32_t)
+    + header->strings_size
+    + (uint64_t)header->num_constants * sizeof(IRConstant)
+    + (uint64_t)header->num_blocks * sizeof(IRBlock)
+    + (uint64_t)header->num_edges * sizeof(uint32_t)
+    + (uint64_t)header->num_instructions * sizeof(IRInstruction)
+    + (uint64_t)header->num_operands * sizeof(IROperand);
+  if (required > size)
+    return false;
+
+  Sections sections = { .header = header, .borrow_strings = borrow_strings };
+  sections.offsets = take(&r, header->num_strings * sizeof(uint32_t));
+  sections.strings = take(&r, header->strings_size);
+  sections.constants = take(&r, header->num_constants * sizeof(IRConstant));
+  const IRBlock *blocks = take(&r, header->num_blocks * sizeof(IRBlock));
+  const uint32_t *edges = take(&r, header->num_edges * sizeof(uint32_t));
+  const IRInstruction *instructions = take(&r, header->num_instructions * sizeof(IRInstruction));
+  const IROperand *operands = take(&r, header->num_operands * sizeof(IROperand));
+  if (!sections.offsets || !sections.strings || !sections.constants
+      || !blocks || !edges || !instructions || !operands)
+    return false;
+  if (header->strings_size && sections.strings[header->strings_size - 1] != 0)
+    return false;
+
+  uint32_t num_blocks = header->num_blocks;
+  BasicBlock **order = calloc(num_blocks ? num_blocks : 1, sizeof(BasicBlock *));
+  BasicBlock head = { 0 };
+  BasicBlock *tail = &head;
+  bool ok = true;
+  for (uint32_t b = 0; b < num_blocks; b++) {
+    char *tag = string_at(&sections, blocks[b].tag);
+    ok = ok && tag;
+    order[b] = make_basic_block(tag, blocks[b].id);
+    tail = tail->next = order[b];
+  }
+  graph->blocks = head.next;
+  graph->num_blocks = num_blocks;
+
+  for (uint32_t b = 0; b < num_blocks && ok; b++) {
+    const IRBlock *encoded = &blocks[b];
+    BasicBlock *block = order[b];
+
+    uint64_t edge_end = (uint64_t)encoded->first_edge
+      + encoded->num_predecessors + encoded->num_successors;
+    uint64_t inst_end = (uint64_t)encoded->first_instruction + encoded->num_instructions;
+    if (edge_end > header->num_edges || inst_end > header->num_instructions) {
+      ok = false;
+      break;
+    }
+
+    for (uint32_t e = 0; e < encoded->num_predecessors + encoded->num_successors; e++) {
+      uint32_t target = edges[encoded->first_edge + e];
+      if (target >= num_blocks) { ok = false; break; }
+      Vector *adjacent = e < encoded->num_predecessors
+        ? &block->predecessors : &block->successors;
+      vector_push_back(adjacent, order[target]);
+    }
+
+    for (uint32_t i = 0; i < encoded->num_instructions && ok; i++) {
+      const IRInstruction *encoded_inst = &instructions[encoded->first_instruction + i];
+      uint64_t operand_end = (uint64_t)encoded_inst->first_operand + encoded_inst->num_operands;
+      if (operand_end > header->num_operands) {
+        ok = false;
+        break;
+      }
+
+      Instruction *inst = make_instruction(encoded_inst->opcode);
+      inst->assignee = string_at(&sections, encoded_inst->assignee);
+      for (uint32_t o = 0; o < encoded_inst->num_operands && ok; o++)
+        ok = decode_operand(&operands[encoded_inst->first_operand + o], &sections, push_operand(inst));
+      ok = ok && is_well_formed(inst);
+      vector_push_back(&block->instructions, inst);
+    }
+  }
+
+  if (ok && header->entry != IR_NONE && header->entry >= num_blocks) ok = false;
+  if (ok && header->exit != IR_NONE && header->exit >= num_blocks) ok = false;
+
+  if (ok) {
+    graph->entry = header->entry == IR_NONE ? NULL : order[header->entry];
+    graph->exit = header->exit == IR_NONE ? NULL : order[header->exit];
+  } else {
+    free_cfg(graph);
+  }
+
+  free(order);
+  return ok;
+}
+
+bool deserialize_cfg(const uint8_t *data, size_t size, ControlFlowGraph *graph)
+{
+  return decode_cfg(data, size, false, graph);
+}
+
+/* Files */
+
+bool write_ir_file(const char *path, ControlFlowGraph *graph)
+{
+  Buffer out;
+  buffer_init(&out);
+  serialize_cfg(graph, &out);
+
+  FILE *file = fopen(path, "wb");
+  bool ok = file && fwrite(out.data, 1, out.size, file) == out.size;
+  if (file && fclose(file) != 0)
+    ok = false;
+
+  buffer_free(&out);
+  return ok;
+}
+
+bool map_ir_file(const char *path, IRMapping *mapping, ControlFlowGraph *graph)
+{
+  mapping->base = NULL;
+  mapping->size = 0;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return false;
+
+  mapping->base = base;
+  mapping->size = st.st_size;
+
+  // Names are interned in place rather than copied out of the mapping
+  if (!decode_cfg(base, st.st_size, true, graph)) {
+    unmap_ir_file(mapping);
+    return false;
+  }
+  return true;
+}
+
+void unmap_ir_file(IRMapping *mapping)
+{
+  if (!mapping->base) return;
+
+  intern_release(mapping->base, mapping->size);
+  munmap(mapping->base, mapping->size);
+  mapping->base = NULL;
+  mapping->size = 0;
+}
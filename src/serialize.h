@@ -0,0 +1,99 @@
+#ifndef MINI_SERIALIZE_H
+#define MINI_SERIALIZE_H
+
+#include "buffer.h"
+#include "cfa.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Binary IR Format
+ *
+ * All sections are little-endian, fixed-width and 8-byte aligned, so a file
+ * can be used in place once it is mapped into memory:
+ *   IRHeader
+ *   uint32_t string_offsets[num_strings]
+ *   char strings[strings_size] (NUL-terminated)
+ *   IRConstant constants[num_constants]
+ *   IRBlock blocks[num_blocks]
+ *   uint32_t edges[num_edges] (per block: predecessors, then successors)
+ *   IRInstruction instructions[num_instructions]
+ *   IROperand operands[num_operands]
+ *
+ * Operands refer to the string table (variables and labels) or to the
+ * constant pool (literals), which are both deduplicated.
+ */
+
+#define IR_MAGIC    "MIR"
+#define IR_VERSION  3
+#define IR_NONE     UINT32_MAX
+
+typedef struct
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t num_strings;
+  uint32_t strings_size;
+  uint32_t num_constants;
+  uint32_t num_blocks;
+  uint32_t num_edges;
+  uint32_t num_instructions;
+  uint32_t num_operands;
+  uint32_t entry;
+  uint32_t exit;
+  uint32_t reserved;
+} IRHeader;
+
+typedef struct
+{
+  uint8_t value_kind;
+  uint8_t reserved[3];
+  uint32_t str;
+  uint64_t bits;
+} IRConstant;
+
+typedef struct
+{
+  uint32_t id;
+  uint32_t tag;
+  uint32_t first_instruction;
+  uint32_t num_instructions;
+  uint32_t first_edge;
+  uint32_t num_predecessors;
+  uint32_t num_successors;
+  uint32_t reserved;
+} IRBlock;
+
+typedef struct
+{
+  uint32_t opcode;
+  uint32_t assignee;
+  uint32_t first_operand;
+  uint32_t num_operands;
+} IRInstruction;
+
+typedef struct
+{
+  uint8_t kind;
+  uint8_t type;
+  uint16_t reserved;
+  uint32_t index;
+} IROperand;
+
+// A read-only mapping of an IR file. Strings of a graph loaded from it point
+// into the mapping, so it must outlive the graph.
+typedef struct
+{
+  void *base;
+  size_t size;
+} IRMapping;
+
+void serialize_cfg(ControlFlowGraph *graph, Buffer *out);
+bool deserialize_cfg(const uint8_t *data, size_t size, ControlFlowGraph *graph);
+
+bool write_ir_file(const char *path, ControlFlowGraph *graph);
+bool map_ir_file(const char *path, IRMapping *mapping, ControlFlowGraph *graph);
+void unmap_ir_file(IRMapping *mapping);
+
+#endif
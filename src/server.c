@@ -0,0 +1,320 @@
+#define _DEFAULT_SOURCE
+#include "server.h"
+#include "buffer.h"
+#include "cache.h"
+#include "intern.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVER_BACKLOG        16
+#define SERVER_NUM_FDS        3
+#define SERVER_MAX_REQUEST    (1 << 20)
+#define SERVER_MEMORY_CACHE   (64UL * 1024 * 1024)
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int signal)
+{
+  (void)signal;
+  running = 0;
+}
+
+char *server_default_socket_path()
+{
+  char *path = getenv("MINI_SOCKET");
+  if (path) return path;
+  return aprintf("/tmp/mini-%d.sock", (int)getuid());
+}
+
+static double now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double lhs = *(const double *)a;
+  double rhs = *(const double *)b;
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+static bool read_all(int fd, void *data, size_t size)
+{
+  size_t total = 0;
+  while (total < size) {
+    ssize_t n = read(fd, (uint8_t *)data + total, size - total);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    total += n;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+  size_t total = 0;
+  while (total < size) {
+    ssize_t n = write(fd, (const uint8_t *)data + total, size - total);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    total += n;
+  }
+  return true;
+}
+
+static struct sockaddr_un socket_address(const char *socket_path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(socket_path) >= sizeof(addr.sun_path))
+    fatal("socket path `%s` is too long", socket_path);
+  strcpy(addr.sun_path, socket_path);
+  return addr;
+}
+
+/* Wire Format
+ *
+ * Request:  uint32_t size, then `size` bytes of NUL-separated strings: the
+ *           client's working directory followed by its arguments. The
+ *           client's stdin, stdout and stderr ride along as SCM_RIGHTS.
+ * Response: int32_t exit status.
+ */
+
+static bool receive_request(int conn, Buffer *payload, int fds[SERVER_NUM_FDS])
+{
+  uint32_t size = 0;
+  char control[CMSG_SPACE(sizeof(int) * SERVER_NUM_FDS)];
+  struct iovec iov = { .iov_base = &size, .iov_len = sizeof(size) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+
+  if (recvmsg(conn, &msg, 0) != sizeof(size))
+    return false;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * SERVER_NUM_FDS))
+    return false;
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * SERVER_NUM_FDS);
+
+  if (size == 0 || size > SERVER_MAX_REQUEST) {
+    for (int i = 0; i < SERVER_NUM_FDS; i++) close(fds[i]);
+    return false;
+  }
+
+  buffer_reserve(payload, size);
+  payload->size = size;
+  if (!read_all(conn, payload->data, size) || payload->data[size - 1] != 0) {
+    for (int i = 0; i < SERVER_NUM_FDS; i++) close(fds[i]);
+    return false;
+  }
+  return true;
+}
+
+static int handle_request(Buffer *payload, int fds[SERVER_NUM_FDS],
+    CompileHandler compile, CleanupHandler cleanup)
+{
+  // Split the payload into the working directory and argv
+  char *cwd = (char *)payload->data;
+  int argc = 1;
+  for (size_t i = strlen(cwd) + 1; i < payload->size; i += strlen((char *)payload->data + i) + 1)
+    argc++;
+
+  char **argv = calloc(argc + 1, sizeof(char *));
+  argv[0] = "mini";
+  size_t offset = strlen(cwd) + 1;
+  for (int i = 1; i < argc; i++) {
+    argv[i] = (char *)payload->data + offset;
+    offset += strlen(argv[i]) + 1;
+  }
+
+  // Borrow the client's standard streams and working directory
+  int saved_fds[SERVER_NUM_FDS];
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = 0; i < SERVER_NUM_FDS; i++) {
+    saved_fds[i] = dup(i);
+    dup2(fds[i], i);
+    close(fds[i]);
+  }
+  int saved_cwd = open(".", O_RDONLY | O_DIRECTORY);
+
+  volatile int status = EXIT_FAILURE;
+  jmp_buf handler;
+  if (chdir(cwd) != 0) {
+    fprintf(stderr, "mini: couldn't change directory to `%s`\n", cwd);
+  }
+  else if (setjmp(handler) == 0) {
+    set_fatal_handler(&handler);
+    status = compile(argc, argv);
+  }
+  else {
+    cleanup();
+  }
+  set_fatal_handler(NULL);
+
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = 0; i < SERVER_NUM_FDS; i++) {
+    dup2(saved_fds[i], i);
+    close(saved_fds[i]);
+  }
+  if (saved_cwd >= 0) {
+    if (fchdir(saved_cwd) != 0)
+      LOG_WARN("couldn't restore the server's working directory");
+    close(saved_cwd);
+  }
+
+  free(argv);
+  return status;
+}
+
+int server_run(const char *socket_path, CompileHandler compile, CleanupHandler cleanup)
+{
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0)
+    fatal("couldn't create socket: %s", strerror(errno));
+
+  // Only a socket nothing answers on is left over from an earlier server
+  struct sockaddr_un addr = socket_address(socket_path);
+  int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (probe < 0)
+    fatal("couldn't create socket: %s", strerror(errno));
+  bool is_live = connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  close(probe);
+  if (is_live) {
+    close(listener);
+    fatal("a compile server is already listening on `%s`", socket_path);
+  }
+  struct stat status;
+  if (errno == ECONNREFUSED && lstat(socket_path, &status) == 0 && S_ISSOCK(status.st_mode))
+    unlink(socket_path);
+  if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    fatal("couldn't bind `%s`: %s", socket_path, strerror(errno));
+  if (listen(listener, SERVER_BACKLOG) != 0)
+    fatal("couldn't listen on `%s`: %s", socket_path, strerror(errno));
+
+  // Interrupt accept() instead of restarting it so we can shut down cleanly
+  struct sigaction action = { .sa_handler = stop };
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  // Function cache entries stay resident between requests
+  cache_enable_memory(SERVER_MEMORY_CACHE);
+
+  LOG_INFO("compile server listening on %s", socket_path);
+
+  size_t num_requests = 0, capacity = 256;
+  double *latencies = malloc(capacity * sizeof(double));
+
+  Buffer payload;
+  buffer_init(&payload);
+
+  while (running) {
+    int conn = accept(listener, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR) continue;
+      LOG_WARN("accept failed: %s", strerror(errno));
+      continue;
+    }
+
+    double start = now_ms();
+    int fds[SERVER_NUM_FDS];
+    if (receive_request(conn, &payload, fds)) {
+      int32_t status = handle_request(&payload, fds, compile, cleanup);
+      write_all(conn, &status, sizeof(status));
+
+      if (num_requests == capacity) {
+        capacity *= 2;
+        latencies = realloc(latencies, capacity * sizeof(double));
+      }
+      latencies[num_requests++] = now_ms() - start;
+    }
+    close(conn);
+  }
+
+  close(listener);
+  unlink(socket_path);
+  buffer_free(&payload);
+
+  if (num_requests) {
+    qsort(latencies, num_requests, sizeof(double), compare_doubles);
+    LOG_INFO("served %zu requests: p50 %.3f ms, p99 %.3f ms, max %.3f ms (%zu interned strings)",
+        num_requests,
+        latencies[(num_requests - 1) * 50 / 100],
+        latencies[(num_requests - 1) * 99 / 100],
+        latencies[num_requests - 1],
+        intern_count());
+  }
+  free(latencies);
+
+  return 0;
+}
+
+int server_connect(const char *socket_path, int argc, char **argv)
+{
+  int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (conn < 0)
+    fatal("couldn't create socket: %s", strerror(errno));
+
+  struct sockaddr_un addr = socket_address(socket_path);
+  if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    fatal("couldn't connect to compile server at `%s`: %s", socket_path, strerror(errno));
+
+  char cwd[4096];
+  if (!getcwd(cwd, sizeof(cwd)))
+    fatal("couldn't determine the working directory");
+
+  Buffer payload;
+  buffer_init(&payload);
+  buffer_append(&payload, cwd, strlen(cwd) + 1);
+  for (int i = 0; i < argc; i++)
+    buffer_append(&payload, argv[i], strlen(argv[i]) + 1);
+
+  uint32_t size = payload.size;
+  int fds[SERVER_NUM_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = { .iov_base = &size, .iov_len = sizeof(size) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(conn, &msg, 0) != sizeof(size) || !write_all(conn, payload.data, payload.size))
+    fatal("couldn't send request to compile server");
+  buffer_free(&payload);
+
+  int32_t status = EXIT_FAILURE;
+  if (!read_all(conn, &status, sizeof(status)))
+    fatal("compile server closed the connection");
+
+  close(conn);
+  return status;
+}
@@ -0,0 +1,21 @@
+#ifndef MINI_SERVER_H
+#define MINI_SERVER_H
+
+/* Compile Server
+ *
+ * `mini --server` keeps a warm process listening on a Unix socket. A client
+ * (`mini --connect ARGS...`) forwards its arguments, working directory and
+ * stdin/stdout/stderr, so diagnostics and output go straight to the client's
+ * terminal. The server replies with the exit status of the compilation.
+ * Programs run with `--run` run in a child of the server, so one that
+ * crashes reports the signal as status 128 + N instead of killing it.
+ */
+
+typedef int (*CompileHandler)(int argc, char **argv);
+typedef void (*CleanupHandler)();
+
+char *server_default_socket_path();
+int server_run(const char *socket_path, CompileHandler compile, CleanupHandler cleanup);
+int server_connect(const char *socket_path, int argc, char **argv);
+
+#endif
@@ -0,0 +1,606 @@
+#include "ssa.h"
+#include "dominators.h"
+#include "intern.h"
+#include "util.h"
+#include "varmap.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Singly linked lists of blocks per variable, threaded through one pool
+typedef struct
+{
+  IntList blocks;
+  IntList next;
+} BlockLists;
+
+static void block_lists_push(BlockLists *lists, int *head, int block)
+{
+  int_list_push(&lists->blocks, block);
+  int_list_push(&lists->next, *head);
+  *head = lists->blocks.size - 1;
+}
+
+/* Construction */
+
+typedef struct
+{
+  Dominators dom;
+  VarMap vars;
+  int num_vars;
+  char **var_names;       // Original name of each variable
+  int *num_defs;
+  int *def_head;          // Blocks that define each variable
+  int *use_head;          // Blocks in which each variable is upward exposed
+  BlockLists lists;
+
+  Vector *pending_phis;   // New phis per block
+  Instruction **phis;     // All phis, grouped by block
+  int *phi_var;
+  char **phi_name;
+  int *phi_start;         // Phis of block `i` are phis[phi_start[i]..phi_start[i + 1])
+  int num_phis;
+
+  int *version;           // Next version of each variable
+  int *top;               // Innermost definition of each variable, or -1
+  IntList stack_prev;     // Definition shadowed by each pushed one
+  IntList stack_vars;
+  Vector names;           // char *
+} SSABuilder;
+
+static bool is_def(Instruction *inst, uint32_t operand)
+{
+  return inst->opcode == OP_DEF && operand > 0;
+}
+
+// Gives every local of the function an id and records where it is defined
+static void collect_definitions(SSABuilder *ssa)
+{
+  Dominators *dom = &ssa->dom;
+  var_map_init(&ssa->vars);
+
+  for (int b = 0; b < dom->num_blocks; b++) {
+    BasicBlock *block = dom->order[b];
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = vector_get(&block->instructions, i);
+      if (inst->assignee)
+        var_map_insert(&ssa->vars, inst->assignee);
+      for (uint32_t o = 0; o < inst->num_operands; o++) {
+        if (is_def(inst, o))
+          var_map_insert(&ssa->vars, inst->operands[o].var);
+      }
+    }
+  }
+
+  int n = ssa->num_vars = ssa->vars.count;
+  ssa->var_names = malloc((n ? n : 1) * sizeof(char *));
+  for (size_t i = 0; i < ssa->vars.capacity; i++) {
+    if (ssa->vars.keys[i])
+      ssa->var_names[ssa->vars.ids[i]] = ssa->vars.keys[i];
+  }
+
+  ssa->num_defs = calloc(n ? n : 1, sizeof(int));
+  ssa->def_head = malloc((n ? n : 1) * sizeof(int));
+  ssa->use_head = malloc((n ? n : 1) * sizeof(int));
+  for (int v = 0; v < n; v++)
+    ssa->def_head[v] = ssa->use_head[v] = -1;
+}
+
+// Records the blocks that define each variable and the blocks that read it
+// before defining it
+static void collect_uses(SSABuilder *ssa)
+{
+  Dominators *dom = &ssa->dom;
+  int n = ssa->num_vars;
+  int *defined_in = malloc((n ? n : 1) * sizeof(int));
+  int *used_in = malloc((n ? n : 1) * sizeof(int));
+  for (int v = 0; v < n; v++)
+    defined_in[v] = used_in[v] = -1;
+
+  for (int b = 0; b < dom->num_blocks; b++) {
+    BasicBlock *block = dom->order[b];
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = vector_get(&block->instructions, i);
+
+      for (uint32_t o = 0; o < inst->num_operands; o++) {
+        Operand *operand = &inst->operands[o];
+        if (operand->kind != OPERAND_VARIABLE)
+          continue;
+
+        int v = var_map_lookup(&ssa->vars, operand->var);
+        if (v < 0) continue;
+
+        if (is_def(inst, o)) {
+          ssa->num_defs[v]++;
+          if (defined_in[v] != b) {
+            defined_in[v] = b;
+            block_lists_push(&ssa->lists, &ssa->def_head[v], b);
+          }
+        } else if (defined_in[v] != b && used_in[v] != b) {
+          used_in[v] = b;
+          block_lists_push(&ssa->lists, &ssa->use_head[v], b);
+        }
+      }
+
+      if (inst->assignee) {
+        int v = var_map_lookup(&ssa->vars, inst->assignee);
+        ssa->num_defs[v]++;
+        if (defined_in[v] != b) {
+          defined_in[v] = b;
+          block_lists_push(&ssa->lists, &ssa->def_head[v], b);
+        }
+      }
+    }
+  }
+
+  free(used_in);
+  free(defined_in);
+}
+
+// Places phis at the iterated dominance frontier of each variable's
+// definitions, restricted to blocks where the variable is live on entry.
+// Liveness is found per variable by walking backwards from its upward
+// exposed uses, so the cost is proportional to the variable's live range.
+static void place_phis(SSABuilder *ssa)
+{
+  Dominators *dom = &ssa->dom;
+  int n = dom->num_blocks;
+  int *live = malloc(n * sizeof(int));
+  int *defines = malloc(n * sizeof(int));
+  int *has_phi = malloc(n * sizeof(int));
+  int *queued = malloc(n * sizeof(int));
+  for (int b = 0; b < n; b++)
+    live[b] = defines[b] = has_phi[b] = queued[b] = -1;
+
+  ssa->pending_phis = calloc(n, sizeof(Vector));
+  IntList worklist = { 0 };
+
+  for (int v = 0; v < ssa->num_vars; v++) {
+    // A single definition reaches all of its uses without any phis
+    if (ssa->num_defs[v] < 2)
+      continue;
+
+    for (int d = ssa->def_head[v]; d >= 0; d = ssa->lists.next.data[d])
+      defines[ssa->lists.blocks.data[d]] = v;
+
+    worklist.size = 0;
+    for (int u = ssa->use_head[v]; u >= 0; u = ssa->lists.next.data[u]) {
+      int b = ssa->lists.blocks.data[u];
+      live[b] = v;
+      int_list_push(&worklist, b);
+    }
+    while (worklist.size) {
+      BasicBlock *block = dom->order[worklist.data[--worklist.size]];
+      for (size_t p = 0; p < block->predecessors.size; p++) {
+        int pred = dominator_index(dom, vector_get(&block->predecessors, p));
+        if (pred < 0 || live[pred] == v || defines[pred] == v)
+          continue;
+        live[pred] = v;
+        int_list_push(&worklist, pred);
+      }
+    }
+
+    worklist.size = 0;
+    for (int d = ssa->def_head[v]; d >= 0; d = ssa->lists.next.data[d]) {
+      int b = ssa->lists.blocks.data[d];
+      queued[b] = v;
+      int_list_push(&worklist, b);
+    }
+    while (worklist.size) {
+      int b = worklist.data[--worklist.size];
+      for (int f = dom->frontier_start[b]; f < dom->frontier_start[b + 1]; f++) {
+        int join = dom->frontier[f];
+        if (has_phi[join] == v || live[join] != v)
+          continue;
+        has_phi[join] = v;
+
+        BasicBlock *block = dom->order[join];
+        Instruction *phi = make_instruction(OP_PHI);
+        phi->assignee = ssa->var_names[v];
+        for (size_t p = 0; p < block->predecessors.size; p++) {
+          Operand *operand = push_operand(phi);
+          operand->kind = OPERAND_VARIABLE;
+          operand->var = ssa->var_names[v];
+        }
+
+        Vector *pending = &ssa->pending_phis[join];
+        if (!pending->elem_size)
+          vector_init(pending, sizeof(Instruction *));
+        vector_push_back(pending, phi);
+        ssa->num_defs[v]++;
+
+        if (queued[join] != v) {
+          queued[join] = v;
+          int_list_push(&worklist, join);
+        }
+      }
+    }
+  }
+
+  free(worklist.data);
+  free(queued);
+  free(has_phi);
+  free(defines);
+  free(live);
+}
+
+// Moves the pending phis to the top of their blocks, after a leading `def`
+static void insert_phis(SSABuilder *ssa)
+{
+  Dominators *dom = &ssa->dom;
+  int n = dom->num_blocks;
+
+  ssa->phi_start = malloc((n + 1) * sizeof(int));
+  int total = 0;
+  for (int b = 0; b < n; b++) {
+    ssa->phi_start[b] = total;
+    total += ssa->pending_phis[b].size;
+  }
+  ssa->phi_start[n] = total;
+  ssa->num_phis = total;
+  ssa->phis = malloc((total ? total : 1) * sizeof(Instruction *));
+  ssa->phi_var = malloc((total ? total : 1) * sizeof(int));
+  ssa->phi_name = malloc((total ? total : 1) * sizeof(char *));
+
+  for (int b = 0; b < n; b++) {
+    Vector *pending = &ssa->pending_phis[b];
+    if (!pending->size) continue;
+
+    BasicBlock *block = dom->order[b];
+    Vector *instructions = &block->instructions;
+    size_t head = 0;
+    Instruction *first = vector_get(instructions, 0);
+    if (first && first->opcode == OP_DEF)
+      head = 1;
+
+    size_t old_size = instructions->size;
+    for (size_t i = 0; i < pending->size; i++)
+      vector_push_back(instructions, NULL);
+    memmove(instructions->data + head + pending->size, instructions->data + head,
+        (old_size - head) * sizeof(void *));
+
+    for (size_t i = 0; i < pending->size; i++) {
+      Instruction *phi = pending->data[i];
+      int k = ssa->phi_start[b] + i;
+      instructions->data[head + i] = phi;
+      ssa->phis[k] = phi;
+      ssa->phi_var[k] = var_map_lookup(&ssa->vars, phi->assignee);
+    }
+    vector_free(pending);
+  }
+  free(ssa->pending_phis);
+  ssa->pending_phis = NULL;
+}
+
+static char *new_version(SSABuilder *ssa, int v)
+{
+  char *name = aprintf("%s.%d", ssa->var_names[v], ssa->version[v]++);
+  char *interned = intern(name);
+  free(name);
+  return interned;
+}
+
+static void push_definition(SSABuilder *ssa, int v, char *name)
+{
+  vector_push_back(&ssa->names, name);
+  int_list_push(&ssa->stack_prev, ssa->top[v]);
+  int_list_push(&ssa->stack_vars, v);
+  ssa->top[v] = ssa->names.size - 1;
+}
+
+static char *current_name(SSABuilder *ssa, int v)
+{
+  // Reads that no definition reaches keep the original name
+  if (ssa->top[v] < 0)
+    return ssa->var_names[v];
+  return ssa->names.data[ssa->top[v]];
+}
+
+// Renames a variable if it is assigned more than once, returning -1 otherwise
+static int renamed_var(SSABuilder *ssa, char *name)
+{
+  int v = var_map_lookup(&ssa->vars, name);
+  return v >= 0 && ssa->num_defs[v] > 1 ? v : -1;
+}
+
+static void rename_block(SSABuilder *ssa, int b)
+{
+  Dominators *dom = &ssa->dom;
+  BasicBlock *block = dom->order[b];
+
+  for (int k = ssa->phi_start[b]; k < ssa->phi_start[b + 1]; k++) {
+    int v = ssa->phi_var[k];
+    ssa->phi_name[k] = new_version(ssa, v);
+    push_definition(ssa, v, ssa->phi_name[k]);
+  }
+
+  for (size_t i = 0; i < block->instructions.size; i++) {
+    Instruction *inst = vector_get(&block->instructions, i);
+    if (inst->opcode == OP_PHI)
+      continue;
+
+    for (uint32_t o = 0; o < inst->num_operands; o++) {
+      Operand *operand = &inst->operands[o];
+      if (operand->kind != OPERAND_VARIABLE)
+        continue;
+
+      int v = renamed_var(ssa, operand->var);
+      if (v < 0) continue;
+
+      if (is_def(inst, o)) {
+        operand->var = new_version(ssa, v);
+        push_definition(ssa, v, operand->var);
+      } else {
+        operand->var = current_name(ssa, v);
+      }
+    }
+
+    if (inst->assignee) {
+      int v = renamed_var(ssa, inst->assignee);
+      if (v >= 0) {
+        inst->assignee = new_version(ssa, v);
+        push_definition(ssa, v, inst->assignee);
+      }
+    }
+  }
+
+  // Fill in the operands of the successors' phis for the edges leaving here
+  for (size_t s = 0; s < block->successors.size; s++) {
+    int succ = dominator_index(dom, vector_get(&block->successors, s));
+    if (succ < 0 || ssa->phi_start[succ] == ssa->phi_start[succ + 1])
+      continue;
+
+    BasicBlock *succ_block = dom->order[succ];
+    for (size_t p = 0; p < succ_block->predecessors.size; p++) {
+      if (vector_get(&succ_block->predecessors, p) != block)
+        continue;
+      for (int k = ssa->phi_start[succ]; k < ssa->phi_start[succ + 1]; k++)
+        ssa->phis[k]->operands[p].var = current_name(ssa, ssa->phi_var[k]);
+    }
+  }
+}
+
+// Walks the dominator tree in preorder, keeping the innermost definition of
+// every variable on a stack that is unwound when a subtree is left
+static void rename_variables(SSABuilder *ssa)
+{
+  Dominators *dom = &ssa->dom;
+  int n = ssa->num_vars;
+  ssa->version = calloc(n ? n : 1, sizeof(int));
+  ssa->top = malloc((n ? n : 1) * sizeof(int));
+  for (int v = 0; v < n; v++)
+    ssa->top[v] = -1;
+  vector_init(&ssa->names, sizeof(char *));
+
+  int *saved = malloc(dom->num_blocks * sizeof(int));
+  IntList walk = { 0 };
+  int_list_push(&walk, 0);
+  while (walk.size) {
+    int b = walk.data[--walk.size];
+    if (b < 0) {
+      // Leaving the subtree of block ~b
+      b = ~b;
+      while (ssa->stack_vars.size > (size_t)saved[b]) {
+        size_t top = --ssa->stack_vars.size;
+        ssa->top[ssa->stack_vars.data[top]] = ssa->stack_prev.data[top];
+      }
+      ssa->stack_prev.size = ssa->stack_vars.size;
+      continue;
+    }
+
+    saved[b] = ssa->stack_vars.size;
+    rename_block(ssa, b);
+    int_list_push(&walk, ~b);
+    for (int child = dom->first_child[b]; child >= 0; child = dom->next_sibling[child])
+      int_list_push(&walk, child);
+  }
+
+  for (int k = 0; k < ssa->num_phis; k++)
+    ssa->phis[k]->assignee = ssa->phi_name[k];
+
+  free(walk.data);
+  free(saved);
+}
+
+static void free_builder(SSABuilder *ssa)
+{
+  free_dominators(&ssa->dom);
+  var_map_free(&ssa->vars);
+  free(ssa->var_names);
+  free(ssa->num_defs);
+  free(ssa->def_head);
+  free(ssa->use_head);
+  free(ssa->lists.blocks.data);
+  free(ssa->lists.next.data);
+  free(ssa->phis);
+  free(ssa->phi_var);
+  free(ssa->phi_name);
+  free(ssa->phi_start);
+  free(ssa->version);
+  free(ssa->top);
+  free(ssa->stack_prev.data);
+  free(ssa->stack_vars.data);
+  vector_free(&ssa->names);
+}
+
+static void construct_function_ssa(BasicBlock *entry)
+{
+  SSABuilder ssa = { 0 };
+  compute_dominators(entry, &ssa.dom);
+  collect_definitions(&ssa);
+  collect_uses(&ssa);
+  place_phis(&ssa);
+  insert_phis(&ssa);
+  rename_variables(&ssa);
+  free_builder(&ssa);
+}
+
+void construct_ssa(ControlFlowGraph *graph)
+{
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    if (is_function_entry(block))
+      construct_function_ssa(block);
+  }
+}
+
+/* Destruction */
+
+static int num_copy_temporaries = 0;
+
+static bool same_variable(Operand *operand, char *name)
+{
+  return operand->kind == OPERAND_VARIABLE && operand->var == name;
+}
+
+static Instruction *make_copy(char *dest, Operand src)
+{
+  Instruction *copy = make_instruction(OP_ASSIGN);
+  copy->assignee = dest;
+  *push_operand(copy) = src;
+  return copy;
+}
+
+// Inserts copies before the terminator of `block`
+static void insert_copies(BasicBlock *block, Vector *copies)
+{
+  if (!copies->size) return;
+
+  Vector *instructions = &block->instructions;
+  size_t at = instructions->size;
+  Instruction *last = vector_get(instructions, at - 1);
+  if (last && is_terminator(last))
+    at--;
+
+  size_t old_size = instructions->size;
+  for (size_t i = 0; i < copies->size; i++)
+    vector_push_back(instructions, NULL);
+  memmove(instructions->data + at + copies->size, instructions->data + at,
+      (old_size - at) * sizeof(void *));
+  memcpy(instructions->data + at, copies->data, copies->size * sizeof(void *));
+}
+
+// Orders the parallel copies `dests[i] := srcs[i]` so that no copy overwrites
+// a value that another one still reads, breaking cycles with a temporary
+static void sequentialize_copies(char **dests, Operand *srcs, size_t count, Vector *out)
+{
+  while (count) {
+    size_t ready = count;
+    for (size_t i = 0; i < count && ready == count; i++) {
+      bool read = false;
+      for (size_t j = 0; j < count && !read; j++)
+        read = j != i && same_variable(&srcs[j], dests[i]);
+      if (!read)
+        ready = i;
+    }
+
+    if (ready == count) {
+      // Every destination is still read: save one of them first
+      char *name = aprintf("$copy.%d", num_copy_temporaries++);
+      char *temporary = intern(name);
+      free(name);
+
+      Operand saved = { .kind = OPERAND_VARIABLE, .var = dests[0] };
+      vector_push_back(out, make_copy(temporary, saved));
+      for (size_t j = 0; j < count; j++) {
+        if (same_variable(&srcs[j], dests[0]))
+          srcs[j].var = temporary;
+      }
+      continue;
+    }
+
+    vector_push_back(out, make_copy(dests[ready], srcs[ready]));
+    dests[ready] = dests[count - 1];
+    srcs[ready] = srcs[count - 1];
+    count--;
+  }
+}
+
+// Splits the edge from `pred` to its `s`th successor with a block that only
+// jumps to the successor, so that copies can be placed on the edge alone
+static BasicBlock *split_edge(ControlFlowGraph *graph, BasicBlock *pred, size_t s, size_t p)
+{
+  BasicBlock *succ = vector_get(&pred->successors, s);
+
+  char *tag = aprintf("split.%d", graph->num_blocks);
+  BasicBlock *edge = make_basic_block(intern(tag), graph->num_blocks++);
+  free(tag);
+
+  Instruction *jmp = make_instruction(OP_JMP);
+  Operand *label = push_operand(jmp);
+  label->kind = OPERAND_LABEL;
+  label->label = succ->tag;
+  vector_push_back(&edge->instructions, jmp);
+
+  pred->successors.data[s] = edge;
+  succ->predecessors.data[p] = edge;
+  vector_push_back(&edge->predecessors, pred);
+  vector_push_back(&edge->successors, succ);
+
+  // Successors are in the order of the labels of the terminator
+  Instruction *terminator = vector_get(&pred->instructions, pred->instructions.size - 1);
+  uint32_t first_label = terminator->opcode == OP_BR ? 1 : 0;
+  terminator->operands[first_label + s].label = edge->tag;
+
+  edge->next = pred->next;
+  pred->next = edge;
+  return edge;
+}
+
+static void destruct_block(ControlFlowGraph *graph, BasicBlock *block)
+{
+  Vector *instructions = &block->instructions;
+  size_t num_phis = 0;
+  while (num_phis < instructions->size
+      && ((Instruction *)instructions->data[num_phis])->opcode == OP_PHI)
+    num_phis++;
+  if (!num_phis) return;
+
+  char **dests = malloc(num_phis * sizeof(char *));
+  Operand *srcs = malloc(num_phis * sizeof(Operand));
+  Vector copies;
+  vector_init(&copies, sizeof(Instruction *));
+
+  for (size_t p = 0; p < block->predecessors.size; p++) {
+    BasicBlock *pred = vector_get(&block->predecessors, p);
+
+    size_t count = 0;
+    for (size_t i = 0; i < num_phis; i++) {
+      Instruction *phi = instructions->data[i];
+      if (same_variable(&phi->operands[p], phi->assignee))
+        continue;
+      dests[count] = phi->assignee;
+      srcs[count++] = phi->operands[p];
+    }
+    if (!count) continue;
+
+    if (pred->successors.size > 1) {
+      size_t s = 0;
+      while (vector_get(&pred->successors, s) != block) s++;
+      pred = split_edge(graph, pred, s, p);
+    }
+
+    copies.size = 0;
+    sequentialize_copies(dests, srcs, count, &copies);
+    insert_copies(pred, &copies);
+  }
+
+  for (size_t i = 0; i < num_phis; i++)
+    free_instruction(instructions->data[i]);
+  memmove(instructions->data, instructions->data + num_phis,
+      (instructions->size - num_phis) * sizeof(void *));
+  instructions->size -= num_phis;
+
+  vector_free(&copies);
+  free(srcs);
+  free(dests);
+}
+
+void destruct_ssa(ControlFlowGraph *graph)
+{
+  num_copy_temporaries = 0;
+
+  // Split blocks are inserted right after their predecessor and have no phis
+  for (BasicBlock *block = graph->blocks; block; block = block->next)
+    destruct_block(graph, block);
+}
@@ -0,0 +1,18 @@
+#ifndef MINI_SSA_H
+#define MINI_SSA_H
+
+#include "cfa.h"
+
+/* Static Single Assignment Form
+ *
+ * `construct_ssa()` rewrites every function in the graph so that each local
+ * variable is assigned exactly once. Phis are only placed where a variable
+ * is live (pruned SSA), and the definitions of a variable that is assigned
+ * more than once are renamed to `name.N`. `destruct_ssa()` replaces the phis
+ * with copies on the incoming edges again, splitting critical edges.
+ */
+
+void construct_ssa(ControlFlowGraph *graph);
+void destruct_ssa(ControlFlowGraph *graph);
+
+#endif
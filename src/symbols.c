@@ -25,6 +25,8 @@ static Symbol *symbol_info_create(void)
     s->name = NULL;
     s->is_constant = false;
     s->is_initialized = false;
+    s->is_imported = false;
+    s->type = primitive_types[TYPE_UNKNOWN];
     return s;
 }
 
@@ -69,6 +71,7 @@ Symbol *symbol_table_insert(SymbolTable *table, char *symbol_name, SymbolKind ki
         new_info->name = symbol_name;
         new_info->kind = kind;
         new_info->next = info;
+        table->symbols[index] = new_info;
         return new_info;
     }
 
@@ -87,7 +90,7 @@ Symbol *symbol_table_lookup(SymbolTable *table, char *symbol_name)
     Symbol *info = table->symbols[index];
 
     while (info && info->name) {
-        if (memcmp(info->name, symbol_name, strlen(symbol_name)) == 0) {
+        if (strcmp(info->name, symbol_name) == 0) {
             return info;
         }
         info = info->next;
@@ -102,10 +105,36 @@ Symbol *symbol_table_lookup(SymbolTable *table, char *symbol_name)
 
 void symbol_table_add_child(SymbolTable *parent, SymbolTable *child)
 {
-    parent->child = child;
+    // Children are siblings through `next`, in the order they were added
+    SymbolTable **last = &parent->child;
+    while (*last)
+        last = &(*last)->next;
+    *last = child;
     child->parent = parent;
 }
 
+void symbol_table_free(SymbolTable *table)
+{
+    if (!table) return;
+
+    symbol_table_free(table->child);
+    symbol_table_free(table->next);
+
+    // Symbol names are owned by the AST (or the string interner), so only the
+    // entries themselves are released here.
+    for (size_t i = 0; i < SYMBOL_TABLE_SIZE; i++) {
+        Symbol *info = table->symbols[i];
+        while (info) {
+            Symbol *next = info->next;
+            free(info);
+            info = next;
+        }
+    }
+
+    free(table->name);
+    free(table);
+}
+
 void symbol_table_dump(SymbolTable *table, int level)
 {
     printf("%*sScope: %s\n", level, "", table->name);
@@ -25,6 +25,7 @@ struct Symbol
   char *name;
   bool is_constant;
   bool is_initialized;
+  bool is_imported;
   Type type;
   Node *node;
   Symbol *next;
@@ -45,6 +46,7 @@ SymbolTable *symbol_table_create(char *table_name);
 Symbol *symbol_table_insert(SymbolTable *table, char *symbol_name, SymbolKind kind);
 Symbol *symbol_table_lookup(SymbolTable *table, char *symbol_name);
 void symbol_table_add_child(SymbolTable *parent, SymbolTable *child);
+void symbol_table_free(SymbolTable *table);
 void symbol_table_dump(SymbolTable *table, int level);
 
 #endif
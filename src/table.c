@@ -56,6 +56,7 @@ void table_clear(Table *table)
             free(entry);
             entry = next;
         }
+        table->entries[i] = NULL;
     }
 }
 
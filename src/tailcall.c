@@ -0,0 +1,121 @@
+#include "tailcall.h"
+#include "intern.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+bool is_tail_call(BasicBlock *block, size_t index)
+{
+  if (index + 2 != block->instructions.size)
+    return false;
+  Instruction *call = block->instructions.data[index];
+  Instruction *ret = block->instructions.data[index + 1];
+  if (call->opcode != OP_CALL || ret->opcode != OP_RET || !call->assignee || !ret->num_operands)
+    return false;
+  Operand *value = &ret->operands[0];
+  return value->kind == OPERAND_VARIABLE && strcmp(value->var, call->assignee) == 0;
+}
+
+// Whether `block` ends with a tail call of the function starting at `entry`
+static bool is_self_tail_call(BasicBlock *block, BasicBlock *entry)
+{
+  size_t size = block->instructions.size;
+  if (size < 2 || !is_tail_call(block, size - 2))
+    return false;
+  Instruction *call = block->instructions.data[size - 2];
+  Instruction *def = entry->instructions.data[0];
+  return strcmp(call->operands[0].label, entry->tag) == 0
+    && call->num_operands == def->num_operands;
+}
+
+// The `def` takes new names for the values parameters have on entry, as the
+// parameters themselves are now defined by the phis of the header
+static char *entry_value_name(char *param, int header)
+{
+  char *name = aprintf("%s.t%d", param, header);
+  char *interned = intern(name);
+  free(name);
+  return interned;
+}
+
+// Moves everything but the `def` of `entry` to a new block after it, which
+// the entry then jumps to
+static BasicBlock *split_entry(ControlFlowGraph *graph, BasicBlock *entry)
+{
+  char *tag = aprintf("tailcall.%d", graph->num_blocks);
+  BasicBlock *header = make_basic_block(intern(tag), graph->num_blocks++);
+  free(tag);
+  header->next = entry->next;
+  entry->next = header;
+
+  for (size_t i = 1; i < entry->instructions.size; i++)
+    vector_push_back(&header->instructions, entry->instructions.data[i]);
+  entry->instructions.size = 1;
+
+  for (size_t s = 0; s < entry->successors.size; s++) {
+    BasicBlock *succ = entry->successors.data[s];
+    for (size_t p = 0; p < succ->predecessors.size; p++) {
+      if (succ->predecessors.data[p] == entry)
+        succ->predecessors.data[p] = header;
+    }
+    vector_push_back(&header->successors, succ);
+  }
+  entry->successors.size = 0;
+  vector_push_back(&entry->instructions, make_jump(entry, header));
+  return header;
+}
+
+static void eliminate_in_function(ControlFlowGraph *graph, BasicBlock *entry)
+{
+  BasicBlock *end = function_end(entry);
+  Vector tails;
+  vector_init(&tails, sizeof(BasicBlock *));
+  for (BasicBlock *block = entry; block != end; block = block->next) {
+    if (is_self_tail_call(block, entry))
+      vector_push_back(&tails, block);
+  }
+  if (!tails.size) {
+    vector_free(&tails);
+    return;
+  }
+
+  Instruction *def = entry->instructions.data[0];
+  BasicBlock *header = split_entry(graph, entry);
+  Vector instructions = header->instructions;
+  vector_init(&header->instructions, sizeof(Instruction *));
+  for (uint32_t p = 1; p < def->num_operands; p++) {
+    Instruction *phi = make_instruction(OP_PHI);
+    phi->assignee = def->operands[p].var;
+    def->operands[p].var = entry_value_name(phi->assignee, header->id);
+    *push_operand(phi) = def->operands[p];
+    vector_push_back(&header->instructions, phi);
+  }
+  size_t num_phis = header->instructions.size;
+  for (size_t i = 0; i < instructions.size; i++)
+    vector_push_back(&header->instructions, instructions.data[i]);
+  vector_free(&instructions);
+
+  // Each tail call adds a predecessor to the header, and its arguments the
+  // operands of the phis for it
+  for (size_t t = 0; t < tails.size; t++) {
+    BasicBlock *block = tails.data[t] == entry ? header : tails.data[t];
+    Instruction *ret = block->instructions.data[--block->instructions.size];
+    Instruction *call = block->instructions.data[--block->instructions.size];
+    for (size_t p = 0; p < num_phis; p++)
+      *push_operand(header->instructions.data[p]) = call->operands[p + 1];
+    vector_push_back(&block->instructions, make_jump(block, header));
+    LOG_INFO("turning the tail call of `%s` to itself into a jump", entry->tag);
+    free_instruction(call);
+    free_instruction(ret);
+  }
+  vector_free(&tails);
+}
+
+void eliminate_tail_calls(ControlFlowGraph *graph)
+{
+  for (BasicBlock *block = graph->blocks; block; block = block->next) {
+    if (is_function_entry(block))
+      eliminate_in_function(graph, block);
+  }
+}
@@ -0,0 +1,31 @@
+#ifndef MINI_TAILCALL_H
+#define MINI_TAILCALL_H
+
+#include "cfa.h"
+
+/* Tail Calls
+ *
+ * A call is in tail position when its block returns what it returned right
+ * after it, `$t := call f(...); ret $t`, so that nothing of the caller is
+ * needed once it is made.
+ *
+ * `eliminate_tail_calls()` turns the tail calls of functions to themselves
+ * into loops, in SSA form. The entry block of such a function is split after
+ * its `def`, and the rest becomes the header of the loop, where a phi per
+ * parameter takes the incoming value or the argument of a tail call. The
+ * tail calls become jumps back to the header, so recursion that only ever
+ * happens in tail position runs in constant stack space. Every call turned
+ * into a jump is logged as a remark.
+ *
+ * The backend makes the remaining tail calls, to other functions, jumps to
+ * the callee once the arguments are in place and the frame is gone. Those
+ * that pass more arguments on the stack than the caller received stay
+ * calls, as there is no room for them.
+ */
+
+// Whether the call at `index` of `block` is in tail position
+bool is_tail_call(BasicBlock *block, size_t index);
+
+void eliminate_tail_calls(ControlFlowGraph *graph);
+
+#endif
@@ -1,6 +1,14 @@
 #include "util.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+static jmp_buf *fatal_handler = NULL;
+
+void set_fatal_handler(jmp_buf *handler)
+{
+    fatal_handler = handler;
+}
 
 void fatal(const char *fmt, ...)
 {
@@ -10,16 +18,19 @@ void fatal(const char *fmt, ...)
     vfprintf(stderr, fmt, args);
     va_end(args);
     fprintf(stderr, "\n");
+    if (fatal_handler)
+        longjmp(*fatal_handler, 1);
     exit(EXIT_FAILURE);
 }
 
-int str_to_int(const char *s, size_t length)
+// Literals that don't fit wrap around like the arithmetic on them does
+intmax_t str_to_int(const char *s, size_t length)
 {
-    int n = 0;
+    uintmax_t n = 0;
     for (size_t i = 0; i < length; i++) {
         n = n * 10 + (s[i] - '0');
     }
-    return n;
+    return (intmax_t)n;
 }
 
 uint64_t hash(const char *s)
@@ -45,6 +56,81 @@ uint64_t hash_n(uint8_t *data, size_t size)
     return hash;
 }
 
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// MurmurHash3 (x64, 128-bit variant)
+Hash128 hash_128(const uint8_t *data, size_t size, uint64_t seed)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    const size_t num_blocks = size / 16;
+
+    uint64_t h1 = seed;
+    uint64_t h2 = seed;
+
+    for (size_t i = 0; i < num_blocks; i++) {
+        uint64_t k1, k2;
+        memcpy(&k1, data + i * 16, sizeof(k1));
+        memcpy(&k2, data + i * 16 + 8, sizeof(k2));
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const uint8_t *tail = data + num_blocks * 16;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    switch (size & 15) {
+        case 15: k2 ^= (uint64_t)tail[14] << 48; // fallthrough
+        case 14: k2 ^= (uint64_t)tail[13] << 40; // fallthrough
+        case 13: k2 ^= (uint64_t)tail[12] << 32; // fallthrough
+        case 12: k2 ^= (uint64_t)tail[11] << 24; // fallthrough
+        case 11: k2 ^= (uint64_t)tail[10] << 16; // fallthrough
+        case 10: k2 ^= (uint64_t)tail[9] << 8;   // fallthrough
+        case 9:
+            k2 ^= (uint64_t)tail[8];
+            k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+            // fallthrough
+        case 8: k1 ^= (uint64_t)tail[7] << 56;   // fallthrough
+        case 7: k1 ^= (uint64_t)tail[6] << 48;   // fallthrough
+        case 6: k1 ^= (uint64_t)tail[5] << 40;   // fallthrough
+        case 5: k1 ^= (uint64_t)tail[4] << 32;   // fallthrough
+        case 4: k1 ^= (uint64_t)tail[3] << 24;   // fallthrough
+        case 3: k1 ^= (uint64_t)tail[2] << 16;   // fallthrough
+        case 2: k1 ^= (uint64_t)tail[1] << 8;    // fallthrough
+        case 1:
+            k1 ^= (uint64_t)tail[0];
+            k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    return (Hash128){ .lo = h1, .hi = h2 };
+}
+
 char *aprintf(const char *fmt, ...)
 {
     va_list args;
@@ -1,6 +1,7 @@
 #ifndef MINI_UTIL_H
 #define MINI_UTIL_H
 
+#include <setjmp.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <stddef.h>
@@ -23,10 +24,20 @@
 
 void fatal(const char *fmt, ...);
 
+// When a handler is set, `fatal()` reports the error and jumps to it instead
+// of exiting, which lets long-running processes survive failed compilations.
+void set_fatal_handler(jmp_buf *handler);
+
+typedef struct
+{
+    uint64_t lo, hi;
+} Hash128;
+
 uint64_t hash(const char *s);
 uint64_t hash_n(uint8_t *data, size_t size);
+Hash128 hash_128(const uint8_t *data, size_t size, uint64_t seed);
 
-int str_to_int(const char *s, size_t length);
+intmax_t str_to_int(const char *s, size_t length);
 char *aprintf(const char *fmt, ...);
 char *rand_str(size_t length);
 
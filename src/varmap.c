@@ -0,0 +1,60 @@
+#include "varmap.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+static size_t pointer_hash(const void *p)
+{
+    return (size_t)(((uintptr_t)p >> 3) * 0x9E3779B97F4A7C15ull);
+}
+
+void var_map_init(VarMap *map)
+{
+    map->capacity = 64;
+    map->count = 0;
+    map->keys = calloc(map->capacity, sizeof(char *));
+    map->ids = malloc(map->capacity * sizeof(int));
+}
+
+void var_map_free(VarMap *map)
+{
+    free(map->keys);
+    free(map->ids);
+}
+
+int var_map_lookup(VarMap *map, char *name)
+{
+    size_t mask = map->capacity - 1;
+    for (size_t i = pointer_hash(name) & mask; map->keys[i]; i = (i + 1) & mask) {
+        if (map->keys[i] == name)
+            return map->ids[i];
+    }
+    return -1;
+}
+
+int var_map_insert(VarMap *map, char *name)
+{
+    int id = var_map_lookup(map, name);
+    if (id >= 0) return id;
+
+    if ((map->count + 1) * 2 > map->capacity) {
+        VarMap grown = { .capacity = map->capacity * 2, .count = map->count };
+        grown.keys = calloc(grown.capacity, sizeof(char *));
+        grown.ids = malloc(grown.capacity * sizeof(int));
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (!map->keys[i]) continue;
+            size_t j = pointer_hash(map->keys[i]) & (grown.capacity - 1);
+            while (grown.keys[j]) j = (j + 1) & (grown.capacity - 1);
+            grown.keys[j] = map->keys[i];
+            grown.ids[j] = map->ids[i];
+        }
+        var_map_free(map);
+        *map = grown;
+    }
+
+    size_t mask = map->capacity - 1;
+    size_t i = pointer_hash(name) & mask;
+    while (map->keys[i]) i = (i + 1) & mask;
+    map->keys[i] = name;
+    map->ids[i] = map->count++;
+    return map->ids[i];
+}
@@ -0,0 +1,23 @@
+#ifndef MINI_VARMAP_H
+#define MINI_VARMAP_H
+
+#include <stddef.h>
+
+typedef struct VarMap VarMap;
+
+// Maps interned variable names to dense ids in the order they were inserted.
+// Names are compared by pointer.
+struct VarMap
+{
+    char **keys;
+    int *ids;
+    size_t capacity;
+    size_t count;
+};
+
+void var_map_init(VarMap *map);
+void var_map_free(VarMap *map);
+int var_map_lookup(VarMap *map, char *name);   // -1 if `name` isn't mapped
+int var_map_insert(VarMap *map, char *name);
+
+#endif
@@ -52,3 +52,12 @@ void vector_free(Vector *v)
     if (v->data)
         free(v->data);
 }
+
+void int_list_push(IntList *list, int value)
+{
+    if (list->size == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * VECTOR_DEFAULT_GROWTH_RATE : 4;
+        list->data = realloc(list->data, list->capacity * sizeof(int));
+    }
+    list->data[list->size++] = value;
+}
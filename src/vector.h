@@ -18,4 +18,16 @@ void *vector_get(Vector *v, size_t index);
 void vector_clear(Vector *v);
 void vector_free(Vector *v);
 
+// A growable array of ints, stored inline rather than behind pointers, that
+// starts out empty and unallocated when zeroed
+typedef struct IntList IntList;
+struct IntList
+{
+    int *data;
+    size_t size;
+    size_t capacity;
+};
+
+void int_list_push(IntList *list, int value);
+
 #endif
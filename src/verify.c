@@ -0,0 +1,253 @@
+#include "verify.h"
+#include "util.h"
+#include "varmap.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+static const char *verified_after = NULL;
+
+static void fail(BasicBlock *block, const char *fmt, ...)
+{
+  char message[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(message, sizeof(message), fmt, args);
+  va_end(args);
+  fatal("invalid IR after `%s`, in block `%s`: %s", verified_after, block->tag, message);
+}
+
+/* Instructions */
+
+static uint32_t expected_operands(Instruction *inst, int *at_most)
+{
+  *at_most = -1;
+  switch (inst->opcode) {
+    case OP_NEG:
+    case OP_NOT:
+    case OP_DEREF:
+    case OP_ADDR:
+    case OP_ASSIGN:
+    case OP_JMP:
+      return 1;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_CMP:
+    case OP_CMP_NOT:
+    case OP_CMP_LT:
+    case OP_CMP_GT:
+    case OP_CMP_LT_EQ:
+    case OP_CMP_GT_EQ:
+    case OP_STORE:
+      return 2;
+    case OP_BR:
+      return 3;
+    case OP_RET:
+      *at_most = 1;
+      return 0;
+    default:
+      // `def`, phis and calls take any number of operands
+      *at_most = INT32_MAX;
+      return 1;
+  }
+}
+
+static bool has_assignee(OpCode opcode)
+{
+  return opcode != OP_DEF && opcode != OP_JMP && opcode != OP_BR
+    && opcode != OP_RET && opcode != OP_STORE;
+}
+
+static bool is_known_opcode(OpCode opcode)
+{
+  return opcode > OP_UNKNOWN && opcode <= OP_CALL;
+}
+
+static bool has_operand_count(Instruction *inst)
+{
+  int at_most;
+  uint32_t count = expected_operands(inst, &at_most);
+  return inst->num_operands >= count && (at_most >= 0 || inst->num_operands == count)
+    && (at_most < 0 || inst->num_operands <= (uint32_t)at_most);
+}
+
+static bool is_label_operand(Instruction *inst, uint32_t o)
+{
+  return inst->opcode == OP_JMP || (inst->opcode == OP_BR && o > 0)
+    || ((inst->opcode == OP_DEF || inst->opcode == OP_CALL) && o == 0);
+}
+
+bool is_well_formed(Instruction *inst)
+{
+  if (!is_known_opcode(inst->opcode) || !has_operand_count(inst))
+    return false;
+  for (uint32_t o = 0; o < inst->num_operands; o++) {
+    if (is_label_operand(inst, o) != (inst->operands[o].kind == OPERAND_LABEL))
+      return false;
+  }
+  return true;
+}
+
+static void verify_instruction(BasicBlock *block, Instruction *inst)
+{
+  if (!is_known_opcode(inst->opcode))
+    fail(block, "unknown opcode %d", inst->opcode);
+  if (!has_operand_count(inst))
+    fail(block, "instruction with opcode %d has %u operands", inst->opcode, inst->num_operands);
+
+  // Calls may drop their result
+  if (inst->opcode != OP_CALL && has_assignee(inst->opcode) != (inst->assignee != NULL))
+    fail(block, "instruction with opcode %d %s an assignee", inst->opcode,
+        inst->assignee ? "has" : "lacks");
+
+  for (uint32_t o = 0; o < inst->num_operands; o++) {
+    Operand *operand = &inst->operands[o];
+    if (operand->kind == OPERAND_UNKNOWN || operand->kind > OPERAND_GLOBAL)
+      fail(block, "operand %u has unknown kind %d", o, operand->kind);
+
+    bool is_label = is_label_operand(inst, o);
+    if (is_label != (operand->kind == OPERAND_LABEL))
+      fail(block, "operand %u of instruction with opcode %d is %sa label", o, inst->opcode,
+          is_label ? "not " : "");
+    if (inst->opcode == OP_DEF && o > 0 && operand->kind != OPERAND_VARIABLE)
+      fail(block, "parameter %u isn't a variable", o);
+    if (inst->opcode == OP_STORE && o == 0 && operand->kind != OPERAND_GLOBAL)
+      fail(block, "store to something other than a global");
+  }
+}
+
+/* Blocks */
+
+static size_t count_edges(Vector *edges, BasicBlock *block)
+{
+  size_t count = 0;
+  for (size_t i = 0; i < edges->size; i++)
+    count += edges->data[i] == block;
+  return count;
+}
+
+// The labels of a terminator name the successors of its block, in order
+static void verify_terminator(BasicBlock *block)
+{
+  Instruction *last = vector_get(&block->instructions, block->instructions.size - 1);
+  uint32_t first_label = 0, num_labels = 0;
+  if (last && last->opcode == OP_JMP) {
+    num_labels = 1;
+  } else if (last && last->opcode == OP_BR) {
+    first_label = 1;
+    num_labels = 2;
+  }
+
+  if (block->successors.size != num_labels)
+    fail(block, "%zu successors but %u branch targets", block->successors.size, num_labels);
+  for (uint32_t l = 0; l < num_labels; l++) {
+    BasicBlock *succ = block->successors.data[l];
+    if (succ->tag != last->operands[first_label + l].label)
+      fail(block, "branch to `%s` but successor %u is `%s`",
+          last->operands[first_label + l].label, l, succ->tag);
+  }
+}
+
+static void verify_block(BasicBlock *block, uint32_t mark, bool is_ssa)
+{
+  for (size_t s = 0; s < block->successors.size; s++) {
+    BasicBlock *succ = block->successors.data[s];
+    if (succ->mark != mark)
+      fail(block, "successor `%s` isn't in the graph", succ->tag);
+    if (count_edges(&succ->predecessors, block) != count_edges(&block->successors, succ))
+      fail(block, "successor `%s` doesn't list it as a predecessor", succ->tag);
+  }
+  for (size_t p = 0; p < block->predecessors.size; p++) {
+    BasicBlock *pred = block->predecessors.data[p];
+    if (pred->mark != mark)
+      fail(block, "predecessor `%s` isn't in the graph", pred->tag);
+    if (count_edges(&pred->successors, block) != count_edges(&block->predecessors, pred))
+      fail(block, "predecessor `%s` doesn't list it as a successor", pred->tag);
+  }
+
+  bool in_phis = true;
+  for (size_t i = 0; i < block->instructions.size; i++) {
+    Instruction *inst = block->instructions.data[i];
+    verify_instruction(block, inst);
+
+    if (inst->opcode == OP_DEF && i > 0)
+      fail(block, "`def` isn't the first instruction");
+    if (is_terminator(inst) && i + 1 < block->instructions.size)
+      fail(block, "instructions follow a terminator");
+
+    if (inst->opcode == OP_PHI) {
+      if (!is_ssa)
+        fail(block, "phi for `%s` outside of SSA form", inst->assignee);
+      if (!in_phis)
+        fail(block, "phi for `%s` after other instructions", inst->assignee);
+      if (inst->num_operands != block->predecessors.size)
+        fail(block, "phi for `%s` has %u operands for %zu predecessors",
+            inst->assignee, inst->num_operands, block->predecessors.size);
+    } else if (inst->opcode != OP_DEF) {
+      in_phis = false;
+    }
+  }
+
+  verify_terminator(block);
+}
+
+// In SSA form each local, parameters included, has a single definition.
+// Only blocks reachable from the entry are in SSA form.
+static void verify_single_definitions(BasicBlock *entry)
+{
+  VarMap defined;
+  var_map_init(&defined);
+  Vector stack;
+  vector_init(&stack, sizeof(BasicBlock *));
+  uint32_t mark = new_visit_mark();
+  entry->mark = mark;
+  vector_push_back(&stack, entry);
+  while (stack.size) {
+    BasicBlock *block = stack.data[--stack.size];
+    for (size_t s = 0; s < block->successors.size; s++) {
+      BasicBlock *succ = block->successors.data[s];
+      if (succ->mark != mark) {
+        succ->mark = mark;
+        vector_push_back(&stack, succ);
+      }
+    }
+
+    for (size_t i = 0; i < block->instructions.size; i++) {
+      Instruction *inst = block->instructions.data[i];
+      for (uint32_t o = 0; o <= inst->num_operands; o++) {
+        char *name = NULL;
+        if (o == inst->num_operands)
+          name = inst->assignee;
+        else if (inst->opcode == OP_DEF && o > 0)
+          name = inst->operands[o].var;
+        if (!name)
+          continue;
+
+        size_t count = defined.count;
+        var_map_insert(&defined, name);
+        if (defined.count == count)
+          fail(block, "`%s` is defined more than once in SSA form", name);
+      }
+    }
+  }
+  vector_free(&stack);
+  var_map_free(&defined);
+}
+
+void verify_cfg(ControlFlowGraph *graph, bool is_ssa, const char *after)
+{
+  verified_after = after;
+  uint32_t mark = new_visit_mark();
+  for (BasicBlock *block = graph->blocks; block; block = block->next)
+    block->mark = mark;
+
+  for (BasicBlock *block = graph->blocks; block; block = block->next)
+    verify_block(block, mark, is_ssa);
+
+  for (BasicBlock *block = graph->blocks; is_ssa && block; block = block->next) {
+    if (is_function_entry(block))
+      verify_single_definitions(block);
+  }
+}
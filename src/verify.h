@@ -0,0 +1,25 @@
+#ifndef MINI_VERIFY_H
+#define MINI_VERIFY_H
+
+#include "cfa.h"
+
+#include <stdbool.h>
+
+/* IR Verifier
+ *
+ * `verify_cfg()` checks the structural invariants of the IR that the passes
+ * rely on: operand counts and kinds, terminators that agree with the edges
+ * of their block, predecessor lists that mirror successor lists, and phis
+ * with one operand per predecessor. In SSA form every local must also be
+ * defined at most once. The first violation is reported with `fatal()`,
+ * naming the pass that ran last.
+ */
+
+void verify_cfg(ControlFlowGraph *graph, bool is_ssa, const char *after);
+
+// Whether an instruction has a known opcode and the number of operands it
+// takes, with labels where it takes them. IR read from outside the compiler
+// is checked with this rather than `verify_cfg()`, which doesn't return.
+bool is_well_formed(Instruction *inst);
+
+#endif
@@ -0,0 +1,106 @@
+#!/usr/bin/env bash
+# Differential tests: runs each program every way the compiler can and checks
+# that they all exit with the status the program expects.
+#
+#   tests/differential.sh MINI FILE...
+#
+# A program states its status in a comment, `// exit: N`, or `// exit: error`
+# when compiling it must fail. Programs without one are skipped. Each
+# `// warning: TEXT` comment names a warning compiling it must report. The status
+# is checked for the interpreter at -O0 and -O1 to -O3, with the IR verified
+# and re-run after every pass, and for code from both register allocators at
+# every level, run in-process and as an executable, and compiled streaming.
+
+set -u
+
+if [ $# -lt 1 ]; then
+  echo "usage: $0 MINI FILE..." >&2
+  exit 2
+fi
+mini=$1
+shift
+
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+
+num_checks=0
+num_failures=0
+
+# Also shows the errors of the compiler's last run
+fail()
+{
+  num_failures=$((num_failures + 1))
+  echo "FAIL $1"
+  grep '^mini:' "$scratch/stderr" 2>/dev/null | sed 's/^/    /'
+}
+
+# check FILE EXPECTED DESCRIPTION ARGS...: runs the compiler on FILE
+check()
+{
+  local file=$1 expected=$2 description=$3
+  shift 3
+  num_checks=$((num_checks + 1))
+  "$mini" "$@" "$file" >/dev/null 2>"$scratch/stderr"
+  local status=$?
+  [ "$status" = "$expected" ] || fail "$file ($description): exited with $status, expected $expected"
+}
+
+# check_warnings FILE: looks for the warnings FILE expects in the last run
+check_warnings()
+{
+  local file=$1 warning
+  while IFS= read -r warning; do
+    num_checks=$((num_checks + 1))
+    grep -qF -- "$warning" "$scratch/stderr" || fail "$file: didn't warn \`$warning'"
+  done < <(sed -n 's|^// warning: *||p' "$file")
+}
+
+# check_executable FILE EXPECTED DESCRIPTION ARGS...: builds FILE, then runs it
+check_executable()
+{
+  local file=$1 expected=$2 description=$3
+  shift 3
+  num_checks=$((num_checks + 1))
+  rm -f "$scratch/a.out"
+  if ! "$mini" "$@" --emit=exe -o "$scratch/a.out" "$file" >/dev/null 2>"$scratch/stderr"; then
+    fail "$file ($description): didn't compile"
+    return
+  fi
+  "$scratch/a.out" >/dev/null 2>&1
+  local status=$?
+  [ "$status" = "$expected" ] || fail "$file ($description): exited with $status, expected $expected"
+}
+
+for file in "$@"; do
+  expected=$(sed -n 's|^// exit: *||p' "$file" | head -n 1)
+  if [ -z "$expected" ]; then
+    echo "skip $file (no expected status)"
+    continue
+  fi
+
+  if [ "$expected" = error ]; then
+    num_checks=$((num_checks + 1))
+    if "$mini" --emit=asm -o "$scratch/out.asm" "$file" >/dev/null 2>"$scratch/stderr"; then
+      fail "$file: compiled, but was expected not to"
+    fi
+    continue
+  fi
+
+  check "$file" "$expected" "interpreted at -O0" -O0 --interp
+  check_warnings "$file"
+  for level in 1 2 3; do
+    check "$file" "$expected" "interpreted at -O$level" -O$level --interp
+    check "$file" "$expected" "verified at -O$level" -O$level --interp --verify-ir --verify-exec
+  done
+  for level in 0 1 2 3; do
+    for allocator in linear graph; do
+      check "$file" "$expected" "run at -O$level with $allocator" -O$level --regalloc=$allocator --run
+      check_executable "$file" "$expected" "executable at -O$level with $allocator" \
+        -O$level --regalloc=$allocator
+    done
+  done
+  check_executable "$file" "$expected" "streamed at -O2" -O2 --stream
+done
+
+echo "$num_checks checks, $num_failures failures"
+[ "$num_failures" -eq 0 ]